@@ -28,12 +28,25 @@
 #include "error.h"
 #include "zoom.h"
 
+/* Concurrency: all functions can be called from several threads at
+   the same time, as long as no object is changed by one call while
+   another one uses it.  The comments below say which objects a
+   function changes, and where more is allowed.  Libraries are only
+   read while mosaics are generated and pasted, so any number of
+   mosaics can be made from the same libraries at the same time, and
+   they can share a tile cache.  Errors are reported to the error
+   context of the calling thread (see error.h).  Many functions split
+   their work into tasks on the default thread pool (see thread.h),
+   which the calling thread helps running. */
+
 typedef struct _library_t library_t;
 typedef struct _metapixel_t metapixel_t;
 typedef struct _bitmap_t bitmap_t;
 typedef struct _metric_t metric_t;
 typedef struct _matcher_t matcher_t;
 typedef struct _tiling_t tiling_t;
+typedef struct _tile_cache_t tile_cache_t;
+typedef struct _binary_tables_t binary_tables_t;
 
 #define FLIP_HOR               1
 #define FLIP_VER               2
@@ -74,8 +87,10 @@ struct _bitmap_t
     bitmap_t *super;
 };
 
-/* bitmap_new takes possession of data.  It is freed when the bitmap
-   is freed. */
+/* Bitmaps sharing pixel data (via bitmap_copy or bitmap_sub) can be
+   used and freed by different threads, but only one thread at a time
+   may change the pixels.  bitmap_new takes possession of data.  It
+   is freed when the bitmap is freed. */
 bitmap_t* bitmap_new (int color, unsigned int width, unsigned int height,
 		      unsigned int pixel_stride, unsigned int row_stride, unsigned char *data);
 /* bitmap_new_copying doesn't take possession of data. */
@@ -97,6 +112,16 @@ bitmap_t* bitmap_new_empty (int color, unsigned int width, unsigned int height);
 
 /* Only supports whatever read_image supports (i.e., JPEG and PNG). */
 bitmap_t* bitmap_read (const char *filename);
+/* Like bitmap_read, but JPEG files may be decoded at a smaller size,
+   though not smaller than min_width x min_height.  The size of the
+   image in the file is stored in full_width and full_height. */
+bitmap_t* bitmap_read_scaled (const char *filename, unsigned int min_width, unsigned int min_height,
+			      unsigned int *full_width, unsigned int *full_height);
+/* Reads only the thumbnail embedded in the EXIF data of a JPEG file,
+   if it is at least min_width x min_height and has the aspect ratio
+   of the image.  Returns 0 otherwise, without reporting an error. */
+bitmap_t* bitmap_read_thumbnail (const char *filename, unsigned int min_width, unsigned int min_height,
+				 unsigned int *full_width, unsigned int *full_height);
 
 bitmap_t* bitmap_copy (bitmap_t *bitmap);
 bitmap_t* bitmap_sub (bitmap_t *super, unsigned int x, unsigned int y,
@@ -104,6 +129,14 @@ bitmap_t* bitmap_sub (bitmap_t *super, unsigned int x, unsigned int y,
 bitmap_t* bitmap_scale (bitmap_t *orig, unsigned int scaled_width, unsigned int scaled_height,
 			int filter);
 bitmap_t* bitmap_flip (bitmap_t *orig, unsigned int flip);
+/* Scales src to width x height, flips it according to flip and
+   stores the result in dst at x, y, without making intermediate
+   bitmaps.  If blend is not 0, the result is composed with the pixels
+   of blend at the same position, like bitmap_alpha_compose does.
+   blend must have the same size as dst.  Returns 0 on failure. */
+int bitmap_paste_scaled (bitmap_t *dst, bitmap_t *src, unsigned int x, unsigned int y,
+			 unsigned int width, unsigned int height, unsigned int flip, int filter,
+			 bitmap_t *blend, unsigned int opacity);
 
 void bitmap_free (bitmap_t *bitmap);
 
@@ -113,14 +146,30 @@ void bitmap_paste (bitmap_t *dst, bitmap_t *src, unsigned int x, unsigned int y)
 /* Opacity is 0 for full transparency and 0x10000 (65536) for full opacity. */
 void bitmap_alpha_compose (bitmap_t *dst, bitmap_t *src, unsigned int opacity);
 
+typedef struct
+{
+    unsigned int width;
+    unsigned int height;
+    /* Only used internally.  Relative to the library path. */
+    char *filename;
+    /* Only for metapixels which are not in a library yet. */
+    bitmap_t *bitmap;
+    /* Only used internally.  -1 if not in an atlas. */
+    int atlas_offset;
+} metapixel_level_t;
+
 struct _metapixel_t
 {
     library_t *library;
 
     char *name;
 
-    /* Only used internally.  Can be zero (for mem libraries). */
+    /* Only used internally.  Can be zero (for mem libraries).  For
+       metapixels in an atlas this only identifies the metapixel. */
     char *filename;
+    /* Only used internally.  Offset of the image in the library's
+       atlas, or -1. */
+    int atlas_offset;
 
     unsigned int width;
     unsigned int height;
@@ -139,16 +188,22 @@ struct _metapixel_t
 
     int enabled;		/* Always true in this release */
 
-    /* these three are very internal */
+    /* these two are very internal */
     unsigned char subpixels_rgb[NUM_SUBPIXELS * NUM_CHANNELS];
-    unsigned char subpixels_hsv[NUM_SUBPIXELS * NUM_CHANNELS];
-    unsigned char subpixels_yiq[NUM_SUBPIXELS * NUM_CHANNELS];
+    /* Index into the feature store of the library, for the subpixels
+       in the other color spaces. */
+    unsigned int feature_index;
 
     /* This is != 0 iff library == 0 || filename == 0, i.e., for
        metapixels which are not in a library or only in a mem
        library. */
     bitmap_t *bitmap;
 
+    /* Smaller versions of the image, largest first, so that it
+       doesn't have to be scaled down as much for small tiles. */
+    unsigned int num_levels;
+    metapixel_level_t *levels;
+
     metapixel_t *next;		/* next in library */
 };
 
@@ -156,8 +211,43 @@ struct _library_t
 {
     char *path;
 
+    /* 0 if the images are stored in separate files */
+    atlas_t *atlas;
+    /* 0 if the tables file was parsed */
+    binary_tables_t *binary_tables;
+    /* 0 if no batch is in progress */
+    library_batch_t *batch;
+    /* 0 if no duplicates were looked for yet */
+    duplicate_index_t *duplicate_index;
+    feature_store_t features;
+    /* for the metapixels and their levels */
+    arena_t metapixel_slab;
+    /* for their names and filenames */
+    arena_t strings;
+
     metapixel_t *metapixels;
     unsigned int num_metapixels;
+
+    /* How much of tables.mxt has been read, and which file it was, so
+       that library_refresh can read what was appended since. */
+    long long tables_size;
+    long long tables_device;
+    long long tables_inode;
+
+    /* For a snapshot, the library it was taken of, otherwise 0. */
+    library_t *snapshot_of;
+    /* The metapixels of a library are only changed, and its
+       snapshots only taken and released, with this held. */
+    pthread_mutex_t snapshot_mutex;
+    /* the snapshot of the current metapixels, which the library holds
+       a reference to, or 0 */
+    library_t *current_snapshot;
+    /* all snapshots of a library, linked by next_snapshot */
+    library_t *snapshots;
+    unsigned int epoch;
+    /* of a snapshot */
+    library_t *next_snapshot;
+    unsigned int num_references;
 };
 
 typedef struct
@@ -184,10 +274,23 @@ typedef struct
     collage_match_t *matches;
 } collage_mosaic_t;
 
+/* A tile cache keeps the final (scaled and flipped) pixels of
+   pasted metapixels, so that a metapixel which occurs more than once
+   in a mosaic only has to be read and scaled once.  max_bytes is the
+   memory budget of the cache, after which the least recently used
+   tiles are evicted.  A tile cache must not be used anymore once one
+   of the libraries whose metapixels it has seen has been closed.  A
+   tile cache can be used by any number of threads at the same
+   time. */
+tile_cache_t* tile_cache_new (unsigned long max_bytes);
+void tile_cache_free (tile_cache_t *cache);
+void tile_cache_get_stats (tile_cache_t *cache, unsigned long *num_hits, unsigned long *num_misses);
+
 /* value will be in the range 0.0 to 1.0 */
 typedef void (*progress_report_func_t) (float value);
 
-/* library_new and library_open return 0 on failure. */
+/* library_new and library_open return 0 on failure.  Different
+   libraries can be opened at the same time. */
 /* library_new will not create the directory! */
 library_t* library_new (const char *path);
 library_t* library_open (const char *path);
@@ -201,22 +304,87 @@ library_t* library_new_mem (void);
 
 /* Saves a mem library or copies an external library.  Modifies the
    library data structure to accomodate for the change.  Returns 0 on
-   failure. */
+   failure.  Changes the library. */
 int library_save (library_t *library, const char *path);
 
+/* Nothing may use the library or its metapixels anymore. */
 void library_close (library_t *library);
 
+/* With share set, the features of each library which a metric needs
+   are published for other processes in shared memory the first time,
+   and taken from there by the others, instead of each process having
+   its own.  They are in POSIX shared memory, or in files in directory
+   if it's not 0, which can be on hugetlbfs.  Must be called before
+   any libraries are used, and before other threads use the
+   library. */
+void library_set_shared_features (int share, const char *directory);
+
 /* Copies the metapixel data structure and adds the copy to the
-   library.  Returns the copied metapixel or 0 on failure. */
+   library.  Returns the copied metapixel or 0 on failure.  Changes
+   the library, but snapshots of it can be used in the meantime. */
 metapixel_t* library_add_metapixel (library_t *library, metapixel_t *metapixel);
 
+/* Returns a metapixel of the library whose subpixels each differ by
+   at most max_distance from those of the given metapixel, preferring
+   one with identical subpixels, or 0 if there is none.  The first call
+   builds an index, which is kept up to date as metapixels are added,
+   so each further call only looks at a few similar metapixels.
+   Changes the library. */
+metapixel_t* library_find_duplicate (library_t *library, metapixel_t *metapixel, unsigned int max_distance);
+
+/* Metapixels added between library_begin_batch and library_end_batch
+   are added much faster than on their own, but the tables file is
+   only guaranteed to be on disk after library_end_batch.  No other
+   program may add to the library while a batch is in progress.
+   Both return 0 on failure.  Both change the library. */
+int library_begin_batch (library_t *library);
+int library_end_batch (library_t *library);
+
+/* Reads the metapixels appended to the tables file since the library
+   last read it, for example by another process preparing images, so
+   that snapshots acquired from then on have them.  Returns the number
+   of new metapixels, or -1 on failure, in which case the library is
+   unchanged.  Changes the library, but snapshots of it can be used
+   in the meantime. */
+int library_refresh (library_t *library);
+
+/* A snapshot of a library can be used just like the library, but it
+   doesn't change, so a search running on it sees the same metapixels
+   all the time, while library_refresh adds new ones to the library.
+   Acquiring one is cheap if the library hasn't changed since the last
+   one.  All snapshots must be released before the library is
+   closed.  Snapshots can be acquired and released while the library
+   is changed by library_refresh or library_add_metapixel. */
+library_t* library_acquire_snapshot (library_t *library);
+void library_release_snapshot (library_t *snapshot);
+
+/* Moves the images of all metapixels of the library into an atlas
+   file, and stores all images added later there, too.  The separate
+   image files are removed once the tables file is rewritten.
+   Returns 0 on failure.  Changes the library. */
+int library_convert_to_atlas (library_t *library);
+
+/* Removes the metapixels with the given filenames from the library
+   and deletes their images.  Returns 0 on failure, in which case the
+   library is unchanged.  Changes the library, which must not have
+   any snapshots. */
+int library_remove_metapixels (library_t *library, char **filenames, unsigned int num_filenames);
+
 metapixel_t* metapixel_new_from_bitmap (bitmap_t *bitmap, const char *name,
 					unsigned int scaled_width, unsigned int scaled_height);
 void metapixel_free (metapixel_t *metapixel);
 
+/* Adds levels to a metapixel which is not in a library, each half
+   the size of the previous one, as long as they are at least
+   min_size x min_size. */
+void metapixel_add_levels (metapixel_t *metapixel, unsigned int min_size);
+
 /* The returned bitmap must be freed with bitmap_free.  Returns 0 on
-   failure. */
+   failure.  Only reads the metapixel and its library. */
 bitmap_t* metapixel_get_bitmap (metapixel_t *metapixel);
+/* Like metapixel_get_bitmap, but returns the smallest level which is
+   at least width x height, or the full image if there is none. */
+bitmap_t* metapixel_get_bitmap_for_size (metapixel_t *metapixel, unsigned int width, unsigned int height);
 
 /* Not functional yet. */
 void metapixel_set_enabled (metapixel_t *metapixel, int enabled);
@@ -235,14 +403,22 @@ void tiling_get_metapixel_coords (tiling_t *tiling, unsigned int image_width, un
 #define COLOR_SPACE_HSV        2
 #define COLOR_SPACE_YIQ        3
 
-/* These do not allocate memory for the metric. */
+/* These do not allocate memory for the metric.  They only change
+   the metric, which can be shared by searches afterwards. */
 metric_t* metric_init (metric_t *metric, int kind, int color_space, float weights[]);
 
-/* These do not allocate memory for the matcher. */
+/* These do not allocate memory for the matcher.  Each mosaic needs
+   its own matcher. */
 matcher_t* matcher_init_local (matcher_t *matcher, metric_t *metric, unsigned int min_distance);
 matcher_t* matcher_init_global (matcher_t *matcher, metric_t *metric);
 
+/* Readers and writers are changed by every function using them, so
+   each mosaic needs its own. */
 classic_reader_t* classic_reader_new_from_file (const char *image_filename, tiling_t *tiling);
+/* JPEG files may be decoded at a smaller size, though not smaller
+   than min_width x min_height.  0 means full size. */
+classic_reader_t* classic_reader_new_from_file_scaled (const char *image_filename, tiling_t *tiling,
+						      unsigned int min_width, unsigned int min_height);
 classic_reader_t* classic_reader_new_from_bitmap (bitmap_t *bitmap, tiling_t *tiling);
 void classic_reader_free (classic_reader_t *reader);
 
@@ -252,7 +428,10 @@ void classic_writer_free (classic_writer_t *writer);
 
 /* forbid_reconstruction_radius is only relevant for antimosaics.  If
    the mosaic to be generated is not from an antimosaic, it must be
-   0. */
+   0.  The libraries are only read, so they must not be changed
+   meanwhile, except through snapshots.  The first mosaic made in a
+   color space computes the features of the libraries for it, which
+   is safe with other mosaics running. */
 classic_mosaic_t* classic_generate (int num_libraries, library_t **libraries,
 				    classic_reader_t *reader, matcher_t *matcher,
 				    unsigned int forbid_reconstruction_radius,
@@ -263,26 +442,54 @@ classic_mosaic_t* classic_generate_from_bitmap (int num_libraries, library_t **l
 						unsigned int forbid_reconstruction_radius,
 						unsigned int allowed_flips,
 						progress_report_func_t report_func);
+/* Only reads the libraries, like classic_generate.  Places the
+   metapixels randomly, with a seed drawn from rand(), so it must not
+   run at the same time as other calls of rand(). */
 collage_mosaic_t* collage_generate_from_bitmap (int num_libraries, library_t **libraries, bitmap_t *in_bitmap,
 						unsigned int min_small_width, unsigned int min_small_height,
 						unsigned int max_small_width, unsigned int max_small_height,
 						unsigned int min_distance, metric_t *metric,
 						unsigned int allowed_flips,
 						progress_report_func_t report_func);
+/* The same, but the random placement starts from seed, so the same
+   seed gives the same collage, and it shares no state with other
+   collages made at the same time. */
+collage_mosaic_t* collage_generate_from_bitmap_with_seed (int num_libraries, library_t **libraries,
+							  bitmap_t *in_bitmap,
+							  unsigned int min_small_width, unsigned int min_small_height,
+							  unsigned int max_small_width, unsigned int max_small_height,
+							  unsigned int min_distance, metric_t *metric,
+							  unsigned int allowed_flips, unsigned int seed,
+							  progress_report_func_t report_func);
+
+/* Generates a mosaic with a local matcher and pastes it in a single
+   pass over the input image.  Each metarow is pasted and written as
+   soon as it's searched, so only a few metarows of the input and the
+   output are in memory at a time.  The reader is used for searching
+   and for cheating, so it must give at least as many pixels per tile
+   as cheating needs.  The progress of the search and of pasting is
+   reported separately, by metarow.  Returns the mosaic, for writing a
+   protocol, or 0 on failure.  Only reads the libraries. */
+classic_mosaic_t* classic_generate_and_paste (int num_libraries, library_t **libraries,
+					      classic_reader_t *reader, matcher_t *matcher,
+					      unsigned int forbid_reconstruction_radius, unsigned int allowed_flips,
+					      unsigned int cheat, classic_writer_t *writer, tile_cache_t *tile_cache,
+					      progress_report_func_t generate_report_func,
+					      progress_report_func_t paste_report_func);
 
 /* If some metapixel in the mosaic isn't in one of the supplied
    libraries, classic_read tries to open the library.  If
    *num_new_libraries is >0 after classic_read returns, then each
    library in *new_libraries and the *new_libraries array itself
    belongs to the caller (libraries must be freed with library_free,
-   the array with free. */
+   the array with free.  Only reads the supplied libraries. */
 classic_mosaic_t* classic_read (int num_libraries, library_t **libraries, const char *filename,
 				int *num_new_libraries, library_t ***new_libraries);
 collage_mosaic_t* collage_read (int num_libraries, library_t **libraries, const char *filename,
 				int *num_new_libraries, library_t ***new_libraries);
 
 /* Each metapixel in the mosaic must be in a (saved) library.  Returns
-   0 on failure. */
+   0 on failure.  Only reads the mosaic. */
 int classic_write (classic_mosaic_t *mosaic, FILE *out);
 int collage_write (collage_mosaic_t *mosaic, FILE *out);
 
@@ -291,7 +498,9 @@ void collage_free (collage_mosaic_t *mosaic);
 
 /* cheat must be in the range from 0 (full transparency, i.e., no
    cheating) to 0x10000 (full opacity).  If cheat == 0, then
-   reader/in_image can be 0. */
+   reader/in_image can be 0.  The mosaic and its libraries are only
+   read, so several pastes of the same mosaic can run at the same
+   time. */
 int classic_paste (classic_mosaic_t *mosaic, classic_reader_t *reader, unsigned int cheat,
 		   classic_writer_t *writer, progress_report_func_t report_func);
 /* width and height are the width and height of the resulting bitmap. */
@@ -300,4 +509,15 @@ bitmap_t* classic_paste_to_bitmap (classic_mosaic_t *mosaic, unsigned int width,
 bitmap_t* collage_paste_to_bitmap (collage_mosaic_t *mosaic, unsigned int width, unsigned int height,
 				   bitmap_t *in_image, unsigned int cheat, progress_report_func_t report_func);
 
+/* The same, but the scaled tiles are taken from and added to
+   tile_cache, which can be 0. */
+int classic_paste_with_cache (classic_mosaic_t *mosaic, classic_reader_t *reader, unsigned int cheat,
+			      classic_writer_t *writer, tile_cache_t *tile_cache, progress_report_func_t report_func);
+bitmap_t* classic_paste_to_bitmap_with_cache (classic_mosaic_t *mosaic, unsigned int width, unsigned int height,
+					      bitmap_t *in_image, unsigned int cheat, tile_cache_t *tile_cache,
+					      progress_report_func_t report_func);
+bitmap_t* collage_paste_to_bitmap_with_cache (collage_mosaic_t *mosaic, unsigned int width, unsigned int height,
+					      bitmap_t *in_image, unsigned int cheat, tile_cache_t *tile_cache,
+					      progress_report_func_t report_func);
+
 #endif
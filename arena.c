@@ -0,0 +1,140 @@
+/*
+ * arena.c
+ *
+ * metapixel
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "api.h"
+
+/* enough for everything we put into arenas */
+#define ARENA_ALIGNMENT		8
+
+struct _arena_chunk_t
+{
+    arena_chunk_t *next;
+    size_t size;
+    size_t used;
+    /* to keep the data aligned */
+    double data[1];
+};
+
+void
+arena_init (arena_t *arena, size_t chunk_size)
+{
+    arena->chunks = 0;
+    arena->chunk_size = chunk_size;
+}
+
+void
+arena_free (arena_t *arena)
+{
+    while (arena->chunks != 0)
+    {
+	arena_chunk_t *next = arena->chunks->next;
+
+	free(arena->chunks);
+	arena->chunks = next;
+    }
+}
+
+static void*
+alloc_aligned (arena_t *arena, size_t size, size_t alignment)
+{
+    arena_chunk_t *chunk = arena->chunks;
+    size_t offset = 0;
+    void *p;
+
+    if (chunk != 0)
+	offset = (chunk->used + alignment - 1) & ~(alignment - 1);
+
+    if (chunk == 0 || offset > chunk->size || chunk->size - offset < size)
+    {
+	size_t chunk_size = MAX(arena->chunk_size, size);
+
+	chunk = (arena_chunk_t*)malloc(sizeof(arena_chunk_t) + chunk_size);
+	assert(chunk != 0);
+
+	chunk->size = chunk_size;
+	chunk->used = 0;
+	offset = 0;
+
+	/* a large allocation shouldn't waste what's left in the
+	   current chunk */
+	if (size > arena->chunk_size / 2 && arena->chunks != 0)
+	{
+	    chunk->next = arena->chunks->next;
+	    arena->chunks->next = chunk;
+	}
+	else
+	{
+	    chunk->next = arena->chunks;
+	    arena->chunks = chunk;
+	}
+    }
+
+    p = (char*)chunk->data + offset;
+    chunk->used = offset + size;
+
+    return p;
+}
+
+void*
+arena_alloc (arena_t *arena, size_t size)
+{
+    return alloc_aligned(arena, size, ARENA_ALIGNMENT);
+}
+
+char*
+arena_strdup (arena_t *arena, const char *str)
+{
+    size_t length = strlen(str) + 1;
+    char *copy = (char*)alloc_aligned(arena, length, 1);
+
+    memcpy(copy, str, length);
+
+    return copy;
+}
+
+void
+arena_take (arena_t *arena, arena_t *other)
+{
+    arena_chunk_t *last;
+
+    if (other->chunks == 0)
+	return;
+
+    for (last = other->chunks; last->next != 0; last = last->next)
+	;
+
+    /* we keep allocating from our current chunk */
+    if (arena->chunks != 0)
+    {
+	last->next = arena->chunks->next;
+	arena->chunks->next = other->chunks;
+    }
+    else
+	arena->chunks = other->chunks;
+
+    other->chunks = 0;
+}
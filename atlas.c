@@ -0,0 +1,272 @@
+/*
+ * atlas.c
+ *
+ * metapixel
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <assert.h>
+
+#include "api.h"
+
+static char*
+atlas_filename (const char *library_path)
+{
+    char *name = (char*)malloc(strlen(library_path) + 1 + strlen(ATLAS_FILENAME) + 1);
+
+    assert(name != 0);
+
+    strcpy(name, library_path);
+    strcat(name, "/");
+    strcat(name, ATLAS_FILENAME);
+
+    return name;
+}
+
+static atlas_t*
+make_atlas (char *filename)
+{
+    atlas_t *atlas = (atlas_t*)malloc(sizeof(atlas_t));
+
+    assert(atlas != 0);
+
+    atlas->filename = filename;
+    pthread_mutex_init(&atlas->mutex, 0);
+    atlas->mappings = 0;
+
+    return atlas;
+}
+
+atlas_t*
+atlas_open (const char *library_path)
+{
+    char *filename = atlas_filename(library_path);
+
+    if (access(filename, F_OK) != 0)
+    {
+	free(filename);
+	return 0;
+    }
+
+    return make_atlas(filename);
+}
+
+atlas_t*
+atlas_create (const char *library_path)
+{
+    char *filename = atlas_filename(library_path);
+    int fd = open(filename, O_RDWR | O_CREAT, 0666);
+
+    if (fd == -1)
+    {
+	error_info_t info = error_make_string_info(filename);
+
+	free(filename);
+
+	error_report(ERROR_ATLAS_CANNOT_OPEN, info);
+
+	return 0;
+    }
+
+    close(fd);
+
+    return make_atlas(filename);
+}
+
+void
+atlas_close (atlas_t *atlas)
+{
+    while (atlas->mappings != 0)
+    {
+	atlas_mapping_t *next = atlas->mappings->next;
+
+	munmap(atlas->mappings->data, atlas->mappings->size);
+	free(atlas->mappings);
+
+	atlas->mappings = next;
+    }
+
+    pthread_mutex_destroy(&atlas->mutex);
+    free(atlas->filename);
+    free(atlas);
+}
+
+int
+atlas_sync (atlas_t *atlas)
+{
+    int fd = open(atlas->filename, O_WRONLY);
+    int result;
+
+    if (fd == -1)
+	return 0;
+
+    result = fsync(fd) == 0;
+    close(fd);
+
+    return result;
+}
+
+int
+atlas_append (atlas_t *atlas, bitmap_t *bitmap)
+{
+    size_t data_size = (size_t)bitmap->width * bitmap->height * NUM_CHANNELS;
+    size_t record_size = (sizeof(atlas_header_t) + data_size + ATLAS_ALIGNMENT - 1) & ~(size_t)(ATLAS_ALIGNMENT - 1);
+    unsigned char *record;
+    atlas_header_t *header;
+    off_t end;
+    unsigned int y;
+    int fd;
+
+    assert(bitmap->color == COLOR_RGB_8);
+    assert(sizeof(atlas_header_t) % ATLAS_ALIGNMENT == 0);
+
+    record = (unsigned char*)malloc(record_size);
+    assert(record != 0);
+    memset(record, 0, record_size);
+
+    header = (atlas_header_t*)record;
+    header->magic = ATLAS_MAGIC;
+    header->width = bitmap->width;
+    header->height = bitmap->height;
+
+    for (y = 0; y < bitmap->height; ++y)
+    {
+	unsigned char *src = bitmap->data + y * bitmap->row_stride;
+	unsigned char *dst = record + sizeof(atlas_header_t) + y * bitmap->width * NUM_CHANNELS;
+	unsigned int x;
+
+	for (x = 0; x < bitmap->width; ++x)
+	    memcpy(dst + x * NUM_CHANNELS, src + x * bitmap->pixel_stride, NUM_CHANNELS);
+    }
+
+    fd = open(atlas->filename, O_WRONLY);
+    if (fd == -1)
+	goto error;
+
+    /* records are always padded, so the end is aligned */
+    end = lseek(fd, 0, SEEK_END);
+    if (end == (off_t)-1 || end % ATLAS_ALIGNMENT != 0
+	|| end / ATLAS_ALIGNMENT > 0x7fffffff)
+    {
+	close(fd);
+	goto error;
+    }
+
+    if (write(fd, record, record_size) != (ssize_t)record_size)
+    {
+	/* don't leave a partial record behind */
+	if (ftruncate(fd, end) != 0)
+	{
+	    /* nothing we can do about it */
+	}
+	close(fd);
+	goto error;
+    }
+
+    close(fd);
+    free(record);
+
+    return (int)(end / ATLAS_ALIGNMENT);
+
+ error:
+    free(record);
+
+    error_report(ERROR_ATLAS_CANNOT_WRITE, error_make_string_info(atlas->filename));
+
+    return -1;
+}
+
+/* Must be called with the mutex held.  Returns a mapping which
+   contains the given range, mapping the whole file anew if
+   necessary. */
+static atlas_mapping_t*
+find_mapping (atlas_t *atlas, size_t start, size_t size)
+{
+    atlas_mapping_t *mapping = atlas->mappings;
+    struct stat buf;
+    void *data;
+    int fd;
+
+    if (mapping != 0 && start + size <= mapping->size)
+	return mapping;
+
+    /* the atlas has grown since we mapped it */
+    fd = open(atlas->filename, O_RDONLY);
+    if (fd == -1)
+	return 0;
+
+    if (fstat(fd, &buf) != 0 || buf.st_size < start + size)
+    {
+	close(fd);
+	return 0;
+    }
+
+    data = mmap(0, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+	return 0;
+
+    mapping = (atlas_mapping_t*)malloc(sizeof(atlas_mapping_t));
+    assert(mapping != 0);
+
+    mapping->data = (unsigned char*)data;
+    mapping->size = buf.st_size;
+    mapping->next = atlas->mappings;
+    atlas->mappings = mapping;
+
+    return mapping;
+}
+
+bitmap_t*
+atlas_get_bitmap (atlas_t *atlas, int offset, unsigned int width, unsigned int height)
+{
+    size_t start = (size_t)offset * ATLAS_ALIGNMENT;
+    size_t size = sizeof(atlas_header_t) + (size_t)width * height * NUM_CHANNELS;
+    atlas_mapping_t *mapping;
+    atlas_header_t *header;
+
+    assert(offset >= 0);
+
+    pthread_mutex_lock(&atlas->mutex);
+    mapping = find_mapping(atlas, start, size);
+    pthread_mutex_unlock(&atlas->mutex);
+
+    if (mapping == 0)
+    {
+	error_report(ERROR_ATLAS_CANNOT_OPEN, error_make_string_info(atlas->filename));
+	return 0;
+    }
+
+    header = (atlas_header_t*)(mapping->data + start);
+    if (header->magic != ATLAS_MAGIC || header->width != width || header->height != height)
+    {
+	error_report(ERROR_ATLAS_CORRUPT, error_make_string_info(atlas->filename));
+	return 0;
+    }
+
+    return bitmap_new_dont_possess(COLOR_RGB_8, width, height, NUM_CHANNELS, width * NUM_CHANNELS,
+				   mapping->data + start + sizeof(atlas_header_t));
+}
@@ -0,0 +1,399 @@
+/*
+ * bintables.c
+ *
+ * metapixel
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <assert.h>
+
+#include "api.h"
+
+/* The binary tables file is a cache of tables.mxt which can be used
+   without parsing.  It is only valid for the exact tables.mxt it was
+   made from, and is made anew whenever that changes.  It consists of
+   the header, the records in the order of tables.mxt, the levels of
+   all records and the string table. */
+
+#define BINARY_TABLES_MAGIC	0x4254584d	/* "MXTB" */
+#define BINARY_TABLES_VERSION	2
+
+#define NO_STRING		0xffffffff
+
+typedef struct
+{
+    unsigned int magic;
+    unsigned int version;
+    /* guard against reading a file made on a different platform */
+    unsigned int record_size;
+    unsigned int num_records;
+    unsigned int num_levels;
+    unsigned int strings_size;
+    /* of the tables file this was made from */
+    long long tables_size;
+    long long tables_mtime;
+    long long tables_mtime_nsec;
+    long long tables_inode;
+} binary_tables_header_t;
+
+typedef struct
+{
+    unsigned int name;		/* offsets into the string table */
+    unsigned int filename;
+    unsigned int width;
+    unsigned int height;
+    float aspect_ratio;
+    unsigned int flip;
+    int anti_x;
+    int anti_y;
+    int atlas_offset;
+    unsigned int first_level;
+    unsigned int num_levels;
+    unsigned char subpixels_rgb[NUM_SUBPIXELS * NUM_CHANNELS];
+} binary_tables_record_t;
+
+typedef struct
+{
+    unsigned int width;
+    unsigned int height;
+    unsigned int filename;
+    int atlas_offset;
+} binary_tables_level_t;
+
+struct _binary_tables_t
+{
+    void *data;
+    size_t size;
+    unsigned int num_metapixels;
+    metapixel_t *metapixels;
+    metapixel_level_t *levels;
+};
+
+static int
+header_matches (binary_tables_header_t *header, struct stat *tables_stat, size_t size)
+{
+    size_t expected_size;
+
+    if (size < sizeof(binary_tables_header_t))
+	return 0;
+
+    if (header->magic != BINARY_TABLES_MAGIC
+	|| header->version != BINARY_TABLES_VERSION
+	|| header->record_size != sizeof(binary_tables_record_t)
+	|| header->tables_size != (long long)tables_stat->st_size
+	|| header->tables_mtime != (long long)tables_stat->st_mtime
+	|| header->tables_mtime_nsec != (long long)tables_stat->st_mtim.tv_nsec
+	|| header->tables_inode != (long long)tables_stat->st_ino)
+	return 0;
+
+    expected_size = sizeof(binary_tables_header_t)
+	+ (size_t)header->num_records * sizeof(binary_tables_record_t)
+	+ (size_t)header->num_levels * sizeof(binary_tables_level_t)
+	+ header->strings_size;
+
+    return size == expected_size;
+}
+
+static const char*
+get_string (const char *strings, unsigned int strings_size, unsigned int offset)
+{
+    if (offset == NO_STRING)
+	return 0;
+    /* the string table ends with a 0 */
+    if (offset >= strings_size)
+	return 0;
+    return strings + offset;
+}
+
+int
+binary_tables_read (library_t *library, struct stat *tables_stat)
+{
+    char *filename = library_filename(library->path, BINARY_TABLES_FILENAME);
+    binary_tables_t *tables;
+    binary_tables_header_t *header;
+    binary_tables_record_t *records;
+    binary_tables_level_t *levels;
+    const char *strings;
+    struct stat buf;
+    void *data;
+    unsigned int i;
+    int fd;
+
+    assert(library->metapixels == 0);
+
+    fd = open(filename, O_RDONLY);
+    free(filename);
+
+    if (fd == -1)
+	return 0;
+
+    if (fstat(fd, &buf) != 0 || buf.st_size < sizeof(binary_tables_header_t))
+    {
+	close(fd);
+	return 0;
+    }
+
+    data = mmap(0, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+	return 0;
+
+    header = (binary_tables_header_t*)data;
+    if (!header_matches(header, tables_stat, buf.st_size)
+	|| (header->strings_size > 0 && ((char*)data)[buf.st_size - 1] != 0))
+    {
+	munmap(data, buf.st_size);
+	return 0;
+    }
+
+    records = (binary_tables_record_t*)((char*)data + sizeof(binary_tables_header_t));
+    levels = (binary_tables_level_t*)(records + header->num_records);
+    strings = (const char*)(levels + header->num_levels);
+
+    tables = (binary_tables_t*)malloc(sizeof(binary_tables_t));
+    assert(tables != 0);
+
+    tables->data = data;
+    tables->size = buf.st_size;
+    tables->num_metapixels = header->num_records;
+    tables->metapixels = (metapixel_t*)malloc(sizeof(metapixel_t) * (header->num_records + 1));
+    tables->levels = (metapixel_level_t*)malloc(sizeof(metapixel_level_t) * (header->num_levels + 1));
+    assert(tables->metapixels != 0 && tables->levels != 0);
+
+    for (i = 0; i < header->num_levels; ++i)
+    {
+	metapixel_level_t *level = &tables->levels[i];
+
+	level->width = levels[i].width;
+	level->height = levels[i].height;
+	level->filename = (char*)get_string(strings, header->strings_size, levels[i].filename);
+	level->bitmap = 0;
+	level->atlas_offset = levels[i].atlas_offset;
+    }
+
+    for (i = 0; i < header->num_records; ++i)
+    {
+	binary_tables_record_t *record = &records[i];
+	metapixel_t *pixel = &tables->metapixels[i];
+
+	memset(pixel, 0, sizeof(metapixel_t));
+
+	/* the strings are not copied - they stay in the mapping */
+	pixel->library = library;
+	pixel->name = (char*)get_string(strings, header->strings_size, record->name);
+	pixel->filename = (char*)get_string(strings, header->strings_size, record->filename);
+	pixel->width = record->width;
+	pixel->height = record->height;
+	pixel->flip = record->flip;
+	pixel->aspect_ratio = record->aspect_ratio;
+	pixel->anti_x = record->anti_x;
+	pixel->anti_y = record->anti_y;
+	pixel->enabled = 1;
+	pixel->atlas_offset = record->atlas_offset;
+
+	memcpy(pixel->subpixels_rgb, record->subpixels_rgb, sizeof(pixel->subpixels_rgb));
+
+	if (pixel->name == 0
+	    || (record->num_levels > 0
+		&& (record->first_level >= header->num_levels
+		    || record->num_levels > header->num_levels - record->first_level))
+	    || (pixel->atlas_offset >= 0 && library->atlas == 0))
+	{
+	    library->metapixels = 0;
+	    library->num_metapixels = 0;
+	    tables->num_metapixels = 0;
+	    binary_tables_free(tables);
+	    return 0;
+	}
+
+	pixel->num_levels = record->num_levels;
+	pixel->levels = record->num_levels > 0 ? &tables->levels[record->first_level] : 0;
+
+	/* same order as when reading tables.mxt */
+	pixel->next = library->metapixels;
+	library->metapixels = pixel;
+    }
+
+    library->num_metapixels = header->num_records;
+    library->binary_tables = tables;
+
+    return 1;
+}
+
+void
+binary_tables_free (binary_tables_t *tables)
+{
+    free(tables->metapixels);
+    free(tables->levels);
+    munmap(tables->data, tables->size);
+    free(tables);
+}
+
+static unsigned int
+string_size (const char *str)
+{
+    if (str == 0)
+	return 0;
+    return strlen(str) + 1;
+}
+
+static unsigned int
+add_string (unsigned int *strings_size, const char *str)
+{
+    unsigned int offset = *strings_size;
+
+    if (str == 0)
+	return NO_STRING;
+
+    *strings_size += string_size(str);
+
+    return offset;
+}
+
+int
+binary_tables_write (library_t *library, struct stat *tables_stat)
+{
+    char *filename = library_filename(library->path, BINARY_TABLES_FILENAME);
+    char temp_filename[strlen(filename) + 7 + 1];
+    binary_tables_header_t header;
+    metapixel_t **pixels;
+    metapixel_t *pixel;
+    unsigned int num_levels = 0, strings_size = 0;
+    unsigned int i, j;
+    FILE *file;
+    int result;
+
+    file = utils_create_temp_file(filename, temp_filename);
+    if (file == 0)
+    {
+	free(filename);
+	return 0;
+    }
+
+    pixels = library_metapixels_in_file_order(library->metapixels, library->num_metapixels);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = BINARY_TABLES_MAGIC;
+    header.version = BINARY_TABLES_VERSION;
+    header.record_size = sizeof(binary_tables_record_t);
+    header.num_records = library->num_metapixels;
+    header.tables_size = tables_stat->st_size;
+    header.tables_mtime = tables_stat->st_mtime;
+    header.tables_mtime_nsec = tables_stat->st_mtim.tv_nsec;
+    header.tables_inode = tables_stat->st_ino;
+
+    /* the header is written again at the end, when the sizes are
+       known */
+    fwrite(&header, sizeof(header), 1, file);
+
+    /* the strings are written in the order in which their offsets
+       are assigned here */
+    for (i = 0; i < library->num_metapixels; ++i)
+    {
+	binary_tables_record_t record;
+
+	pixel = pixels[i];
+
+	memset(&record, 0, sizeof(record));
+
+	record.name = add_string(&strings_size, pixel->name);
+	record.filename = add_string(&strings_size, pixel->filename);
+	for (j = 0; j < pixel->num_levels; ++j)
+	    strings_size += string_size(pixel->levels[j].filename);
+
+	record.width = pixel->width;
+	record.height = pixel->height;
+	record.aspect_ratio = pixel->aspect_ratio;
+	record.flip = pixel->flip;
+	record.anti_x = pixel->anti_x;
+	record.anti_y = pixel->anti_y;
+	record.atlas_offset = pixel->atlas_offset;
+	record.first_level = num_levels;
+	record.num_levels = pixel->num_levels;
+
+	memcpy(record.subpixels_rgb, pixel->subpixels_rgb, sizeof(record.subpixels_rgb));
+
+	num_levels += pixel->num_levels;
+
+	fwrite(&record, sizeof(record), 1, file);
+    }
+
+    strings_size = 0;
+    for (i = 0; i < library->num_metapixels; ++i)
+    {
+	pixel = pixels[i];
+
+	add_string(&strings_size, pixel->name);
+	add_string(&strings_size, pixel->filename);
+
+	for (j = 0; j < pixel->num_levels; ++j)
+	{
+	    binary_tables_level_t level;
+
+	    level.width = pixel->levels[j].width;
+	    level.height = pixel->levels[j].height;
+	    level.filename = add_string(&strings_size, pixel->levels[j].filename);
+	    level.atlas_offset = pixel->levels[j].atlas_offset;
+
+	    fwrite(&level, sizeof(level), 1, file);
+	}
+    }
+
+    for (i = 0; i < library->num_metapixels; ++i)
+    {
+	pixel = pixels[i];
+
+	fwrite(pixel->name, string_size(pixel->name), 1, file);
+	if (pixel->filename != 0)
+	    fwrite(pixel->filename, string_size(pixel->filename), 1, file);
+	for (j = 0; j < pixel->num_levels; ++j)
+	    if (pixel->levels[j].filename != 0)
+		fwrite(pixel->levels[j].filename, string_size(pixel->levels[j].filename), 1, file);
+    }
+
+    free(pixels);
+
+    header.num_levels = num_levels;
+    header.strings_size = strings_size;
+
+    result = fseek(file, 0, SEEK_SET) == 0
+	&& fwrite(&header, sizeof(header), 1, file) == 1
+	&& fflush(file) == 0
+	&& !ferror(file);
+    if (fclose(file) != 0)
+	result = 0;
+
+    if (result)
+	result = rename(temp_filename, filename) == 0;
+
+    if (!result)
+	unlink(temp_filename);
+
+    free(filename);
+
+    return result;
+}
@@ -37,14 +37,16 @@ color_channels (int color)
     return 3;
 }
 
+/* The sign of the refcount never changes, so only the count itself
+   has to be updated atomically for bitmaps shared between threads. */
 static void
 ref_bitmap (bitmap_t *bitmap)
 {
     assert(bitmap->refcount != 0);
     if (bitmap->refcount > 0)
-	++bitmap->refcount;
+	__sync_add_and_fetch(&bitmap->refcount, 1);
     else
-	--bitmap->refcount;
+	__sync_sub_and_fetch(&bitmap->refcount, 1);
 }
 
 bitmap_t*
@@ -128,9 +130,7 @@ bitmap_free (bitmap_t *bitmap)
 
     if (bitmap->refcount > 0)
     {
-	--bitmap->refcount;
-
-	if (bitmap->refcount == 0)
+	if (__sync_sub_and_fetch(&bitmap->refcount, 1) == 0)
 	{
 	    if (bitmap->super != 0)
 		bitmap_free(bitmap->super);
@@ -141,11 +141,9 @@ bitmap_free (bitmap_t *bitmap)
     }
     else
     {
-	++bitmap->refcount;
-
 	assert(bitmap->super == 0);
 
-	if (bitmap->refcount == 0)
+	if (__sync_add_and_fetch(&bitmap->refcount, 1) == 0)
 	    free(bitmap);
     }
 }
@@ -233,6 +231,110 @@ bitmap_flip (bitmap_t *orig, unsigned int flip)
     return flipped;
 }
 
+int
+bitmap_paste_scaled (bitmap_t *dst, bitmap_t *src, unsigned int x, unsigned int y,
+		     unsigned int width, unsigned int height, unsigned int flip, int filter_id,
+		     bitmap_t *blend, unsigned int opacity)
+{
+    unsigned int num_channels = color_channels(dst->color);
+    unsigned char *dst_data = dst->data + y * dst->row_stride + x * dst->pixel_stride;
+    int dst_pixel_stride = dst->pixel_stride, dst_row_stride = dst->row_stride;
+    unsigned char *blend_data = 0;
+    int blend_pixel_stride = 0, blend_row_stride = 0;
+
+    assert(dst->color == src->color);
+    assert(width > 0 && height > 0);
+    assert(x + width <= dst->width);
+    assert(y + height <= dst->height);
+
+    if (blend != 0)
+    {
+	assert(blend->color == dst->color);
+	assert(blend->width == dst->width && blend->height == dst->height);
+
+	blend_data = blend->data + y * blend->row_stride + x * blend->pixel_stride;
+	blend_pixel_stride = blend->pixel_stride;
+	blend_row_stride = blend->row_stride;
+    }
+
+    /* we flip by walking the destination (and the blend bitmap,
+       which must stay aligned with it) backwards */
+    if (flip & FLIP_HOR)
+    {
+	dst_data += (width - 1) * dst_pixel_stride;
+	dst_pixel_stride = -dst_pixel_stride;
+
+	if (blend != 0)
+	{
+	    blend_data += (width - 1) * blend_pixel_stride;
+	    blend_pixel_stride = -blend_pixel_stride;
+	}
+    }
+    if (flip & FLIP_VER)
+    {
+	dst_data += (height - 1) * dst_row_stride;
+	dst_row_stride = -dst_row_stride;
+
+	if (blend != 0)
+	{
+	    blend_data += (height - 1) * blend_row_stride;
+	    blend_row_stride = -blend_row_stride;
+	}
+    }
+
+    if (src->width == width && src->height == height)
+    {
+	unsigned int row;
+
+	for (row = 0; row < height; ++row)
+	{
+	    unsigned char *src_pixel = src->data + row * src->row_stride;
+	    unsigned char *dst_pixel = dst_data + (int)row * dst_row_stride;
+	    unsigned int column;
+
+	    if (blend == 0 && dst_pixel_stride == src->pixel_stride)
+	    {
+		memcpy(dst_pixel, src_pixel, width * src->pixel_stride);
+		continue;
+	    }
+
+	    for (column = 0; column < width; ++column)
+	    {
+		unsigned int i;
+
+		if (blend != 0)
+		{
+		    unsigned char *blend_pixel = blend_data + (int)row * blend_row_stride
+			+ (int)column * blend_pixel_stride;
+
+		    for (i = 0; i < num_channels; ++i)
+			dst_pixel[i] = (((unsigned int)src_pixel[i] * (0x10000 - opacity)) >> 16)
+			    + (((unsigned int)blend_pixel[i] * opacity) >> 16);
+		}
+		else
+		    memcpy(dst_pixel, src_pixel, num_channels);
+
+		src_pixel += src->pixel_stride;
+		dst_pixel += dst_pixel_stride;
+	    }
+	}
+    }
+    else
+    {
+	filter_t *filter = get_filter(filter_id);
+
+	if (filter == 0)
+	    return 0;
+
+	zoom_image_blended(dst_data, src->data, filter, num_channels,
+			   width, height, dst_pixel_stride, dst_row_stride,
+			   src->width, src->height, src->pixel_stride, src->row_stride,
+			   blend_data, blend_pixel_stride, blend_row_stride, opacity);
+    }
+
+    return 1;
+}
+
 bitmap_t*
 bitmap_copy (bitmap_t *bitmap)
 {
@@ -50,10 +50,32 @@ make_classic_reader (int kind, tiling_t *tiling, unsigned int width, unsigned in
 
 classic_reader_t*
 classic_reader_new_from_file (const char *image_filename, tiling_t *tiling)
+{
+    return classic_reader_new_from_file_scaled(image_filename, tiling, 0, 0);
+}
+
+classic_reader_t*
+classic_reader_new_from_file_scaled (const char *image_filename, tiling_t *tiling,
+				     unsigned int min_width, unsigned int min_height)
 {
     classic_reader_t *reader;
     image_reader_t *image_reader;
 
+    if (min_width > 0 && min_height > 0)
+    {
+	jpeg_reader_t *jpeg_reader = jpeg_reader_open(image_filename, min_width, min_height);
+
+	if (jpeg_reader != 0)
+	{
+	    reader = make_classic_reader(CLASSIC_READER_JPEG, tiling, jpeg_reader->width, jpeg_reader->height);
+	    assert(reader != 0);
+
+	    reader->v.jpeg_reader = jpeg_reader;
+
+	    return reader;
+	}
+    }
+
     image_reader = open_image_reading(image_filename);
     if (image_reader == 0)
     {
@@ -97,13 +119,17 @@ read_classic_row (classic_reader_t *reader)
 
     reader->num_lines = tiling_get_rectangular_height(&reader->tiling, reader->in_image_height, reader->y);
 
-    if (reader->kind == CLASSIC_READER_IMAGE_READER)
+    if (reader->kind == CLASSIC_READER_IMAGE_READER
+	|| reader->kind == CLASSIC_READER_JPEG)
     {
 	image_data = (unsigned char*)malloc(reader->num_lines * reader->in_image_width * NUM_CHANNELS);
 	assert(image_data != 0);
 
 	/* FIXME: add error handling */
-	read_lines(reader->v.image_reader, image_data, reader->num_lines);
+	if (reader->kind == CLASSIC_READER_JPEG)
+	    jpeg_reader_read_lines(reader->v.jpeg_reader, image_data, reader->num_lines);
+	else
+	    read_lines(reader->v.image_reader, image_data, reader->num_lines);
 
 	reader->in_image = bitmap_new_packed(COLOR_RGB_8, reader->in_image_width, reader->num_lines, image_data);
     }
@@ -127,6 +153,8 @@ classic_reader_free (classic_reader_t *reader)
 	bitmap_free(reader->in_image);
     if (reader->kind == CLASSIC_READER_IMAGE_READER)
 	free_image_reader(reader->v.image_reader);
+    else if (reader->kind == CLASSIC_READER_JPEG)
+	jpeg_reader_free(reader->v.jpeg_reader);
     else if (reader->kind == CLASSIC_READER_BITMAP)
 	bitmap_free(reader->v.bitmap);
     else
@@ -188,15 +216,17 @@ classic_writer_new_for_bitmap (bitmap_t *bitmap)
     return writer;
 }
 
+/* Rows can be requested ahead of writing them, but they must be
+   written in order. */
 static bitmap_t*
-writer_get_row (classic_writer_t *writer, tiling_t *tiling)
+writer_get_row (classic_writer_t *writer, tiling_t *tiling, int y)
 {
-    unsigned int height = tiling_get_rectangular_height(tiling, writer->out_image_height, writer->y);
+    unsigned int height = tiling_get_rectangular_height(tiling, writer->out_image_height, y);
 
     if (writer->kind == CLASSIC_WRITER_IMAGE_WRITER)
 	return bitmap_new_empty(COLOR_RGB_8, writer->out_image_width, height);
     else if (writer->kind == CLASSIC_WRITER_BITMAP)
-	return bitmap_sub(writer->v.bitmap, 0, tiling_get_rectangular_y(tiling, writer->out_image_height, writer->y),
+	return bitmap_sub(writer->v.bitmap, 0, tiling_get_rectangular_y(tiling, writer->out_image_height, y),
 			  writer->out_image_width, height);
     else
 	assert(0);
@@ -276,38 +306,110 @@ generate_search_coeffs_for_classic_subimage (classic_reader_t *reader, int x, co
 					left_x, 0, width, reader->num_lines, metric);
 }
 
-static classic_mosaic_t*
-generate_local (int num_libraries, library_t **libraries, classic_reader_t *reader, int min_distance, metric_t *metric,
-		unsigned int forbid_reconstruction_radius, unsigned int allowed_flips, progress_report_func_t report_func)
+/* The tiles of a metarow are searched on the thread pool, as long as
+   they don't depend on each other. */
+typedef struct
+{
+    int num_libraries;
+    library_t **libraries;
+    classic_reader_t *reader;
+    metric_t *metric;
+    unsigned int forbid_reconstruction_radius;
+    unsigned int allowed_flips;
+    int y;
+    coeffs_union_t *coeffs;	/* one per tile */
+    metapixel_match_t *matches;	/* for local searches, of the whole mosaic */
+    global_match_t *global_matches; /* for global searches, of the row */
+    int matches_per_metapixel;
+    /* for local searches with a min_distance */
+    int min_distance;
+    metapixel_t **neighborhood;
+} row_search_t;
+
+static void
+generate_row_coeffs (unsigned int start, unsigned int end, void *data)
+{
+    row_search_t *row = (row_search_t*)data;
+    unsigned int x;
+
+    for (x = start; x < end; ++x)
+	generate_search_coeffs_for_classic_subimage(row->reader, x, &row->coeffs[x], row->metric);
+}
+
+/* Only for a min_distance of 0. */
+static void
+search_local_tiles (unsigned int start, unsigned int end, void *data)
+{
+    row_search_t *row = (row_search_t*)data;
+    unsigned int x;
+
+    generate_row_coeffs(start, end, data);
+
+    for (x = start; x < end; ++x)
+	row->matches[row->y * row->reader->tiling.metawidth + x] =
+	    search_metapixel_nearest_to(row->num_libraries, row->libraries,
+					&row->coeffs[x], row->metric, x, row->y, 0, 0,
+					row->forbid_reconstruction_radius, row->allowed_flips, 0, 0);
+}
+
+static void
+init_local_search (row_search_t *row, int num_libraries, library_t **libraries, classic_reader_t *reader,
+		   classic_mosaic_t *mosaic, int min_distance, metric_t *metric,
+		   unsigned int forbid_reconstruction_radius, unsigned int allowed_flips)
 {
-    classic_mosaic_t *mosaic = init_mosaic_from_reader(reader);
-    int metawidth = reader->tiling.metawidth, metaheight = reader->tiling.metaheight;
-    int x, y;
-    metapixel_t **neighborhood = 0;
     int neighborhood_diameter = min_distance * 2 + 1;
-    int neighborhood_size = (neighborhood_diameter * neighborhood_diameter - 1) / 2;
-    float num_metapixels = (float)(metawidth * metaheight);
-    PROGRESS_DECLS;
 
+    row->num_libraries = num_libraries;
+    row->libraries = libraries;
+    row->reader = reader;
+    row->metric = metric;
+    row->forbid_reconstruction_radius = forbid_reconstruction_radius;
+    row->allowed_flips = allowed_flips;
+    row->coeffs = (coeffs_union_t*)malloc(sizeof(coeffs_union_t) * reader->tiling.metawidth);
+    assert(row->coeffs != 0);
+    row->matches = mosaic->matches;
+    row->min_distance = min_distance;
+
+    row->neighborhood = 0;
     if (min_distance > 0)
     {
-	neighborhood = (metapixel_t**)malloc(sizeof(metapixel_t*) * neighborhood_size);
-	assert(neighborhood != 0);
+	row->neighborhood = (metapixel_t**)malloc(sizeof(metapixel_t*)
+						  * (neighborhood_diameter * neighborhood_diameter - 1) / 2);
+	assert(row->neighborhood != 0);
     }
+}
 
-    START_PROGRESS;
+static void
+free_local_search (row_search_t *row)
+{
+    free(row->coeffs);
+    if (row->neighborhood != 0)
+	free(row->neighborhood);
+}
 
-    for (y = 0; y < metaheight; ++y)
-    {
-	read_classic_row(reader);
+/* Searches the tiles of the row the reader has just read.  The
+   matches of a row are final once it's searched.  Returns 0 if there
+   was no match for some tile. */
+static int
+search_local_row (row_search_t *row, int y)
+{
+    int metawidth = row->reader->tiling.metawidth, metaheight = row->reader->tiling.metaheight;
+    int min_distance = row->min_distance;
+    int neighborhood_diameter = min_distance * 2 + 1;
+    int neighborhood_size = (neighborhood_diameter * neighborhood_diameter - 1) / 2;
+    int x;
 
-	// bitmap_write(reader->in_image, "/tmp/metarow.png");
+    /* with a min_distance each tile depends on the ones before it,
+       so only the coefficients can be computed in parallel */
+    row->y = y;
+    parallel_for(thread_pool_get_default(), 0, metawidth, 1,
+		 min_distance > 0 ? generate_row_coeffs : search_local_tiles, row);
 
-	for (x = 0; x < metawidth; ++x)
+    for (x = 0; x < metawidth; ++x)
+    {
+	if (min_distance > 0)
 	{
-	    metapixel_match_t match;
 	    int i;
-	    coeffs_union_t coeffs;
 
 	    for (i = 0; i < neighborhood_size; ++i)
 	    {
@@ -315,27 +417,55 @@ generate_local (int num_libraries, library_t **libraries, classic_reader_t *read
 		int ny = y + i / neighborhood_diameter - min_distance;
 
 		if (nx < 0 || nx >= metawidth || ny < 0 || ny >= metaheight)
-		    neighborhood[i] = 0;
+		    row->neighborhood[i] = 0;
 		else
-		    neighborhood[i] = mosaic->matches[ny * metawidth + nx].pixel;
+		    row->neighborhood[i] = row->matches[ny * metawidth + nx].pixel;
 	    }
 
-	    generate_search_coeffs_for_classic_subimage(reader, x, &coeffs, metric);
+	    row->matches[y * metawidth + x] =
+		search_metapixel_nearest_to(row->num_libraries, row->libraries,
+					    &row->coeffs[x], row->metric, x, y, row->neighborhood, neighborhood_size,
+					    row->forbid_reconstruction_radius, row->allowed_flips, 0, 0);
+	}
 
-	    match = search_metapixel_nearest_to(num_libraries, libraries,
-						&coeffs, metric, x, y, neighborhood, neighborhood_size,
-						forbid_reconstruction_radius, allowed_flips, 0, 0);
+	if (row->matches[y * metawidth + x].pixel == 0)
+	    return 0;
+    }
 
-	    if (match.pixel == 0)
-	    {
-		/* FIXME: free stuff */
+    return 1;
+}
 
-		error_report(ERROR_CANNOT_FIND_LOCAL_MATCH, error_make_null_info());
-		return 0;
-	    }
+static classic_mosaic_t*
+generate_local (int num_libraries, library_t **libraries, classic_reader_t *reader, int min_distance, metric_t *metric,
+		unsigned int forbid_reconstruction_radius, unsigned int allowed_flips, progress_report_func_t report_func)
+{
+    classic_mosaic_t *mosaic = init_mosaic_from_reader(reader);
+    int metawidth = reader->tiling.metawidth, metaheight = reader->tiling.metaheight;
+    int x, y;
+    float num_metapixels = (float)(metawidth * metaheight);
+    row_search_t row;
+    PROGRESS_DECLS;
 
-	    mosaic->matches[y * metawidth + x] = match;
+    init_local_search(&row, num_libraries, libraries, reader, mosaic, min_distance, metric,
+		      forbid_reconstruction_radius, allowed_flips);
 
+    START_PROGRESS;
+
+    for (y = 0; y < metaheight; ++y)
+    {
+	read_classic_row(reader);
+
+	if (!search_local_row(&row, y))
+	{
+	    free_local_search(&row);
+	    classic_free(mosaic);
+
+	    error_report(ERROR_CANNOT_FIND_LOCAL_MATCH, error_make_null_info());
+	    return 0;
+	}
+
+	for (x = 0; x < metawidth; ++x)
+	{
 #ifdef CONSOLE_OUTPUT
 	    printf(".");
 	    fflush(stdout);
@@ -345,7 +475,7 @@ generate_local (int num_libraries, library_t **libraries, classic_reader_t *read
 	}
     }
 
-    free(neighborhood);
+    free_local_search(&row);
 
 #ifdef CONSOLE_OUTPUT
     printf("\n");
@@ -367,6 +497,35 @@ compare_global_matches (const void *_m1, const void *_m2)
     return 0;
 }
 
+static void
+search_global_tiles (unsigned int start, unsigned int end, void *data)
+{
+    row_search_t *row = (row_search_t*)data;
+    unsigned int x;
+
+    generate_row_coeffs(start, end, data);
+
+    for (x = start; x < end; ++x)
+    {
+	global_match_t *m = row->global_matches + x * row->matches_per_metapixel;
+	int i;
+
+	search_n_metapixel_nearest_to(row->num_libraries, row->libraries, row->matches_per_metapixel, m,
+				      &row->coeffs[x], row->metric, row->allowed_flips);
+	for (i = 0; i < row->matches_per_metapixel; ++i)
+	{
+	    int j;
+
+	    for (j = i + 1; j < row->matches_per_metapixel; ++j)
+		assert(m[i].match.pixel != m[j].match.pixel
+		       || m[i].match.orientation != m[j].match.orientation);
+
+	    m[i].x = x;
+	    m[i].y = row->y;
+	}
+    }
+}
+
 static classic_mosaic_t*
 generate_global (int num_libraries, library_t **libraries, classic_reader_t *reader, metric_t *metric,
 		 unsigned int forbid_reconstruction_radius, unsigned int allowed_flips, progress_report_func_t report_func)
@@ -383,6 +542,7 @@ generate_global (int num_libraries, library_t **libraries, classic_reader_t *rea
     int matches_per_metapixel = metawidth * metaheight * multiplier;
     /* FIXME: this will overflow if metawidth and/or metaheight are large! */
     int num_matches = (metawidth * metaheight) * matches_per_metapixel;
+    row_search_t row;
     PROGRESS_DECLS;
 
     if (library_count_metapixels(num_libraries, libraries) < metawidth * metaheight)
@@ -397,6 +557,15 @@ generate_global (int num_libraries, library_t **libraries, classic_reader_t *rea
     matches = (global_match_t*)malloc(sizeof(global_match_t) * num_matches);
     assert(matches != 0);
 
+    row.num_libraries = num_libraries;
+    row.libraries = libraries;
+    row.reader = reader;
+    row.metric = metric;
+    row.allowed_flips = allowed_flips;
+    row.matches_per_metapixel = matches_per_metapixel;
+    row.coeffs = (coeffs_union_t*)malloc(sizeof(coeffs_union_t) * metawidth);
+    assert(row.coeffs != 0);
+
     START_PROGRESS;
 
     m = matches;
@@ -404,28 +573,14 @@ generate_global (int num_libraries, library_t **libraries, classic_reader_t *rea
     {
 	read_classic_row(reader);
 
-	for (x = 0; x < metawidth; ++x)
-	{
-	    coeffs_union_t coeffs;
-
-	    generate_search_coeffs_for_classic_subimage(reader, x, &coeffs, metric);
-	    
-	    search_n_metapixel_nearest_to(num_libraries, libraries, matches_per_metapixel, m,
-					  &coeffs, metric, allowed_flips);
-	    for (i = 0; i < metawidth * metaheight * multiplier; ++i)
-	    {
-		int j;
-
-		for (j = i + 1; j < matches_per_metapixel; ++j)
-		    assert(m[i].match.pixel != m[j].match.pixel
-			   || m[i].match.orientation != m[j].match.orientation);
-
-		m[i].x = x;
-		m[i].y = y;
-	    }
+	row.y = y;
+	row.global_matches = m;
+	parallel_for(thread_pool_get_default(), 0, metawidth, 1, search_global_tiles, &row);
 
-	    m += matches_per_metapixel;
+	m += metawidth * matches_per_metapixel;
 
+	for (x = 0; x < metawidth; ++x)
+	{
 #ifdef CONSOLE_OUTPUT
 	    printf(".");
 	    fflush(stdout);
@@ -435,6 +590,8 @@ generate_global (int num_libraries, library_t **libraries, classic_reader_t *rea
 	}
     }
 
+    free(row.coeffs);
+
     qsort(matches, num_matches, sizeof(global_match_t), compare_global_matches);
 
     flags = (char*)malloc(num_metapixels * sizeof(char));
@@ -503,6 +660,8 @@ classic_generate (int num_libraries, library_t **libraries,
 {
     classic_mosaic_t *mosaic;
 
+    metric_prepare_libraries(&matcher->metric, num_libraries, libraries);
+
     if (matcher->kind == MATCHER_LOCAL)
 	mosaic = generate_local(num_libraries, libraries, reader, matcher->v.local.min_distance, &matcher->metric,
 				forbid_reconstruction_radius, allowed_flips, report_func);
@@ -544,13 +703,139 @@ classic_free (classic_mosaic_t *mosaic)
     free(mosaic);
 }
 
-int
-classic_paste (classic_mosaic_t *mosaic, classic_reader_t *reader, unsigned int cheat,
-	       classic_writer_t *writer, progress_report_func_t report_func)
+/* The number of metarows which are rendered at the same time.  Rows
+   are written out strictly in order, so this also bounds the number
+   of row bitmaps in memory. */
+#define PASTE_RING_SIZE		4
+
+typedef struct _paste_row_t paste_row_t;
+
+typedef struct
+{
+    paste_row_t *row;
+    metapixel_t *pixel;
+    unsigned int orientation;
+    unsigned int x;
+    unsigned int width;
+    int result;
+} paste_tile_t;
+
+struct _paste_row_t
+{
+    bitmap_t *out_bitmap;
+    bitmap_t *source_bitmap;
+    unsigned int cheat;
+    tile_cache_t *tile_cache;
+    task_group_t group;
+    paste_tile_t *tiles;
+};
+
+static void
+paste_tile (void *data)
+{
+    paste_tile_t *tile = (paste_tile_t*)data;
+    paste_row_t *row = tile->row;
+
+    tile->result = metapixel_paste(tile->pixel, row->out_bitmap, tile->x, 0, tile->width, row->out_bitmap->height,
+				   tile->orientation, row->source_bitmap, row->cheat, row->tile_cache);
+}
+
+/* source_row is the row of the input image to blend in, or 0 if
+   cheat is 0. */
+static void
+start_paste_row (classic_mosaic_t *mosaic, bitmap_t *source_row, unsigned int cheat,
+		 classic_writer_t *writer, tile_cache_t *tile_cache, thread_pool_t *pool,
+		 paste_row_t *row, int y)
 {
-    int x, y;
     unsigned int out_image_width = writer->out_image_width;
-    unsigned int out_image_height = writer->out_image_height;
+    unsigned int row_height = tiling_get_rectangular_height(&mosaic->tiling, writer->out_image_height, y);
+    int x;
+
+    row->out_bitmap = writer_get_row(writer, &mosaic->tiling, y);
+    assert(row->out_bitmap != 0);
+
+    assert(row->out_bitmap->width == out_image_width);
+    assert(row->out_bitmap->height == row_height);
+
+    /* the source row is blended in while the metapixels are
+       pasted, so we need it first */
+    row->source_bitmap = 0;
+    if (cheat > 0)
+    {
+	assert(source_row != 0);
+
+	if (source_row->width != out_image_width
+	    || source_row->height != row_height)
+	    row->source_bitmap = bitmap_scale(source_row, out_image_width, row_height, FILTER_MITCHELL);
+	else
+	    row->source_bitmap = bitmap_copy(source_row);
+	assert(row->source_bitmap != 0);
+    }
+
+    row->cheat = cheat;
+    row->tile_cache = tile_cache;
+
+    task_group_init(&row->group, pool);
+
+    for (x = 0; x < mosaic->tiling.metawidth; ++x)
+    {
+	paste_tile_t *tile = &row->tiles[x];
+	int index = y * mosaic->tiling.metawidth + x;
+
+	tile->row = row;
+	tile->pixel = mosaic->matches[index].pixel;
+	tile->orientation = mosaic->matches[index].orientation;
+	tile->x = tiling_get_rectangular_x(&mosaic->tiling, out_image_width, x);
+	tile->width = tiling_get_rectangular_width(&mosaic->tiling, out_image_width, x);
+
+	task_group_spawn(&row->group, paste_tile, tile);
+    }
+}
+
+/* Waits until all the tiles of the row are pasted.  Returns 0 if
+   one of them failed. */
+static int
+finish_paste_row (classic_mosaic_t *mosaic, paste_row_t *row)
+{
+    int x;
+    int result = 1;
+
+    task_group_wait(&row->group);
+
+    if (row->source_bitmap != 0)
+	bitmap_free(row->source_bitmap);
+
+    for (x = 0; x < mosaic->tiling.metawidth; ++x)
+	if (!row->tiles[x].result)
+	    result = 0;
+
+    return result;
+}
+
+/* Waits for the rows from y to next_row, which have been started, and
+   drops them. */
+static void
+abandon_paste_rows (classic_mosaic_t *mosaic, paste_row_t *rows, int y, int next_row)
+{
+    for (; y < next_row; ++y)
+    {
+	paste_row_t *row = &rows[y % PASTE_RING_SIZE];
+
+	finish_paste_row(mosaic, row);
+	bitmap_free(row->out_bitmap);
+    }
+}
+
+int
+classic_paste_with_cache (classic_mosaic_t *mosaic, classic_reader_t *reader, unsigned int cheat,
+			  classic_writer_t *writer, tile_cache_t *tile_cache, progress_report_func_t report_func)
+{
+    thread_pool_t *pool = thread_pool_get_default();
+    prefetcher_t *prefetcher;
+    paste_row_t rows[PASTE_RING_SIZE];
+    int y, i;
+    int next_row = 0;
+    int result = 1;
     float num_metapixels;
     PROGRESS_DECLS;
 
@@ -566,87 +851,224 @@ classic_paste (classic_mosaic_t *mosaic, classic_reader_t *reader, unsigned int
 
     num_metapixels = (float)(mosaic->tiling.metawidth * mosaic->tiling.metaheight);
 
+    for (i = 0; i < PASTE_RING_SIZE; ++i)
+    {
+	rows[i].tiles = (paste_tile_t*)malloc(sizeof(paste_tile_t) * mosaic->tiling.metawidth);
+	assert(rows[i].tiles != 0);
+    }
+
+    /* stay a few rows ahead of the rows in flight */
+    prefetcher = prefetcher_new(MAX(PREFETCH_WINDOW, 2 * PASTE_RING_SIZE * mosaic->tiling.metawidth));
+    for (i = 0; i < mosaic->tiling.metawidth * mosaic->tiling.metaheight; ++i)
+    {
+	int x = i % mosaic->tiling.metawidth, y = i / mosaic->tiling.metawidth;
+
+	prefetcher_add(prefetcher, mosaic->matches[i].pixel,
+		       tiling_get_rectangular_width(&mosaic->tiling, writer->out_image_width, x),
+		       tiling_get_rectangular_height(&mosaic->tiling, writer->out_image_height, y));
+    }
+    prefetcher_start(prefetcher, 1);
+
     START_PROGRESS;
 
+    /* The rows ahead of y are pasted by the pool while y is waited
+       for and written out by this thread. */
     for (y = 0; y < mosaic->tiling.metaheight; ++y)
     {
-	unsigned int row_height = tiling_get_rectangular_height(&mosaic->tiling, out_image_height, y);
-	bitmap_t *out_bitmap;
-
-	out_bitmap = writer_get_row(writer, &mosaic->tiling);
-	assert(out_bitmap != 0);
+	paste_row_t *row = &rows[y % PASTE_RING_SIZE];
 
-	assert(out_bitmap->width == out_image_width);
-	assert(out_bitmap->height == row_height);
+	while (next_row < mosaic->tiling.metaheight && next_row < y + PASTE_RING_SIZE)
+	{
+	    if (cheat > 0)
+		read_classic_row(reader);
+	    start_paste_row(mosaic, cheat > 0 ? reader->in_image : 0, cheat, writer, tile_cache, pool,
+			    &rows[next_row % PASTE_RING_SIZE], next_row);
+	    ++next_row;
+	}
 
-	for (x = 0; x < mosaic->tiling.metawidth; ++x)
+	if (!finish_paste_row(mosaic, row))
 	{
-	    /*
-	    if (benchmark_rendering)
-		assert(mosaic->matches[y * metawidth + x].pixel->bitmap != 0);
-	    */
-	    unsigned int column_x = tiling_get_rectangular_x(&mosaic->tiling, out_image_width, x);
-	    unsigned int column_width = tiling_get_rectangular_width(&mosaic->tiling, out_image_width, x);
-	    int index = y * mosaic->tiling.metawidth + x;
-
-	    if (!metapixel_paste(mosaic->matches[index].pixel,
-				 out_bitmap, column_x, 0, column_width, row_height,
-				 mosaic->matches[index].orientation))
-	    {
-		/* FIXME: free stuff */
+	    bitmap_free(row->out_bitmap);
+	    abandon_paste_rows(mosaic, rows, y + 1, next_row);
 
-		return 0;
-	    }
+	    result = 0;
+	    break;
+	}
 
-	    //if (!benchmark_rendering)
-	    {
+	prefetcher_set_position(prefetcher, (y + 1) * mosaic->tiling.metawidth);
+
+	//if (!benchmark_rendering)
+	{
 #ifdef CONSOLE_OUTPUT
+	    int x;
+
+	    for (x = 0; x < mosaic->tiling.metawidth; ++x)
 		printf("X");
-		fflush(stdout);
+	    fflush(stdout);
 #endif
+	}
+
+	REPORT_PROGRESS((float)((y + 1) * mosaic->tiling.metawidth) / num_metapixels);
+
+	//if (!benchmark_rendering)
+	writer_write_row(writer, row->out_bitmap);
+    }
+
+    prefetcher_free(prefetcher);
+
+    for (i = 0; i < PASTE_RING_SIZE; ++i)
+	free(rows[i].tiles);
+
+    /*
+    if (benchmark_rendering)
+	print_current_time();
+    */
+
+#ifdef CONSOLE_OUTPUT
+    printf("\n");
+#endif
+
+    return result;
+}
+
+int
+classic_paste (classic_mosaic_t *mosaic, classic_reader_t *reader, unsigned int cheat,
+	       classic_writer_t *writer, progress_report_func_t report_func)
+{
+    return classic_paste_with_cache(mosaic, reader, cheat, writer, 0, report_func);
+}
+
+classic_mosaic_t*
+classic_generate_and_paste (int num_libraries, library_t **libraries,
+			    classic_reader_t *reader, matcher_t *matcher,
+			    unsigned int forbid_reconstruction_radius, unsigned int allowed_flips,
+			    unsigned int cheat, classic_writer_t *writer, tile_cache_t *tile_cache,
+			    progress_report_func_t generate_report_func, progress_report_func_t paste_report_func)
+{
+    thread_pool_t *pool = thread_pool_get_default();
+    classic_mosaic_t *mosaic;
+    row_search_t search;
+    prefetcher_t *prefetcher;
+    paste_row_t rows[PASTE_RING_SIZE];
+    int metawidth = reader->tiling.metawidth, metaheight = reader->tiling.metaheight;
+    int y, i;
+    int next_row = 0;
+    int result = 1;
+
+    assert(matcher->kind == MATCHER_LOCAL);
+
+    metric_prepare_libraries(&matcher->metric, num_libraries, libraries);
+
+    mosaic = init_mosaic_from_reader(reader);
+    init_local_search(&search, num_libraries, libraries, reader, mosaic, matcher->v.local.min_distance,
+		      &matcher->metric, forbid_reconstruction_radius, allowed_flips);
+
+    for (i = 0; i < PASTE_RING_SIZE; ++i)
+    {
+	rows[i].tiles = (paste_tile_t*)malloc(sizeof(paste_tile_t) * metawidth);
+	assert(rows[i].tiles != 0);
+    }
+
+    /* the matches of each row are added once it's searched */
+    prefetcher = prefetcher_new(MAX(PREFETCH_WINDOW, 2 * PASTE_RING_SIZE * metawidth));
+    prefetcher_start(prefetcher, 0);
+
+    if (generate_report_func != 0)
+	generate_report_func(0.0);
+    if (paste_report_func != 0)
+	paste_report_func(0.0);
+
+    /* Row next_row is searched by this thread while the pool pastes
+       the rows before it.  Once PASTE_RING_SIZE rows are in flight
+       the oldest one is written out. */
+    for (y = 0; y < metaheight; ++y)
+    {
+	paste_row_t *row = &rows[y % PASTE_RING_SIZE];
+
+	while (next_row < metaheight && next_row < y + PASTE_RING_SIZE)
+	{
+	    read_classic_row(reader);
+
+	    if (!search_local_row(&search, next_row))
+	    {
+		error_report(ERROR_CANNOT_FIND_LOCAL_MATCH, error_make_null_info());
+		result = 0;
+		break;
 	    }
 
-	    REPORT_PROGRESS((float)(y * mosaic->tiling.metawidth + (x + 1)) / num_metapixels);
+#ifdef CONSOLE_OUTPUT
+	    for (i = 0; i < metawidth; ++i)
+		printf(".");
+	    fflush(stdout);
+#endif
+
+	    if (generate_report_func != 0)
+		generate_report_func((float)(next_row + 1) / (float)metaheight);
+
+	    for (i = 0; i < metawidth; ++i)
+		prefetcher_add(prefetcher, mosaic->matches[next_row * metawidth + i].pixel,
+			       tiling_get_rectangular_width(&mosaic->tiling, writer->out_image_width, i),
+			       tiling_get_rectangular_height(&mosaic->tiling, writer->out_image_height, next_row));
+
+	    /* the paste row takes its own reference to the input row,
+	       so the reader can go on to the next one */
+	    start_paste_row(mosaic, reader->in_image, cheat, writer, tile_cache, pool,
+			    &rows[next_row % PASTE_RING_SIZE], next_row);
+	    ++next_row;
 	}
 
-	if (cheat > 0)
+	if (!result)
 	{
-	    bitmap_t *source_bitmap;
+	    abandon_paste_rows(mosaic, rows, y, next_row);
+	    break;
+	}
 
-	    read_classic_row(reader);
-	    assert(reader->in_image != 0);
+	if (!finish_paste_row(mosaic, row))
+	{
+	    bitmap_free(row->out_bitmap);
+	    abandon_paste_rows(mosaic, rows, y + 1, next_row);
 
-	    if (reader->in_image_width != out_image_width
-		|| reader->num_lines != row_height)
-		source_bitmap = bitmap_scale(reader->in_image, out_image_width, row_height, FILTER_MITCHELL);
-	    else
-		source_bitmap = bitmap_copy(reader->in_image);
-	    assert(source_bitmap != 0);
+	    result = 0;
+	    break;
+	}
 
-	    bitmap_alpha_compose(out_bitmap, source_bitmap, cheat);
+#ifdef CONSOLE_OUTPUT
+	for (i = 0; i < metawidth; ++i)
+	    printf("X");
+	fflush(stdout);
+#endif
 
-	    bitmap_free(source_bitmap);
-	}
+	prefetcher_set_position(prefetcher, (y + 1) * metawidth);
 
-	//if (!benchmark_rendering)
-	writer_write_row(writer, out_bitmap);
+	if (paste_report_func != 0)
+	    paste_report_func((float)(y + 1) / (float)metaheight);
+
+	writer_write_row(writer, row->out_bitmap);
     }
 
-    /*
-    if (benchmark_rendering)
-	print_current_time();
-    */
+    prefetcher_free(prefetcher);
+
+    for (i = 0; i < PASTE_RING_SIZE; ++i)
+	free(rows[i].tiles);
+    free_local_search(&search);
 
 #ifdef CONSOLE_OUTPUT
     printf("\n");
 #endif
 
-    return 1;
+    if (!result)
+    {
+	classic_free(mosaic);
+	return 0;
+    }
+
+    return mosaic;
 }
 
 bitmap_t*
-classic_paste_to_bitmap (classic_mosaic_t *mosaic, unsigned int width, unsigned int height,
-			 bitmap_t *in_image, unsigned int cheat, progress_report_func_t report_func)
+classic_paste_to_bitmap_with_cache (classic_mosaic_t *mosaic, unsigned int width, unsigned int height,
+				    bitmap_t *in_image, unsigned int cheat, tile_cache_t *tile_cache,
+				    progress_report_func_t report_func)
 {
     bitmap_t *out_bitmap = bitmap_new_empty(COLOR_RGB_8, width, height);
     classic_writer_t *writer;
@@ -664,7 +1086,7 @@ classic_paste_to_bitmap (classic_mosaic_t *mosaic, unsigned int width, unsigned
 	assert(reader != 0);
     }
 
-    if (!classic_paste(mosaic, reader, cheat, writer, report_func))
+    if (!classic_paste_with_cache(mosaic, reader, cheat, writer, tile_cache, report_func))
     {
 	bitmap_free(out_bitmap);
 	out_bitmap = 0;
@@ -677,6 +1099,13 @@ classic_paste_to_bitmap (classic_mosaic_t *mosaic, unsigned int width, unsigned
     return out_bitmap;
 }
 
+bitmap_t*
+classic_paste_to_bitmap (classic_mosaic_t *mosaic, unsigned int width, unsigned int height,
+			 bitmap_t *in_image, unsigned int cheat, progress_report_func_t report_func)
+{
+    return classic_paste_to_bitmap_with_cache(mosaic, width, height, in_image, cheat, 0, report_func);
+}
+
 classic_mosaic_t*
 classic_read (int num_libraries, library_t **libraries, const char *filename,
 	      int *num_new_libraries, library_t ***new_libraries)
@@ -696,14 +1125,17 @@ classic_read (int num_libraries, library_t **libraries, const char *filename,
 	return 0;
     }
 
+    /* protocols are read while other mosaics are made */
+    utils_lock_lisp_reader();
     obj = lisp_read(&stream);
+    utils_unlock_lisp_reader();
     type = lisp_type(obj);
     if (type != LISP_TYPE_EOF && type != LISP_TYPE_PARSE_ERROR)
     {
 	lisp_object_t *vars[3];
 
-	if (lisp_match_string("(classic-mosaic (size #?(integer) #?(integer)) (metapixels . #?(list)))",
-			      obj, vars))
+	if (utils_lisp_match_string("(classic-mosaic (size #?(integer) #?(integer)) (metapixels . #?(list)))",
+				    obj, vars))
 	{
 	    int i;
 	    int num_pixels;
@@ -732,8 +1164,8 @@ classic_read (int num_libraries, library_t **libraries, const char *filename,
 	    {
 		lisp_object_t *vars[9];
 
-		if (lisp_match_string("(#?(integer) #?(integer) #?(integer) #?(integer) #?(string) #?(string) #?(boolean) #?(boolean) #?(real))",
-				      lisp_car(lst), vars))
+		if (utils_lisp_match_string("(#?(integer) #?(integer) #?(integer) #?(integer) #?(string) #?(string) #?(boolean) #?(boolean) #?(real))",
+					    lisp_car(lst), vars))
 		{
 		    int x = lisp_integer(vars[0]);
 		    int y = lisp_integer(vars[1]);
@@ -31,9 +31,15 @@
 #define DEFAULT_PREPARE_WIDTH       128
 #define DEFAULT_PREPARE_HEIGHT      128
 
+/* smallest level of the pyramid stored by --pyramid */
+#define DEFAULT_PYRAMID_MIN_SIZE     16
+
 #define DEFAULT_CLASSIC_MIN_DISTANCE     5
 #define DEFAULT_COLLAGE_MIN_DISTANCE   256
 
+/* in megabytes */
+#define DEFAULT_TILE_CACHE_SIZE         64
+
 #define SEARCH_LOCAL         1
 #define SEARCH_GLOBAL        2
 
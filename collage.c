@@ -85,17 +85,17 @@ free_positions (position_t *positions)
 }
 
 static float
-frand (void)
+frand (unsigned int *seed)
 {
-    return rand() / (float)RAND_MAX;
+    return rand_r(seed) / (float)RAND_MAX;
 }
 
 collage_mosaic_t*
-collage_generate_from_bitmap (int num_libraries, library_t **libraries, bitmap_t *in_bitmap,
-			      unsigned int min_small_width, unsigned int min_small_height,
-			      unsigned int max_small_width, unsigned int max_small_height,
-			      unsigned int min_distance, metric_t *metric, unsigned int allowed_flips,
-			      progress_report_func_t report_func)
+collage_generate_from_bitmap_with_seed (int num_libraries, library_t **libraries, bitmap_t *in_bitmap,
+					unsigned int min_small_width, unsigned int min_small_height,
+					unsigned int max_small_width, unsigned int max_small_height,
+					unsigned int min_distance, metric_t *metric, unsigned int allowed_flips,
+					unsigned int seed, progress_report_func_t report_func)
 {
     char *bitmap;
     unsigned int num_pixels_done = 0;
@@ -121,6 +121,8 @@ collage_generate_from_bitmap (int num_libraries, library_t **libraries, bitmap_t
 	return 0;
     }
 
+    metric_prepare_libraries(metric, num_libraries, libraries);
+
     if (num_metapixels == 0)
     {
 	error_report(ERROR_CANNOT_FIND_COLLAGE_MATCH, error_make_null_info());
@@ -150,15 +152,15 @@ collage_generate_from_bitmap (int num_libraries, library_t **libraries, bitmap_t
 	coeffs_union_t coeffs;
 	metapixel_match_t match;
 	collage_position_valid_data_t valid_data = { min_distance, collage_positions };
-	float size_rand = frand();
+	float size_rand = frand(&seed);
 
 	width = min_small_width + (unsigned int)(size_rand * (max_small_width - min_small_width));
 	height = min_small_height + (unsigned int)(size_rand * (max_small_height - min_small_height));
 
 	while (1)
 	{
-	    x = random() % in_bitmap->width - width / 2;
-	    y = random() % in_bitmap->height - height / 2;
+	    x = (int)(rand_r(&seed) % in_bitmap->width) - (int)(width / 2);
+	    y = (int)(rand_r(&seed) % in_bitmap->height) - (int)(height / 2);
 
 	    if (x < 0)
 		x = 0;
@@ -244,6 +246,19 @@ collage_generate_from_bitmap (int num_libraries, library_t **libraries, bitmap_t
     return mosaic;
 }
 
+collage_mosaic_t*
+collage_generate_from_bitmap (int num_libraries, library_t **libraries, bitmap_t *in_bitmap,
+			      unsigned int min_small_width, unsigned int min_small_height,
+			      unsigned int max_small_width, unsigned int max_small_height,
+			      unsigned int min_distance, metric_t *metric, unsigned int allowed_flips,
+			      progress_report_func_t report_func)
+{
+    return collage_generate_from_bitmap_with_seed(num_libraries, libraries, in_bitmap,
+						  min_small_width, min_small_height,
+						  max_small_width, max_small_height,
+						  min_distance, metric, allowed_flips, (unsigned int)rand(), report_func);
+}
+
 void
 collage_free (collage_mosaic_t *mosaic)
 {
@@ -260,11 +275,23 @@ scale_coord (unsigned int x, unsigned int old_limit, unsigned int new_limit)
     return x * new_limit / old_limit;
 }
 
+static void
+scale_match (collage_mosaic_t *mosaic, collage_match_t *match, unsigned int out_width, unsigned int out_height,
+	     unsigned int *x, unsigned int *y, unsigned int *width, unsigned int *height)
+{
+    *x = scale_coord(match->x, mosaic->in_image_width - 1, out_width - 1);
+    *y = scale_coord(match->y, mosaic->in_image_height - 1, out_height - 1);
+    *width = scale_coord(match->x + match->width, mosaic->in_image_width, out_width) - *x;
+    *height = scale_coord(match->y + match->height, mosaic->in_image_height, out_height) - *y;
+}
+
 bitmap_t*
-collage_paste_to_bitmap (collage_mosaic_t *mosaic, unsigned int out_width, unsigned int out_height,
-			 bitmap_t *in_image, unsigned int cheat, progress_report_func_t report_func)
+collage_paste_to_bitmap_with_cache (collage_mosaic_t *mosaic, unsigned int out_width, unsigned int out_height,
+				    bitmap_t *in_image, unsigned int cheat, tile_cache_t *tile_cache,
+				    progress_report_func_t report_func)
 {
     bitmap_t *out_bitmap;
+    prefetcher_t *prefetcher;
     unsigned int i;
     PROGRESS_DECLS;
 
@@ -274,6 +301,16 @@ collage_paste_to_bitmap (collage_mosaic_t *mosaic, unsigned int out_width, unsig
     out_bitmap = bitmap_new_empty(COLOR_RGB_8, out_width, out_height);
     assert(out_bitmap != 0);
 
+    prefetcher = prefetcher_new(PREFETCH_WINDOW);
+    for (i = 0; i < mosaic->num_matches; ++i)
+    {
+	unsigned int x, y, width, height;
+
+	scale_match(mosaic, &mosaic->matches[i], out_width, out_height, &x, &y, &width, &height);
+	prefetcher_add(prefetcher, mosaic->matches[i].match.pixel, width, height);
+    }
+    prefetcher_start(prefetcher, 1);
+
     START_PROGRESS;
 
     for (i = 0; i < mosaic->num_matches; ++i)
@@ -281,24 +318,28 @@ collage_paste_to_bitmap (collage_mosaic_t *mosaic, unsigned int out_width, unsig
 	collage_match_t *match = &mosaic->matches[i];
 	unsigned int x, y, width, height;
 
-	x = scale_coord(match->x, mosaic->in_image_width - 1, out_width - 1);
-	y = scale_coord(match->y, mosaic->in_image_height - 1, out_height - 1);
-	width = scale_coord(match->x + match->width, mosaic->in_image_width, out_width) - x;
-	height = scale_coord(match->y + match->height, mosaic->in_image_height, out_height) - y;
+	scale_match(mosaic, match, out_width, out_height, &x, &y, &width, &height);
 
 	assert(x < out_width && y < out_width);
 	assert(width > 0 && height > 0);
 
-	if (!metapixel_paste(match->match.pixel, out_bitmap, x, y, width, height, match->match.orientation))
+	if (!metapixel_paste(match->match.pixel, out_bitmap, x, y, width, height, match->match.orientation,
+			     0, 0, tile_cache))
 	{
 	    /* FIXME: free stuff */
 
+	    prefetcher_free(prefetcher);
+
 	    return 0;
 	}
 
+	prefetcher_set_position(prefetcher, i + 1);
+
 	REPORT_PROGRESS((float)(i + 1) / (float)mosaic->num_matches);
     }
 
+    prefetcher_free(prefetcher);
+
     if (cheat > 0)
     {
 	bitmap_t *scaled_bitmap;
@@ -319,6 +360,13 @@ collage_paste_to_bitmap (collage_mosaic_t *mosaic, unsigned int out_width, unsig
     return out_bitmap;
 }
 
+bitmap_t*
+collage_paste_to_bitmap (collage_mosaic_t *mosaic, unsigned int out_width, unsigned int out_height,
+			 bitmap_t *in_image, unsigned int cheat, progress_report_func_t report_func)
+{
+    return collage_paste_to_bitmap_with_cache(mosaic, out_width, out_height, in_image, cheat, 0, report_func);
+}
+
 collage_mosaic_t*
 collage_read (int num_libraries, library_t **libraries, const char *filename,
 	      int *num_new_libraries, library_t ***new_libraries)
@@ -338,15 +386,18 @@ collage_read (int num_libraries, library_t **libraries, const char *filename,
 	return 0;
     }
 
+    /* protocols are read while other mosaics are made */
+    utils_lock_lisp_reader();
     obj = lisp_read(&stream);
+    utils_unlock_lisp_reader();
     type = lisp_type(obj);
 
     if (type != LISP_TYPE_EOF && type != LISP_TYPE_PARSE_ERROR)
     {
 	lisp_object_t *vars[3];
 
-	if (lisp_match_string("(collage-mosaic (input-size #?(integer) #?(integer)) "
-			      "                (metapixels . #?(list)))", obj, vars))
+	if (utils_lisp_match_string("(collage-mosaic (input-size #?(integer) #?(integer)) "
+				    "                (metapixels . #?(list)))", obj, vars))
 	{
 	    lisp_object_t *lst;
 	    unsigned int i;
@@ -364,8 +415,8 @@ collage_read (int num_libraries, library_t **libraries, const char *filename,
 	    {
 		lisp_object_t *vars[7];
 
-		if (lisp_match_string("(#?(integer) #?(integer) #?(integer) #?(integer) #?(string) #?(string) #?(real))",
-				      lisp_car(lst), vars))
+		if (utils_lisp_match_string("(#?(integer) #?(integer) #?(integer) #?(integer) #?(string) #?(string) #?(real))",
+					    lisp_car(lst), vars))
 		{
 		    mosaic->matches[i].x = lisp_integer(vars[0]);
 		    mosaic->matches[i].y = lisp_integer(vars[1]);
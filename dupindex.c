@@ -0,0 +1,222 @@
+/*
+ * dupindex.c
+ *
+ * metapixel
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "api.h"
+
+/* The index is a grid over the mean brightness of the four corners of
+   the subpixel image, with cells one more than the maximum distance
+   wide.  Two metapixels whose subpixels differ by at most that much
+   have corner means which differ by at most that much as well, so a
+   duplicate is either in the cell of a metapixel or in one of the
+   neighbouring ones. */
+
+#define NUM_KEY_DIMENSIONS	4
+#define NUM_NEIGHBOUR_CELLS	81 /* 3 ^ NUM_KEY_DIMENSIONS */
+
+static unsigned int
+hash_cell_key (const void *key)
+{
+    return hash_bytes(key, sizeof(unsigned int), 0);
+}
+
+static int
+cell_keys_equal (const void *key1, const void *key2)
+{
+    return *(const unsigned int*)key1 == *(const unsigned int*)key2;
+}
+
+static void
+compute_cell_coords (duplicate_index_t *index, metapixel_t *pixel, int coords[NUM_KEY_DIMENSIONS])
+{
+    static const int corner_x[NUM_KEY_DIMENSIONS] = { 0, NUM_SUBPIXEL_ROWS_COLS - 2, 0, NUM_SUBPIXEL_ROWS_COLS - 2 };
+    static const int corner_y[NUM_KEY_DIMENSIONS] = { 0, 0, NUM_SUBPIXEL_ROWS_COLS - 2, NUM_SUBPIXEL_ROWS_COLS - 2 };
+    int i;
+
+    for (i = 0; i < NUM_KEY_DIMENSIONS; ++i)
+    {
+	unsigned int sum = 0;
+	int x, y, channel;
+
+	for (y = corner_y[i]; y < corner_y[i] + 2; ++y)
+	    for (x = corner_x[i]; x < corner_x[i] + 2; ++x)
+		for (channel = 0; channel < NUM_CHANNELS; ++channel)
+		    sum += pixel->subpixels_rgb[(y * NUM_SUBPIXEL_ROWS_COLS + x) * NUM_CHANNELS + channel];
+
+	coords[i] = sum / (4 * NUM_CHANNELS) / index->cell_size;
+    }
+}
+
+/* Each coordinate is less than 256. */
+static unsigned int
+make_cell_key (int coords[NUM_KEY_DIMENSIONS])
+{
+    unsigned int key = 0;
+    int i;
+
+    for (i = 0; i < NUM_KEY_DIMENSIONS; ++i)
+	key = (key << 8) | coords[i];
+
+    return key;
+}
+
+static unsigned int
+compute_checksum (metapixel_t *pixel)
+{
+    return hash_bytes(pixel->subpixels_rgb, NUM_SUBPIXELS * NUM_CHANNELS, 0);
+}
+
+duplicate_index_t*
+duplicate_index_new (unsigned int max_distance)
+{
+    duplicate_index_t *index = (duplicate_index_t*)malloc(sizeof(duplicate_index_t));
+
+    assert(index != 0);
+
+    index->max_distance = max_distance;
+    index->cell_size = max_distance + 1;
+    index->cells = hash_table_new(hash_cell_key, cell_keys_equal);
+
+    return index;
+}
+
+static void
+free_cell (const void *key, void *value, void *data)
+{
+    duplicate_cell_t *cell = (duplicate_cell_t*)value;
+
+    free(cell->entries);
+    free(cell);
+}
+
+void
+duplicate_index_free (duplicate_index_t *index)
+{
+    hash_table_foreach(index->cells, free_cell, 0);
+    hash_table_free(index->cells);
+    free(index);
+}
+
+void
+duplicate_index_add (duplicate_index_t *index, metapixel_t *pixel)
+{
+    int coords[NUM_KEY_DIMENSIONS];
+    unsigned int key;
+    duplicate_cell_t *cell;
+
+    compute_cell_coords(index, pixel, coords);
+    key = make_cell_key(coords);
+
+    cell = (duplicate_cell_t*)hash_table_lookup(index->cells, &key);
+    if (cell == 0)
+    {
+	cell = (duplicate_cell_t*)malloc(sizeof(duplicate_cell_t));
+	assert(cell != 0);
+
+	cell->key = key;
+	cell->num_entries = 0;
+	cell->num_allocated = 4;
+	cell->entries = (duplicate_entry_t*)malloc(sizeof(duplicate_entry_t) * cell->num_allocated);
+	assert(cell->entries != 0);
+
+	hash_table_insert(index->cells, &cell->key, cell);
+    }
+
+    if (cell->num_entries == cell->num_allocated)
+    {
+	cell->num_allocated *= 2;
+	cell->entries = (duplicate_entry_t*)realloc(cell->entries, sizeof(duplicate_entry_t) * cell->num_allocated);
+	assert(cell->entries != 0);
+    }
+
+    cell->entries[cell->num_entries].pixel = pixel;
+    cell->entries[cell->num_entries].checksum = compute_checksum(pixel);
+    ++cell->num_entries;
+}
+
+static int
+within_distance (const unsigned char *subpixels1, const unsigned char *subpixels2, int max_distance)
+{
+    int i;
+
+    for (i = 0; i < NUM_SUBPIXELS * NUM_CHANNELS; ++i)
+    {
+	int diff = (int)subpixels1[i] - (int)subpixels2[i];
+
+	if (diff > max_distance || diff < -max_distance)
+	    return 0;
+    }
+
+    return 1;
+}
+
+metapixel_t*
+duplicate_index_lookup (duplicate_index_t *index, metapixel_t *pixel)
+{
+    int coords[NUM_KEY_DIMENSIONS], neighbour[NUM_KEY_DIMENSIONS];
+    unsigned int checksum = compute_checksum(pixel);
+    metapixel_t *found = 0;
+    int i, j;
+
+    compute_cell_coords(index, pixel, coords);
+
+    for (i = 0; i < NUM_NEIGHBOUR_CELLS; ++i)
+    {
+	duplicate_cell_t *cell;
+	unsigned int key;
+	int n = i;
+
+	for (j = 0; j < NUM_KEY_DIMENSIONS; ++j)
+	{
+	    neighbour[j] = coords[j] + n % 3 - 1;
+	    n /= 3;
+	    if (neighbour[j] < 0 || neighbour[j] > 255)
+		break;
+	}
+	if (j < NUM_KEY_DIMENSIONS)
+	    continue;
+
+	key = make_cell_key(neighbour);
+	cell = (duplicate_cell_t*)hash_table_lookup(index->cells, &key);
+	if (cell == 0)
+	    continue;
+
+	for (j = 0; j < cell->num_entries; ++j)
+	{
+	    duplicate_entry_t *entry = &cell->entries[j];
+
+	    /* an identical one is the best we can find */
+	    if (entry->checksum == checksum
+		&& memcmp(entry->pixel->subpixels_rgb, pixel->subpixels_rgb, NUM_SUBPIXELS * NUM_CHANNELS) == 0)
+		return entry->pixel;
+
+	    if (found == 0 && within_distance(entry->pixel->subpixels_rgb, pixel->subpixels_rgb, index->max_distance))
+		found = entry->pixel;
+	}
+    }
+
+    return found;
+}
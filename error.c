@@ -28,6 +28,7 @@
 #include "error.h"
 
 static error_handler_func_t error_handler = 0;
+static __thread error_context_t *current_context = 0;
 
 static int
 error_kind (int error_code)
@@ -54,6 +55,15 @@ error_kind (int error_code)
 	  { ERROR_PROTOCOL_INCONSISTENCY, ERROR_INFO_STRING },
 	  { ERROR_METAPIXEL_NOT_FOUND, ERROR_INFO_STRING },
 	  { ERROR_ILLEGAL_SMALL_IMAGE_SIZE, ERROR_INFO_NULL },
+	  { ERROR_ATLAS_CANNOT_OPEN, ERROR_INFO_STRING },
+	  { ERROR_ATLAS_CANNOT_WRITE, ERROR_INFO_STRING },
+	  { ERROR_ATLAS_CORRUPT, ERROR_INFO_STRING },
+	  { ERROR_TABLES_FILE_CANNOT_WRITE, ERROR_INFO_STRING },
+	  { ERROR_CANNOT_READ_LIBRARY_DIRECTORY, ERROR_INFO_STRING },
+	  { ERROR_MANIFEST_CANNOT_WRITE, ERROR_INFO_STRING },
+	  { ERROR_MANIFEST_SYNTAX_ERROR, ERROR_INFO_STRING },
+	  { ERROR_TABLES_FILE_REPLACED, ERROR_INFO_STRING },
+	  { ERROR_PROTOCOL_FILE_CANNOT_WRITE, ERROR_INFO_STRING },
 	  { -1, -1 } };
 
     int i;
@@ -92,6 +102,15 @@ error_format_error (int error_code, error_info_t info)
 	  { ERROR_PROTOCOL_INCONSISTENCY, "Protocol `%s' is inconsistent" },
 	  { ERROR_METAPIXEL_NOT_FOUND, "Metapixel with filename `%s' not found" },
 	  { ERROR_ILLEGAL_SMALL_IMAGE_SIZE, "Illegal small image size" },
+	  { ERROR_ATLAS_CANNOT_OPEN, "Cannot open image atlas `%s'" },
+	  { ERROR_ATLAS_CANNOT_WRITE, "Cannot write to image atlas `%s'" },
+	  { ERROR_ATLAS_CORRUPT, "Image atlas `%s' is corrupt" },
+	  { ERROR_TABLES_FILE_CANNOT_WRITE, "Cannot write tables file `%s'" },
+	  { ERROR_CANNOT_READ_LIBRARY_DIRECTORY, "Cannot read library directory `%s'" },
+	  { ERROR_MANIFEST_CANNOT_WRITE, "Cannot write manifest `%s'" },
+	  { ERROR_MANIFEST_SYNTAX_ERROR, "Syntax error in manifest `%s'" },
+	  { ERROR_TABLES_FILE_REPLACED, "Tables file `%s' was replaced - the library must be opened again" },
+	  { ERROR_PROTOCOL_FILE_CANNOT_WRITE, "Cannot write protocol file `%s'" },
 	  { -1, 0 } };
 
     int kind = error_kind(error_code);
@@ -136,10 +155,45 @@ error_set_handler (error_handler_func_t handler)
     error_handler = handler;
 }
 
+void
+error_push_context (error_context_t *context, error_context_handler_func_t handler, void *data)
+{
+    context->handler = handler;
+    context->data = data;
+    context->previous = current_context;
+
+    current_context = context;
+}
+
+void
+error_pop_context (error_context_t *context)
+{
+    assert(current_context == context);
+
+    current_context = context->previous;
+}
+
+error_context_t*
+error_get_context (void)
+{
+    return current_context;
+}
+
+void
+error_set_context (error_context_t *context)
+{
+    current_context = context;
+}
+
 void
 error_report (int code, error_info_t info)
 {
-    if (error_handler != 0)
+    if (current_context != 0)
+    {
+	current_context->handler(code, info, current_context->data);
+	error_free_info(code, info);
+    }
+    else if (error_handler != 0)
     {
 	error_handler(code, info);
 	error_free_info(code, info);
@@ -44,6 +44,15 @@
 #define ERROR_PROTOCOL_INCONSISTENCY             19
 #define ERROR_METAPIXEL_NOT_FOUND                20
 #define ERROR_ILLEGAL_SMALL_IMAGE_SIZE           21
+#define ERROR_ATLAS_CANNOT_OPEN                  22
+#define ERROR_ATLAS_CANNOT_WRITE                 23
+#define ERROR_ATLAS_CORRUPT                      24
+#define ERROR_TABLES_FILE_CANNOT_WRITE           25
+#define ERROR_CANNOT_READ_LIBRARY_DIRECTORY      26
+#define ERROR_MANIFEST_CANNOT_WRITE              27
+#define ERROR_MANIFEST_SYNTAX_ERROR              28
+#define ERROR_TABLES_FILE_REPLACED               29
+#define ERROR_PROTOCOL_FILE_CANNOT_WRITE         30
 
 #define ERROR_INFO_NULL             0
 #define ERROR_INFO_STRING           1
@@ -54,12 +63,35 @@ typedef union
 } error_info_t;
 
 typedef void (*error_handler_func_t) (int error_code, error_info_t info);
+typedef void (*error_context_handler_func_t) (int error_code, error_info_t info, void *data);
+
+typedef struct _error_context_t
+{
+    error_context_handler_func_t handler;
+    void *data;
+    struct _error_context_t *previous;
+} error_context_t;
 
 /* If the error handler does a nonlocal exit (i.e., a longjmp or an
    exception throw), it is the error handler's responsibility to free
-   the error info via error_free_info. */
+   the error info via error_free_info.  The handler set here gets the
+   errors reported outside of any error context.  It must be set
+   before other threads use the library. */
 void error_set_handler (error_handler_func_t handler);
 
+/* Errors reported by the calling thread between error_push_context
+   and the matching error_pop_context, and by the tasks it spawns in
+   the meantime, go to handler instead, called with data.  Contexts
+   nest, and the handler may be called from several threads at the
+   same time.  The context must stay valid until it is popped. */
+void error_push_context (error_context_t *context, error_context_handler_func_t handler, void *data);
+void error_pop_context (error_context_t *context);
+
+/* The innermost context of the calling thread, or 0.  Used to carry
+   the context over to tasks running in other threads. */
+error_context_t* error_get_context (void);
+void error_set_context (error_context_t *context);
+
 void error_free_info (int error_code, error_info_t info);
 
 /* The returned string must be freed by the caller. */
@@ -0,0 +1,1023 @@
+/*
+ * features.c
+ *
+ * metapixel
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <assert.h>
+
+#include "api.h"
+
+/* The features file is a cache of the features of all metapixels of
+   a library in all color spaces.  It consists of the header, the
+   order, the blocks of each color space and the records, one for
+   each metapixel, in the order of tables.mxt.  Adding a metapixel
+   appends its record, so the order covers only the first
+   num_ordered of them.  The file belongs to the tables.mxt with the
+   inode in the header, and is only used if its records match the
+   metapixels in the library.  Otherwise it's made anew. */
+
+#define FEATURES_MAGIC		0x4654584d	/* "MXTF" */
+#define FEATURES_VERSION	1
+
+/* The file is made anew if more than this fraction of its records
+   are unordered. */
+#define MAX_UNORDERED_FRACTION	8
+
+/* in metapixels */
+#define CONVERT_CHUNK_SIZE	4096
+/* in chunks */
+#define WRITE_WINDOW_SIZE	16
+
+#define NUM_BLOCKS(n)		(((n) + FEATURE_BLOCK_SIZE - 1) / FEATURE_BLOCK_SIZE)
+
+typedef struct
+{
+    unsigned int magic;
+    unsigned int version;
+    /* guard against reading a file made on a different platform */
+    unsigned int record_size;
+    unsigned int block_size;
+    unsigned int num_records;
+    unsigned int num_ordered;
+    /* of the tables file the records belong to */
+    long long tables_device;
+    long long tables_inode;
+} features_header_t;
+
+/* by color space minus one */
+typedef struct
+{
+    float means[NUM_COLOR_SPACES][NUM_CHANNELS];
+    unsigned char subpixels[NUM_COLOR_SPACES][SUBPIXELS_SIZE];
+} features_record_t;
+
+static size_t
+blocks_offset (unsigned int num_ordered)
+{
+    return sizeof(features_header_t) + (size_t)num_ordered * sizeof(unsigned int);
+}
+
+static size_t
+records_offset (unsigned int num_ordered)
+{
+    return blocks_offset(num_ordered)
+	+ (size_t)NUM_COLOR_SPACES * NUM_BLOCKS(num_ordered) * sizeof(feature_block_t);
+}
+
+void
+subpixel_means (unsigned char *subpixels, float *means)
+{
+    int channel, i;
+
+    for (channel = 0; channel < NUM_CHANNELS; ++channel)
+    {
+	unsigned int sum = 0;
+
+	for (i = 0; i < NUM_SUBPIXELS; ++i)
+	    sum += subpixels[i * NUM_CHANNELS + channel];
+
+	means[channel] = (float)sum / NUM_SUBPIXELS;
+    }
+}
+
+static void
+compute_record (metapixel_t *pixel, features_record_t *record)
+{
+    int i;
+
+    memset(record, 0, sizeof(features_record_t));
+
+    for (i = 1; i <= NUM_COLOR_SPACES; ++i)
+    {
+	color_convert_rgb_pixels(record->subpixels[i - 1], pixel->subpixels_rgb, NUM_SUBPIXELS, i);
+	subpixel_means(record->subpixels[i - 1], record->means[i - 1]);
+    }
+}
+
+typedef struct
+{
+    unsigned int key;
+    unsigned int index;
+} order_entry_t;
+
+static int
+compare_order_entries (const void *p1, const void *p2)
+{
+    const order_entry_t *entry1 = (const order_entry_t*)p1;
+    const order_entry_t *entry2 = (const order_entry_t*)p2;
+
+    if (entry1->key != entry2->key)
+	return entry1->key < entry2->key ? -1 : 1;
+    if (entry1->index != entry2->index)
+	return entry1->index < entry2->index ? -1 : 1;
+    return 0;
+}
+
+/* Interleaves the bits of the channel means, so that metapixels with
+   similar means have similar keys. */
+static unsigned int
+morton_key (float *means)
+{
+    unsigned int key = 0;
+    int bit, channel;
+
+    for (bit = 7; bit >= 0; --bit)
+	for (channel = 0; channel < NUM_CHANNELS; ++channel)
+	    key = (key << 1) | (((unsigned int)means[channel] >> bit) & 1);
+
+    return key;
+}
+
+/* Sorts the metapixels along a Z-order curve through their RGB means,
+   so that similar ones end up in the same blocks. */
+static unsigned int*
+compute_order (float *rgb_means, unsigned int num_pixels)
+{
+    order_entry_t *entries = (order_entry_t*)malloc(sizeof(order_entry_t) * (num_pixels + 1));
+    unsigned int *order = (unsigned int*)malloc(sizeof(unsigned int) * (num_pixels + 1));
+    unsigned int i;
+
+    assert(entries != 0 && order != 0);
+
+    for (i = 0; i < num_pixels; ++i)
+    {
+	entries[i].key = morton_key(rgb_means + (size_t)i * NUM_CHANNELS);
+	entries[i].index = i;
+    }
+
+    qsort(entries, num_pixels, sizeof(order_entry_t), compare_order_entries);
+
+    for (i = 0; i < num_pixels; ++i)
+	order[i] = entries[i].index;
+
+    free(entries);
+
+    return order;
+}
+
+/* Without an order the means are in order already. */
+static feature_block_t*
+compute_blocks (float *means, unsigned int *order, unsigned int num_ordered)
+{
+    unsigned int num_blocks = NUM_BLOCKS(num_ordered);
+    feature_block_t *blocks = (feature_block_t*)malloc(sizeof(feature_block_t) * (num_blocks + 1));
+    unsigned int i;
+    int channel;
+
+    assert(blocks != 0);
+
+    for (i = 0; i < num_ordered; ++i)
+    {
+	feature_block_t *block = &blocks[i / FEATURE_BLOCK_SIZE];
+	float *pixel_means = means + (size_t)(order != 0 ? order[i] : i) * NUM_CHANNELS;
+
+	for (channel = 0; channel < NUM_CHANNELS; ++channel)
+	    if (i % FEATURE_BLOCK_SIZE == 0)
+		block->min[channel] = block->max[channel] = pixel_means[channel];
+	    else
+	    {
+		block->min[channel] = MIN(block->min[channel], pixel_means[channel]);
+		block->max[channel] = MAX(block->max[channel], pixel_means[channel]);
+	    }
+    }
+
+    return blocks;
+}
+
+typedef struct
+{
+    metapixel_t **pixels;
+    unsigned int first;
+    unsigned int num_pixels;
+    features_record_t *records;
+    float **means;
+} record_chunk_t;
+
+static void
+record_chunk_task (void *data)
+{
+    record_chunk_t *chunk = (record_chunk_t*)data;
+    unsigned int i;
+    int j;
+
+    for (i = 0; i < chunk->num_pixels; ++i)
+    {
+	features_record_t *record = &chunk->records[i];
+
+	compute_record(chunk->pixels[chunk->first + i], record);
+	for (j = 1; j <= NUM_COLOR_SPACES; ++j)
+	    memcpy(chunk->means[j] + (size_t)(chunk->first + i) * NUM_CHANNELS,
+		   record->means[j - 1], sizeof(float) * NUM_CHANNELS);
+    }
+}
+
+/* Writes the records in windows of chunks computed on the thread
+   pool, and collects the means for the order and the blocks. */
+static int
+write_records (FILE *file, metapixel_t **pixels, unsigned int num_pixels, float **means)
+{
+    unsigned int window_size = CONVERT_CHUNK_SIZE * WRITE_WINDOW_SIZE;
+    features_record_t *records = (features_record_t*)malloc(sizeof(features_record_t) * window_size);
+    record_chunk_t chunks[WRITE_WINDOW_SIZE];
+    unsigned int first, i;
+    int result = 1;
+
+    assert(records != 0);
+
+    for (first = 0; first < num_pixels && result; first += window_size)
+    {
+	unsigned int num_window_pixels = MIN(window_size, num_pixels - first);
+	unsigned int num_chunks = (num_window_pixels + CONVERT_CHUNK_SIZE - 1) / CONVERT_CHUNK_SIZE;
+	task_group_t group;
+
+	task_group_init(&group, thread_pool_get_default());
+	for (i = 0; i < num_chunks; ++i)
+	{
+	    chunks[i].pixels = pixels;
+	    chunks[i].first = first + i * CONVERT_CHUNK_SIZE;
+	    chunks[i].num_pixels = MIN(CONVERT_CHUNK_SIZE, num_window_pixels - i * CONVERT_CHUNK_SIZE);
+	    chunks[i].records = records + i * CONVERT_CHUNK_SIZE;
+	    chunks[i].means = means;
+
+	    task_group_spawn(&group, record_chunk_task, &chunks[i]);
+	}
+	task_group_wait(&group);
+
+	result = fwrite(records, sizeof(features_record_t), num_window_pixels, file) == num_window_pixels;
+    }
+
+    free(records);
+
+    return result;
+}
+
+int
+features_file_write (library_t *library)
+{
+    char *filename = library_filename(library->path, FEATURES_FILENAME);
+    char temp_filename[strlen(filename) + 7 + 1];
+    unsigned int num_pixels = library->num_metapixels;
+    metapixel_t **pixels = library_metapixels_in_file_order(library->metapixels, library->num_metapixels);
+    float *means[NUM_COLOR_SPACES + 1];
+    unsigned int *order = 0;
+    features_header_t header;
+    struct stat tables_stat;
+    FILE *file;
+    int result;
+    int i;
+
+    memset(means, 0, sizeof(means));
+    for (i = 1; i <= NUM_COLOR_SPACES; ++i)
+    {
+	means[i] = (float*)malloc(sizeof(float) * NUM_CHANNELS * (num_pixels + 1));
+	assert(means[i] != 0);
+    }
+
+    result = library_stat_tables(library, &tables_stat);
+
+    /* other processes may be writing the file at the same time */
+    file = result ? utils_create_temp_file(filename, temp_filename) : 0;
+    if (file == 0)
+	result = 0;
+
+    if (result)
+	result = fseek(file, records_offset(num_pixels), SEEK_SET) == 0
+	    && write_records(file, pixels, num_pixels, means);
+
+    if (result)
+    {
+	memset(&header, 0, sizeof(header));
+	header.magic = FEATURES_MAGIC;
+	header.version = FEATURES_VERSION;
+	header.record_size = sizeof(features_record_t);
+	header.block_size = FEATURE_BLOCK_SIZE;
+	header.num_records = num_pixels;
+	header.num_ordered = num_pixels;
+	header.tables_device = (long long)tables_stat.st_dev;
+	header.tables_inode = (long long)tables_stat.st_ino;
+
+	order = compute_order(means[COLOR_SPACE_RGB], num_pixels);
+
+	result = fseek(file, 0, SEEK_SET) == 0
+	    && fwrite(&header, sizeof(header), 1, file) == 1
+	    && fwrite(order, sizeof(unsigned int), num_pixels, file) == num_pixels;
+
+	for (i = 1; i <= NUM_COLOR_SPACES && result; ++i)
+	{
+	    feature_block_t *blocks = compute_blocks(means[i], order, num_pixels);
+
+	    result = fwrite(blocks, sizeof(feature_block_t), NUM_BLOCKS(num_pixels), file) == NUM_BLOCKS(num_pixels);
+
+	    free(blocks);
+	}
+
+	result = result && fflush(file) == 0 && !ferror(file);
+    }
+
+    if (file != 0)
+    {
+	if (fclose(file) != 0)
+	    result = 0;
+
+	if (result)
+	    result = rename(temp_filename, filename) == 0;
+
+	if (!result)
+	    unlink(temp_filename);
+    }
+
+    if (order != 0)
+	free(order);
+    for (i = 1; i <= NUM_COLOR_SPACES; ++i)
+	free(means[i]);
+    free(pixels);
+    free(filename);
+
+    return result;
+}
+
+int
+features_file_append (library_t *library, metapixel_t *pixel)
+{
+    char *filename = library_filename(library->path, FEATURES_FILENAME);
+    features_header_t header;
+    features_record_t record;
+    struct stat tables_stat;
+    off_t offset;
+    int result;
+    int fd;
+
+    fd = open(filename, O_RDWR);
+    free(filename);
+
+    if (fd == -1)
+	return 0;
+
+    result = pread(fd, &header, sizeof(header), 0) == sizeof(header)
+	&& header.magic == FEATURES_MAGIC
+	&& header.version == FEATURES_VERSION
+	&& header.record_size == sizeof(features_record_t)
+	&& library_stat_tables(library, &tables_stat)
+	&& header.tables_device == (long long)tables_stat.st_dev
+	&& header.tables_inode == (long long)tables_stat.st_ino;
+
+    if (result)
+    {
+	compute_record(pixel, &record);
+
+	offset = records_offset(header.num_ordered) + (off_t)header.num_records * sizeof(features_record_t);
+	++header.num_records;
+
+	/* the header last, so that a failure leaves the old file */
+	result = pwrite(fd, &record, sizeof(record), offset) == sizeof(record)
+	    && pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+    }
+
+    close(fd);
+
+    return result;
+}
+
+/* Maps the features file of the library if its records are those of
+   exactly the metapixels in the store. */
+static int
+map_features_file (library_t *library)
+{
+    feature_store_t *store = &library->features;
+    char *filename = library_filename(library->path, FEATURES_FILENAME);
+    features_header_t *header;
+    features_record_t *records;
+    unsigned int *order;
+    struct stat buf, tables_stat;
+    void *data;
+    unsigned int i;
+    int result;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    free(filename);
+
+    if (fd == -1)
+	return 0;
+
+    if (fstat(fd, &buf) != 0 || buf.st_size < sizeof(features_header_t))
+    {
+	close(fd);
+	return 0;
+    }
+
+    data = mmap(0, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+	return 0;
+
+    header = (features_header_t*)data;
+    result = header->magic == FEATURES_MAGIC
+	&& header->version == FEATURES_VERSION
+	&& header->record_size == sizeof(features_record_t)
+	&& header->block_size == FEATURE_BLOCK_SIZE
+	&& header->num_records == store->num_metapixels
+	&& header->num_ordered <= header->num_records
+	&& header->num_records - header->num_ordered <= header->num_records / MAX_UNORDERED_FRACTION
+	&& records_offset(header->num_ordered) + (size_t)header->num_records * sizeof(features_record_t) <= buf.st_size
+	&& library_stat_tables(library, &tables_stat)
+	&& header->tables_device == (long long)tables_stat.st_dev
+	&& header->tables_inode == (long long)tables_stat.st_ino;
+
+    if (result)
+    {
+	order = (unsigned int*)((char*)data + sizeof(features_header_t));
+	records = (features_record_t*)((char*)data + records_offset(header->num_ordered));
+
+	for (i = 0; i < header->num_ordered && result; ++i)
+	    result = order[i] < header->num_ordered;
+
+	for (i = 0; i < header->num_records && result; ++i)
+	    result = memcmp(records[i].subpixels[COLOR_SPACE_RGB - 1], store->pixels[i]->subpixels_rgb,
+			    SUBPIXELS_SIZE) == 0;
+    }
+
+    if (!result)
+    {
+	munmap(data, buf.st_size);
+	return 0;
+    }
+
+    store->file_data = data;
+    store->file_size = buf.st_size;
+
+    return 1;
+}
+
+static void
+reset_store (feature_store_t *store)
+{
+    store->num_metapixels = 0;
+    store->num_allocated = 0;
+    store->pixels = 0;
+    memset(store->subpixels, 0, sizeof(store->subpixels));
+    memset(store->means, 0, sizeof(store->means));
+    store->num_ordered = 0;
+    store->order = 0;
+    memset(store->blocks, 0, sizeof(store->blocks));
+    store->file_data = 0;
+    store->file_size = 0;
+    store->shared_data = 0;
+    store->shared_size = 0;
+    store->retire = 0;
+    store->epoch = 0;
+    store->retired = 0;
+    store->view_of = 0;
+}
+
+void
+feature_store_init (feature_store_t *store)
+{
+    pthread_mutex_init(&store->mutex, 0);
+    pthread_cond_init(&store->computed_cond, 0);
+    store->computing = 0;
+    reset_store(store);
+}
+
+/* Takes the mutex once no thread is computing features for the
+   store. */
+static void
+lock_store (feature_store_t *store)
+{
+    pthread_mutex_lock(&store->mutex);
+    while (store->computing)
+	pthread_cond_wait(&store->computed_cond, &store->mutex);
+}
+
+/* Frees the arrays of the store, except for the metapixels. */
+static void
+free_arrays (feature_store_t *store)
+{
+    int i;
+
+    if (store->shared_data != 0)
+    {
+	munmap(store->shared_data, store->shared_size);
+	store->shared_data = 0;
+    }
+    else
+    {
+	for (i = 0; i <= NUM_COLOR_SPACES; ++i)
+	{
+	    if (store->subpixels[i] != 0)
+		free(store->subpixels[i]);
+	    if (store->means[i] != 0)
+		free(store->means[i]);
+	    if (store->blocks[i] != 0)
+		free(store->blocks[i]);
+	}
+	if (store->order != 0)
+	    free(store->order);
+    }
+
+    memset(store->subpixels, 0, sizeof(store->subpixels));
+    memset(store->means, 0, sizeof(store->means));
+    memset(store->blocks, 0, sizeof(store->blocks));
+    store->order = 0;
+}
+
+static void
+use_shared_features (feature_store_t *store, shared_features_t *features)
+{
+    free_arrays(store);
+
+    store->shared_data = features->data;
+    store->shared_size = features->size;
+    store->num_ordered = features->num_ordered;
+    store->order = features->order;
+    memcpy(store->blocks, features->blocks, sizeof(store->blocks));
+    memcpy(store->means, features->means, sizeof(store->means));
+    memcpy(store->subpixels, features->subpixels, sizeof(store->subpixels));
+}
+
+static void*
+copy_array (void *array, size_t size, size_t allocated_size)
+{
+    void *copy = malloc(allocated_size + 1);
+
+    assert(copy != 0);
+    memcpy(copy, array, size);
+
+    return copy;
+}
+
+static void
+retire_array (feature_store_t *store, void *data, size_t map_size)
+{
+    feature_retired_t *retired = (feature_retired_t*)malloc(sizeof(feature_retired_t));
+
+    assert(retired != 0);
+
+    retired->data = data;
+    retired->map_size = map_size;
+    retired->epoch = store->epoch;
+    retired->next = store->retired;
+    store->retired = retired;
+}
+
+static void
+free_retired (feature_store_t *store, unsigned int min_epoch)
+{
+    feature_retired_t **retired = &store->retired;
+
+    while (*retired != 0)
+    {
+	feature_retired_t *r = *retired;
+
+	if (r->epoch < min_epoch)
+	{
+	    if (r->map_size > 0)
+		munmap(r->data, r->map_size);
+	    else
+		free(r->data);
+
+	    *retired = r->next;
+	    free(r);
+	}
+	else
+	    retired = &r->next;
+    }
+}
+
+/* Snapshots might still be reading the old array, which is why it's
+   not realloced then. */
+static void*
+grow_array (feature_store_t *store, void *data, size_t size, size_t new_size)
+{
+    void *grown;
+
+    if (!store->retire)
+    {
+	grown = realloc(data, new_size);
+	assert(grown != 0);
+
+	return grown;
+    }
+
+    grown = malloc(new_size);
+    assert(grown != 0);
+    memcpy(grown, data, size);
+
+    retire_array(store, data, 0);
+
+    return grown;
+}
+
+/* Makes private copies of the arrays in shared memory, so that they
+   can grow. */
+static void
+unshare_store (feature_store_t *store)
+{
+    unsigned int num_blocks = (store->num_ordered + FEATURE_BLOCK_SIZE - 1) / FEATURE_BLOCK_SIZE;
+    shared_features_t features;
+    int i;
+
+    assert(store->shared_data != 0);
+
+    memset(&features, 0, sizeof(features));
+    features.data = store->shared_data;
+    features.size = store->shared_size;
+    features.order = (unsigned int*)copy_array(store->order, sizeof(unsigned int) * store->num_ordered,
+					       sizeof(unsigned int) * store->num_ordered);
+    for (i = 1; i <= NUM_COLOR_SPACES; ++i)
+    {
+	features.blocks[i] = (feature_block_t*)copy_array(store->blocks[i], sizeof(feature_block_t) * num_blocks,
+							  sizeof(feature_block_t) * num_blocks);
+	features.means[i] = (float*)copy_array(store->means[i], sizeof(float) * NUM_CHANNELS * store->num_metapixels,
+					       sizeof(float) * NUM_CHANNELS * store->num_allocated);
+	features.subpixels[i] = (unsigned char*)copy_array(store->subpixels[i],
+							   (size_t)SUBPIXELS_SIZE * store->num_metapixels,
+							   (size_t)SUBPIXELS_SIZE * store->num_allocated);
+    }
+
+    if (store->retire)
+	retire_array(store, store->shared_data, store->shared_size);
+    else
+	munmap(store->shared_data, store->shared_size);
+    store->shared_data = 0;
+
+    store->order = features.order;
+    memcpy(store->blocks, features.blocks, sizeof(store->blocks));
+    memcpy(store->means, features.means, sizeof(store->means));
+    memcpy(store->subpixels, features.subpixels, sizeof(store->subpixels));
+}
+
+void
+feature_store_clear (feature_store_t *store)
+{
+    feature_store_t *view_of = store->view_of;
+
+    if (view_of == 0)
+    {
+	free_arrays(store);
+	if (store->pixels != 0)
+	    free(store->pixels);
+	if (store->file_data != 0)
+	    munmap(store->file_data, store->file_size);
+	free_retired(store, UINT_MAX);
+    }
+
+    reset_store(store);
+    store->view_of = view_of;
+}
+
+void
+feature_store_init_view (feature_store_t *view, feature_store_t *store, unsigned int num_metapixels)
+{
+    feature_store_init(view);
+    view->view_of = store;
+    view->num_metapixels = num_metapixels;
+}
+
+void
+feature_store_set_epoch (feature_store_t *store, int retire, unsigned int epoch)
+{
+    lock_store(store);
+    store->retire = retire;
+    store->epoch = epoch;
+    pthread_mutex_unlock(&store->mutex);
+}
+
+void
+feature_store_reclaim (feature_store_t *store, unsigned int min_epoch)
+{
+    lock_store(store);
+    free_retired(store, min_epoch);
+    pthread_mutex_unlock(&store->mutex);
+}
+
+void
+feature_store_free (feature_store_t *store)
+{
+    feature_store_clear(store);
+    pthread_cond_destroy(&store->computed_cond);
+    pthread_mutex_destroy(&store->mutex);
+}
+
+typedef struct
+{
+    feature_store_t *store;
+    unsigned int first;
+    unsigned int num_pixels;
+    int color_space;
+} convert_chunk_t;
+
+static void
+convert_chunk_task (void *data)
+{
+    convert_chunk_t *chunk = (convert_chunk_t*)data;
+    feature_store_t *store = chunk->store;
+    int color_space = chunk->color_space;
+    unsigned int i;
+
+    for (i = chunk->first; i < chunk->first + chunk->num_pixels; ++i)
+    {
+	unsigned char *subpixels = store->subpixels[color_space] + (size_t)i * SUBPIXELS_SIZE;
+
+	color_convert_rgb_pixels(subpixels, store->pixels[i]->subpixels_rgb, NUM_SUBPIXELS, color_space);
+	subpixel_means(subpixels, store->means[color_space] + (size_t)i * NUM_CHANNELS);
+    }
+}
+
+/* Converts the subpixels of all metapixels in the store, in chunks on
+   the thread pool. */
+static void
+compute_features (feature_store_t *store, int color_space)
+{
+    unsigned int num_chunks = (store->num_metapixels + CONVERT_CHUNK_SIZE - 1) / CONVERT_CHUNK_SIZE;
+    convert_chunk_t *chunks = (convert_chunk_t*)malloc(sizeof(convert_chunk_t) * (num_chunks + 1));
+    task_group_t group;
+    unsigned int i;
+
+    assert(chunks != 0);
+
+    task_group_init(&group, thread_pool_get_default());
+    for (i = 0; i < num_chunks; ++i)
+    {
+	chunks[i].store = store;
+	chunks[i].first = i * CONVERT_CHUNK_SIZE;
+	chunks[i].num_pixels = MIN(CONVERT_CHUNK_SIZE, store->num_metapixels - i * CONVERT_CHUNK_SIZE);
+	chunks[i].color_space = color_space;
+
+	task_group_spawn(&group, convert_chunk_task, &chunks[i]);
+    }
+    task_group_wait(&group);
+
+    free(chunks);
+}
+
+static void
+load_features (feature_store_t *store, int color_space)
+{
+    features_header_t *header = (features_header_t*)store->file_data;
+    features_record_t *records = (features_record_t*)((char*)store->file_data + records_offset(header->num_ordered));
+    feature_block_t *blocks = (feature_block_t*)((char*)store->file_data + blocks_offset(header->num_ordered));
+    unsigned int num_blocks = NUM_BLOCKS(header->num_ordered);
+    /* metapixels added since the file was mapped are past its end */
+    unsigned int num_mapped = (store->file_size - records_offset(header->num_ordered)) / sizeof(features_record_t);
+    unsigned int i;
+
+    for (i = 0; i < store->num_metapixels; ++i)
+    {
+	unsigned int file_index = feature_store_file_index(store, i);
+	unsigned char *subpixels = store->subpixels[color_space] + (size_t)i * SUBPIXELS_SIZE;
+	float *means = store->means[color_space] + (size_t)i * NUM_CHANNELS;
+
+	if (file_index < num_mapped)
+	{
+	    memcpy(subpixels, records[file_index].subpixels[color_space - 1], SUBPIXELS_SIZE);
+	    memcpy(means, records[file_index].means[color_space - 1], sizeof(float) * NUM_CHANNELS);
+	}
+	else
+	{
+	    color_convert_rgb_pixels(subpixels, store->pixels[i]->subpixels_rgb, NUM_SUBPIXELS, color_space);
+	    subpixel_means(subpixels, means);
+	}
+    }
+
+    store->blocks[color_space] = (feature_block_t*)malloc(sizeof(feature_block_t) * (num_blocks + 1));
+    assert(store->blocks[color_space] != 0);
+    memcpy(store->blocks[color_space], blocks + (color_space - 1) * num_blocks,
+	   sizeof(feature_block_t) * num_blocks);
+}
+
+/* Puts the metapixels into the store in their order, which is taken
+   from shared memory or the features file if possible. */
+static void
+init_store (library_t *library)
+{
+    feature_store_t *store = &library->features;
+    unsigned int num_pixels = library->num_metapixels;
+    metapixel_t **pixels = library_metapixels_in_file_order(library->metapixels, library->num_metapixels);
+    shared_features_t features;
+    unsigned int i;
+
+    store->num_metapixels = store->num_allocated = num_pixels;
+    store->pixels = pixels;
+
+    if (shared_features_enabled() && shared_features_attach(library, &features))
+	use_shared_features(store, &features);
+    else
+    {
+	/* If that fails we'll just compute them each time. */
+	if (!map_features_file(library)
+	    && features_file_write(library))
+	    map_features_file(library);
+
+	if (store->file_data != 0)
+	{
+	    features_header_t *header = (features_header_t*)store->file_data;
+
+	    store->num_ordered = header->num_ordered;
+	    store->order = (unsigned int*)malloc(sizeof(unsigned int) * (store->num_ordered + 1));
+	    assert(store->order != 0);
+	    memcpy(store->order, (char*)store->file_data + sizeof(features_header_t),
+		   sizeof(unsigned int) * store->num_ordered);
+	}
+	else
+	{
+	    float *means = (float*)malloc(sizeof(float) * NUM_CHANNELS * (num_pixels + 1));
+
+	    assert(means != 0);
+
+	    for (i = 0; i < num_pixels; ++i)
+		subpixel_means(pixels[i]->subpixels_rgb, means + (size_t)i * NUM_CHANNELS);
+
+	    store->num_ordered = num_pixels;
+	    store->order = compute_order(means, num_pixels);
+
+	    free(means);
+	}
+    }
+
+    store->pixels = (metapixel_t**)malloc(sizeof(metapixel_t*) * (num_pixels + 1));
+    assert(store->pixels != 0);
+
+    for (i = 0; i < num_pixels; ++i)
+    {
+	store->pixels[i] = pixels[feature_store_file_index(store, i)];
+	store->pixels[i]->feature_index = i;
+    }
+
+    free(pixels);
+}
+
+static void
+need_color_space (feature_store_t *store, int color_space)
+{
+    if (store->subpixels[color_space] != 0)
+	return;
+
+    store->subpixels[color_space] = (unsigned char*)malloc((size_t)store->num_allocated * SUBPIXELS_SIZE + 1);
+    store->means[color_space] = (float*)malloc(sizeof(float) * NUM_CHANNELS * store->num_allocated + 1);
+    assert(store->subpixels[color_space] != 0 && store->means[color_space] != 0);
+
+    if (store->file_data != 0)
+	load_features(store, color_space);
+    else
+    {
+	compute_features(store, color_space);
+	store->blocks[color_space] = compute_blocks(store->means[color_space], 0, store->num_ordered);
+    }
+}
+
+/* A snapshot gets the arrays of its library, which has its
+   metapixels, in the same order, at the start. */
+static void
+need_view_features (library_t *snapshot, int color_space)
+{
+    feature_store_t *view = &snapshot->features;
+    feature_store_t *store = view->view_of;
+
+    library_need_features(snapshot->snapshot_of, color_space);
+
+    pthread_mutex_lock(&view->mutex);
+    lock_store(store);
+
+    assert(store->num_ordered <= view->num_metapixels && view->num_metapixels <= store->num_metapixels);
+
+    view->pixels = store->pixels;
+    view->num_ordered = store->num_ordered;
+    view->order = store->order;
+    memcpy(view->subpixels, store->subpixels, sizeof(view->subpixels));
+    memcpy(view->means, store->means, sizeof(view->means));
+    memcpy(view->blocks, store->blocks, sizeof(view->blocks));
+
+    pthread_mutex_unlock(&store->mutex);
+    pthread_mutex_unlock(&view->mutex);
+}
+
+void
+library_need_features (library_t *library, int color_space)
+{
+    feature_store_t *store = &library->features;
+    shared_features_t features;
+    int i;
+
+    assert(color_space > 0 && color_space <= NUM_COLOR_SPACES);
+
+    if (store->view_of != 0)
+    {
+	need_view_features(library, color_space);
+	return;
+    }
+
+    lock_store(store);
+
+    if (store->pixels != 0 && store->subpixels[color_space] != 0)
+    {
+	pthread_mutex_unlock(&store->mutex);
+	return;
+    }
+
+    /* everybody else waits until we are done */
+    store->computing = 1;
+    pthread_mutex_unlock(&store->mutex);
+
+    if (store->pixels == 0)
+    {
+	init_store(library);
+
+	/* Other processes might need any of them. */
+	if (shared_features_enabled() && store->shared_data == 0)
+	{
+	    for (i = 1; i <= NUM_COLOR_SPACES; ++i)
+		need_color_space(store, i);
+
+	    if (shared_features_publish(library)
+		&& shared_features_attach(library, &features))
+		use_shared_features(store, &features);
+	}
+    }
+
+    need_color_space(store, color_space);
+
+    pthread_mutex_lock(&store->mutex);
+    store->computing = 0;
+    pthread_cond_broadcast(&store->computed_cond);
+    pthread_mutex_unlock(&store->mutex);
+}
+
+void
+feature_store_add (feature_store_t *store, metapixel_t *pixel)
+{
+    int i;
+
+    lock_store(store);
+
+    if (store->pixels == 0)
+    {
+	pthread_mutex_unlock(&store->mutex);
+	return;
+    }
+
+    if (store->shared_data != 0)
+	unshare_store(store);
+
+    if (store->num_metapixels == store->num_allocated)
+    {
+	unsigned int n = store->num_metapixels;
+
+	store->num_allocated = store->num_allocated * 2 + 16;
+
+	store->pixels = (metapixel_t**)grow_array(store, store->pixels, sizeof(metapixel_t*) * n,
+						  sizeof(metapixel_t*) * store->num_allocated);
+
+	for (i = 0; i <= NUM_COLOR_SPACES; ++i)
+	    if (store->subpixels[i] != 0)
+	    {
+		store->subpixels[i] = (unsigned char*)grow_array(store, store->subpixels[i],
+								 (size_t)n * SUBPIXELS_SIZE,
+								 (size_t)store->num_allocated * SUBPIXELS_SIZE);
+		store->means[i] = (float*)grow_array(store, store->means[i],
+						     sizeof(float) * NUM_CHANNELS * n,
+						     sizeof(float) * NUM_CHANNELS * store->num_allocated);
+	    }
+    }
+
+    /* it's not in the order, so searches look at it separately */
+    pixel->feature_index = store->num_metapixels++;
+    store->pixels[pixel->feature_index] = pixel;
+
+    for (i = 0; i <= NUM_COLOR_SPACES; ++i)
+	if (store->subpixels[i] != 0)
+	{
+	    unsigned char *subpixels = store->subpixels[i] + (size_t)pixel->feature_index * SUBPIXELS_SIZE;
+
+	    color_convert_rgb_pixels(subpixels, pixel->subpixels_rgb, NUM_SUBPIXELS, i);
+	    subpixel_means(subpixels, store->means[i] + (size_t)pixel->feature_index * NUM_CHANNELS);
+	}
+
+    pthread_mutex_unlock(&store->mutex);
+}
@@ -0,0 +1,247 @@
+/*
+ * hash.c
+ *
+ * metapixel
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "hash.h"
+
+#define INITIAL_NUM_BUCKETS      64
+
+hash_table_t*
+hash_table_new (hash_func_t hash_func, hash_equal_func_t equal_func)
+{
+    hash_table_t *table = (hash_table_t*)malloc(sizeof(hash_table_t));
+
+    assert(table != 0);
+
+    table->hash_func = hash_func;
+    table->equal_func = equal_func;
+    table->num_buckets = INITIAL_NUM_BUCKETS;
+    table->num_entries = 0;
+
+    table->buckets = (hash_node_t**)malloc(sizeof(hash_node_t*) * table->num_buckets);
+    assert(table->buckets != 0);
+    memset(table->buckets, 0, sizeof(hash_node_t*) * table->num_buckets);
+
+    return table;
+}
+
+void
+hash_table_free (hash_table_t *table)
+{
+    unsigned int i;
+
+    for (i = 0; i < table->num_buckets; ++i)
+    {
+	hash_node_t *node = table->buckets[i];
+
+	while (node != 0)
+	{
+	    hash_node_t *next = node->next;
+
+	    free(node);
+
+	    node = next;
+	}
+    }
+
+    free(table->buckets);
+    free(table);
+}
+
+static hash_node_t**
+find_node (hash_table_t *table, const void *key, unsigned int hash)
+{
+    hash_node_t **node = &table->buckets[hash & (table->num_buckets - 1)];
+
+    while (*node != 0)
+    {
+	if ((*node)->hash == hash && table->equal_func((*node)->key, key))
+	    break;
+	node = &(*node)->next;
+    }
+
+    return node;
+}
+
+static void
+grow_table (hash_table_t *table)
+{
+    unsigned int new_num_buckets = table->num_buckets * 2;
+    hash_node_t **new_buckets = (hash_node_t**)malloc(sizeof(hash_node_t*) * new_num_buckets);
+    unsigned int i;
+
+    assert(new_buckets != 0);
+    memset(new_buckets, 0, sizeof(hash_node_t*) * new_num_buckets);
+
+    for (i = 0; i < table->num_buckets; ++i)
+    {
+	hash_node_t *node = table->buckets[i];
+
+	while (node != 0)
+	{
+	    hash_node_t *next = node->next;
+	    unsigned int index = node->hash & (new_num_buckets - 1);
+
+	    node->next = new_buckets[index];
+	    new_buckets[index] = node;
+
+	    node = next;
+	}
+    }
+
+    free(table->buckets);
+
+    table->buckets = new_buckets;
+    table->num_buckets = new_num_buckets;
+}
+
+void*
+hash_table_lookup (hash_table_t *table, const void *key)
+{
+    hash_node_t *node = *find_node(table, key, table->hash_func(key));
+
+    if (node == 0)
+	return 0;
+    return node->value;
+}
+
+void
+hash_table_insert (hash_table_t *table, const void *key, void *value)
+{
+    unsigned int hash = table->hash_func(key);
+    hash_node_t **node = find_node(table, key, hash);
+
+    if (*node != 0)
+    {
+	(*node)->key = key;
+	(*node)->value = value;
+	return;
+    }
+
+    *node = (hash_node_t*)malloc(sizeof(hash_node_t));
+    assert(*node != 0);
+
+    (*node)->key = key;
+    (*node)->value = value;
+    (*node)->hash = hash;
+    (*node)->next = 0;
+
+    if (++table->num_entries > table->num_buckets * 2)
+	grow_table(table);
+}
+
+void*
+hash_table_remove (hash_table_t *table, const void *key)
+{
+    hash_node_t **node = find_node(table, key, table->hash_func(key));
+    hash_node_t *removed = *node;
+    void *value;
+
+    if (removed == 0)
+	return 0;
+
+    *node = removed->next;
+    value = removed->value;
+    free(removed);
+
+    --table->num_entries;
+
+    return value;
+}
+
+void
+hash_table_foreach (hash_table_t *table, void (*func) (const void *key, void *value, void *data), void *data)
+{
+    unsigned int i;
+
+    for (i = 0; i < table->num_buckets; ++i)
+    {
+	hash_node_t *node;
+
+	for (node = table->buckets[i]; node != 0; node = node->next)
+	    func(node->key, node->value, data);
+    }
+}
+
+/* FNV-1a */
+unsigned int
+hash_bytes (const void *data, unsigned int length, unsigned int seed)
+{
+    const unsigned char *p = (const unsigned char*)data;
+    unsigned int hash = 2166136261U ^ seed;
+    unsigned int i;
+
+    for (i = 0; i < length; ++i)
+    {
+	hash ^= p[i];
+	hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+/* FNV-1a, 64 bit.  Pass the result as the seed of the next call to
+   hash data in pieces, and 0 for the first. */
+unsigned long long
+hash_bytes_64 (const void *data, unsigned int length, unsigned long long seed)
+{
+    const unsigned char *p = (const unsigned char*)data;
+    unsigned long long hash = seed == 0 ? 14695981039346656037ULL : seed;
+    unsigned int i;
+
+    for (i = 0; i < length; ++i)
+    {
+	hash ^= p[i];
+	hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+unsigned int
+hash_string (const void *key)
+{
+    return hash_bytes(key, strlen((const char*)key), 0);
+}
+
+int
+hash_string_equal (const void *key1, const void *key2)
+{
+    return strcmp((const char*)key1, (const char*)key2) == 0;
+}
+
+unsigned int
+hash_pointer (const void *key)
+{
+    unsigned long value = (unsigned long)key;
+
+    return (unsigned int)((value >> 4) ^ (value >> 20) ^ (value * 2654435761UL));
+}
+
+int
+hash_pointer_equal (const void *key1, const void *key2)
+{
+    return key1 == key2;
+}
@@ -0,0 +1,71 @@
+/* -*- c -*- */
+
+/*
+ * hash.h
+ *
+ * metapixel
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __METAPIXEL_HASH_H__
+#define __METAPIXEL_HASH_H__
+
+typedef unsigned int (*hash_func_t) (const void *key);
+typedef int (*hash_equal_func_t) (const void *key1, const void *key2);
+
+typedef struct _hash_node_t
+{
+    const void *key;
+    void *value;
+    unsigned int hash;
+    struct _hash_node_t *next;
+} hash_node_t;
+
+typedef struct
+{
+    hash_func_t hash_func;
+    hash_equal_func_t equal_func;
+    unsigned int num_buckets;	/* always a power of two */
+    unsigned int num_entries;
+    hash_node_t **buckets;
+} hash_table_t;
+
+/* The table neither copies nor frees keys and values.  A key must
+   stay valid and unchanged for as long as it is in the table. */
+hash_table_t* hash_table_new (hash_func_t hash_func, hash_equal_func_t equal_func);
+void hash_table_free (hash_table_t *table);
+
+/* Returns 0 if the key is not in the table. */
+void* hash_table_lookup (hash_table_t *table, const void *key);
+/* Replaces the value if the key is already in the table. */
+void hash_table_insert (hash_table_t *table, const void *key, void *value);
+/* Returns the value of the removed entry or 0 if there was none. */
+void* hash_table_remove (hash_table_t *table, const void *key);
+
+void hash_table_foreach (hash_table_t *table, void (*func) (const void *key, void *value, void *data), void *data);
+
+unsigned int hash_bytes (const void *data, unsigned int length, unsigned int seed);
+unsigned long long hash_bytes_64 (const void *data, unsigned int length, unsigned long long seed);
+
+unsigned int hash_string (const void *key);
+int hash_string_equal (const void *key1, const void *key2);
+
+unsigned int hash_pointer (const void *key);
+int hash_pointer_equal (const void *key1, const void *key2);
+
+#endif
@@ -24,11 +24,15 @@
 #define __METAPIXEL_INTERNALS_H__
 
 #include <stdarg.h>
+#include <sys/stat.h>
 
 #include "rwimg/readimage.h"
 #include "rwimg/writeimage.h"
+#include "lispreader/lispreader.h"
 
 #include "api.h"
+#include "hash.h"
+#include "thread.h"
 
 #ifndef MIN
 #define MIN(a,b)           ((a)<(b)?(a):(b))
@@ -40,6 +44,18 @@
 #define SQRT_OF_TWO         1.414213562373095048801688724209698078570
 
 #define TABLES_FILENAME "tables.mxt"
+#define ATLAS_FILENAME  "images.mxa"
+#define BINARY_TABLES_FILENAME "tables.mxb"
+#define MANIFEST_FILENAME "manifest.mxt"
+
+/* The result must be freed. */
+char* library_filename (const char *path, const char *name);
+/* Returns 0 if tables.mxt of the library cannot be stat'ed. */
+int library_stat_tables (library_t *library, struct stat *buf);
+/* The first num_metapixels metapixels of the list starting at first,
+   in the order of tables.mxt, which is the reverse of the list.  The
+   result must be freed. */
+metapixel_t** library_metapixels_in_file_order (metapixel_t *first, unsigned int num_metapixels);
 
 #define NUM_CHANNELS        3
 
@@ -51,6 +67,8 @@
 /* Subpixel parameters */
 #define NUM_SUBPIXEL_ROWS_COLS       5
 #define NUM_SUBPIXELS                (NUM_SUBPIXEL_ROWS_COLS * NUM_SUBPIXEL_ROWS_COLS)
+/* of all channels, in bytes */
+#define SUBPIXELS_SIZE               (NUM_SUBPIXELS * NUM_CHANNELS)
 
 typedef struct
 {
@@ -97,8 +115,27 @@ typedef struct
     int y;
 } global_match_t;
 
+typedef struct _jpeg_decoder_t jpeg_decoder_t;
+
+/* Reads a JPEG file at a reduced size. */
+typedef struct
+{
+    unsigned int width, height;		/* as decoded */
+    unsigned int full_width, full_height;
+    jpeg_decoder_t *decoder;
+} jpeg_reader_t;
+
+/* Decodes at the smallest of 1/8, 1/4, 1/2 and full size which is at
+   least min_width x min_height.  Returns 0 if the file is not a JPEG
+   file we can read, without reporting an error. */
+jpeg_reader_t* jpeg_reader_open (const char *filename, unsigned int min_width, unsigned int min_height);
+/* Returns 0 if the file is corrupt. */
+int jpeg_reader_read_lines (jpeg_reader_t *reader, unsigned char *lines, unsigned int num_lines);
+void jpeg_reader_free (jpeg_reader_t *reader);
+
 #define CLASSIC_READER_IMAGE_READER          1
 #define CLASSIC_READER_BITMAP                2
+#define CLASSIC_READER_JPEG                  3
 
 typedef struct
 {
@@ -107,6 +144,7 @@ typedef struct
     {
 	image_reader_t *image_reader;
 	bitmap_t *bitmap;
+	jpeg_reader_t *jpeg_reader;
     } v;
     tiling_t tiling;
     unsigned int in_image_width;
@@ -132,6 +170,370 @@ typedef struct
     unsigned int y;
 } classic_writer_t;
 
+typedef struct
+{
+    metapixel_t *pixel;
+    unsigned int width;
+    unsigned int height;
+    unsigned int orientation;
+} tile_cache_key_t;
+
+typedef struct _tile_cache_entry_t
+{
+    tile_cache_key_t key;
+    bitmap_t *tile;
+    unsigned long num_bytes;
+    struct _tile_cache_entry_t *lru_prev;
+    struct _tile_cache_entry_t *lru_next;
+} tile_cache_entry_t;
+
+struct _tile_cache_t
+{
+    pthread_mutex_t mutex;
+    unsigned long max_bytes;
+    unsigned long num_bytes;
+    unsigned long num_hits;
+    unsigned long num_misses;
+    hash_table_t *table;
+    /* most recently used first */
+    tile_cache_entry_t *lru_first;
+    tile_cache_entry_t *lru_last;
+};
+
+/* Returns a new reference to the cached tile or 0 if there is
+   none. */
+bitmap_t* tile_cache_lookup (tile_cache_t *cache, metapixel_t *pixel,
+			     unsigned int width, unsigned int height, unsigned int orientation);
+/* The cache takes a new reference to tile. */
+void tile_cache_insert (tile_cache_t *cache, metapixel_t *pixel,
+			unsigned int width, unsigned int height, unsigned int orientation,
+			bitmap_t *tile);
+
+/* An atlas keeps all the images of a library in one file, as raw
+   RGB data.  Every image starts with a header and is aligned to
+   ATLAS_ALIGNMENT bytes.  Offsets are given in units of
+   ATLAS_ALIGNMENT, so that an int covers large atlases. */
+#define ATLAS_ALIGNMENT		16
+#define ATLAS_MAGIC		0x3141584d	/* "MXA1" */
+
+typedef struct
+{
+    unsigned int magic;
+    unsigned int width;
+    unsigned int height;
+    unsigned int reserved;
+} atlas_header_t;
+
+typedef struct _atlas_mapping_t
+{
+    unsigned char *data;
+    size_t size;
+    struct _atlas_mapping_t *next;
+} atlas_mapping_t;
+
+typedef struct
+{
+    char *filename;
+    pthread_mutex_t mutex;
+    /* Bitmaps from the atlas point into the mappings, so a mapping
+       is only unmapped when the atlas is closed.  The most recent,
+       i.e., largest, mapping comes first. */
+    atlas_mapping_t *mappings;
+} atlas_t;
+
+/* atlas_open returns 0 if the library has no atlas, without
+   reporting an error. */
+atlas_t* atlas_open (const char *library_path);
+atlas_t* atlas_create (const char *library_path);
+void atlas_close (atlas_t *atlas);
+/* Returns the offset of the image or -1 on failure. */
+int atlas_append (atlas_t *atlas, bitmap_t *bitmap);
+/* The bitmap is valid until the atlas is closed. */
+bitmap_t* atlas_get_bitmap (atlas_t *atlas, int offset, unsigned int width, unsigned int height);
+/* Returns 0 on failure, without reporting an error. */
+int atlas_sync (atlas_t *atlas);
+
+/* While a batch is in progress, additions to a library go to a
+   tables file which is kept open, and the names of the files in the
+   library are kept in memory instead of being looked up. */
+typedef struct
+{
+    FILE *tables_file;
+    /* All files in the library directory, including the ones added
+       in the batch.  Keys and values are the same string. */
+    hash_table_t *filenames;
+    /* For each image name which had to be made unique, the next
+       suffix to try.  The values are library_batch_suffix_t. */
+    hash_table_t *next_suffixes;
+    /* whether the library had read all of the tables file when the
+       batch began */
+    int tables_current;
+} library_batch_t;
+
+typedef struct
+{
+    int next;
+    char name[1];
+} library_batch_suffix_t;
+
+/* The manifest of a library records which source file each of its
+   metapixels was prepared from, so that preparing again can skip
+   sources which haven't changed. */
+typedef struct
+{
+    char *path;			/* of the source, absolute */
+    char *filename;		/* of the metapixel */
+    long long size;
+    long long mtime;
+    unsigned long long hash;	/* of the contents of the source, 0 if unknown */
+} manifest_entry_t;
+
+typedef struct
+{
+    char *filename;
+    FILE *file;			/* for appending, opened on demand */
+    int failed;
+    unsigned int num_records;
+    hash_table_t *entries;	/* by path */
+    hash_table_t *hashes;	/* by content hash, one entry per hash */
+} manifest_t;
+
+/* A library without a manifest has an empty one.  Returns 0 on
+   failure. */
+manifest_t* manifest_open (const char *library_path);
+/* Both make sure all changes are on disk.  They return 0 if any of
+   them could not be written. */
+int manifest_sync (manifest_t *manifest);
+int manifest_close (manifest_t *manifest);
+manifest_entry_t* manifest_lookup (manifest_t *manifest, const char *path);
+/* Returns one of the entries with the given content hash. */
+manifest_entry_t* manifest_lookup_hash (manifest_t *manifest, unsigned long long hash);
+/* Entries returned by the lookup functions are invalid after the
+   next change. */
+void manifest_set (manifest_t *manifest, const char *path, const char *filename,
+		   long long size, long long mtime, unsigned long long hash);
+void manifest_remove (manifest_t *manifest, const char *path);
+/* The result must be freed, but not the entries. */
+manifest_entry_t** manifest_get_entries (manifest_t *manifest, unsigned int *num_entries);
+/* Returns 0 if the file cannot be read. */
+int manifest_hash_file (const char *path, unsigned long long *hash);
+
+/* The binary tables file is a copy of the tables file which can be
+   mapped instead of parsed.  The metapixels read from it are
+   allocated in one block, and their names and filenames point into
+   the mapping, so they must not be freed individually. */
+/* Both only succeed if the binary tables file belongs to the tables
+   file with the given stat.  Reading fails silently, in which case
+   the tables file must be parsed. */
+int binary_tables_read (library_t *library, struct stat *tables_stat);
+int binary_tables_write (library_t *library, struct stat *tables_stat);
+void binary_tables_free (binary_tables_t *tables);
+
+/* An arena hands out memory which is only freed all at once. */
+typedef struct _arena_chunk_t arena_chunk_t;
+
+typedef struct
+{
+    arena_chunk_t *chunks;	/* the one allocated from is first */
+    size_t chunk_size;
+} arena_t;
+
+void arena_init (arena_t *arena, size_t chunk_size);
+/* The arena can be used again after it's freed. */
+void arena_free (arena_t *arena);
+void* arena_alloc (arena_t *arena, size_t size);
+char* arena_strdup (arena_t *arena, const char *str);
+/* Moves all memory of other into arena, leaving other empty. */
+void arena_take (arena_t *arena, arena_t *other);
+
+#define NUM_COLOR_SPACES	3
+
+#define FEATURES_FILENAME	"features.mxf"
+
+#define FEATURE_BLOCK_SIZE	64
+
+/* The range of the means of each channel over a block of
+   metapixels. */
+typedef struct
+{
+    float min[NUM_CHANNELS];
+    float max[NUM_CHANNELS];
+} feature_block_t;
+
+/* An array a feature store has replaced but which snapshots taken
+   up to the epoch might still use. */
+typedef struct _feature_retired_t
+{
+    void *data;
+    size_t map_size;		/* 0 if it's from malloc */
+    unsigned int epoch;
+    struct _feature_retired_t *next;
+} feature_retired_t;
+
+/* The subpixels of the metapixels of a library in each color space,
+   and their means, are only computed (or taken from the features
+   file) when a metric first needs them, all at once.  Those of a
+   metapixel are at its feature_index.  The first num_ordered
+   metapixels are sorted so that those of similar colors are close
+   together.  Metapixels added later get theirs in every color space
+   computed so far, after those, so the feature index of a metapixel
+   never changes. */
+typedef struct _feature_store_t
+{
+    pthread_mutex_t mutex;
+    /* Features are computed on the thread pool, so the mutex isn't
+       held while that happens.  Instead this is set, and everybody
+       else waits for computed_cond before using the store. */
+    int computing;
+    pthread_cond_t computed_cond;
+    unsigned int num_metapixels;
+    unsigned int num_allocated;
+    /* by feature index, 0 if nothing was computed yet */
+    metapixel_t **pixels;
+    /* by color space, 0 if not computed yet */
+    unsigned char *subpixels[NUM_COLOR_SPACES + 1];
+    float *means[NUM_COLOR_SPACES + 1];
+    /* the positions in tables.mxt of the first num_ordered
+       metapixels */
+    unsigned int num_ordered;
+    unsigned int *order;
+    /* the ranges of the means of each FEATURE_BLOCK_SIZE of the first
+       num_ordered metapixels, by color space */
+    feature_block_t *blocks[NUM_COLOR_SPACES + 1];
+    /* the features file, mapped, or 0 */
+    void *file_data;
+    size_t file_size;
+    /* If the arrays are in shared memory, this is its mapping,
+       otherwise 0. */
+    void *shared_data;
+    size_t shared_size;
+    /* While there are snapshots of the library, arrays the store
+       replaces are retired instead of freed, tagged with the epoch
+       of the newest snapshot. */
+    int retire;
+    unsigned int epoch;
+    feature_retired_t *retired;
+    /* The store of a snapshot only refers to the arrays of the store
+       of its library, up to its own num_metapixels.  0 for the store
+       of a library. */
+    struct _feature_store_t *view_of;
+} feature_store_t;
+
+void feature_store_init (feature_store_t *store);
+void feature_store_free (feature_store_t *store);
+/* Must be called whenever metapixels are removed from the library. */
+void feature_store_clear (feature_store_t *store);
+void feature_store_add (feature_store_t *store, metapixel_t *pixel);
+/* Makes view the store of a snapshot of the library with the store,
+   with its first num_metapixels metapixels. */
+void feature_store_init_view (feature_store_t *view, feature_store_t *store, unsigned int num_metapixels);
+void feature_store_set_epoch (feature_store_t *store, int retire, unsigned int epoch);
+/* Frees the retired arrays from before min_epoch. */
+void feature_store_reclaim (feature_store_t *store, unsigned int min_epoch);
+/* Computes the subpixels of all metapixels of the library in the
+   color space, their means and the blocks, unless that was done
+   already. */
+void library_need_features (library_t *library, int color_space);
+
+/* Writes the features file of the library anew. */
+int features_file_write (library_t *library);
+/* Appends the features of a metapixel just added to the tables file,
+   if the features file belongs to it. */
+int features_file_append (library_t *library, metapixel_t *pixel);
+
+/* The position in tables.mxt of the metapixel with the feature
+   index. */
+#define feature_store_file_index(store,i)	((i) < (store)->num_ordered ? (store)->order[(i)] : (i))
+
+void subpixel_means (unsigned char *subpixels, float *means);
+
+/* The arrays of a feature store in shared memory, all read-only. */
+typedef struct
+{
+    void *data;
+    size_t size;
+    unsigned int num_ordered;
+    unsigned int *order;
+    feature_block_t *blocks[NUM_COLOR_SPACES + 1];
+    float *means[NUM_COLOR_SPACES + 1];
+    unsigned char *subpixels[NUM_COLOR_SPACES + 1];
+} shared_features_t;
+
+int shared_features_enabled (void);
+/* Maps the features of the library published by some process, if they
+   belong to its tables file as it is now.  Returns 0 otherwise. */
+int shared_features_attach (library_t *library, shared_features_t *features);
+/* Publishes the feature store of the library, which must have all
+   color spaces. */
+int shared_features_publish (library_t *library);
+
+/* The duplicate index finds metapixels whose subpixels (in RGB)
+   each differ by at most max_distance from those of a given one. */
+typedef struct
+{
+    metapixel_t *pixel;
+    unsigned int checksum;	/* of the subpixels */
+} duplicate_entry_t;
+
+typedef struct
+{
+    unsigned int key;
+    unsigned int num_entries;
+    unsigned int num_allocated;
+    duplicate_entry_t *entries;
+} duplicate_cell_t;
+
+typedef struct
+{
+    unsigned int max_distance;
+    unsigned int cell_size;
+    hash_table_t *cells;	/* values are duplicate_cell_t */
+} duplicate_index_t;
+
+duplicate_index_t* duplicate_index_new (unsigned int max_distance);
+void duplicate_index_free (duplicate_index_t *index);
+void duplicate_index_add (duplicate_index_t *index, metapixel_t *pixel);
+/* Prefers a metapixel with identical subpixels.  Returns 0 if there
+   is no duplicate. */
+metapixel_t* duplicate_index_lookup (duplicate_index_t *index, metapixel_t *pixel);
+
+#define PREFETCH_NUM_THREADS	4
+/* in metapixels */
+#define PREFETCH_WINDOW		512
+
+/* A prefetcher reads the files of metapixels into the page cache
+   shortly before the renderer needs them. */
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned int window;
+    /* the file of each metapixel only once, in the order they are
+       first needed */
+    unsigned int num_files;
+    unsigned int num_allocated;
+    char **filenames;
+    unsigned int *positions;	/* position of the first use */
+    hash_table_t *seen;
+    unsigned int num_added;
+    unsigned int next;		/* next index into filenames to fetch */
+    unsigned int position;	/* current position of the renderer */
+    int stopping;
+    unsigned int num_threads;
+    pthread_t threads[PREFETCH_NUM_THREADS];
+} prefetcher_t;
+
+/* The prefetcher stays at most window positions ahead of the
+   renderer.  Metapixels must be added in the order in which they are
+   rendered, one position each, with the size they are rendered at,
+   by one thread.  Unless all_added is set when the prefetcher is
+   started, they can still be added after that. */
+prefetcher_t* prefetcher_new (unsigned int window);
+void prefetcher_add (prefetcher_t *prefetcher, metapixel_t *pixel, unsigned int width, unsigned int height);
+void prefetcher_start (prefetcher_t *prefetcher, int all_added);
+void prefetcher_set_position (prefetcher_t *prefetcher, unsigned int position);
+void prefetcher_free (prefetcher_t *prefetcher);
+
 unsigned int library_count_metapixels (int num_libraries, library_t **libraries);
 
 /* num_new_libraries and new_libraries have very peculiar semantics! */
@@ -142,11 +544,20 @@ library_t* library_find_or_open (int num_libraries, library_t **libraries,
 /* Does not initialize coefficients! */
 metapixel_t* metapixel_new (const char *name, unsigned int scaled_width, unsigned int scaled_height,
 			    float aspect_ratio);
+/* Returns the full path of the metapixel's image file, or 0 if it
+   has none, which is also the case if it is in an atlas.  The result
+   must be freed. */
+char* metapixel_get_filename (metapixel_t *metapixel);
+/* The file metapixel_get_bitmap_for_size reads. */
+char* metapixel_get_filename_for_size (metapixel_t *metapixel, unsigned int width, unsigned int height);
+/* Returns 0 on failure. */
+bitmap_t* metapixel_get_level_bitmap (metapixel_t *metapixel, unsigned int level);
+/* Scales, flips and pastes the metapixel into image in one go.  If
+   cheat is not 0, cheat_image, which must have the same size as
+   image, is blended in with that opacity.  tile_cache can be 0. */
 int metapixel_paste (metapixel_t *pixel, bitmap_t *image, unsigned int x, unsigned int y,
-		     unsigned int small_width, unsigned int small_height, unsigned int orientation);
-
-/* Converts the RGB subpixel data to HSV and YIQ */
-void metapixel_complete_subpixel (metapixel_t *pixel);
+		     unsigned int small_width, unsigned int small_height, unsigned int orientation,
+		     bitmap_t *cheat_image, unsigned int cheat, tile_cache_t *tile_cache);
 
 /* num_new_libraries and new_libraries have very peculiar semantics! */
 metapixel_t* metapixel_find_in_libraries (int num_libraries, library_t **libraries,
@@ -168,6 +579,9 @@ void metric_generate_coeffs_for_subimage (coeffs_union_t *coeffs, bitmap_t *bitm
 					  int x, int y, int width, int height, metric_t *metric);
 /* the returned struct (pointed to) is static and must not be altered.  */
 compare_func_set_t* metric_compare_func_set_for_metric (metric_t *metric);
+/* Must be called before metapixels of the libraries are compared
+   with the metric. */
+void metric_prepare_libraries (metric_t *metric, int num_libraries, library_t **libraries);
 
 metapixel_match_t search_metapixel_nearest_to (int num_libraries, library_t **libraries,
 					       coeffs_union_t *coeffs, metric_t *metric, int x, int y,
@@ -186,11 +600,25 @@ unsigned int tiling_get_rectangular_y (tiling_t *tiling, unsigned int image_heig
 unsigned int tiling_get_rectangular_height (tiling_t *tiling, unsigned int image_height, unsigned int metapixel_y);
 
 classic_reader_t* classic_reader_new_from_file (const char *image_filename, tiling_t *tiling);
+classic_reader_t* classic_reader_new_from_file_scaled (const char *image_filename, tiling_t *tiling,
+						      unsigned int min_width, unsigned int min_height);
 classic_reader_t* classic_reader_new_from_bitmap (bitmap_t *bitmap, tiling_t *tiling);
 void classic_reader_free (classic_reader_t *reader);
 
 int utils_manhattan_distance (int x1, int y1, int x2, int y2);
 int utils_flip_multiplier (unsigned int flips);
+/* Must be held around reading expressions, including with
+   lisp_match_string, wherever that can happen in more than one thread,
+   but never while the read can block on a pipe or a socket. */
+void utils_lock_lisp_reader (void);
+void utils_unlock_lisp_reader (void);
+/* Creates a temporary file with a unique name in the directory of
+   filename, for writing a new version of it which is then renamed to
+   filename, and returns it opened for writing.  temp_filename must
+   have room for 7 more characters than filename.  Returns 0 if the
+   file cannot be created. */
+FILE* utils_create_temp_file (const char *filename, char *temp_filename);
+int utils_lisp_match_string (const char *pattern_string, lisp_object_t *obj, lisp_object_t **vars);
 
 void color_rgb_to_yiq (unsigned char *yiq, unsigned char *rgb);
 void color_rgb_to_hsv (unsigned char *hsv, unsigned char *rgb);
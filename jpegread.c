@@ -0,0 +1,507 @@
+/*
+ * jpegread.c
+ *
+ * metapixel
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <math.h>
+#include <assert.h>
+
+#ifdef RWIMG_JPEG
+#include <jpeglib.h>
+#endif
+
+#include "api.h"
+
+/* rwimg always decodes JPEG files at full size.  Most of the time we
+   need much less than that, and libjpeg can skip most of the work for
+   the DCT coefficients we don't need if it decodes at 1/2, 1/4 or 1/8
+   of the size, so we do it ourselves. */
+
+#ifdef RWIMG_JPEG
+#define THUMBNAIL_MAX_ASPECT_RATIO_ERROR	0.02
+
+struct _jpeg_decoder_t
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+    FILE *file;			/* 0 if decoding from memory */
+    unsigned char *data;	/* owned by the decoder */
+};
+
+static void
+error_exit (j_common_ptr cinfo)
+{
+    jpeg_decoder_t *decoder = (jpeg_decoder_t*)cinfo->client_data;
+
+    longjmp(decoder->setjmp_buffer, 1);
+}
+
+static void
+output_message (j_common_ptr cinfo)
+{
+    /* warnings about corrupt data are not interesting */
+}
+
+static int
+is_jpeg_file (FILE *file)
+{
+    unsigned char magic[2];
+
+    if (fread(magic, 1, 2, file) != 2)
+	return 0;
+    rewind(file);
+
+    return magic[0] == 0xff && magic[1] == 0xd8;
+}
+
+static void
+free_decoder (jpeg_decoder_t *decoder)
+{
+    jpeg_destroy_decompress(&decoder->cinfo);
+    if (decoder->file != 0)
+	fclose(decoder->file);
+    if (decoder->data != 0)
+	free(decoder->data);
+    free(decoder);
+}
+
+/* Decodes either from the file or from the data, taking ownership of
+   both. */
+static jpeg_reader_t*
+open_reader (FILE *file, unsigned char *data, unsigned long size,
+	     unsigned int min_width, unsigned int min_height)
+{
+    jpeg_decoder_t *decoder;
+    jpeg_reader_t *reader;
+    int denom;
+
+    decoder = (jpeg_decoder_t*)malloc(sizeof(jpeg_decoder_t));
+    assert(decoder != 0);
+
+    decoder->file = file;
+    decoder->data = data;
+    decoder->cinfo.err = jpeg_std_error(&decoder->pub);
+    decoder->pub.error_exit = error_exit;
+    decoder->pub.output_message = output_message;
+    decoder->cinfo.client_data = decoder;
+
+    if (setjmp(decoder->setjmp_buffer))
+    {
+	free_decoder(decoder);
+	return 0;
+    }
+
+    jpeg_create_decompress(&decoder->cinfo);
+    if (file != 0)
+	jpeg_stdio_src(&decoder->cinfo, file);
+    else
+	jpeg_mem_src(&decoder->cinfo, data, size);
+    jpeg_read_header(&decoder->cinfo, TRUE);
+
+    /* we leave the rest to rwimg */
+    if (decoder->cinfo.jpeg_color_space == JCS_CMYK || decoder->cinfo.jpeg_color_space == JCS_YCCK)
+    {
+	free_decoder(decoder);
+	return 0;
+    }
+
+    /* the smallest reduction which still gives us enough pixels */
+    for (denom = 8; denom > 1; denom /= 2)
+	if ((decoder->cinfo.image_width + denom - 1) / denom >= min_width
+	    && (decoder->cinfo.image_height + denom - 1) / denom >= min_height)
+	    break;
+
+    decoder->cinfo.scale_num = 1;
+    decoder->cinfo.scale_denom = denom;
+    decoder->cinfo.out_color_space = JCS_RGB;
+    decoder->cinfo.dct_method = JDCT_ISLOW;
+    /* At 1/8 every block becomes a single pixel computed from its DC
+       coefficient alone, without an IDCT.  Smoothing the chroma on
+       top of that isn't worth its cost. */
+    if (denom == 8)
+	decoder->cinfo.do_fancy_upsampling = FALSE;
+
+    jpeg_start_decompress(&decoder->cinfo);
+
+    assert(decoder->cinfo.output_components == NUM_CHANNELS);
+
+    reader = (jpeg_reader_t*)malloc(sizeof(jpeg_reader_t));
+    assert(reader != 0);
+
+    reader->width = decoder->cinfo.output_width;
+    reader->height = decoder->cinfo.output_height;
+    reader->full_width = decoder->cinfo.image_width;
+    reader->full_height = decoder->cinfo.image_height;
+    reader->decoder = decoder;
+
+    return reader;
+}
+
+jpeg_reader_t*
+jpeg_reader_open (const char *filename, unsigned int min_width, unsigned int min_height)
+{
+    FILE *file = fopen(filename, "rb");
+
+    if (file == 0)
+	return 0;
+
+    if (!is_jpeg_file(file))
+    {
+	fclose(file);
+	return 0;
+    }
+
+    return open_reader(file, 0, 0, min_width, min_height);
+}
+
+static unsigned int
+get_16 (const unsigned char *p, int big_endian)
+{
+    if (big_endian)
+	return (p[0] << 8) | p[1];
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned int
+get_32 (const unsigned char *p, int big_endian)
+{
+    if (big_endian)
+	return ((unsigned int)get_16(p, 1) << 16) | get_16(p + 2, 1);
+    return get_16(p, 0) | ((unsigned int)get_16(p + 2, 0) << 16);
+}
+
+/* Finds the thumbnail in the TIFF structure of EXIF data.  It is
+   referred to by the second IFD. */
+static int
+find_exif_thumbnail (const unsigned char *tiff, unsigned long size,
+		     unsigned long *thumbnail_offset, unsigned long *thumbnail_size)
+{
+    unsigned long ifd, num_entries, i;
+    unsigned long offset = 0, length = 0;
+    int big_endian;
+
+    if (size < 8)
+	return 0;
+
+    if (tiff[0] == 'M' && tiff[1] == 'M')
+	big_endian = 1;
+    else if (tiff[0] == 'I' && tiff[1] == 'I')
+	big_endian = 0;
+    else
+	return 0;
+
+    /* skip the first IFD */
+    ifd = get_32(tiff + 4, big_endian);
+    /* the entry count and the next IFD pointer must fit */
+    if (ifd > size - 6)
+	return 0;
+    num_entries = get_16(tiff + ifd, big_endian);
+    if (num_entries * 12 > size - ifd - 6)
+	return 0;
+    ifd = get_32(tiff + ifd + 2 + num_entries * 12, big_endian);
+    if (ifd == 0 || ifd > size - 2)
+	return 0;
+
+    num_entries = get_16(tiff + ifd, big_endian);
+    if (num_entries * 12 > size - ifd - 2)
+	return 0;
+
+    for (i = 0; i < num_entries; ++i)
+    {
+	const unsigned char *entry = tiff + ifd + 2 + i * 12;
+	unsigned int tag = get_16(entry, big_endian);
+
+	/* JPEGInterchangeFormat and JPEGInterchangeFormatLength */
+	if (tag == 0x0201)
+	    offset = get_32(entry + 8, big_endian);
+	else if (tag == 0x0202)
+	    length = get_32(entry + 8, big_endian);
+    }
+
+    if (offset == 0 || length == 0 || offset > size || length > size - offset)
+	return 0;
+
+    *thumbnail_offset = offset;
+    *thumbnail_size = length;
+
+    return 1;
+}
+
+/* Reads only the markers up to the frame header, skipping the data
+   of all but the EXIF segment.  Returns the thumbnail, which must be
+   freed, or 0 if there is none. */
+static unsigned char*
+read_exif_thumbnail (FILE *file, unsigned long *thumbnail_size,
+		     unsigned int *full_width, unsigned int *full_height)
+{
+    unsigned char *thumbnail = 0;
+    unsigned char header[4];
+
+    if (fread(header, 1, 2, file) != 2 || header[0] != 0xff || header[1] != 0xd8)
+	return 0;
+
+    for (;;)
+    {
+	unsigned int marker, length;
+	int c;
+
+	/* markers may be padded with any number of 0xff */
+	c = getc(file);
+	if (c != 0xff)
+	    break;
+	while ((c = getc(file)) == 0xff)
+	    ;
+	if (c == EOF)
+	    break;
+	marker = c;
+
+	/* these have no length */
+	if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7))
+	    continue;
+	/* end of image or start of scan */
+	if (marker == 0xd9 || marker == 0xda)
+	    break;
+
+	if (fread(header, 1, 2, file) != 2)
+	    break;
+	length = get_16(header, 1);
+	if (length < 2)
+	    break;
+	length -= 2;
+
+	/* a frame header, except DHT, JPG and DAC */
+	if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+	{
+	    unsigned char frame[5];
+
+	    if (length < 5 || fread(frame, 1, 5, file) != 5)
+		break;
+
+	    *full_height = get_16(frame + 1, 1);
+	    *full_width = get_16(frame + 3, 1);
+
+	    if (thumbnail != 0 && *full_width > 0 && *full_height > 0)
+		return thumbnail;
+	    break;
+	}
+
+	if (marker == 0xe1 && thumbnail == 0 && length > 6)
+	{
+	    unsigned char *segment = (unsigned char*)malloc(length);
+	    unsigned long offset;
+
+	    assert(segment != 0);
+
+	    if (fread(segment, 1, length, file) != length)
+	    {
+		free(segment);
+		break;
+	    }
+
+	    if (memcmp(segment, "Exif\0\0", 6) == 0
+		&& find_exif_thumbnail(segment + 6, length - 6, &offset, thumbnail_size))
+	    {
+		thumbnail = (unsigned char*)malloc(*thumbnail_size);
+		assert(thumbnail != 0);
+
+		memcpy(thumbnail, segment + 6 + offset, *thumbnail_size);
+	    }
+
+	    free(segment);
+	}
+	else if (fseek(file, length, SEEK_CUR) != 0)
+	    break;
+    }
+
+    if (thumbnail != 0)
+	free(thumbnail);
+
+    return 0;
+}
+
+bitmap_t*
+bitmap_read_thumbnail (const char *filename, unsigned int min_width, unsigned int min_height,
+		       unsigned int *full_width, unsigned int *full_height)
+{
+    FILE *file = fopen(filename, "rb");
+    unsigned char *thumbnail, *data;
+    unsigned long thumbnail_size;
+    jpeg_reader_t *reader;
+    bitmap_t *bitmap;
+    float aspect_ratio, thumbnail_aspect_ratio;
+
+    if (file == 0)
+	return 0;
+
+    thumbnail = read_exif_thumbnail(file, &thumbnail_size, full_width, full_height);
+    fclose(file);
+
+    if (thumbnail == 0)
+	return 0;
+
+    reader = open_reader(0, thumbnail, thumbnail_size, min_width, min_height);
+    if (reader == 0)
+	return 0;
+
+    /* Thumbnails of images with a different aspect ratio are often
+       padded with black bars. */
+    aspect_ratio = (float)*full_width / (float)*full_height;
+    thumbnail_aspect_ratio = (float)reader->full_width / (float)reader->full_height;
+    if (reader->width < min_width || reader->height < min_height
+	|| fabs(thumbnail_aspect_ratio / aspect_ratio - 1.0) > THUMBNAIL_MAX_ASPECT_RATIO_ERROR)
+    {
+	jpeg_reader_free(reader);
+	return 0;
+    }
+
+    data = (unsigned char*)malloc((size_t)reader->width * reader->height * NUM_CHANNELS);
+    assert(data != 0);
+
+    if (!jpeg_reader_read_lines(reader, data, reader->height))
+    {
+	free(data);
+	jpeg_reader_free(reader);
+	return 0;
+    }
+
+    bitmap = bitmap_new_packed(COLOR_RGB_8, reader->width, reader->height, data);
+    assert(bitmap != 0);
+
+    jpeg_reader_free(reader);
+
+    return bitmap;
+}
+
+int
+jpeg_reader_read_lines (jpeg_reader_t *reader, unsigned char *lines, unsigned int num_lines)
+{
+    jpeg_decoder_t *decoder = reader->decoder;
+    unsigned int row_stride = reader->width * NUM_CHANNELS;
+    unsigned int i = 0;
+
+    if (setjmp(decoder->setjmp_buffer))
+    {
+	/* keep whatever garbage was there */
+	return 0;
+    }
+
+    while (i < num_lines && decoder->cinfo.output_scanline < decoder->cinfo.output_height)
+    {
+	JSAMPROW row = lines + i * row_stride;
+
+	i += jpeg_read_scanlines(&decoder->cinfo, &row, 1);
+    }
+
+    return i == num_lines;
+}
+
+void
+jpeg_reader_free (jpeg_reader_t *reader)
+{
+    jpeg_decoder_t *decoder = reader->decoder;
+
+    /* jpeg_finish_decompress would complain about unread lines */
+    if (!setjmp(decoder->setjmp_buffer))
+	jpeg_abort_decompress(&decoder->cinfo);
+
+    free_decoder(decoder);
+    free(reader);
+}
+#else
+jpeg_reader_t*
+jpeg_reader_open (const char *filename, unsigned int min_width, unsigned int min_height)
+{
+    return 0;
+}
+
+int
+jpeg_reader_read_lines (jpeg_reader_t *reader, unsigned char *lines, unsigned int num_lines)
+{
+    assert(0);
+    return 0;
+}
+
+void
+jpeg_reader_free (jpeg_reader_t *reader)
+{
+    assert(0);
+}
+
+bitmap_t*
+bitmap_read_thumbnail (const char *filename, unsigned int min_width, unsigned int min_height,
+		       unsigned int *full_width, unsigned int *full_height)
+{
+    return 0;
+}
+#endif
+
+static bitmap_t*
+read_full_size (const char *filename, unsigned int *full_width, unsigned int *full_height)
+{
+    bitmap_t *bitmap = bitmap_read(filename);
+
+    if (bitmap != 0)
+    {
+	*full_width = bitmap->width;
+	*full_height = bitmap->height;
+    }
+
+    return bitmap;
+}
+
+bitmap_t*
+bitmap_read_scaled (const char *filename, unsigned int min_width, unsigned int min_height,
+		    unsigned int *full_width, unsigned int *full_height)
+{
+    jpeg_reader_t *reader = jpeg_reader_open(filename, min_width, min_height);
+    unsigned char *data;
+    bitmap_t *bitmap;
+
+    if (reader == 0)
+	return read_full_size(filename, full_width, full_height);
+
+    data = (unsigned char*)malloc((size_t)reader->width * reader->height * NUM_CHANNELS);
+    assert(data != 0);
+
+    if (!jpeg_reader_read_lines(reader, data, reader->height))
+    {
+	free(data);
+	jpeg_reader_free(reader);
+
+	/* rwimg might be more forgiving */
+	return read_full_size(filename, full_width, full_height);
+    }
+
+    bitmap = bitmap_new_packed(COLOR_RGB_8, reader->width, reader->height, data);
+    assert(bitmap != 0);
+
+    *full_width = reader->full_width;
+    *full_height = reader->full_height;
+
+    jpeg_reader_free(reader);
+
+    return bitmap;
+}
@@ -22,28 +22,180 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include <assert.h>
 
 #include "lispreader/lispreader.h"
 
 #include "api.h"
 
+/* in metapixels */
+#define METAPIXEL_SLAB_SIZE	1024
+/* in bytes */
+#define STRING_AREA_SIZE	(64 * 1024)
+#define TABLES_CHUNK_MIN_SIZE	(1024 * 1024)
+
+char*
+library_filename (const char *path, const char *name)
+{
+    char *filename = (char*)malloc(strlen(path) + 1 + strlen(name) + 1);
+
+    assert(filename != 0);
+
+    strcpy(filename, path);
+    strcat(filename, "/");
+    strcat(filename, name);
+
+    return filename;
+}
+
 static char*
 tables_filename (const char *path)
 {
-    char *name = (char*)malloc(strlen(path) + 1 + strlen(TABLES_FILENAME) + 1);
+    return library_filename(path, TABLES_FILENAME);
+}
+
+int
+library_stat_tables (library_t *library, struct stat *buf)
+{
+    char *filename = tables_filename(library->path);
+    int result = stat(filename, buf) == 0;
+
+    free(filename);
+
+    return result;
+}
+
+metapixel_t**
+library_metapixels_in_file_order (metapixel_t *first, unsigned int num_metapixels)
+{
+    metapixel_t **pixels = (metapixel_t**)malloc(sizeof(metapixel_t*) * (num_metapixels + 1));
+    unsigned int i = num_metapixels;
+    metapixel_t *pixel;
+
+    assert(pixels != 0);
+
+    for (pixel = first; i > 0; pixel = pixel->next)
+    {
+	assert(pixel != 0);
+	pixels[--i] = pixel;
+    }
+
+    return pixels;
+}
+
+/* The level files of an image are named after it, with the size
+   inserted before the extension, so that they have the same format.
+   The result must be freed. */
+static char*
+level_filename (const char *filename, unsigned int width, unsigned int height)
+{
+    const char *slash = strrchr(filename, '/');
+    const char *dot = strrchr(filename, '.');
+    char *name;
 
+    if (dot == 0 || (slash != 0 && dot < slash))
+	dot = filename + strlen(filename);
+
+    name = (char*)malloc((dot - filename) + 1 + 2 * 10 + 1 + strlen(dot) + 1);
     assert(name != 0);
 
-    strcpy(name, path);
-    strcat(name, "/");
-    strcat(name, TABLES_FILENAME);
+    sprintf(name, "%.*s-%ux%u%s", (int)(dot - filename), filename, width, height, dot);
 
     return name;
 }
 
+/* Checks whether a file exists in the library.  Within a batch we
+   know all the files, so we don't have to ask the file system. */
+static int
+library_file_exists (library_t *library, const char *filename)
+{
+    if (library->batch != 0)
+	return hash_table_lookup(library->batch->filenames, filename + strlen(library->path) + 1) != 0;
+    return access(filename, F_OK) == 0;
+}
+
+/* Checks whether the image file or any of the level files for the
+   metapixel would overwrite an existing file. */
+static int
+metapixel_filenames_taken (library_t *library, metapixel_t *metapixel, const char *filename)
+{
+    unsigned int i;
+
+    if (library_file_exists(library, filename))
+	return 1;
+
+    for (i = 0; i < metapixel->num_levels; ++i)
+    {
+	char *name = level_filename(filename, metapixel->levels[i].width, metapixel->levels[i].height);
+	int taken = library_file_exists(library, name);
+
+	free(name);
+
+	if (taken)
+	    return 1;
+    }
+
+    return 0;
+}
+
+static void
+batch_add_filename (library_batch_t *batch, const char *filename)
+{
+    char *key;
+
+    if (hash_table_lookup(batch->filenames, filename) != 0)
+	return;
+
+    key = strdup(filename);
+    assert(key != 0);
+
+    hash_table_insert(batch->filenames, key, key);
+}
+
+/* Remembers the files of a metapixel added in the batch, and where
+   to continue looking for a free name the next time an image with
+   the same name is added. */
+static void
+batch_add_metapixel_filenames (library_t *library, metapixel_t *metapixel,
+			       const char *filename, int next_suffix)
+{
+    library_batch_t *batch = library->batch;
+    size_t path_length = strlen(library->path) + 1;
+    library_batch_suffix_t *suffix;
+    unsigned int i;
+
+    batch_add_filename(batch, filename + path_length);
+
+    for (i = 0; i < metapixel->num_levels; ++i)
+    {
+	char *level_name = level_filename(filename, metapixel->levels[i].width, metapixel->levels[i].height);
+
+	batch_add_filename(batch, level_name + path_length);
+	free(level_name);
+    }
+
+    if (next_suffix > 0)
+    {
+	suffix = (library_batch_suffix_t*)hash_table_lookup(batch->next_suffixes, metapixel->name);
+	if (suffix == 0)
+	{
+	    suffix = (library_batch_suffix_t*)malloc(sizeof(library_batch_suffix_t) + strlen(metapixel->name));
+	    assert(suffix != 0);
+
+	    strcpy(suffix->name, metapixel->name);
+	    hash_table_insert(batch->next_suffixes, suffix->name, suffix);
+	}
+
+	suffix->next = next_suffix;
+    }
+}
+
 static library_t*
 make_library (const char *path)
 {
@@ -54,44 +206,101 @@ make_library (const char *path)
     library->path = strdup(path);
     assert(library->path != 0);
 
+    library->atlas = atlas_open(path);
+    library->binary_tables = 0;
+    library->batch = 0;
+    library->duplicate_index = 0;
+    feature_store_init(&library->features);
+    arena_init(&library->metapixel_slab, METAPIXEL_SLAB_SIZE * sizeof(metapixel_t));
+    arena_init(&library->strings, STRING_AREA_SIZE);
+
     library->metapixels = 0;
     library->num_metapixels = 0;
 
+    library->tables_size = 0;
+    library->tables_device = -1;
+    library->tables_inode = -1;
+
+    library->snapshot_of = 0;
+    pthread_mutex_init(&library->snapshot_mutex, 0);
+    library->current_snapshot = 0;
+    library->snapshots = 0;
+    library->epoch = 0;
+    library->next_snapshot = 0;
+    library->num_references = 0;
+
     return library;
 }
 
+/* Metapixels in a library, their names, filenames and levels are in
+   the arenas of the library, except for the ones in the binary tables,
+   so they are never freed individually. */
+static metapixel_level_t*
+new_library_levels (library_t *library, unsigned int num_levels)
+{
+    return (metapixel_level_t*)arena_alloc(&library->metapixel_slab, sizeof(metapixel_level_t) * num_levels);
+}
+
 static metapixel_t*
 copy_metapixel_for_library (metapixel_t *metapixel, library_t *library, const char *filename)
 {
-    metapixel_t *copy = (metapixel_t*)malloc(sizeof(metapixel_t));
-
-    assert(copy != 0);
+    metapixel_t *copy = (metapixel_t*)arena_alloc(&library->metapixel_slab, sizeof(metapixel_t));
 
     memcpy(copy, metapixel, sizeof(metapixel_t));
 
     copy->library = library;
-    copy->name = strdup(metapixel->name);
-    copy->filename = strdup(filename);
-    assert(copy->filename != 0);
+    copy->name = arena_strdup(&library->strings, metapixel->name);
+    copy->filename = arena_strdup(&library->strings, filename);
     copy->bitmap = 0;
+    copy->atlas_offset = -1;
+    copy->num_levels = 0;
+    copy->levels = 0;
     copy->next = 0;
 
     return copy;
 }
 
+/* Only the bitmaps cached in the metapixels, for example when
+   benchmarking rendering, are not in the arenas. */
 static void
-free_metapixels (metapixel_t *metapixel)
+free_metapixel_bitmaps (metapixel_t *metapixel)
 {
-    while (metapixel != 0)
-    {
-	metapixel_t *next = metapixel->next;
+    unsigned int i;
 
-	metapixel_free(metapixel);
+    if (metapixel->bitmap != 0)
+	bitmap_free(metapixel->bitmap);
+    metapixel->bitmap = 0;
 
-	metapixel = next;
+    for (i = 0; i < metapixel->num_levels; ++i)
+    {
+	if (metapixel->levels[i].bitmap != 0)
+	    bitmap_free(metapixel->levels[i].bitmap);
+	metapixel->levels[i].bitmap = 0;
     }
 }
 
+static void
+free_metapixels (library_t *library)
+{
+    metapixel_t *pixel;
+
+    for (pixel = library->metapixels; pixel != 0; pixel = pixel->next)
+	free_metapixel_bitmaps(pixel);
+
+    arena_free(&library->metapixel_slab);
+    arena_free(&library->strings);
+    if (library->binary_tables != 0)
+	binary_tables_free(library->binary_tables);
+    if (library->duplicate_index != 0)
+	duplicate_index_free(library->duplicate_index);
+    feature_store_clear(&library->features);
+
+    library->metapixels = 0;
+    library->num_metapixels = 0;
+    library->binary_tables = 0;
+    library->duplicate_index = 0;
+}
+
 static void
 write_metapixel_metadata (metapixel_t *metapixel, FILE *out)
 {
@@ -138,269 +347,1032 @@ write_metapixel_metadata (metapixel_t *metapixel, FILE *out)
 	    lisp_print_integer(metapixel->anti_x, out);
 	    lisp_print_integer(metapixel->anti_y, out);
 	lisp_print_close_paren(out);
+
+	if (metapixel->atlas_offset >= 0)
+	{
+	    lisp_print_open_paren(out);
+		lisp_print_symbol("atlas", out);
+		lisp_print_integer(metapixel->atlas_offset, out);
+	    lisp_print_close_paren(out);
+	}
+
+	if (metapixel->num_levels > 0)
+	{
+	    unsigned int i;
+
+	    lisp_print_open_paren(out);
+		lisp_print_symbol("levels", out);
+		for (i = 0; i < metapixel->num_levels; ++i)
+		{
+		    lisp_print_open_paren(out);
+			lisp_print_integer(metapixel->levels[i].width, out);
+			lisp_print_integer(metapixel->levels[i].height, out);
+			if (metapixel->levels[i].atlas_offset >= 0)
+			    lisp_print_integer(metapixel->levels[i].atlas_offset, out);
+			else
+			    lisp_print_string(metapixel->levels[i].filename, out);
+		    lisp_print_close_paren(out);
+		}
+	    lisp_print_close_paren(out);
+	}
     lisp_print_close_paren(out);
     fputs("\n", out);
 }
 
-static int
-read_tables (const char *library_dir, library_t *library)
+/* The tables file is read in chunks of whole lines, each by its own
+   task, with its own arenas, which are handed to the library once all
+   chunks are read. */
+typedef struct
 {
-    lisp_object_t *pattern;
-    lisp_object_t *obj;
-    lisp_stream_t stream;
-    int num_subs;
-    pools_t pools;
-    allocator_t allocator;
-    char *tables_name;
-    int retval = 1;
-
-    assert(library != 0);
-    assert(library->metapixels == 0);
+    library_t *library;
 
-    tables_name = tables_filename(library_dir);
-    if (lisp_stream_init_path(&stream, tables_name) == 0)
-    {
-	error_info_t info = error_make_string_info(tables_name);
+    char *text;			/* zero-terminated */
 
-	free(tables_name);
+    arena_t metapixel_slab;
+    arena_t strings;
+    /* in reverse order of the file, like the library's list */
+    metapixel_t *first, *last;
+    unsigned int num_metapixels;
 
-	error_report(ERROR_TABLES_FILE_CANNOT_OPEN, info);
+    /* 0 if the chunk could be read */
+    int error_code;
+    char *error_string;
+} tables_chunk_t;
 
-	return 0;
-    }
-    free(tables_name);
+static void
+set_chunk_error (tables_chunk_t *chunk, int error_code, const char *string)
+{
+    chunk->error_code = error_code;
+    chunk->error_string = strdup(string);
+    assert(chunk->error_string != 0);
+}
 
-    pattern = lisp_read_from_string("(small-image #?(string) #?(string)"
-				    "  (size #?(integer) #?(integer) #?(real))"
-				    "  (flip #?(boolean) #?(boolean))"
-				    "  (subpixel (r . #?(list)) (g . #?(list)) (b . #?(list)))"
-				    "  (anti #?(integer) #?(integer)))");
-    assert(pattern != 0
-	   && lisp_type(pattern) != LISP_TYPE_EOF
-	   && lisp_type(pattern) != LISP_TYPE_PARSE_ERROR);
-    assert(lisp_compile_pattern(&pattern, &num_subs));
-    assert(num_subs == 12);
+/* The tokenizer of the lispreader can only be used by one thread at a
+   time, so the entries, which write_metapixel_metadata writes, are
+   scanned directly instead.  Whitespace and comments are allowed
+   between tokens, as they are for the lispreader. */
+typedef struct
+{
+    const char *p;
+    /* ERROR_TABLES_PARSE_ERROR if a token is malformed or the text ends
+       early, ERROR_TABLES_SYNTAX_ERROR if the tokens don't make an entry */
+    int error_code;
+} tables_scanner_t;
 
-    init_pools(&pools);
-    init_pools_allocator(&allocator, &pools);
+static int
+scan_fail (tables_scanner_t *scanner, int error_code)
+{
+    if (scanner->error_code == 0)
+	scanner->error_code = *scanner->p == '\0' ? ERROR_TABLES_PARSE_ERROR : error_code;
+    return 0;
+}
 
+static void
+scan_space (tables_scanner_t *scanner)
+{
     for (;;)
     {
-        int type;
-
-	reset_pools(&pools);
-        obj = lisp_read_with_allocator(&allocator, &stream);
-        type = lisp_type(obj);
-        if (type != LISP_TYPE_EOF && type != LISP_TYPE_PARSE_ERROR)
-        {
-            lisp_object_t *vars[12];
-
-            if (lisp_match_pattern(pattern, obj, vars, num_subs))
-	    {
-		metapixel_t *pixel;
-		lisp_object_t *lst;
-		int channel, i;
+	if (isspace((unsigned char)*scanner->p))
+	    ++scanner->p;
+	else if (*scanner->p == ';')
+	{
+	    while (*scanner->p != '\0' && *scanner->p != '\n')
+		++scanner->p;
+	}
+	else
+	    break;
+    }
+}
 
-		pixel = metapixel_new(lisp_string(vars[0]), lisp_integer(vars[2]), lisp_integer(vars[3]),
-				      lisp_real(vars[4]));
-		assert(pixel != 0);
+static int
+is_delimiter (char c)
+{
+    return c == '\0' || isspace((unsigned char)c) || c == '(' || c == ')' || c == '"' || c == ';';
+}
 
-		pixel->filename = strdup(lisp_string(vars[1]));
-		assert(pixel->filename != 0);
+/* Returns the next character which is not whitespace, without
+   consuming it. */
+static char
+scan_peek (tables_scanner_t *scanner)
+{
+    scan_space(scanner);
+    return *scanner->p;
+}
 
-		pixel->anti_x = lisp_integer(vars[10]);
-		pixel->anti_y = lisp_integer(vars[11]);
+static int
+scan_char (tables_scanner_t *scanner, char c)
+{
+    if (scan_peek(scanner) != c)
+	return scan_fail(scanner, ERROR_TABLES_SYNTAX_ERROR);
+    ++scanner->p;
+    return 1;
+}
 
-		if (lisp_boolean(vars[5]))
-		    pixel->flip |= FLIP_HOR;
-		if (lisp_boolean(vars[6]))
-		    pixel->flip |= FLIP_VER;
+/* Consumes the symbol if it is next.  Doesn't fail otherwise. */
+static int
+scan_is_symbol (tables_scanner_t *scanner, const char *symbol)
+{
+    size_t length = strlen(symbol);
 
-		pixel->library = library;
+    scan_space(scanner);
+    if (strncmp(scanner->p, symbol, length) != 0 || !is_delimiter(scanner->p[length]))
+	return 0;
+    scanner->p += length;
+    return 1;
+}
 
-		pixel->next = library->metapixels;
-		library->metapixels = pixel;
+/* Scans the open parenthesis and the symbol of a list. */
+static int
+scan_open (tables_scanner_t *scanner, const char *symbol)
+{
+    if (!scan_char(scanner, '('))
+	return 0;
+    if (!scan_is_symbol(scanner, symbol))
+	return scan_fail(scanner, ERROR_TABLES_SYNTAX_ERROR);
+    return 1;
+}
 
-		++library->num_metapixels;
+static int
+scan_integer (tables_scanner_t *scanner, int *value)
+{
+    const char *p;
+    char *end;
+
+    scan_space(scanner);
+    p = scanner->p;
+    if (*p == '-' || *p == '+')
+	++p;
+    if (!isdigit((unsigned char)*p))
+	return scan_fail(scanner, ERROR_TABLES_SYNTAX_ERROR);
+
+    *value = (int)strtol(scanner->p, &end, 10);
+    if (!is_delimiter(*end))
+	return scan_fail(scanner, ERROR_TABLES_SYNTAX_ERROR);
+    scanner->p = end;
+    return 1;
+}
 
-		for (channel = 0; channel < NUM_CHANNELS; ++channel)
-		{
-		    lst = vars[7 + channel];
+static int
+scan_real (tables_scanner_t *scanner, float *value)
+{
+    const char *p;
+    char *end;
+
+    scan_space(scanner);
+    p = scanner->p;
+    if (*p == '-' || *p == '+')
+	++p;
+    if (!isdigit((unsigned char)*p) && *p != '.')
+	return scan_fail(scanner, ERROR_TABLES_SYNTAX_ERROR);
+
+    *value = strtod(scanner->p, &end);
+    if (end == scanner->p || !is_delimiter(*end))
+	return scan_fail(scanner, ERROR_TABLES_SYNTAX_ERROR);
+    scanner->p = end;
+    return 1;
+}
 
-		    if (lisp_list_length(lst) != NUM_SUBPIXELS)
-		    {
-			error_info_t info = error_make_string_info(pixel->filename);
+static int
+scan_boolean (tables_scanner_t *scanner, int *value)
+{
+    if (scan_is_symbol(scanner, "#t"))
+	*value = 1;
+    else if (scan_is_symbol(scanner, "#f"))
+	*value = 0;
+    else
+	return scan_fail(scanner, ERROR_TABLES_SYNTAX_ERROR);
+    return 1;
+}
 
-			lisp_stream_free_path(&stream);
-			free_pools(&pools);
+/* Scans a string, in which a backslash escapes the character after it,
+   into the arena, if that's not 0. */
+static int
+scan_string (tables_scanner_t *scanner, arena_t *arena, char **string)
+{
+    const char *p;
+    size_t length = 0;
+    char *q;
 
-			error_report(ERROR_WRONG_NUM_SUBPIXELS, info);
+    if (!scan_char(scanner, '"'))
+	return 0;
 
-			return 0;
-		    }
-		    else
-			for (i = 0; i < NUM_SUBPIXELS; ++i)
-			{
-			    pixel->subpixels_rgb[i * NUM_CHANNELS + channel] = lisp_integer(lisp_car(lst));
-			    lst = lisp_cdr(lst);
-			}
-		}
+    for (p = scanner->p; *p != '"'; ++p, ++length)
+    {
+	if (*p == '\\')
+	    ++p;
+	if (*p == '\0')
+	{
+	    scanner->p = p;
+	    return scan_fail(scanner, ERROR_TABLES_PARSE_ERROR);
+	}
+    }
 
-		metapixel_complete_subpixel(pixel);
+    if (arena != 0)
+    {
+	*string = q = (char*)arena_alloc(arena, length + 1);
+	for (p = scanner->p; *p != '"'; ++p)
+	{
+	    if (*p == '\\')
+		++p;
+	    *q++ = *p;
+	}
+	*q = '\0';
+    }
 
-		/*
-		pixel->data = 0;
-		pixel->collage_positions = 0;
-		*/
-	    }
-	    else
-	    {
-		lisp_stream_free_path(&stream);
-		free_pools(&pools);
+    scanner->p = p + 1;
+    return 1;
+}
 
-		error_report(ERROR_TABLES_SYNTAX_ERROR, error_make_string_info(library_dir));
+/* Scans the elements of a levels list, up to and including its closing
+   parenthesis, into levels, if that's not 0.  Returns the number of
+   levels, or -1 if they are malformed. */
+static int
+scan_levels (tables_chunk_t *chunk, tables_scanner_t *scanner, metapixel_level_t *levels)
+{
+    int num_levels = 0;
 
-		return 0;
-	    }
-        }
-        else if (type == LISP_TYPE_PARSE_ERROR)
+    while (scan_peek(scanner) == '(')
+    {
+	metapixel_level_t level;
+	int width, height;
+
+	++scanner->p;
+	if (!scan_integer(scanner, &width)
+	    || !scan_integer(scanner, &height))
+	    return -1;
+	level.width = width;
+	level.height = height;
+
+	/* a level is either in a file or in the atlas */
+	if (scan_peek(scanner) == '"')
+	{
+	    if (!scan_string(scanner, levels != 0 ? &chunk->strings : 0, &level.filename))
+		return -1;
+	    level.atlas_offset = -1;
+	}
+	else
 	{
-	    lisp_stream_free_path(&stream);
-	    free_pools(&pools);
+	    if (!scan_integer(scanner, &level.atlas_offset))
+		return -1;
+	    level.filename = 0;
+	}
 
-	    error_report(ERROR_TABLES_PARSE_ERROR, error_make_string_info(library_dir));
+	if (!scan_char(scanner, ')'))
+	    return -1;
 
-	    return 0;
-	}
+	level.bitmap = 0;
 
-        if (type == LISP_TYPE_EOF)
-            break;
+	if (levels != 0)
+	    levels[num_levels] = level;
+	++num_levels;
     }
 
-    lisp_stream_free_path(&stream);
-    free_pools(&pools);
+    if (!scan_char(scanner, ')'))
+	return -1;
 
-    return retval;
+    return num_levels;
 }
 
-library_t*
-library_new (const char *path)
+/* Scans the optional elements at the end of a small-image entry, up to
+   and including its closing parenthesis. */
+static int
+scan_extras (tables_chunk_t *chunk, tables_scanner_t *scanner, metapixel_t *pixel)
 {
-    char *filename = tables_filename(path);
-    int fd;
+    while (scan_peek(scanner) == '(')
+    {
+	++scanner->p;
 
-    assert(filename != 0);
+	if (scan_is_symbol(scanner, "levels"))
+	{
+	    tables_scanner_t counter = *scanner;
+	    int num_levels = scan_levels(chunk, &counter, 0);
 
-    if (access(filename, F_OK) == 0)
-    {
-	error_info_t info = error_make_string_info(filename);
+	    if (num_levels < 0)
+	    {
+		scanner->error_code = counter.error_code;
+		return 0;
+	    }
+	    if (num_levels == 0 || pixel->num_levels != 0)
+		return scan_fail(scanner, ERROR_TABLES_SYNTAX_ERROR);
 
-	free(filename);
+	    pixel->levels = (metapixel_level_t*)arena_alloc(&chunk->metapixel_slab, sizeof(metapixel_level_t) * num_levels);
+	    pixel->num_levels = num_levels;
+	    if (scan_levels(chunk, scanner, pixel->levels) != num_levels)
+		return 0;
+	}
+	else if (scan_is_symbol(scanner, "atlas"))
+	{
+	    if (!scan_integer(scanner, &pixel->atlas_offset)
+		|| !scan_char(scanner, ')'))
+		return 0;
+	    if (pixel->library->atlas == 0 || pixel->atlas_offset < 0)
+		return scan_fail(scanner, ERROR_TABLES_SYNTAX_ERROR);
+	}
+	else
+	    return scan_fail(scanner, ERROR_TABLES_SYNTAX_ERROR);
+    }
 
-	error_report(ERROR_TABLES_FILE_EXISTS, info);
+    return scan_char(scanner, ')');
+}
 
+/* Scans a small-image entry into pixel.  Returns 0 on failure, with
+   the error in the scanner or the chunk. */
+static int
+scan_metapixel (tables_chunk_t *chunk, tables_scanner_t *scanner, metapixel_t *pixel)
+{
+    static const char *channel_names[] = { "r", "g", "b" };
+
+    int width, height;
+    int flip_hor, flip_ver;
+    int channel;
+
+    if (!scan_open(scanner, "small-image")
+	|| !scan_string(scanner, &chunk->strings, &pixel->name)
+	|| !scan_string(scanner, &chunk->strings, &pixel->filename)
+	|| !scan_open(scanner, "size")
+	|| !scan_integer(scanner, &width)
+	|| !scan_integer(scanner, &height)
+	|| !scan_real(scanner, &pixel->aspect_ratio)
+	|| !scan_char(scanner, ')')
+	|| !scan_open(scanner, "flip")
+	|| !scan_boolean(scanner, &flip_hor)
+	|| !scan_boolean(scanner, &flip_ver)
+	|| !scan_char(scanner, ')')
+	|| !scan_open(scanner, "subpixel"))
 	return 0;
-    }
 
-    fd = open(filename, O_RDWR | O_CREAT, 0666);
+    pixel->width = width;
+    pixel->height = height;
+    if (flip_hor)
+	pixel->flip |= FLIP_HOR;
+    if (flip_ver)
+	pixel->flip |= FLIP_VER;
 
-    if (fd == -1)
+    for (channel = 0; channel < NUM_CHANNELS; ++channel)
     {
-	error_info_t info = error_make_string_info(filename);
+	int i;
 
-	free(filename);
+	if (!scan_open(scanner, channel_names[channel]))
+	    return 0;
 
-	error_report(ERROR_TABLES_FILE_CANNOT_CREATE, info);
+	for (i = 0; scan_peek(scanner) != ')'; ++i)
+	{
+	    int value;
 
-	return 0;
-    }
+	    if (!scan_integer(scanner, &value))
+		return 0;
+	    if (i < NUM_SUBPIXELS)
+		pixel->subpixels_rgb[i * NUM_CHANNELS + channel] = value;
+	}
+	++scanner->p;
 
-    free(filename);
+	if (i != NUM_SUBPIXELS)
+	{
+	    set_chunk_error(chunk, ERROR_WRONG_NUM_SUBPIXELS, pixel->filename);
+	    return 0;
+	}
+    }
 
-    return make_library(path);
+    return scan_char(scanner, ')')
+	&& scan_open(scanner, "anti")
+	&& scan_integer(scanner, &pixel->anti_x)
+	&& scan_integer(scanner, &pixel->anti_y)
+	&& scan_char(scanner, ')')
+	&& scan_extras(chunk, scanner, pixel);
 }
 
-library_t*
-library_open_without_reading (const char *path)
+static void
+read_tables_chunk_task (void *data)
 {
-    char *filename = tables_filename(path);
-    int result;
+    tables_chunk_t *chunk = (tables_chunk_t*)data;
+    library_t *library = chunk->library;
+    tables_scanner_t scanner;
 
-    result = access(filename, R_OK | W_OK);
+    scanner.p = chunk->text;
+    scanner.error_code = 0;
 
-    if (result == 0)
+    while (scan_peek(&scanner) != '\0')
     {
-	free(filename);
+	metapixel_t *pixel;
 
-	return make_library(path);
-    }
-    else
-    {
-	error_info_t info = error_make_string_info(filename);
+	pixel = (metapixel_t*)arena_alloc(&chunk->metapixel_slab, sizeof(metapixel_t));
+	memset(pixel, 0, sizeof(metapixel_t));
 
-	free(filename);
+	pixel->library = library;
+	pixel->enabled = 1;
+	pixel->atlas_offset = -1;
 
-	error_report(ERROR_TABLES_FILE_CANNOT_OPEN, info);
+	if (!scan_metapixel(chunk, &scanner, pixel))
+	{
+	    if (chunk->error_code == 0)
+		set_chunk_error(chunk, scanner.error_code, library->path);
+	    break;
+	}
 
-	return 0;
+	pixel->next = chunk->first;
+	chunk->first = pixel;
+	if (chunk->last == 0)
+	    chunk->last = pixel;
+
+	++chunk->num_metapixels;
     }
 }
 
-library_t*
-library_open (const char *path)
+/* Reads the file from offset to its end, as it is when it's opened,
+   and returns its stat in buf.  Returns 0 if that could not be read,
+   without reporting an error.  The result must be freed. */
+static char*
+read_file_from (const char *filename, off_t offset, size_t *size, struct stat *buf)
 {
-    library_t *library = make_library(path);
+    FILE *file = fopen(filename, "rb");
+    char *text;
 
-    assert(library != 0);
+    if (file == 0)
+	return 0;
 
-    if (!read_tables(path, library))
+    if (fstat(fileno(file), buf) != 0
+	|| buf->st_size < offset
+	|| fseeko(file, offset, SEEK_SET) != 0)
     {
-	free_metapixels(library->metapixels);
-	free(library);
-
+	fclose(file);
 	return 0;
     }
 
-    return library;
-}
+    *size = buf->st_size - offset;
 
-void
-library_close (library_t *library)
-{
-    free_metapixels(library->metapixels);
+    text = (char*)malloc(*size + 1);
+    assert(text != 0);
+
+    if (fread(text, 1, *size, file) != *size)
+    {
+	free(text);
+	fclose(file);
+	return 0;
+    }
+
+    fclose(file);
+
+    text[*size] = '\0';
+
+    return text;
+}
+
+/* Splits the text into at most max_chunks chunks, each of which starts
+   at the beginning of a small-image entry, except for the first.  The
+   newline before each chunk is overwritten with a zero, so that the
+   chunks are zero-terminated.  Returns the number of chunks. */
+static unsigned int
+split_tables_text (char *text, size_t size, char **chunks, unsigned int max_chunks)
+{
+    unsigned int num_chunks = 1;
+    char *p = text;
+    unsigned int i;
+
+    chunks[0] = text;
+
+    for (i = 1; i < max_chunks; ++i)
+    {
+	char *start = text + size / max_chunks * i;
+
+	if (start < p)
+	    continue;
+
+	start = strstr(start, "\n(small-image");
+	if (start == 0)
+	    break;
+
+	*start = '\0';
+	p = start + 1;
+	chunks[num_chunks++] = p;
+    }
+
+    return num_chunks;
+}
+
+/* Parses the tables text, which is changed in the process, into
+   metapixels in the arenas of the library.  They are linked in reverse
+   order of the text, from *first to *last.  Returns 0 on failure,
+   after reporting the error. */
+static int
+parse_tables_text (library_t *library, char *text, size_t size,
+		   metapixel_t **first, metapixel_t **last, unsigned int *num_metapixels)
+{
+    thread_pool_t *pool = thread_pool_get_default();
+    unsigned int max_chunks, num_chunks, i;
+    char **texts;
+    tables_chunk_t *chunks;
+    task_group_t group;
+    int retval = 1;
+
+    /* small files aren't worth the threads */
+    max_chunks = MIN(thread_pool_num_threads(pool) + 1, size / TABLES_CHUNK_MIN_SIZE + 1);
+
+    texts = (char**)malloc(sizeof(char*) * max_chunks);
+    assert(texts != 0);
+    num_chunks = split_tables_text(text, size, texts, max_chunks);
+
+    chunks = (tables_chunk_t*)malloc(sizeof(tables_chunk_t) * num_chunks);
+    assert(chunks != 0);
+
+    task_group_init(&group, pool);
+    for (i = 0; i < num_chunks; ++i)
+    {
+	tables_chunk_t *chunk = &chunks[i];
+
+	chunk->library = library;
+	chunk->text = texts[i];
+	arena_init(&chunk->metapixel_slab, METAPIXEL_SLAB_SIZE * sizeof(metapixel_t));
+	arena_init(&chunk->strings, STRING_AREA_SIZE);
+	chunk->first = chunk->last = 0;
+	chunk->num_metapixels = 0;
+	chunk->error_code = 0;
+	chunk->error_string = 0;
+
+	task_group_spawn(&group, read_tables_chunk_task, chunk);
+    }
+    task_group_wait(&group);
+
+    *first = *last = 0;
+    *num_metapixels = 0;
+
+    /* the list is in reverse text order */
+    for (i = 0; i < num_chunks; ++i)
+    {
+	tables_chunk_t *chunk = &chunks[i];
+
+	if (chunk->error_code != 0 && retval)
+	{
+	    error_report(chunk->error_code, error_make_string_info(chunk->error_string));
+	    retval = 0;
+	}
+	if (chunk->error_string != 0)
+	    free(chunk->error_string);
+
+	if (chunk->first != 0)
+	{
+	    chunk->last->next = *first;
+	    *first = chunk->first;
+	    if (*last == 0)
+		*last = chunk->last;
+	    *num_metapixels += chunk->num_metapixels;
+	}
+
+	arena_take(&library->metapixel_slab, &chunk->metapixel_slab);
+	arena_take(&library->strings, &chunk->strings);
+    }
+
+    free(chunks);
+    free(texts);
+
+    return retval;
+}
+
+static void
+remember_tables_stat (library_t *library, struct stat *buf)
+{
+    library->tables_size = buf->st_size;
+    library->tables_device = buf->st_dev;
+    library->tables_inode = buf->st_ino;
+}
+
+/* Whether tables.mxt is the file the library has read, and it has read
+   all of it. */
+static int
+tables_stat_is_current (library_t *library, struct stat *buf)
+{
+    return buf->st_size == library->tables_size
+	&& buf->st_dev == library->tables_device
+	&& buf->st_ino == library->tables_inode;
+}
+
+static int
+read_tables (const char *library_dir, library_t *library)
+{
+    char *tables_name;
+    char *text;
+    size_t size;
+    metapixel_t *first, *last;
+    unsigned int num_metapixels;
+    struct stat buf;
+    int retval;
+
+    assert(library != 0);
+    assert(library->metapixels == 0);
+
+    tables_name = tables_filename(library_dir);
+    text = read_file_from(tables_name, 0, &size, &buf);
+    if (text == 0)
+    {
+	error_info_t info = error_make_string_info(tables_name);
+
+	free(tables_name);
+
+	error_report(ERROR_TABLES_FILE_CANNOT_OPEN, info);
+
+	return 0;
+    }
+    free(tables_name);
+
+    retval = parse_tables_text(library, text, size, &first, &last, &num_metapixels);
+
+    library->metapixels = first;
+    library->num_metapixels = num_metapixels;
+    remember_tables_stat(library, &buf);
+
+    free(text);
+
+    return retval;
+}
+
+library_t*
+library_new (const char *path)
+{
+    char *filename = tables_filename(path);
+    library_t *library;
+    int fd;
+
+    assert(filename != 0);
+
+    if (access(filename, F_OK) == 0)
+    {
+	error_info_t info = error_make_string_info(filename);
+
+	free(filename);
+
+	error_report(ERROR_TABLES_FILE_EXISTS, info);
+
+	return 0;
+    }
+
+    fd = open(filename, O_RDWR | O_CREAT, 0666);
+
+    if (fd == -1)
+    {
+	error_info_t info = error_make_string_info(filename);
+
+	free(filename);
+
+	error_report(ERROR_TABLES_FILE_CANNOT_CREATE, info);
+
+	return 0;
+    }
+
+    close(fd);
+    free(filename);
+
+    library = make_library(path);
+
+    /* so that it grows with the tables file from the start */
+    features_file_write(library);
+
+    return library;
+}
+
+library_t*
+library_open_without_reading (const char *path)
+{
+    char *filename = tables_filename(path);
+    int result;
+
+    result = access(filename, R_OK | W_OK);
+
+    if (result == 0)
+    {
+	free(filename);
+
+	return make_library(path);
+    }
+    else
+    {
+	error_info_t info = error_make_string_info(filename);
+
+	free(filename);
+
+	error_report(ERROR_TABLES_FILE_CANNOT_OPEN, info);
+
+	return 0;
+    }
+}
+
+library_t*
+library_open (const char *path)
+{
+    library_t *library = make_library(path);
+    char *tables_name = tables_filename(path);
+    struct stat tables_stat;
+    int have_stat;
+
+    assert(library != 0);
+
+    /* The stat must be taken before reading, so that the binary
+       tables are never taken for newer than they are. */
+    have_stat = stat(tables_name, &tables_stat) == 0;
+    free(tables_name);
+
+    if (have_stat && binary_tables_read(library, &tables_stat))
+    {
+	remember_tables_stat(library, &tables_stat);
+	return library;
+    }
+
+    if (read_tables(path, library))
+    {
+	/* If that fails we'll just parse again next time. */
+	if (have_stat)
+	    binary_tables_write(library, &tables_stat);
+    }
+    else
+    {
+	free_metapixels(library);
+	feature_store_free(&library->features);
+	if (library->atlas != 0)
+	    atlas_close(library->atlas);
+	pthread_mutex_destroy(&library->snapshot_mutex);
+	free(library->path);
+	free(library);
+
+	return 0;
+    }
+
+    return library;
+}
+
+void
+library_close (library_t *library)
+{
+    assert(library->snapshot_of == 0);
+
+    if (library->current_snapshot != 0)
+    {
+	library_release_snapshot(library->current_snapshot);
+	library->current_snapshot = 0;
+    }
+    assert(library->snapshots == 0);
+
+    if (library->batch != 0)
+	library_end_batch(library);
+    free_metapixels(library);
+    feature_store_free(&library->features);
+    if (library->atlas != 0)
+	atlas_close(library->atlas);
+    pthread_mutex_destroy(&library->snapshot_mutex);
     free(library->path);
     free(library);
 }
 
-metapixel_t*
-library_add_metapixel (library_t *library, metapixel_t *metapixel)
+/* Makes the metapixels, linked in reverse file order from first to
+   last, the newest ones of the library, for the snapshots acquired
+   from now on.  Their features must already be in the store. */
+static void
+publish_metapixels (library_t *library, metapixel_t *first, metapixel_t *last, unsigned int num_metapixels)
+{
+    library_t *old_snapshot;
+
+    pthread_mutex_lock(&library->snapshot_mutex);
+
+    last->next = library->metapixels;
+    library->metapixels = first;
+    library->num_metapixels += num_metapixels;
+
+    old_snapshot = library->current_snapshot;
+    library->current_snapshot = 0;
+
+    pthread_mutex_unlock(&library->snapshot_mutex);
+
+    if (old_snapshot != 0)
+	library_release_snapshot(old_snapshot);
+}
+
+static library_t*
+make_snapshot (library_t *library)
+{
+    library_t *snapshot = (library_t*)malloc(sizeof(library_t));
+
+    assert(snapshot != 0);
+
+    snapshot->path = library->path;
+    snapshot->atlas = library->atlas;
+    snapshot->binary_tables = 0;
+    snapshot->batch = 0;
+    snapshot->duplicate_index = 0;
+    feature_store_init_view(&snapshot->features, &library->features, library->num_metapixels);
+    arena_init(&snapshot->metapixel_slab, METAPIXEL_SLAB_SIZE * sizeof(metapixel_t));
+    arena_init(&snapshot->strings, STRING_AREA_SIZE);
+
+    snapshot->metapixels = library->metapixels;
+    snapshot->num_metapixels = library->num_metapixels;
+
+    snapshot->tables_size = library->tables_size;
+    snapshot->tables_device = library->tables_device;
+    snapshot->tables_inode = library->tables_inode;
+
+    snapshot->snapshot_of = library;
+    snapshot->current_snapshot = 0;
+    snapshot->snapshots = 0;
+    snapshot->epoch = library->epoch;
+    snapshot->next_snapshot = library->snapshots;
+    snapshot->num_references = 1;
+
+    library->snapshots = snapshot;
+
+    return snapshot;
+}
+
+library_t*
+library_acquire_snapshot (library_t *library)
+{
+    library_t *snapshot;
+
+    assert(library->snapshot_of == 0);
+
+    pthread_mutex_lock(&library->snapshot_mutex);
+
+    if (library->current_snapshot == 0)
+    {
+	/* The feature indexes of the metapixels must be fixed before
+	   the first snapshot, so that those of every snapshot come
+	   first in the store, with later ones after them. */
+	library_need_features(library, COLOR_SPACE_RGB);
+
+	/* arrays the store replaces from now on might still be used by
+	   the new snapshot */
+	++library->epoch;
+	feature_store_set_epoch(&library->features, 1, library->epoch);
+
+	library->current_snapshot = make_snapshot(library);
+    }
+
+    snapshot = library->current_snapshot;
+    ++snapshot->num_references;
+
+    pthread_mutex_unlock(&library->snapshot_mutex);
+
+    return snapshot;
+}
+
+void
+library_release_snapshot (library_t *snapshot)
+{
+    library_t *library = snapshot->snapshot_of;
+    library_t **s;
+    unsigned int min_epoch;
+
+    assert(library != 0);
+
+    pthread_mutex_lock(&library->snapshot_mutex);
+
+    assert(snapshot->num_references > 0);
+    if (--snapshot->num_references > 0)
+    {
+	pthread_mutex_unlock(&library->snapshot_mutex);
+	return;
+    }
+
+    for (s = &library->snapshots; *s != snapshot; s = &(*s)->next_snapshot)
+	assert(*s != 0);
+    *s = snapshot->next_snapshot;
+
+    if (library->snapshots == 0)
+    {
+	feature_store_set_epoch(&library->features, 0, library->epoch);
+	min_epoch = UINT_MAX;
+    }
+    else
+    {
+	library_t *other;
+
+	min_epoch = UINT_MAX;
+	for (other = library->snapshots; other != 0; other = other->next_snapshot)
+	    min_epoch = MIN(min_epoch, other->epoch);
+    }
+
+    /* nothing can use the arrays replaced before the oldest snapshot
+       left was taken */
+    feature_store_reclaim(&library->features, min_epoch);
+
+    pthread_mutex_unlock(&library->snapshot_mutex);
+
+    feature_store_free(&snapshot->features);
+    free(snapshot);
+}
+
+int
+library_refresh (library_t *library)
+{
+    char *tables_name = tables_filename(library->path);
+    char *text, *end;
+    size_t size;
+    struct stat buf;
+    metapixel_t *first, *last;
+    unsigned int num_metapixels;
+
+    assert(library->snapshot_of == 0 && library->batch == 0);
+
+    text = read_file_from(tables_name, library->tables_size, &size, &buf);
+
+    /* a library opened without reading has read nothing of any file */
+    if (text == 0
+	|| (library->tables_device != -1
+	    && (buf.st_dev != library->tables_device || buf.st_ino != library->tables_inode)))
+    {
+	error_info_t info = error_make_string_info(tables_name);
+
+	free(tables_name);
+	if (text != 0)
+	    free(text);
+
+	/* it was rewritten, or truncated */
+	error_report(ERROR_TABLES_FILE_REPLACED, info);
+
+	return -1;
+    }
+    free(tables_name);
+
+    /* a prepare might be in the middle of writing a line */
+    end = strrchr(text, '\n');
+    if (end == 0)
+    {
+	free(text);
+	return 0;
+    }
+    end[1] = '\0';
+    size = end + 1 - text;
+
+    if (!parse_tables_text(library, text, size, &first, &last, &num_metapixels))
+    {
+	free(text);
+	return -1;
+    }
+    free(text);
+
+    if (num_metapixels > 0)
+    {
+	/* they get their feature indexes in file order */
+	metapixel_t **pixels = library_metapixels_in_file_order(first, num_metapixels);
+	unsigned int i;
+
+	for (i = 0; i < num_metapixels; ++i)
+	{
+	    if (library->duplicate_index != 0)
+		duplicate_index_add(library->duplicate_index, pixels[i]);
+	    feature_store_add(&library->features, pixels[i]);
+	}
+
+	free(pixels);
+
+	publish_metapixels(library, first, last, num_metapixels);
+    }
+
+    library->tables_size += size;
+    library->tables_device = buf.st_dev;
+    library->tables_inode = buf.st_ino;
+
+    return num_metapixels;
+}
+
+/* Writes the image of the metapixel and its levels to files in the
+   library and returns a copy of the metapixel for the library. */
+static metapixel_t*
+store_metapixel_in_files (library_t *library, metapixel_t *metapixel)
 {
     char bitmap_filename[strlen(library->path) + 1 + strlen(metapixel->name) + 1 + 6 + 1];
-    char tables_filename[strlen(library->path) + 1 + strlen(TABLES_FILENAME) + 1];
+    metapixel_t *original = metapixel;
     bitmap_t *bitmap;
-    FILE *file;
+    unsigned int level_num;
+    int suffix = -1;
 
     /* get a filename for the bitmap */
     sprintf(bitmap_filename, "%s/%s", library->path, metapixel->name);
-    if (access(bitmap_filename, F_OK) == 0)
+    if (metapixel_filenames_taken(library, metapixel, bitmap_filename))
     {
-	int i;
+	suffix = 0;
+	if (library->batch != 0)
+	{
+	    library_batch_suffix_t *next = (library_batch_suffix_t*)hash_table_lookup(library->batch->next_suffixes,
+										     metapixel->name);
+
+	    if (next != 0)
+		suffix = next->next;
+	}
 
-	for (i = 0; i < 1000000; ++i)
+	for (; suffix < 1000000; ++suffix)
 	{
-	    sprintf(bitmap_filename, "%s/%s.%06d", library->path, metapixel->name, i);
-	    if (access(bitmap_filename, F_OK) == -1)
+	    sprintf(bitmap_filename, "%s/%s.%06d", library->path, metapixel->name, suffix);
+	    if (!metapixel_filenames_taken(library, metapixel, bitmap_filename))
 		break;
 	}
     }
 
-    if (access(bitmap_filename, F_OK) == 0)
+    if (metapixel_filenames_taken(library, metapixel, bitmap_filename))
     {
 	error_report(ERROR_CANNOT_FIND_METAPIXEL_IMAGE_NAME, error_make_string_info(bitmap_filename));
 
 	return 0;
     }
 
+    if (library->batch != 0)
+	batch_add_metapixel_filenames(library, metapixel, bitmap_filename, suffix + 1);
+
     /* write the bitmap */
     if (metapixel->bitmap == 0)
 	bitmap = metapixel_get_bitmap(metapixel);
@@ -417,27 +1389,538 @@ library_add_metapixel (library_t *library, metapixel_t *metapixel)
     metapixel = copy_metapixel_for_library(metapixel, library, bitmap_filename + strlen(library->path) + 1);
     assert(metapixel != 0);
 
+    /* write the levels */
+    if (original->num_levels > 0)
+	metapixel->levels = new_library_levels(library, original->num_levels);
+
+    /* on failure the copy is simply left in the arenas */
+    for (level_num = 0; level_num < original->num_levels; ++level_num)
+    {
+	metapixel_level_t *level = &metapixel->levels[level_num];
+	char *filename = level_filename(bitmap_filename, original->levels[level_num].width,
+					original->levels[level_num].height);
+
+	bitmap = metapixel_get_level_bitmap(original, level_num);
+	if (bitmap == 0)
+	{
+	    free(filename);
+	    return 0;
+	}
+
+	/* FIXME: check for errors */
+	bitmap_write(bitmap, filename);
+	bitmap_free(bitmap);
+
+	level->width = original->levels[level_num].width;
+	level->height = original->levels[level_num].height;
+	level->filename = arena_strdup(&library->strings, filename + strlen(library->path) + 1);
+	level->bitmap = 0;
+	level->atlas_offset = -1;
+
+	++metapixel->num_levels;
+
+	free(filename);
+    }
+
+    return metapixel;
+}
+
+static metapixel_t*
+store_metapixel_in_atlas (library_t *library, metapixel_t *metapixel)
+{
+    metapixel_t *original = metapixel;
+    char filename[strlen(metapixel->name) + 1 + 10 + 1];
+    bitmap_t *bitmap;
+    unsigned int level_num;
+    int offset;
+
+    bitmap = metapixel_get_bitmap(metapixel);
+    if (bitmap == 0)
+	return 0;
+
+    offset = atlas_append(library->atlas, bitmap);
+    bitmap_free(bitmap);
+
+    if (offset < 0)
+	return 0;
+
+    /* there is no file, but the filename still identifies the
+       metapixel in protocols */
+    sprintf(filename, "%s@%d", metapixel->name, offset);
+
+    metapixel = copy_metapixel_for_library(metapixel, library, filename);
+    assert(metapixel != 0);
+
+    metapixel->atlas_offset = offset;
+
+    if (original->num_levels > 0)
+	metapixel->levels = new_library_levels(library, original->num_levels);
+
+    /* on failure the copy is simply left in the arenas */
+    for (level_num = 0; level_num < original->num_levels; ++level_num)
+    {
+	metapixel_level_t *level = &metapixel->levels[level_num];
+
+	bitmap = metapixel_get_level_bitmap(original, level_num);
+	if (bitmap == 0)
+	    return 0;
+
+	offset = atlas_append(library->atlas, bitmap);
+	bitmap_free(bitmap);
+
+	if (offset < 0)
+	    return 0;
+
+	level->width = original->levels[level_num].width;
+	level->height = original->levels[level_num].height;
+	level->filename = 0;
+	level->bitmap = 0;
+	level->atlas_offset = offset;
+
+	++metapixel->num_levels;
+    }
+
+    return metapixel;
+}
+
+metapixel_t*
+library_add_metapixel (library_t *library, metapixel_t *metapixel)
+{
+    char tables_filename[strlen(library->path) + 1 + strlen(TABLES_FILENAME) + 1];
+    struct stat buf;
+    int tables_current;
+    FILE *file;
+
+    if (library->atlas != 0)
+	metapixel = store_metapixel_in_atlas(library, metapixel);
+    else
+	metapixel = store_metapixel_in_files(library, metapixel);
+
+    if (metapixel == 0)
+	return 0;
+
     /* add the metadata to the tables file */
-    sprintf(tables_filename, "%s/%s", library->path, TABLES_FILENAME);
-    file = fopen(tables_filename, "a");
+    if (library->batch != 0)
+	write_metapixel_metadata(metapixel, library->batch->tables_file);
+    else
+    {
+	sprintf(tables_filename, "%s/%s", library->path, TABLES_FILENAME);
+	file = fopen(tables_filename, "a");
+	if (file == 0)
+	{
+	    error_report(ERROR_TABLES_FILE_CANNOT_OPEN, error_make_string_info(tables_filename));
+
+	    return 0;
+	}
+	tables_current = fstat(fileno(file), &buf) == 0 && tables_stat_is_current(library, &buf);
+	write_metapixel_metadata(metapixel, file);
+	/* so that library_refresh doesn't read it again */
+	if (fflush(file) == 0 && tables_current && fstat(fileno(file), &buf) == 0)
+	    remember_tables_stat(library, &buf);
+	fclose(file);
+    }
+
+    /* If that fails the features file is made anew when it's needed. */
+    features_file_append(library, metapixel);
+
+    if (library->duplicate_index != 0)
+	duplicate_index_add(library->duplicate_index, metapixel);
+    feature_store_add(&library->features, metapixel);
+
+    publish_metapixels(library, metapixel, metapixel, 1);
+
+    return metapixel;
+}
+
+metapixel_t*
+library_find_duplicate (library_t *library, metapixel_t *metapixel, unsigned int max_distance)
+{
+    if (library->duplicate_index != 0 && library->duplicate_index->max_distance != max_distance)
+    {
+	duplicate_index_free(library->duplicate_index);
+	library->duplicate_index = 0;
+    }
+
+    if (library->duplicate_index == 0)
+    {
+	metapixel_t *pixel;
+
+	library->duplicate_index = duplicate_index_new(max_distance);
+	for (pixel = library->metapixels; pixel != 0; pixel = pixel->next)
+	    duplicate_index_add(library->duplicate_index, pixel);
+    }
+
+    return duplicate_index_lookup(library->duplicate_index, metapixel);
+}
+
+int
+library_begin_batch (library_t *library)
+{
+    char *filename;
+    library_batch_t *batch;
+    DIR *dir = 0;
+    FILE *file;
+    struct dirent *entry;
+    struct stat buf;
+
+    assert(library->batch == 0);
+
+    /* Only images in separate files need names. */
+    if (library->atlas == 0)
+    {
+	dir = opendir(library->path);
+	if (dir == 0)
+	{
+	    error_report(ERROR_CANNOT_READ_LIBRARY_DIRECTORY, error_make_string_info(library->path));
+
+	    return 0;
+	}
+    }
+
+    filename = tables_filename(library->path);
+    file = fopen(filename, "a");
     if (file == 0)
     {
-	metapixel_free(metapixel);
+	error_info_t info = error_make_string_info(filename);
+
+	free(filename);
+	if (dir != 0)
+	    closedir(dir);
 
-	error_report(ERROR_TABLES_FILE_CANNOT_OPEN, error_make_string_info(tables_filename));
+	error_report(ERROR_TABLES_FILE_CANNOT_OPEN, info);
 
 	return 0;
     }
-    write_metapixel_metadata(metapixel, file);
-    fclose(file);
+    free(filename);
 
-    /* add the metapixel to the library */
-    metapixel->next = library->metapixels;
-    library->metapixels = metapixel;
+    batch = (library_batch_t*)malloc(sizeof(library_batch_t));
+    assert(batch != 0);
 
-    ++library->num_metapixels;
+    batch->tables_file = file;
+    batch->tables_current = fstat(fileno(file), &buf) == 0 && tables_stat_is_current(library, &buf);
+    batch->filenames = hash_table_new(hash_string, hash_string_equal);
+    batch->next_suffixes = hash_table_new(hash_string, hash_string_equal);
 
-    return metapixel;
+    if (dir != 0)
+    {
+	while ((entry = readdir(dir)) != 0)
+	    batch_add_filename(batch, entry->d_name);
+
+	closedir(dir);
+    }
+
+    library->batch = batch;
+
+    return 1;
+}
+
+static void
+free_value (const void *key, void *value, void *data)
+{
+    free(value);
+}
+
+int
+library_end_batch (library_t *library)
+{
+    library_batch_t *batch = library->batch;
+    struct stat buf;
+    int result;
+
+    assert(batch != 0);
+
+    result = fflush(batch->tables_file) == 0 && fsync(fileno(batch->tables_file)) == 0;
+    /* No other program may add to the library during the batch, so
+       all that was added since it began is ours. */
+    if (result && batch->tables_current && fstat(fileno(batch->tables_file), &buf) == 0)
+	remember_tables_stat(library, &buf);
+    if (fclose(batch->tables_file) != 0)
+	result = 0;
+
+    /* the tables must not refer to images which aren't on disk */
+    if (library->atlas != 0 && !atlas_sync(library->atlas))
+	result = 0;
+
+    hash_table_foreach(batch->filenames, free_value, 0);
+    hash_table_free(batch->filenames);
+    hash_table_foreach(batch->next_suffixes, free_value, 0);
+    hash_table_free(batch->next_suffixes);
+
+    free(batch);
+    library->batch = 0;
+
+    if (!result)
+    {
+	char *filename = tables_filename(library->path);
+
+	error_report(ERROR_TABLES_FILE_CANNOT_WRITE, error_make_string_info(filename));
+	free(filename);
+    }
+
+    return result;
+}
+
+/* Writes the tables file anew, via a temporary file, so that it is
+   replaced atomically. */
+static int
+rewrite_tables (library_t *library)
+{
+    char *filename = tables_filename(library->path);
+    char temp_filename[strlen(filename) + 7 + 1];
+    struct stat tables_stat;
+    metapixel_t **pixels;
+    unsigned int i;
+    FILE *file;
+    int result;
+
+    file = utils_create_temp_file(filename, temp_filename);
+    if (file == 0)
+    {
+	error_info_t info = error_make_string_info(temp_filename);
+
+	free(filename);
+
+	error_report(ERROR_TABLES_FILE_CANNOT_WRITE, info);
+
+	return 0;
+    }
+
+    pixels = library_metapixels_in_file_order(library->metapixels, library->num_metapixels);
+    for (i = 0; i < library->num_metapixels; ++i)
+	write_metapixel_metadata(pixels[i], file);
+
+    free(pixels);
+
+    result = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (fclose(file) != 0)
+	result = 0;
+
+    if (result)
+	result = rename(temp_filename, filename) == 0;
+
+    if (!result)
+    {
+	error_info_t info = error_make_string_info(filename);
+
+	unlink(temp_filename);
+	free(filename);
+
+	error_report(ERROR_TABLES_FILE_CANNOT_WRITE, info);
+
+	return 0;
+    }
+
+    /* keep the binary tables from having to be made again on the
+       next open */
+    if (stat(filename, &tables_stat) == 0)
+    {
+	remember_tables_stat(library, &tables_stat);
+	binary_tables_write(library, &tables_stat);
+    }
+
+    free(filename);
+
+    return 1;
+}
+
+static void
+unlink_library_file (library_t *library, const char *filename)
+{
+    char path[strlen(library->path) + 1 + strlen(filename) + 1];
+
+    sprintf(path, "%s/%s", library->path, filename);
+    unlink(path);
+}
+
+/* Takes ownership of path. */
+static void
+add_path (char ***paths, unsigned int *num_paths, char *path)
+{
+    *paths = (char**)realloc(*paths, sizeof(char*) * (*num_paths + 1));
+    assert(*paths != 0);
+
+    (*paths)[(*num_paths)++] = path;
+}
+
+int
+library_convert_to_atlas (library_t *library)
+{
+    char **old_files = 0;
+    unsigned int num_old_files = 0;
+    metapixel_t *pixel;
+    unsigned int i;
+    int result = 1;
+
+    if (library->atlas == 0)
+    {
+	library->atlas = atlas_create(library->path);
+	if (library->atlas == 0)
+	    return 0;
+    }
+
+    for (pixel = library->metapixels; pixel != 0 && result; pixel = pixel->next)
+    {
+	if (pixel->atlas_offset < 0)
+	{
+	    bitmap_t *bitmap = metapixel_get_bitmap(pixel);
+	    int offset;
+
+	    if (bitmap == 0)
+	    {
+		result = 0;
+		break;
+	    }
+
+	    offset = atlas_append(library->atlas, bitmap);
+	    bitmap_free(bitmap);
+
+	    if (offset < 0)
+	    {
+		result = 0;
+		break;
+	    }
+
+	    /* the filename stays, since protocols refer to it */
+	    add_path(&old_files, &num_old_files, metapixel_get_filename(pixel));
+	    pixel->atlas_offset = offset;
+	}
+
+	for (i = 0; i < pixel->num_levels; ++i)
+	{
+	    metapixel_level_t *level = &pixel->levels[i];
+	    bitmap_t *bitmap;
+	    char *path;
+	    int offset;
+
+	    if (level->atlas_offset >= 0)
+		continue;
+
+	    bitmap = metapixel_get_level_bitmap(pixel, i);
+	    if (bitmap == 0)
+	    {
+		result = 0;
+		break;
+	    }
+
+	    offset = atlas_append(library->atlas, bitmap);
+	    bitmap_free(bitmap);
+
+	    if (offset < 0)
+	    {
+		result = 0;
+		break;
+	    }
+
+	    path = (char*)malloc(strlen(library->path) + 1 + strlen(level->filename) + 1);
+	    assert(path != 0);
+	    sprintf(path, "%s/%s", library->path, level->filename);
+	    add_path(&old_files, &num_old_files, path);
+
+	    level->filename = 0;
+	    level->atlas_offset = offset;
+	}
+    }
+
+    /* the old files are only removed once the new tables are in
+       place */
+    if (result)
+	result = rewrite_tables(library);
+
+    for (i = 0; i < num_old_files; ++i)
+    {
+	if (result)
+	    unlink(old_files[i]);
+	free(old_files[i]);
+    }
+    if (old_files != 0)
+	free(old_files);
+
+    return result;
+}
+
+int
+library_remove_metapixels (library_t *library, char **filenames, unsigned int num_filenames)
+{
+    hash_table_t *removed = hash_table_new(hash_string, hash_string_equal);
+    metapixel_t **pixels;
+    metapixel_t *pixel;
+    unsigned int num_pixels = library->num_metapixels;
+    unsigned int i, j;
+    int result;
+
+    /* snapshots share the metapixels, which are changed here */
+    if (library->current_snapshot != 0)
+    {
+	library_release_snapshot(library->current_snapshot);
+	library->current_snapshot = 0;
+    }
+    assert(library->snapshots == 0);
+
+    for (i = 0; i < num_filenames; ++i)
+	hash_table_insert(removed, filenames[i], filenames[i]);
+
+    pixels = library_metapixels_in_file_order(library->metapixels, num_pixels);
+
+    /* keep the order of the remaining metapixels */
+    library->metapixels = 0;
+    library->num_metapixels = 0;
+    for (i = 0; i < num_pixels; ++i)
+    {
+	pixel = pixels[i];
+	if (hash_table_lookup(removed, pixel->filename) == 0)
+	{
+	    pixel->next = library->metapixels;
+	    library->metapixels = pixel;
+	    ++library->num_metapixels;
+	}
+    }
+
+    result = rewrite_tables(library);
+
+    /* those are rebuilt when they're needed again */
+    if (result)
+    {
+	if (library->duplicate_index != 0)
+	{
+	    duplicate_index_free(library->duplicate_index);
+	    library->duplicate_index = 0;
+	}
+	feature_store_clear(&library->features);
+    }
+
+    if (!result)
+    {
+	library->metapixels = 0;
+	for (i = num_pixels; i > 0; --i)
+	{
+	    pixels[i - 1]->next = library->metapixels;
+	    library->metapixels = pixels[i - 1];
+	}
+	library->num_metapixels = num_pixels;
+    }
+    else
+    {
+	for (i = 0; i < num_pixels; ++i)
+	{
+	    pixel = pixels[i];
+
+	    if (hash_table_lookup(removed, pixel->filename) == 0)
+		continue;
+
+	    /* FIXME: the space in the atlas and in the arenas is not
+	       reclaimed */
+	    if (pixel->atlas_offset < 0)
+		unlink_library_file(library, pixel->filename);
+	    for (j = 0; j < pixel->num_levels; ++j)
+		if (pixel->levels[j].atlas_offset < 0 && pixel->levels[j].filename != 0)
+		    unlink_library_file(library, pixel->levels[j].filename);
+	}
+    }
+
+    free(pixels);
+    hash_table_free(removed);
+
+    return result;
 }
 
 unsigned int
@@ -41,11 +41,14 @@
 #include "lispreader/lispreader.h"
 
 #include "cmdline.h"
+#include "server.h"
 
 static unsigned int num_metapixels = 0;
 
 static library_t **libraries = 0;
 static unsigned int num_libraries = 0;
+/* Server jobs run concurrently and can add libraries. */
+static pthread_mutex_t libraries_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* default settings */
 
@@ -62,6 +65,16 @@ static int default_collage_min_distance = DEFAULT_COLLAGE_MIN_DISTANCE;
 static int default_cheat_amount = 0;
 static int default_forbid_reconstruction_radius = 0;
 static unsigned int default_metapixel_flip = FLIP_HOR | FLIP_VER, default_prepare_flip = FLIP_HOR;
+static int default_tile_cache_size = DEFAULT_TILE_CACHE_SIZE;
+static int default_prepare_pyramid = 0;
+static int default_prepare_from_thumbnails = 0;
+static int default_duplicate_distance = -1;
+static int default_keep_duplicates = 0;
+static int default_shared_features = 0;
+static char *default_shared_features_directory = 0;
+static int default_pyramid_min_size = DEFAULT_PYRAMID_MIN_SIZE;
+static int default_num_jobs = 0;
+static int default_num_threads = 0;
 
 /* actual settings */
 
@@ -70,6 +83,8 @@ static int color_space;
 static float weight_factors[NUM_CHANNELS];
 static int forbid_reconstruction_radius;
 
+static tile_cache_t *tile_cache = 0;
+
 static int benchmark_rendering = 0;
 
 static const char*
@@ -110,6 +125,8 @@ string_list_length (string_list_t *lst)
 static void
 add_library (library_t *library)
 {
+    pthread_mutex_lock(&libraries_mutex);
+
     ++num_libraries;
 
     if (num_libraries == 1)
@@ -122,6 +139,76 @@ add_library (library_t *library)
     libraries[num_libraries - 1] = library;
 
     num_metapixels += library->num_metapixels;
+
+    pthread_mutex_unlock(&libraries_mutex);
+}
+
+/* Returns a copy of the libraries array which stays valid while other
+   threads add libraries. */
+static library_t**
+copy_libraries (unsigned int *num)
+{
+    library_t **copy;
+
+    pthread_mutex_lock(&libraries_mutex);
+
+    *num = num_libraries;
+    copy = (library_t**)malloc(sizeof(library_t*) * (num_libraries > 0 ? num_libraries : 1));
+    assert(copy != 0);
+    memcpy(copy, libraries, sizeof(library_t*) * num_libraries);
+
+    pthread_mutex_unlock(&libraries_mutex);
+
+    return copy;
+}
+
+typedef struct
+{
+    const char *path;
+    library_t *library;
+} open_library_job_t;
+
+static void
+open_library_task (void *data)
+{
+    open_library_job_t *job = (open_library_job_t*)data;
+
+    job->library = library_open(job->path);
+}
+
+/* Opens the libraries concurrently and adds them in the order of the
+   list.  Returns 0 if one of them could not be opened. */
+static int
+open_libraries (string_list_t *directories)
+{
+    unsigned int num_jobs = string_list_length(directories);
+    open_library_job_t *jobs = (open_library_job_t*)malloc(sizeof(open_library_job_t) * num_jobs);
+    task_group_t group;
+    string_list_t *lst;
+    unsigned int i;
+    int result = 1;
+
+    assert(jobs != 0);
+
+    task_group_init(&group, thread_pool_get_default());
+    for (i = 0, lst = directories; lst != 0; ++i, lst = lst->next)
+    {
+	jobs[i].path = lst->str;
+	task_group_spawn(&group, open_library_task, &jobs[i]);
+    }
+    task_group_wait(&group);
+
+    for (i = 0; i < num_jobs; ++i)
+    {
+	if (jobs[i].library == 0)
+	    result = 0;
+	else
+	    add_library(jobs[i].library);
+    }
+
+    free(jobs);
+
+    return result;
 }
 
 static void
@@ -143,7 +230,9 @@ print_current_time (void)
     printf("time: %lu %lu\n", (unsigned long)tv.tv_sec, (unsigned long)tv.tv_usec);
 }
 
-static void
+/* Returns 0 if the collage cannot be made, after reporting the
+   error. */
+static int
 generate_collage (char *input_name, char *output_name, float scale, int min_distance, int metric_kind, int cheat,
 		  unsigned int allowed_flips)
 {
@@ -156,32 +245,40 @@ generate_collage (char *input_name, char *output_name, float scale, int min_dist
     in_bitmap = bitmap_read(input_name);
     if (in_bitmap == 0)
     {
-	fprintf(stderr, "Error: Could not read image `%s'.\n", input_name);
-	exit(1);
+	error_report(ERROR_CANNOT_READ_INPUT_IMAGE, error_make_string_info(input_name));
+	return 0;
     }
 
     init_metric(&metric, metric_kind);
-    mosaic = collage_generate_from_bitmap(num_libraries, libraries, in_bitmap,
-					  scaled_small_width, scaled_small_height,
-					  scaled_small_width, scaled_small_height,
-					  min_distance, &metric, allowed_flips, 0);
-    assert(mosaic != 0);
-
-    out_bitmap = collage_paste_to_bitmap(mosaic,
-					 (unsigned int)(in_bitmap->width * scale),
-					 (unsigned int)(in_bitmap->height * scale),
-					 in_bitmap,
-					 cheat * 0x10000 / 100,
-					 0);
-    assert(out_bitmap != 0);
+    mosaic = collage_generate_from_bitmap_with_seed(num_libraries, libraries, in_bitmap,
+						    scaled_small_width, scaled_small_height,
+						    scaled_small_width, scaled_small_height,
+						    min_distance, &metric, allowed_flips, 1, 0);
+    if (mosaic == 0)
+    {
+	bitmap_free(in_bitmap);
+	return 0;
+    }
+
+    out_bitmap = collage_paste_to_bitmap_with_cache(mosaic,
+						    (unsigned int)(in_bitmap->width * scale),
+						    (unsigned int)(in_bitmap->height * scale),
+						    in_bitmap,
+						    cheat * 0x10000 / 100,
+						    tile_cache, 0);
 
     collage_free(mosaic);
 
     bitmap_free(in_bitmap);
 
+    if (out_bitmap == 0)
+	return 0;
+
     bitmap_write(out_bitmap, output_name);
 
     bitmap_free(out_bitmap);
+
+    return 1;
 }
 
 static int
@@ -217,8 +314,11 @@ calculate_metasize (const char *filename, float scale, unsigned int *metawidth,
     return 1;
 }
 
+/* The reader gives at least tile_width x tile_height pixels per tile
+   but might decode the input image at a reduced size to do so. */
 static classic_reader_t*
-make_classic_reader (const char *in_image_name, float in_image_scale)
+make_classic_reader (const char *in_image_name, float in_image_scale,
+		     unsigned int tile_width, unsigned int tile_height)
 {
     tiling_t tiling;
     classic_reader_t *reader;
@@ -229,25 +329,136 @@ make_classic_reader (const char *in_image_name, float in_image_scale)
 
     tiling_init_rectangular(&tiling, metawidth, metaheight);
 
-    reader = classic_reader_new_from_file(in_image_name, &tiling);
+    reader = classic_reader_new_from_file_scaled(in_image_name, &tiling,
+						 metawidth * tile_width, metaheight * tile_height);
     assert(reader != 0);
 
     return reader;
 }
 
+/* Batch entries which run at the same time can write the same
+   protocol file, so it's written via a temporary file, and one
+   complete protocol wins. */
+static int
+write_classic_protocol (classic_mosaic_t *mosaic, const char *out_protocol_name)
+{
+    char temp_filename[strlen(out_protocol_name) + 7 + 1];
+    FILE *protocol_out = utils_create_temp_file(out_protocol_name, temp_filename);
+
+    if (protocol_out == 0)
+    {
+	error_report(ERROR_PROTOCOL_FILE_CANNOT_WRITE, error_make_string_info(out_protocol_name));
+	return 0;
+    }
+
+    if (!classic_write(mosaic, protocol_out))
+    {
+	fclose(protocol_out);
+	unlink(temp_filename);
+	return 0;
+    }
+
+    if (fclose(protocol_out) != 0 || rename(temp_filename, out_protocol_name) != 0)
+    {
+	unlink(temp_filename);
+	error_report(ERROR_PROTOCOL_FILE_CANNOT_WRITE, error_make_string_info(out_protocol_name));
+	return 0;
+    }
+
+    return 1;
+}
+
+/* With a local search a metarow can be pasted as soon as it has been
+   searched, so the input image is read only once and each metarow is
+   written right away. */
+static int
+make_streamed_classic_mosaic (unsigned int num_job_libraries, library_t **job_libraries,
+			      char *in_image_name, char *out_image_name,
+			      int metric_kind, float scale, int min_distance, int cheat, unsigned int flip,
+			      char *out_protocol_name,
+			      progress_report_func_t generate_report_func, progress_report_func_t paste_report_func)
+{
+    classic_reader_t *reader;
+    classic_writer_t *writer;
+    classic_mosaic_t *mosaic;
+    metric_t metric;
+    matcher_t matcher;
+    int result = 1;
+
+    /* the search only needs the subpixels of each tile, but cheating
+       needs the full tiles */
+    if (cheat > 0)
+	reader = make_classic_reader(in_image_name, scale, small_width, small_height);
+    else
+	reader = make_classic_reader(in_image_name, scale, NUM_SUBPIXEL_ROWS_COLS, NUM_SUBPIXEL_ROWS_COLS);
+
+    if (reader == 0)
+    {
+	error_report(ERROR_CANNOT_READ_INPUT_IMAGE, error_make_string_info(in_image_name));
+	return 0;
+    }
+
+    writer = classic_writer_new_for_file(out_image_name,
+					 reader->tiling.metawidth * small_width,
+					 reader->tiling.metaheight * small_height);
+    if (writer == 0)
+    {
+	classic_reader_free(reader);
+	return 0;
+    }
+
+    init_metric(&metric, metric_kind);
+    matcher_init_local(&matcher, &metric, min_distance);
+
+    mosaic = classic_generate_and_paste(num_job_libraries, job_libraries, reader, &matcher,
+					forbid_reconstruction_radius, flip,
+					cheat * 0x10000 / 100, writer, tile_cache,
+					generate_report_func, paste_report_func);
+
+    classic_writer_free(writer);
+    classic_reader_free(reader);
+
+    /* the output image was created before the search could fail */
+    if (mosaic == 0)
+    {
+	unlink(out_image_name);
+	return 0;
+    }
+
+    if (out_protocol_name != 0)
+	result = write_classic_protocol(mosaic, out_protocol_name);
+
+    classic_free(mosaic);
+
+    return result;
+}
+
 static int
 make_classic_mosaic (char *in_image_name, char *out_image_name,
 		     int metric_kind, float scale, int search, int min_distance, int cheat, unsigned int flip,
-		     char *in_protocol_name, char *out_protocol_name)
+		     char *in_protocol_name, char *out_protocol_name,
+		     progress_report_func_t generate_report_func, progress_report_func_t paste_report_func)
 {
     classic_mosaic_t *mosaic;
+    int result;
+    unsigned int num_job_libraries;
+    library_t **job_libraries = copy_libraries(&num_job_libraries);
+
+    if (in_protocol_name == 0 && search == SEARCH_LOCAL && !benchmark_rendering)
+    {
+	result = make_streamed_classic_mosaic(num_job_libraries, job_libraries, in_image_name, out_image_name,
+					      metric_kind, scale, min_distance, cheat, flip,
+					      out_protocol_name, generate_report_func, paste_report_func);
+	free(job_libraries);
+	return result;
+    }
 
     if (in_protocol_name != 0)
     {
 	int num_new_libraries;
 	library_t **new_libraries;
 
-	mosaic = classic_read(num_libraries, libraries, in_protocol_name, &num_new_libraries, &new_libraries);
+	mosaic = classic_read(num_job_libraries, job_libraries, in_protocol_name, &num_new_libraries, &new_libraries);
 
 	if (num_new_libraries > 0)
 	{
@@ -260,7 +471,10 @@ make_classic_mosaic (char *in_image_name, char *out_image_name,
 	}
 
 	if (mosaic == 0)
+	{
+	    free(job_libraries);
 	    return 0;
+	}
     }
     else
     {
@@ -268,11 +482,15 @@ make_classic_mosaic (char *in_image_name, char *out_image_name,
 	metric_t metric;
 	matcher_t matcher;
 
-	reader = make_classic_reader(in_image_name, scale);
+	/* The search only needs the subpixels of each tile.  For tiles
+	   of 40 or more source pixels they come from the DC
+	   coefficients of a JPEG input image. */
+	reader = make_classic_reader(in_image_name, scale, NUM_SUBPIXEL_ROWS_COLS, NUM_SUBPIXEL_ROWS_COLS);
 
 	if (reader == 0)
 	{
-	    fprintf(stderr, "Error: cannot open input image `%s'.\n", in_image_name);
+	    error_report(ERROR_CANNOT_READ_INPUT_IMAGE, error_make_string_info(in_image_name));
+	    free(job_libraries);
 	    return 0;
 	}
 
@@ -285,43 +503,42 @@ make_classic_mosaic (char *in_image_name, char *out_image_name,
 	else
 	    assert(0);
 
-	mosaic = classic_generate(num_libraries, libraries, reader, &matcher, forbid_reconstruction_radius, flip, 0);
+	mosaic = classic_generate(num_job_libraries, job_libraries, reader, &matcher, forbid_reconstruction_radius, flip,
+				  generate_report_func);
 
 	classic_reader_free(reader);
     }
 
-    assert(mosaic != 0);
+    free(job_libraries);
+
+    if (mosaic == 0)
+	return 0;
 
     if (benchmark_rendering)
     {
 	int i;
 
+	/* batch entries running at the same time can share metapixels */
 	for (i = 0; i < mosaic->tiling.metawidth * mosaic->tiling.metaheight; ++i)
 	{
 	    metapixel_t *pixel = mosaic->matches[i].pixel;
 
-	    if (pixel->bitmap == 0)
+	    if (__sync_fetch_and_add(&pixel->bitmap, 0) == 0)
 	    {
-		pixel->bitmap = metapixel_get_bitmap(pixel);
-		assert(pixel->bitmap != 0);
+		bitmap_t *bitmap = metapixel_get_bitmap(pixel);
+
+		assert(bitmap != 0);
+
+		if (!__sync_bool_compare_and_swap(&pixel->bitmap, 0, bitmap))
+		    bitmap_free(bitmap);
 	    }
 	}
     }
 
-    if (out_protocol_name != 0)
+    if (out_protocol_name != 0 && !write_classic_protocol(mosaic, out_protocol_name))
     {
-	FILE *protocol_out = fopen(out_protocol_name, "w");
-
-	if (protocol_out == 0)
-	{
-	    fprintf(stderr, "Error: Cannot open protocol file `%s' for writing: %s.\n", out_protocol_name, strerror(errno));
-	    /* FIXME: free stuff */
-	    return 0;
-	}
-	else
-	    classic_write(mosaic, protocol_out);
-
-	fclose(protocol_out);
+	classic_free(mosaic);
+	return 0;
     }
 
     {
@@ -331,7 +548,7 @@ make_classic_mosaic (char *in_image_name, char *out_image_name,
 
 	if (!calculate_metasize(in_image_name, scale, &metawidth, &metaheight))
 	{
-	    fprintf(stderr, "Error: could not read input image `%s'.\n", in_image_name);
+	    error_report(ERROR_CANNOT_READ_INPUT_IMAGE, error_make_string_info(in_image_name));
 
 	    classic_free(mosaic);
 	    return 0;
@@ -339,16 +556,24 @@ make_classic_mosaic (char *in_image_name, char *out_image_name,
 
 	if (cheat > 0)
 	{
-	    reader = make_classic_reader(in_image_name, scale);
+	    /* when scaling down we don't need more than the size of
+	       the output image */
+	    reader = make_classic_reader(in_image_name, scale, small_width, small_height);
 	    assert(reader != 0);
 	}
 
 	writer = classic_writer_new_for_file(out_image_name, metawidth * small_width, metaheight * small_height);
-	assert(writer != 0);
-
-	classic_paste(mosaic, reader, cheat * 0x10000 / 100, writer, 0);
+	if (writer == 0)
+	    result = 0;
+	else
+	{
+	    result = classic_paste_with_cache(mosaic, reader, cheat * 0x10000 / 100, writer, tile_cache,
+					      paste_report_func);
+	    classic_writer_free(writer);
 
-	classic_writer_free(writer);
+	    if (!result)
+		unlink(out_image_name);
+	}
 
 	if (cheat > 0)
 	    classic_reader_free(reader);
@@ -356,9 +581,312 @@ make_classic_mosaic (char *in_image_name, char *out_image_name,
 
     classic_free(mosaic);
 
+    return result;
+}
+
+/* The settings of a (classic ...) batch entry. */
+typedef struct
+{
+    char *image_in_filename;
+    char *image_out_filename;
+    char *protocol_in_filename;
+    char *protocol_out_filename;
+    int metric;
+    float scale;
+    int search;
+    int min_distance;
+    int cheat;
+} classic_job_t;
+
+/* Fills in job from a (classic ...) expression, taking the settings
+   the expression doesn't give from defaults.  The filenames point
+   into obj.  Returns 0 if obj is not a (classic ...) expression. */
+static int
+parse_classic_job (lisp_object_t *obj, const classic_job_t *defaults, classic_job_t *job)
+{
+    lisp_object_t *vars[4];
+    lisp_object_t *lst;
+    lisp_object_t *var;
+
+    if (!utils_lisp_match_string("(classic (#?(or image protocol) #?(string)) #?(string) . #?(list))",
+				 obj, vars))
+	return 0;
+
+    *job = *defaults;
+    job->image_out_filename = lisp_string(vars[2]);
+    job->image_in_filename = 0;
+
+    if (strcmp(lisp_symbol(vars[0]), "image") == 0)
+	job->image_in_filename = lisp_string(vars[1]);
+    else
+	job->protocol_in_filename = lisp_string(vars[1]);
+
+    for (lst = vars[3]; lisp_type(lst) != LISP_TYPE_NIL; lst = lisp_cdr(lst))
+    {
+	if (utils_lisp_match_string("(scale #?(real))",
+				    lisp_car(lst), &var))
+	{
+	    float val = lisp_real(var);
+
+	    if (val <= 0.0)
+		fprintf(stderr, "scale must be larger than 0\n");
+	    else
+		job->scale = val;
+	}
+	else if (utils_lisp_match_string("(search #?(or local global))",
+					 lisp_car(lst), &var))
+	{
+	    if (strcmp(lisp_symbol(var), "local") == 0)
+		job->search = SEARCH_LOCAL;
+	    else
+		job->search = SEARCH_GLOBAL;
+	}
+	else if (utils_lisp_match_string("(min-distance #?(integer))",
+					 lisp_car(lst), &var))
+	{
+	    int val = lisp_integer(var);
+
+	    if (val < 0)
+		fprintf(stderr, "min-distance cannot be negative\n");
+	    else
+		job->min_distance = val;
+	}
+	else if (utils_lisp_match_string("(cheat #?(integer))",
+					 lisp_car(lst), &var))
+	{
+	    int val = lisp_integer(var);
+
+	    if (val < 0 || val > 100)
+		fprintf(stderr, "cheat must be between 0 and 100, inclusively\n");
+	    else
+		job->cheat = val;
+	}
+	else if (utils_lisp_match_string("(metric #?(or subpixel))",
+					 lisp_car(lst), &var))
+	{
+	    if (strcmp(lisp_symbol(var), "subpixel") == 0)
+		job->metric = METRIC_SUBPIXEL;
+	}
+	else if (utils_lisp_match_string("(protocol #?(string))",
+					 lisp_car(lst), &var))
+	    job->protocol_out_filename = lisp_string(var);
+	else
+	{
+	    fprintf(stderr, "unknown expression ");
+	    lisp_dump(lisp_car(lst), stderr);
+	    fprintf(stderr, "\n");
+	}
+    }
+
     return 1;
 }
 
+/* The settings from the command line, for server jobs. */
+static classic_job_t server_job_defaults;
+
+static __thread server_job_t *current_server_job = 0;
+
+static void
+report_server_generate_progress (float progress)
+{
+    server_job_report_progress(current_server_job, "generate", progress);
+}
+
+static void
+report_server_paste_progress (float progress)
+{
+    server_job_report_progress(current_server_job, "paste", progress);
+}
+
+/* Errors of a server job go to its client. */
+static void
+report_server_error (int code, error_info_t info, void *data)
+{
+    char *message = error_format_error(code, info);
+
+    assert(message != 0);
+
+    server_job_report_error((server_job_t*)data, message);
+
+    free(message);
+}
+
+static char*
+resolve_server_job_path (server_job_t *server_job, char *path)
+{
+    if (path == 0)
+	return 0;
+    return server_job_resolve_path(server_job, path);
+}
+
+static int
+run_server_job (server_job_t *server_job, lisp_object_t *obj)
+{
+    classic_job_t job;
+    char *image_in_filename, *image_out_filename, *protocol_in_filename, *protocol_out_filename;
+    error_context_t error_context;
+    int result;
+
+    if (!parse_classic_job(obj, &server_job_defaults, &job))
+    {
+	server_job_report_error(server_job, "unknown expression");
+	return 0;
+    }
+
+    image_in_filename = resolve_server_job_path(server_job, job.image_in_filename);
+    image_out_filename = resolve_server_job_path(server_job, job.image_out_filename);
+    protocol_in_filename = resolve_server_job_path(server_job, job.protocol_in_filename);
+    protocol_out_filename = resolve_server_job_path(server_job, job.protocol_out_filename);
+
+    current_server_job = server_job;
+    error_push_context(&error_context, report_server_error, server_job);
+
+    result = make_classic_mosaic(image_in_filename, image_out_filename,
+				 job.metric, job.scale, job.search, job.min_distance, job.cheat, 0,
+				 protocol_in_filename, protocol_out_filename,
+				 report_server_generate_progress, report_server_paste_progress);
+
+    error_pop_context(&error_context);
+    current_server_job = 0;
+
+    if (image_in_filename != 0)
+	free(image_in_filename);
+    free(image_out_filename);
+    if (protocol_in_filename != 0)
+	free(protocol_in_filename);
+    if (protocol_out_filename != 0)
+	free(protocol_out_filename);
+
+    return result;
+}
+
+typedef struct
+{
+    lisp_object_t *obj;
+    classic_job_t job;
+} batch_entry_t;
+
+typedef struct
+{
+    batch_entry_t *entries;
+    unsigned int num_entries;
+    unsigned int next_entry;
+    unsigned int num_failed;
+} batch_t;
+
+/* Each of these tasks performs entries until there are none left, so
+   the number of tasks is the number of entries done at a time. */
+static void
+run_batch_entries_task (void *data)
+{
+    batch_t *batch = (batch_t*)data;
+
+    for (;;)
+    {
+	unsigned int index = __sync_fetch_and_add(&batch->next_entry, 1);
+	classic_job_t *job;
+
+	if (index >= batch->num_entries)
+	    break;
+
+	job = &batch->entries[index].job;
+	if (!make_classic_mosaic(job->image_in_filename, job->image_out_filename,
+				 job->metric, job->scale, job->search, job->min_distance, job->cheat, 0,
+				 job->protocol_in_filename, job->protocol_out_filename, 0, 0))
+	    __sync_fetch_and_add(&batch->num_failed, 1);
+    }
+}
+
+/* Performs the (classic ...) entries of a batch file, num_jobs of
+   them at a time.  The entries share the libraries and the tile
+   cache.  Returns 0 if the file cannot be read, or if any of its
+   entries is malformed or fails. */
+static int
+run_batch (const char *filename, const classic_job_t *defaults, unsigned int num_jobs)
+{
+    FILE *in = fopen(filename, "r");
+    lisp_stream_t stream;
+    batch_entry_t *entries = 0;
+    unsigned int num_entries = 0, allocated = 0;
+    batch_t batch;
+    task_group_t group;
+    unsigned int num_malformed = 0;
+    unsigned int i;
+
+    if (in == 0)
+    {
+	fprintf(stderr, "cannot open batch file `%s': %s\n", filename, strerror(errno));
+	return 0;
+    }
+
+    lisp_stream_init_file(&stream, in);
+
+    /* nothing else reads expressions until the entries run, so the
+       file can be a pipe */
+    for (;;)
+    {
+	lisp_object_t *obj = lisp_read(&stream);
+	int type = lisp_type(obj);
+
+	if (type != LISP_TYPE_EOF && type != LISP_TYPE_PARSE_ERROR)
+	{
+	    if (num_entries == allocated)
+	    {
+		allocated = allocated == 0 ? 64 : allocated * 2;
+		entries = (batch_entry_t*)realloc(entries, sizeof(batch_entry_t) * allocated);
+		assert(entries != 0);
+	    }
+
+	    /* the filenames of the job point into the object, so we
+	       keep it until the job is done */
+	    if (parse_classic_job(obj, defaults, &entries[num_entries].job))
+	    {
+		entries[num_entries].obj = obj;
+		++num_entries;
+		continue;
+	    }
+
+	    fprintf(stderr, "unknown expression ");
+	    lisp_dump(obj, stderr);
+	    fprintf(stderr, "\n");
+	    ++num_malformed;
+	}
+	else if (type == LISP_TYPE_PARSE_ERROR)
+	{
+	    fprintf(stderr, "parse error in batch file\n");
+	    ++num_malformed;
+	}
+	lisp_free(obj);
+
+	if (type == LISP_TYPE_EOF)
+	    break;
+    }
+
+    fclose(in);
+
+    batch.entries = entries;
+    batch.num_entries = num_entries;
+    batch.next_entry = 0;
+    batch.num_failed = 0;
+
+    task_group_init(&group, thread_pool_get_default());
+
+    for (i = 0; i < MIN(num_jobs, num_entries); ++i)
+	task_group_spawn(&group, run_batch_entries_task, &batch);
+
+    task_group_wait(&group);
+
+    for (i = 0; i < num_entries; ++i)
+	lisp_free(entries[i].obj);
+    if (entries != 0)
+	free(entries);
+
+    if (batch.num_failed > 0)
+	fprintf(stderr, "Error: %u of %u batch entries failed.\n", batch.num_failed, num_entries);
+
+    return num_malformed == 0 && batch.num_failed == 0;
+}
+
 #define RC_FILE_NAME      ".metapixelrc"
 
 static void
@@ -376,108 +904,502 @@ read_rc_file (void)
 	return;
     }
 
-    filename = (char*)malloc(strlen(homedir) + 1 + strlen(RC_FILE_NAME) + 1);
-    strcpy(filename, homedir);
-    strcat(filename, "/");
-    strcat(filename, RC_FILE_NAME);
+    filename = (char*)malloc(strlen(homedir) + 1 + strlen(RC_FILE_NAME) + 1);
+    strcpy(filename, homedir);
+    strcat(filename, "/");
+    strcat(filename, RC_FILE_NAME);
+
+    if (access(filename, R_OK) == 0)
+    {
+	if (lisp_stream_init_path(&stream, filename) == 0)
+	    fprintf(stderr, "Warning: could not open rc file `%s'.", filename);
+	else
+	{
+	    for (;;)
+	    {
+		lisp_object_t *obj;
+		int type;
+
+		obj = lisp_read(&stream);
+		type = lisp_type(obj);
+
+		if (type != LISP_TYPE_EOF && type != LISP_TYPE_PARSE_ERROR)
+		{
+		    lisp_object_t *vars[3];
+
+		    if (lisp_match_string("(prepare-directory #?(string))", obj, vars))
+			default_prepare_directory = strdup(lisp_string(vars[0]));
+		    else if (lisp_match_string("(prepare-dimensions #?(integer) #?(integer))", obj, vars))
+		    {
+			default_prepare_width = lisp_integer(vars[0]);
+			default_prepare_height = lisp_integer(vars[1]);
+		    }
+		    else if (lisp_match_string("(library-directory #?(string))", obj, vars))
+			default_library_directories = string_list_prepend_copy(default_library_directories,
+									       lisp_string(vars[0]));
+		    else if (lisp_match_string("(small-image-dimensions #?(integer) #?(integer))", obj, vars))
+		    {
+			default_small_width = lisp_integer(vars[0]);
+			default_small_height = lisp_integer(vars[1]);
+		    }
+		    else if (lisp_match_string("(yiq-weights #?(number) #?(number) #?(number))", obj, vars))
+		    {
+			int i;
+
+			for (i = 0; i < 3; ++i)
+			    default_weight_factors[i] = lisp_real(vars[i]);
+		    }
+		    else if (lisp_match_string("(metric #?(or subpixel))", obj, vars))
+		    {
+			if (strcmp(lisp_symbol(vars[0]), "subpixel") == 0)
+			    default_metric = METRIC_SUBPIXEL;
+		    }
+		    else if (lisp_match_string("(search-method #?(or local global))", obj, vars))
+		    {
+			if (strcmp(lisp_symbol(vars[0]), "local") == 0)
+			    default_search = SEARCH_LOCAL;
+			else
+			    default_search = SEARCH_GLOBAL;
+		    }
+		    else if (lisp_match_string("(minimum-classic-distance #?(integer))", obj, vars))
+			default_classic_min_distance = lisp_integer(vars[0]);
+		    else if (lisp_match_string("(minimum-collage-distance #?(integer))", obj, vars))
+			default_collage_min_distance = lisp_integer(vars[0]);
+		    else if (lisp_match_string("(cheat-amount #?(integer))", obj, vars))
+			default_cheat_amount = lisp_integer(vars[0]);
+		    else if (lisp_match_string("(forbid-reconstruction-distance #?(integer))", obj, vars))
+			default_forbid_reconstruction_radius = lisp_integer(vars[0]);
+		    else if (lisp_match_string("(tile-cache-size #?(integer))", obj, vars))
+			default_tile_cache_size = lisp_integer(vars[0]);
+		    else if (lisp_match_string("(prepare-pyramid #?(boolean))", obj, vars))
+			default_prepare_pyramid = lisp_boolean(vars[0]);
+		    else if (lisp_match_string("(prepare-from-thumbnails #?(boolean))", obj, vars))
+			default_prepare_from_thumbnails = lisp_boolean(vars[0]);
+		    else if (lisp_match_string("(duplicate-distance #?(integer))", obj, vars))
+			default_duplicate_distance = lisp_integer(vars[0]);
+		    else if (lisp_match_string("(keep-duplicates #?(boolean))", obj, vars))
+			default_keep_duplicates = lisp_boolean(vars[0]);
+		    else if (lisp_match_string("(shared-features #?(boolean))", obj, vars))
+			default_shared_features = lisp_boolean(vars[0]);
+		    else if (lisp_match_string("(shared-features-directory #?(string))", obj, vars))
+			default_shared_features_directory = strdup(lisp_string(vars[0]));
+		    else if (lisp_match_string("(pyramid-min-size #?(integer))", obj, vars))
+			default_pyramid_min_size = lisp_integer(vars[0]);
+		    else if (lisp_match_string("(jobs #?(integer))", obj, vars))
+			default_num_jobs = lisp_integer(vars[0]);
+		    else if (lisp_match_string("(threads #?(integer))", obj, vars))
+			default_num_threads = lisp_integer(vars[0]);
+		    else if (lisp_match_string("(prepare-flip #?(boolean) #?(boolean))", obj, vars))
+		    {
+			default_prepare_flip = 0;
+			if (lisp_boolean(vars[0]))
+			    default_prepare_flip |= FLIP_HOR;
+			if (lisp_boolean(vars[1]))
+			    default_prepare_flip |= FLIP_VER;
+		    }
+		    else if (lisp_match_string("(metapixel-flip #?(boolean) #?(boolean))", obj, vars))
+		    {
+			default_metapixel_flip = 0;
+			if (lisp_boolean(vars[0]))
+			    default_metapixel_flip |= FLIP_HOR;
+			if (lisp_boolean(vars[1]))
+			    default_metapixel_flip |= FLIP_VER;
+		    }
+		    else
+		    {
+			fprintf(stderr, "Warning: unknown rc file option ");
+			lisp_dump(obj, stderr);
+			fprintf(stderr, "\n");
+		    }
+		}
+		else if (type == LISP_TYPE_PARSE_ERROR)
+		    fprintf(stderr, "Error: parse error in rc file.\n");
+
+		lisp_free(obj);
+
+		if (type == LISP_TYPE_EOF || type == LISP_TYPE_PARSE_ERROR)
+		    break;
+	    }
+
+	    lisp_stream_free_path(&stream);
+	}
+    }
+
+    free(filename);
+}
+
+typedef struct
+{
+    const char *filename;
+    unsigned int width, height;
+    unsigned int flip;
+    int pyramid;
+    int thumbnail;
+    int duplicate_distance;	/* negative if duplicates are allowed */
+    int keep_duplicates;	/* only warn about them */
+
+    /* Set when the source is looked up in the manifest.  The path is
+       0 if the source doesn't exist. */
+    char *path;
+    long long size, mtime;
+    int have_old_hash;
+    unsigned long long old_hash;
+
+    int hashed;
+    unsigned long long hash;
+    int unchanged;
+    metapixel_t *pixel;		/* 0 if the image could not be read */
+} prepare_job_t;
+
+static void
+prepare_image_task (void *data)
+{
+    prepare_job_t *job = (prepare_job_t*)data;
+    unsigned int full_width, full_height;
+    bitmap_t *bitmap;
+
+    /* hashing would read the whole file, which is what reading only
+       the thumbnail saves us */
+    if (job->path != 0 && !job->thumbnail)
+    {
+	job->hashed = manifest_hash_file(job->path, &job->hash);
+
+	/* only touched */
+	if (job->hashed && job->have_old_hash && job->hash == job->old_hash)
+	{
+	    job->unchanged = 1;
+	    return;
+	}
+    }
+
+    bitmap = 0;
+    if (job->thumbnail)
+	bitmap = bitmap_read_thumbnail(job->filename, job->width, job->height, &full_width, &full_height);
+    /* the image is scaled down anyway */
+    if (bitmap == 0)
+	bitmap = bitmap_read_scaled(job->filename, job->width, job->height, &full_width, &full_height);
+    if (bitmap == 0)
+    {
+	job->pixel = 0;
+	return;
+    }
+
+    job->pixel = metapixel_new_from_bitmap(bitmap, strip_path(job->filename), job->width, job->height);
+    assert(job->pixel != 0);
+
+    /* the size we decoded at is rounded */
+    job->pixel->aspect_ratio = (float)full_width / (float)full_height;
+
+    bitmap_free(bitmap);
+
+    if (job->pyramid)
+	metapixel_add_levels(job->pixel, default_pyramid_min_size > 0 ? default_pyramid_min_size : 1);
+
+    job->pixel->flip = job->flip;
+}
+
+/* Looks up the source of the job in the manifest.  Returns whether
+   it has to be prepared at all. */
+static int
+check_prepare_job (prepare_job_t *job, manifest_t *manifest)
+{
+    manifest_entry_t *entry;
+    struct stat buf;
+
+    job->path = realpath(job->filename, 0);
+    if (job->path == 0 || stat(job->path, &buf) != 0)
+	return 1;
+
+    job->size = buf.st_size;
+    job->mtime = buf.st_mtime;
+
+    entry = manifest_lookup(manifest, job->path);
+    if (entry == 0)
+	return 1;
+
+    if (entry->size == job->size && entry->mtime == job->mtime)
+    {
+	job->unchanged = 1;
+	return 0;
+    }
+
+    /* sources prepared from thumbnails have no hash */
+    job->have_old_hash = entry->hash != 0;
+    job->old_hash = entry->hash;
+
+    return 1;
+}
+
+/* Records in the manifest that the source of the job is the
+   metapixel with the given filename.  The metapixel the source was
+   prepared to before, if it was a different one, is added to the
+   stale ones. */
+static void
+update_manifest (manifest_t *manifest, prepare_job_t *job, const char *filename,
+		 string_list_t **stale_filenames)
+{
+    manifest_entry_t *old = manifest_lookup(manifest, job->path);
+
+    if (old != 0 && strcmp(old->filename, filename) != 0)
+	*stale_filenames = string_list_prepend_copy(*stale_filenames, old->filename);
+
+    manifest_set(manifest, job->path, filename, job->size, job->mtime, job->hashed ? job->hash : 0);
+}
+
+/* Finishes a prepared job in the main thread.  Returns 0 if the
+   image could not be added. */
+static int
+finish_prepare_job (library_t *library, manifest_t *manifest, prepare_job_t *job,
+		    string_list_t **stale_filenames)
+{
+    manifest_entry_t *same;
+    metapixel_t *pixel;
+
+    if (job->unchanged)
+    {
+	/* if it was only touched we must remember the new mtime */
+	if (job->hashed)
+	{
+	    manifest_entry_t *entry = manifest_lookup(manifest, job->path);
+
+	    assert(entry != 0);
+	    manifest_set(manifest, job->path, entry->filename, job->size, job->mtime, job->hash);
+	}
+
+	return 1;
+    }
+
+    if (job->pixel == 0)
+    {
+	fprintf(stderr, "Error: could not read image `%s'.\n", job->filename);
+	return 0;
+    }
+
+    /* the same image was already prepared from another source */
+    same = job->hashed ? manifest_lookup_hash(manifest, job->hash) : 0;
+    if (same != 0)
+    {
+	char *filename = strdup(same->filename);
+
+	assert(filename != 0);
+	update_manifest(manifest, job, filename, stale_filenames);
+	free(filename);
+
+	return 1;
+    }
+
+    if (job->duplicate_distance >= 0)
+    {
+	metapixel_t *duplicate = library_find_duplicate(library, job->pixel, job->duplicate_distance);
+
+	if (duplicate != 0)
+	{
+	    fprintf(stderr, "Warning: `%s' is a duplicate of `%s'.\n", job->filename, duplicate->name);
+
+	    /* so that it's not looked at again until it changes */
+	    if (!job->keep_duplicates)
+	    {
+		if (job->path != 0)
+		{
+		    char *filename = strdup(duplicate->filename);
+
+		    assert(filename != 0);
+		    update_manifest(manifest, job, filename, stale_filenames);
+		    free(filename);
+		}
+
+		return 1;
+	    }
+	}
+    }
+
+    pixel = library_add_metapixel(library, job->pixel);
+    if (pixel == 0)
+    {
+	fprintf(stderr, "Error: could not add `%s' to library.\n", job->filename);
+	return 0;
+    }
+
+    if (job->path != 0)
+	update_manifest(manifest, job, pixel->filename, stale_filenames);
+
+    return 1;
+}
+
+/* Reads, scales and analyzes the images with the thread pool, and
+   adds them to the library in the given order.  While one window of
+   images is being added, the next one is prepared.  Sources which
+   the manifest says haven't changed are skipped.  Returns the number
+   of images which could not be added. */
+static unsigned int
+prepare_images (library_t *library, manifest_t *manifest, char **filenames, unsigned int num_filenames,
+		unsigned int width, unsigned int height, unsigned int flip, int pyramid, int thumbnails,
+		int duplicate_distance, int keep_duplicates, string_list_t **stale_filenames)
+{
+    thread_pool_t *pool = thread_pool_get_default();
+    unsigned int window = 4 * (thread_pool_num_threads(pool) + 1);
+    prepare_job_t *jobs = (prepare_job_t*)malloc(sizeof(prepare_job_t) * (num_filenames + 1));
+    task_group_t groups[2];
+    unsigned int num_failed = 0;
+    unsigned int start, i;
+
+    assert(jobs != 0);
+    memset(jobs, 0, sizeof(prepare_job_t) * num_filenames);
+
+    for (i = 0; i < num_filenames; ++i)
+    {
+	jobs[i].filename = filenames[i];
+	jobs[i].width = width;
+	jobs[i].height = height;
+	jobs[i].flip = flip;
+	jobs[i].pyramid = pyramid;
+	jobs[i].thumbnail = thumbnails;
+	jobs[i].duplicate_distance = duplicate_distance;
+	jobs[i].keep_duplicates = keep_duplicates;
+    }
+
+    for (start = 0; start < num_filenames + window; start += window)
+    {
+	task_group_t *group = &groups[(start / window) % 2];
+
+	/* start preparing the next window */
+	if (start < num_filenames)
+	{
+	    task_group_init(group, pool);
+	    for (i = start; i < num_filenames && i < start + window; ++i)
+		if (check_prepare_job(&jobs[i], manifest))
+		    task_group_spawn(group, prepare_image_task, &jobs[i]);
+	}
+
+	/* and add the previous one */
+	if (start >= window)
+	{
+	    group = &groups[(start / window - 1) % 2];
+	    task_group_wait(group);
+
+	    for (i = start - window; i < num_filenames && i < start; ++i)
+	    {
+		if (!finish_prepare_job(library, manifest, &jobs[i], stale_filenames))
+		    ++num_failed;
+
+		if (jobs[i].pixel != 0)
+		{
+		    metapixel_free(jobs[i].pixel);
+		    free(jobs[i].pixel);
+		    jobs[i].pixel = 0;
+		}
+		if (jobs[i].path != 0)
+		{
+		    free(jobs[i].path);
+		    jobs[i].path = 0;
+		}
+	    }
+	}
+    }
+
+    free(jobs);
+
+    return num_failed;
+}
+
+/* Removes the manifest entries of sources which don't exist anymore
+   and adds their metapixels to the stale ones. */
+static void
+prune_manifest (manifest_t *manifest, string_list_t **stale_filenames)
+{
+    unsigned int num_entries, i;
+    manifest_entry_t **entries = manifest_get_entries(manifest, &num_entries);
+
+    for (i = 0; i < num_entries; ++i)
+    {
+	struct stat buf;
+
+	if (stat(entries[i]->path, &buf) == 0)
+	    continue;
+
+	*stale_filenames = string_list_prepend_copy(*stale_filenames, entries[i]->filename);
+	manifest_remove(manifest, entries[i]->path);
+    }
+
+    free(entries);
+}
+
+/* Removes the stale metapixels which no source in the manifest
+   refers to anymore from the library.  Returns 0 on failure. */
+static int
+remove_stale_metapixels (const char *library_name, manifest_t *manifest, string_list_t *stale_filenames)
+{
+    hash_table_t *referenced = hash_table_new(hash_string, hash_string_equal);
+    unsigned int num_entries, num_filenames = 0, i;
+    manifest_entry_t **entries = manifest_get_entries(manifest, &num_entries);
+    char **filenames = (char**)malloc(sizeof(char*) * (string_list_length(stale_filenames) + 1));
+    library_t *library;
+    int result = 1;
+
+    assert(filenames != 0);
 
-    if (access(filename, R_OK) == 0)
+    for (i = 0; i < num_entries; ++i)
+	hash_table_insert(referenced, entries[i]->filename, entries[i]);
+
+    for (; stale_filenames != 0; stale_filenames = stale_filenames->next)
+	if (hash_table_lookup(referenced, stale_filenames->str) == 0)
+	    filenames[num_filenames++] = stale_filenames->str;
+
+    if (num_filenames > 0)
     {
-	if (lisp_stream_init_path(&stream, filename) == 0)
-	    fprintf(stderr, "Warning: could not open rc file `%s'.", filename);
+	library = library_open(library_name);
+	if (library == 0)
+	    result = 0;
 	else
 	{
-	    for (;;)
-	    {
-		lisp_object_t *obj;
-		int type;
-
-		obj = lisp_read(&stream);
-		type = lisp_type(obj);
+	    result = library_remove_metapixels(library, filenames, num_filenames);
+	    library_close(library);
+	}
+    }
 
-		if (type != LISP_TYPE_EOF && type != LISP_TYPE_PARSE_ERROR)
-		{
-		    lisp_object_t *vars[3];
+    free(filenames);
+    free(entries);
+    hash_table_free(referenced);
 
-		    if (lisp_match_string("(prepare-directory #?(string))", obj, vars))
-			default_prepare_directory = strdup(lisp_string(vars[0]));
-		    else if (lisp_match_string("(prepare-dimensions #?(integer) #?(integer))", obj, vars))
-		    {
-			default_prepare_width = lisp_integer(vars[0]);
-			default_prepare_height = lisp_integer(vars[1]);
-		    }
-		    else if (lisp_match_string("(library-directory #?(string))", obj, vars))
-			default_library_directories = string_list_prepend_copy(default_library_directories,
-									       lisp_string(vars[0]));
-		    else if (lisp_match_string("(small-image-dimensions #?(integer) #?(integer))", obj, vars))
-		    {
-			default_small_width = lisp_integer(vars[0]);
-			default_small_height = lisp_integer(vars[1]);
-		    }
-		    else if (lisp_match_string("(yiq-weights #?(number) #?(number) #?(number))", obj, vars))
-		    {
-			int i;
+    return result;
+}
 
-			for (i = 0; i < 3; ++i)
-			    default_weight_factors[i] = lisp_real(vars[i]);
-		    }
-		    else if (lisp_match_string("(metric #?(or subpixel))", obj, vars))
-		    {
-			if (strcmp(lisp_symbol(vars[0]), "subpixel") == 0)
-			    default_metric = METRIC_SUBPIXEL;
-		    }
-		    else if (lisp_match_string("(search-method #?(or local global))", obj, vars))
-		    {
-			if (strcmp(lisp_symbol(vars[0]), "local") == 0)
-			    default_search = SEARCH_LOCAL;
-			else
-			    default_search = SEARCH_GLOBAL;
-		    }
-		    else if (lisp_match_string("(minimum-classic-distance #?(integer))", obj, vars))
-			default_classic_min_distance = lisp_integer(vars[0]);
-		    else if (lisp_match_string("(minimum-collage-distance #?(integer))", obj, vars))
-			default_collage_min_distance = lisp_integer(vars[0]);
-		    else if (lisp_match_string("(cheat-amount #?(integer))", obj, vars))
-			default_cheat_amount = lisp_integer(vars[0]);
-		    else if (lisp_match_string("(forbid-reconstruction-distance #?(integer))", obj, vars))
-			default_forbid_reconstruction_radius = lisp_integer(vars[0]);
-		    else if (lisp_match_string("(prepare-flip #?(boolean) #?(boolean))", obj, vars))
-		    {
-			default_prepare_flip = 0;
-			if (lisp_boolean(vars[0]))
-			    default_prepare_flip |= FLIP_HOR;
-			if (lisp_boolean(vars[1]))
-			    default_prepare_flip |= FLIP_VER;
-		    }
-		    else if (lisp_match_string("(metapixel-flip #?(boolean) #?(boolean))", obj, vars))
-		    {
-			default_metapixel_flip = 0;
-			if (lisp_boolean(vars[0]))
-			    default_metapixel_flip |= FLIP_HOR;
-			if (lisp_boolean(vars[1]))
-			    default_metapixel_flip |= FLIP_VER;
-		    }
-		    else
-		    {
-			fprintf(stderr, "Warning: unknown rc file option ");
-			lisp_dump(obj, stderr);
-			fprintf(stderr, "\n");
-		    }
-		}
-		else if (type == LISP_TYPE_PARSE_ERROR)
-		    fprintf(stderr, "Error: parse error in rc file.\n");
+/* Reads filenames, one per line, until the end of the file. */
+static char**
+read_filename_list (FILE *in, unsigned int *num_filenames)
+{
+    char **filenames = 0;
+    unsigned int num = 0, allocated = 0;
+    char *line = 0;
+    size_t line_size = 0;
+    ssize_t length;
 
-		lisp_free(obj);
+    while ((length = getline(&line, &line_size, in)) != -1)
+    {
+	while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+	    line[--length] = '\0';
 
-		if (type == LISP_TYPE_EOF || type == LISP_TYPE_PARSE_ERROR)
-		    break;
-	    }
+	if (length == 0)
+	    continue;
 
-	    lisp_stream_free_path(&stream);
+	if (num == allocated)
+	{
+	    allocated = allocated == 0 ? 256 : allocated * 2;
+	    filenames = (char**)realloc(filenames, sizeof(char*) * allocated);
+	    assert(filenames != 0);
 	}
+
+	filenames[num] = strdup(line);
+	assert(filenames[num] != 0);
+	++num;
     }
 
-    free(filename);
+    if (line != 0)
+	free(line);
+
+    *num_filenames = num;
+
+    return filenames;
 }
 
 static void
@@ -490,12 +1412,22 @@ usage (void)
 	   "      print this help text\n"
 	   "  metapixel --new-library <library-dir>\n"
 	   "      create a new library\n"
-	   "  metapixel [option ...] --prepare <library-dir> <image>\n"
-	   "      add <image> to the library in <library-dir>\n"
+	   "  metapixel --convert-to-atlas <library-dir>\n"
+	   "      move the images of a library into a single atlas file\n"
+	   "  metapixel [option ...] --prepare <library-dir> <image> ...\n"
+	   "      add the images to the library in <library-dir>.  Without\n"
+	   "      images, or with -, their filenames are read from stdin,\n"
+	   "      one per line\n"
 	   "  metapixel [option ...] --metapixel <in> <out>\n"
 	   "      transform <in> to <out>\n"
 	   "  metapixel [option ...] --batch <batchfile>\n"
 	   "      perform all the tasks in <batchfile>\n"
+	   "  metapixel [option ...] --server=<socket>\n"
+	   "      keep the libraries loaded and perform the tasks sent to\n"
+	   "      the Unix domain socket <socket>, several at a time\n"
+	   "  metapixel --submit=<socket> [<batchfile>]\n"
+	   "      send the tasks in <batchfile>, or from stdin, to the\n"
+	   "      server at <socket> and print its progress reports\n"
 	   "Options:\n"
 	   "  -l, --library=DIR            add the library in DIR\n"
 	   "  -x, --antimosaic=PIC         use PIC as an antimosaic\n"
@@ -523,11 +1455,35 @@ usage (void)
 	   "                               flipped (no, x, y, xy)\n"
 	   "  --out=FILE                   write protocol to file\n"
 	   "  --in=FILE                    read protocol from file and use it\n"
+	   "  --tile-cache=SIZE            memory for caching scaled small images in MB\n"
+	   "                               default to %d, 0 disables the cache\n"
+	   "  --pyramid                    also store smaller versions of prepared\n"
+	   "                               images, down to %dx%d\n"
+	   "  --atlas                      with --new-library, store the images of the\n"
+	   "                               library in a single atlas file\n"
+	   "  --prune                      with --prepare, remove images whose source\n"
+	   "                               files don't exist anymore from the library\n"
+	   "  --thumbnails                 with --prepare, use the thumbnails embedded\n"
+	   "                               in JPEG files if they are large enough\n"
+	   "  --duplicates=DIST            with --prepare, don't add images whose\n"
+	   "                               subpixels all differ by at most DIST from\n"
+	   "                               those of an image in the library\n"
+	   "  --keep-duplicates            with --duplicates, only warn about them\n"
+	   "  --shared-features[=DIR]      share the features of libraries with other\n"
+	   "                               processes in shared memory, or in files in\n"
+	   "                               DIR, which can be on hugetlbfs\n"
+	   "  --jobs=NUM                   with --batch and --server, perform up to NUM\n"
+	   "                               tasks at once\n"
+	   "                               defaults to the number of threads\n"
+	   "  --threads=NUM                use NUM threads for all work\n"
+	   "                               defaults to one per processor\n"
 	   "\n"
 	   "Report bugs and suggestions to schani@complang.tuwien.ac.at\n",
 	   default_classic_min_distance,
 	   default_cheat_amount,
-	   default_forbid_reconstruction_radius + 1
+	   default_forbid_reconstruction_radius + 1,
+	   default_tile_cache_size,
+	   default_pyramid_min_size, default_pyramid_min_size
 	   );
 }
 
@@ -542,12 +1498,28 @@ usage (void)
 #define OPT_PRINT_PREPARE_SETTINGS     264
 #define OPT_FLIP                       265
 #define OPT_NEW_LIBRARY		       266
+#define OPT_TILE_CACHE                 267
+#define OPT_PYRAMID                    268
+#define OPT_ATLAS                      269
+#define OPT_CONVERT_TO_ATLAS           270
+#define OPT_PRUNE                      271
+#define OPT_THUMBNAILS                 272
+#define OPT_DUPLICATES                 273
+#define OPT_KEEP_DUPLICATES            274
+#define OPT_SHARED_FEATURES            275
+#define OPT_SERVER                     276
+#define OPT_SUBMIT                     277
+#define OPT_JOBS                       278
+#define OPT_THREADS                    279
 
 #define MODE_NONE		0
 #define MODE_NEW_LIBRARY	1
 #define MODE_PREPARE		2
 #define MODE_METAPIXEL		3
 #define MODE_BATCH		4
+#define MODE_CONVERT_TO_ATLAS	5
+#define MODE_SERVER		6
+#define MODE_SUBMIT		7
 
 int
 main (int argc, char *argv[])
@@ -565,6 +1537,17 @@ main (int argc, char *argv[])
     string_list_t *library_directories = 0;
     int prepare_width = 0, prepare_height = 0;
     unsigned int flip = 0xdeadbeef;
+    int tile_cache_size;
+    int prepare_pyramid;
+    int atlas = 0;
+    int prune = 0;
+    int prepare_from_thumbnails;
+    int duplicate_distance, keep_duplicates;
+    int shared_features;
+    char *shared_features_directory;
+    char *socket_path = 0;
+    int num_jobs;
+    int num_threads;
 
     read_rc_file();
 
@@ -580,6 +1563,15 @@ main (int argc, char *argv[])
     collage_min_distance = default_collage_min_distance;
     cheat = default_cheat_amount;
     forbid_reconstruction_radius = default_forbid_reconstruction_radius + 1;
+    tile_cache_size = default_tile_cache_size;
+    prepare_pyramid = default_prepare_pyramid;
+    prepare_from_thumbnails = default_prepare_from_thumbnails;
+    duplicate_distance = default_duplicate_distance;
+    keep_duplicates = default_keep_duplicates;
+    shared_features = default_shared_features;
+    shared_features_directory = default_shared_features_directory;
+    num_jobs = default_num_jobs;
+    num_threads = default_num_threads;
 
     while (1)
     {
@@ -596,6 +1588,19 @@ main (int argc, char *argv[])
 		{ "benchmark-rendering", no_argument, 0, OPT_BENCHMARK_RENDERING },
 		{ "print-prepare-settings", no_argument, 0, OPT_PRINT_PREPARE_SETTINGS },
 		{ "flip", required_argument, 0, OPT_FLIP },
+		{ "tile-cache", required_argument, 0, OPT_TILE_CACHE },
+		{ "pyramid", no_argument, 0, OPT_PYRAMID },
+		{ "atlas", no_argument, 0, OPT_ATLAS },
+		{ "convert-to-atlas", no_argument, 0, OPT_CONVERT_TO_ATLAS },
+		{ "prune", no_argument, 0, OPT_PRUNE },
+		{ "thumbnails", no_argument, 0, OPT_THUMBNAILS },
+		{ "duplicates", required_argument, 0, OPT_DUPLICATES },
+		{ "keep-duplicates", no_argument, 0, OPT_KEEP_DUPLICATES },
+		{ "shared-features", optional_argument, 0, OPT_SHARED_FEATURES },
+		{ "server", required_argument, 0, OPT_SERVER },
+		{ "submit", required_argument, 0, OPT_SUBMIT },
+		{ "jobs", required_argument, 0, OPT_JOBS },
+		{ "threads", required_argument, 0, OPT_THREADS },
 		{ "library", required_argument, 0, 'l' },
 		{ "width", required_argument, 0, 'w' },
 		{ "height", required_argument, 0, 'h' },
@@ -675,6 +1680,77 @@ main (int argc, char *argv[])
 		    flip |= FLIP_VER;
 		break;
 
+	    case OPT_TILE_CACHE :
+		tile_cache_size = atoi(optarg);
+		break;
+
+	    case OPT_PYRAMID :
+		prepare_pyramid = 1;
+		break;
+
+	    case OPT_ATLAS :
+		atlas = 1;
+		break;
+
+	    case OPT_CONVERT_TO_ATLAS :
+		mode = MODE_CONVERT_TO_ATLAS;
+		break;
+
+	    case OPT_PRUNE :
+		prune = 1;
+		break;
+
+	    case OPT_THUMBNAILS :
+		prepare_from_thumbnails = 1;
+		break;
+
+	    case OPT_DUPLICATES :
+		duplicate_distance = atoi(optarg);
+		if (duplicate_distance < 0)
+		{
+		    fprintf(stderr, "Error: duplicate distance must be non-negative.\n");
+		    return 1;
+		}
+		break;
+
+	    case OPT_KEEP_DUPLICATES :
+		keep_duplicates = 1;
+		break;
+
+	    case OPT_SHARED_FEATURES :
+		shared_features = 1;
+		if (optarg != 0)
+		    shared_features_directory = optarg;
+		break;
+
+	    case OPT_SERVER :
+		mode = MODE_SERVER;
+		socket_path = optarg;
+		break;
+
+	    case OPT_SUBMIT :
+		mode = MODE_SUBMIT;
+		socket_path = optarg;
+		break;
+
+	    case OPT_JOBS :
+		num_jobs = atoi(optarg);
+		if (num_jobs < 1)
+		{
+		    fprintf(stderr, "Error: number of jobs must be positive.\n");
+		    return 1;
+		}
+		break;
+
+	    case OPT_THREADS :
+		num_threads = atoi(optarg);
+		if (num_threads < 1)
+		{
+		    fprintf(stderr, "Error: number of threads must be positive.\n");
+		    return 1;
+		}
+		break;
+
 	    case 'm' :
 		if (strcmp(optarg, "subpixel") == 0)
 		    metric = METRIC_SUBPIXEL;
@@ -857,6 +1933,20 @@ main (int argc, char *argv[])
 	fprintf(stderr, "Error: forbid reconstruction distance must be non-negative.\n");
 	return 1;
     }
+    if (tile_cache_size < 0)
+    {
+	fprintf(stderr, "Error: tile cache size must be non-negative.\n");
+	return 1;
+    }
+
+    if (num_threads < 0)
+    {
+	fprintf(stderr, "Error: number of threads must be positive.\n");
+	return 1;
+    }
+
+    thread_pool_set_default_concurrency(num_threads);
+    library_set_shared_features(shared_features, shared_features_directory);
 
     if (in_filename != 0 || out_filename != 0)
     {
@@ -891,18 +1981,47 @@ main (int argc, char *argv[])
 	if (library == 0)
 	    return 1;
 
+	if (atlas && !library_convert_to_atlas(library))
+	    return 1;
+
+	library_close(library);
+
+	return 0;
+    }
+    else if (mode == MODE_CONVERT_TO_ATLAS)
+    {
+	library_t *library;
+
+	if (argc - optind != 1)
+	{
+	    usage();
+	    return 1;
+	}
+
+	library = library_open(argv[optind]);
+	if (library == 0)
+	    return 1;
+
+	if (!library_convert_to_atlas(library))
+	{
+	    fprintf(stderr, "Error: could not convert library.\n");
+	    return 1;
+	}
+
 	library_close(library);
 
 	return 0;
     }
     else if (mode == MODE_PREPARE)
     {
-	char *inimage_name, *library_name;
-	metapixel_t *pixel;
-	bitmap_t *bitmap;
+	char *library_name;
+	char **filenames;
+	unsigned int num_filenames, num_failed, i;
 	library_t *library;
+	manifest_t *manifest;
+	string_list_t *stale_filenames = 0;
 
-	if (argc - optind != 2)
+	if (argc - optind < 1)
 	{
 	    usage();
 	    return 1;
@@ -911,41 +2030,121 @@ main (int argc, char *argv[])
 	assert(prepare_width > 0 && prepare_height > 0);
 
 	library_name = argv[optind + 0];
-	inimage_name = argv[optind + 1];
 
-	library = library_open_without_reading(library_name);
+	/* without images, or with `-', the filenames come from stdin */
+	if (argc - optind == 1 || (argc - optind == 2 && strcmp(argv[optind + 1], "-") == 0))
+	    filenames = read_filename_list(stdin, &num_filenames);
+	else
+	{
+	    num_filenames = argc - optind - 1;
+	    filenames = (char**)malloc(sizeof(char*) * num_filenames);
+	    assert(filenames != 0);
+
+	    for (i = 0; i < num_filenames; ++i)
+	    {
+		filenames[i] = strdup(argv[optind + 1 + i]);
+		assert(filenames[i] != 0);
+	    }
+	}
+
+	/* looking for duplicates needs the metapixels */
+	if (duplicate_distance >= 0)
+	    library = library_open(library_name);
+	else
+	    library = library_open_without_reading(library_name);
 	if (library == 0)
 	    return 1;
 
-	bitmap = bitmap_read(inimage_name);
-	if (bitmap == 0)
+	manifest = manifest_open(library_name);
+	if (manifest == 0)
+	    return 1;
+
+	if (!library_begin_batch(library))
 	{
-	    fprintf(stderr, "Error: could not read image `%s'.\n", inimage_name);
+	    library_close(library);
 	    return 1;
 	}
 
-	pixel = metapixel_new_from_bitmap(bitmap, strip_path(inimage_name), prepare_width, prepare_height);
-	assert(pixel != 0);
+	num_failed = prepare_images(library, manifest, filenames, num_filenames,
+				    prepare_width, prepare_height, flip, prepare_pyramid, prepare_from_thumbnails,
+				    duplicate_distance, keep_duplicates, &stale_filenames);
+
+	/* the manifest must not refer to metapixels which aren't in
+	   the tables file */
+	if (!library_end_batch(library))
+	    num_failed = num_filenames;
+
+	library_close(library);
+
+	if (prune)
+	    prune_manifest(manifest, &stale_filenames);
+
+	/* better to leave metapixels behind than to refer to removed
+	   ones */
+	if (!manifest_sync(manifest))
+	    num_failed = num_filenames;
 
-	bitmap_free(bitmap);
+	if (stale_filenames != 0 && !remove_stale_metapixels(library_name, manifest, stale_filenames))
+	    num_failed = num_filenames;
 
-	pixel->flip = flip;
+	if (!manifest_close(manifest))
+	    num_failed = num_filenames;
+
+	while (stale_filenames != 0)
+	{
+	    string_list_t *next = stale_filenames->next;
+
+	    free(stale_filenames->str);
+	    free(stale_filenames);
+	    stale_filenames = next;
+	}
+
+	for (i = 0; i < num_filenames; ++i)
+	    free(filenames[i]);
+	if (filenames != 0)
+	    free(filenames);
+
+	if (num_failed > 0)
+	    return 1;
+    }
+    else if (mode == MODE_SUBMIT)
+    {
+	FILE *in = stdin;
+	int num_failed;
 
-	if (!library_add_metapixel(library, pixel))
+	if (argc - optind > 1)
 	{
-	    fprintf(stderr, "Error: could not add metapixel to library.\n");
+	    usage();
 	    return 1;
 	}
 
-	metapixel_free(pixel);
+	if (argc - optind == 1 && strcmp(argv[optind], "-") != 0)
+	{
+	    in = fopen(argv[optind], "r");
+	    if (in == 0)
+	    {
+		fprintf(stderr, "cannot open batch file `%s': %s\n", argv[optind], strerror(errno));
+		return 1;
+	    }
+	}
+
+	num_failed = server_submit(socket_path, in);
 
-	library_close(library);
+	if (in != stdin)
+	    fclose(in);
+
+	if (num_failed != 0)
+	    return 1;
     }
     else if (mode == MODE_METAPIXEL
-	     || mode == MODE_BATCH)
+	     || mode == MODE_BATCH
+	     || mode == MODE_SERVER)
     {
+	classic_job_t job_defaults;
+
 	if ((mode == MODE_METAPIXEL && argc - optind != 2)
-	    || (mode == MODE_BATCH && argc - optind != 1))
+	    || (mode == MODE_BATCH && argc - optind != 1)
+	    || (mode == MODE_SERVER && argc - optind != 0))
 	{
 	    usage();
 	    return 1;
@@ -1004,17 +2203,8 @@ main (int argc, char *argv[])
 	}
 	else if (library_directories != 0)
 	{
-	    string_list_t *lst;
-
-	    for (lst = library_directories; lst != 0; lst = lst->next)
-	    {
-		library_t *library = library_open(lst->str);
-
-		if (library == 0)
-		    return 1;
-
-		add_library(library);
-	    }
+	    if (!open_libraries(library_directories))
+		return 1;
 
 	    forbid_reconstruction_radius = 0;
 	}
@@ -1024,136 +2214,66 @@ main (int argc, char *argv[])
 	    return 1;
 	}
 
+	if (tile_cache_size > 0)
+	    tile_cache = tile_cache_new((unsigned long)tile_cache_size << 20);
+
+	if (num_jobs <= 0)
+	    num_jobs = thread_pool_num_threads(thread_pool_get_default()) + 1;
+
+	job_defaults.image_in_filename = 0;
+	job_defaults.image_out_filename = 0;
+	job_defaults.protocol_in_filename = in_filename;
+	job_defaults.protocol_out_filename = out_filename;
+	job_defaults.metric = metric;
+	job_defaults.scale = scale;
+	job_defaults.search = search;
+	job_defaults.min_distance = classic_min_distance;
+	job_defaults.cheat = cheat;
+
 	if (mode == MODE_METAPIXEL)
 	{
 	    if (collage)
-		generate_collage(argv[optind], argv[optind + 1], scale, collage_min_distance,
-				 metric, cheat, flip);
+	    {
+		if (!generate_collage(argv[optind], argv[optind + 1], scale, collage_min_distance,
+				      metric, cheat, flip))
+		    return 1;
+	    }
 	    else
-		make_classic_mosaic(argv[optind], argv[optind + 1],
-				    metric, scale, search, classic_min_distance, cheat, flip,
-				    in_filename, out_filename);
+	    {
+		if (!make_classic_mosaic(argv[optind], argv[optind + 1],
+					 metric, scale, search, classic_min_distance, cheat, flip,
+					 in_filename, out_filename, 0, 0))
+		    return 1;
+	    }
 	}
-	else if (mode == MODE_BATCH)
+	else if (mode == MODE_SERVER)
 	{
-	    FILE *in = fopen(argv[optind], "r");
-	    lisp_stream_t stream;
+	    server_job_defaults = job_defaults;
 
-	    if (in == 0)
-	    {
-		fprintf(stderr, "cannot open batch file `%s': %s\n", argv[optind], strerror(errno));
+	    if (!server_run(socket_path, num_jobs, run_server_job))
 		return 1;
-	    }
-
-	    lisp_stream_init_file(&stream, in);
+	}
+	else if (mode == MODE_BATCH)
+	{
+	    if (!run_batch(argv[optind], &job_defaults, num_jobs))
+		return 1;
+	}
+	else
+	    assert(0);
 
-	    for (;;)
+	if (tile_cache != 0)
+	{
+	    if (benchmark_rendering)
 	    {
-		lisp_object_t *obj = lisp_read(&stream);
-		int type = lisp_type(obj);
-
-		if (type != LISP_TYPE_EOF && type != LISP_TYPE_PARSE_ERROR)
-		{
-		    lisp_object_t *vars[4];
+		unsigned long num_hits, num_misses;
 
-		    if (lisp_match_string("(classic (#?(or image protocol) #?(string)) #?(string) . #?(list))",
-					  obj, vars))
-		    {
-			float this_scale = scale;
-			int this_search = search;
-			int this_min_distance = classic_min_distance;
-			int this_cheat = cheat;
-			int this_metric = metric;
-			char *this_prot_in_filename = in_filename;
-			char *this_prot_out_filename = out_filename;
-			char *this_image_out_filename = lisp_string(vars[2]);
-			char *this_image_in_filename = 0;
-			lisp_object_t *lst;
-			lisp_object_t *var;
-
-			if (strcmp(lisp_symbol(vars[0]), "image") == 0)
-			    this_image_in_filename = lisp_string(vars[1]);
-			else
-			    this_prot_in_filename = lisp_string(vars[1]);
-
-			for (lst = vars[3]; lisp_type(lst) != LISP_TYPE_NIL; lst = lisp_cdr(lst))
-			{
-			    if (lisp_match_string("(scale #?(real))",
-						  lisp_car(lst), &var))
-			    {
-				float val = lisp_real(var);
-
-				if (val <= 0.0)
-				    fprintf(stderr, "scale must be larger than 0\n");
-				else
-				    this_scale = val;
-			    }
-			    else if (lisp_match_string("(search #?(or local global))",
-						       lisp_car(lst), &var))
-			    {
-				if (strcmp(lisp_symbol(var), "local") == 0)
-				    this_search = SEARCH_LOCAL;
-				else
-				    this_search = SEARCH_GLOBAL;
-			    }
-			    else if (lisp_match_string("(min-distance #?(integer))",
-						       lisp_car(lst), &var))
-			    {
-				int val = lisp_integer(var);
-
-				if (val < 0)
-				    fprintf(stderr, "min-distance cannot be negative\n");
-				else
-				    this_min_distance = val;
-			    }
-			    else if (lisp_match_string("(cheat #?(integer))",
-						       lisp_car(lst), &var))
-			    {
-				int val = lisp_integer(var);
-
-				if (val < 0 || val > 100)
-				    fprintf(stderr, "cheat must be between 0 and 100, inclusively\n");
-				else
-				    this_cheat = val;
-			    }
-			    else if (lisp_match_string("(metric #?(or subpixel))",
-						       lisp_car(lst), &var))
-			    {
-				if (strcmp(lisp_symbol(var), "subpixel") == 0)
-				    this_metric = METRIC_SUBPIXEL;
-			    }
-			    else if (lisp_match_string("(protocol #?(string))",
-						       lisp_car(lst), &var))
-				this_prot_out_filename = lisp_string(var);
-			    else
-			    {
-				fprintf(stderr, "unknown expression ");
-				lisp_dump(lisp_car(lst), stderr);
-				fprintf(stderr, "\n");
-			    }
-			}
-
-			make_classic_mosaic(this_image_in_filename, this_image_out_filename,
-					    this_metric, this_scale, this_search, this_min_distance, this_cheat, 0,
-					    this_prot_in_filename, this_prot_out_filename);
-		    }
-		    else
-		    {
-			fprintf(stderr, "unknown expression ");
-			lisp_dump(obj, stderr);
-			fprintf(stderr, "\n");
-		    }
-		}
-		else if (type == LISP_TYPE_PARSE_ERROR)
-		    fprintf(stderr, "parse error in batch file\n");
-		lisp_free(obj);
-
-		if (type == LISP_TYPE_EOF)
-		    break;
+		tile_cache_get_stats(tile_cache, &num_hits, &num_misses);
+		printf("tile cache: %lu hits, %lu misses\n", num_hits, num_misses);
 	    }
+
+	    tile_cache_free(tile_cache);
+	    tile_cache = 0;
 	}
-	else
-	    assert(0);
     }
     else
     {
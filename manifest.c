@@ -0,0 +1,421 @@
+/*
+ * manifest.c
+ *
+ * metapixel
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+
+#include "lispreader/lispreader.h"
+
+#include "api.h"
+
+/* The manifest is a log: every change appends a record, and later
+   records override earlier ones.  It is compacted when it has become
+   much longer than necessary. */
+
+#define HASH_BUFFER_SIZE	65536
+
+static unsigned int
+hash_content_hash (const void *key)
+{
+    return hash_bytes(key, sizeof(unsigned long long), 0);
+}
+
+static int
+content_hashes_equal (const void *key1, const void *key2)
+{
+    return *(const unsigned long long*)key1 == *(const unsigned long long*)key2;
+}
+
+static void
+free_entry (manifest_entry_t *entry)
+{
+    free(entry->path);
+    free(entry->filename);
+    free(entry);
+}
+
+static void
+insert_entry (manifest_t *manifest, manifest_entry_t *entry)
+{
+    manifest_entry_t *old = (manifest_entry_t*)hash_table_lookup(manifest->entries, entry->path);
+
+    if (old != 0)
+    {
+	hash_table_remove(manifest->entries, old->path);
+	if (hash_table_lookup(manifest->hashes, &old->hash) == old)
+	    hash_table_remove(manifest->hashes, &old->hash);
+	free_entry(old);
+    }
+
+    hash_table_insert(manifest->entries, entry->path, entry);
+    /* 0 means the contents weren't hashed */
+    if (entry->hash != 0)
+	hash_table_insert(manifest->hashes, &entry->hash, entry);
+}
+
+static void
+remove_entry (manifest_t *manifest, const char *path)
+{
+    manifest_entry_t *entry = (manifest_entry_t*)hash_table_remove(manifest->entries, path);
+
+    if (entry == 0)
+	return;
+
+    if (hash_table_lookup(manifest->hashes, &entry->hash) == entry)
+	hash_table_remove(manifest->hashes, &entry->hash);
+    free_entry(entry);
+}
+
+static manifest_entry_t*
+make_entry (const char *path, const char *filename, long long size, long long mtime, unsigned long long hash)
+{
+    manifest_entry_t *entry = (manifest_entry_t*)malloc(sizeof(manifest_entry_t));
+
+    assert(entry != 0);
+
+    entry->path = strdup(path);
+    entry->filename = strdup(filename);
+    assert(entry->path != 0 && entry->filename != 0);
+
+    entry->size = size;
+    entry->mtime = mtime;
+    entry->hash = hash;
+
+    return entry;
+}
+
+/* Returns 0 on a syntax error. */
+static int
+read_manifest (manifest_t *manifest)
+{
+    lisp_object_t *source_pattern, *removed_pattern;
+    lisp_stream_t stream;
+    int num_source_subs, num_removed_subs;
+    pools_t pools;
+    allocator_t allocator;
+    int retval = 1;
+
+    if (lisp_stream_init_path(&stream, manifest->filename) == 0)
+	return 1;
+
+    utils_lock_lisp_reader();
+
+    /* the numbers don't necessarily fit into lisp integers */
+    source_pattern = lisp_read_from_string("(source #?(string) #?(string) #?(string) #?(string) #?(string))");
+    assert(source_pattern != 0
+	   && lisp_type(source_pattern) != LISP_TYPE_EOF
+	   && lisp_type(source_pattern) != LISP_TYPE_PARSE_ERROR);
+    assert(lisp_compile_pattern(&source_pattern, &num_source_subs));
+    assert(num_source_subs == 5);
+
+    removed_pattern = lisp_read_from_string("(removed #?(string))");
+    assert(removed_pattern != 0
+	   && lisp_type(removed_pattern) != LISP_TYPE_EOF
+	   && lisp_type(removed_pattern) != LISP_TYPE_PARSE_ERROR);
+    assert(lisp_compile_pattern(&removed_pattern, &num_removed_subs));
+    assert(num_removed_subs == 1);
+
+    utils_unlock_lisp_reader();
+
+    init_pools(&pools);
+    init_pools_allocator(&allocator, &pools);
+
+    for (;;)
+    {
+	lisp_object_t *obj;
+	lisp_object_t *vars[5];
+	int type;
+
+	reset_pools(&pools);
+	utils_lock_lisp_reader();
+	obj = lisp_read_with_allocator(&allocator, &stream);
+	utils_unlock_lisp_reader();
+	type = lisp_type(obj);
+
+	if (type == LISP_TYPE_EOF)
+	    break;
+	if (type == LISP_TYPE_PARSE_ERROR)
+	{
+	    retval = 0;
+	    break;
+	}
+
+	if (lisp_match_pattern(source_pattern, obj, vars, num_source_subs))
+	    insert_entry(manifest, make_entry(lisp_string(vars[0]), lisp_string(vars[1]),
+					      strtoll(lisp_string(vars[2]), 0, 10),
+					      strtoll(lisp_string(vars[3]), 0, 10),
+					      strtoull(lisp_string(vars[4]), 0, 16)));
+	else if (lisp_match_pattern(removed_pattern, obj, vars, num_removed_subs))
+	    remove_entry(manifest, lisp_string(vars[0]));
+	else
+	{
+	    retval = 0;
+	    break;
+	}
+
+	++manifest->num_records;
+    }
+
+    lisp_stream_free_path(&stream);
+    free_pools(&pools);
+
+    return retval;
+}
+
+static void
+free_entry_func (const void *key, void *value, void *data)
+{
+    free_entry((manifest_entry_t*)value);
+}
+
+static void
+free_manifest (manifest_t *manifest)
+{
+    hash_table_foreach(manifest->entries, free_entry_func, 0);
+    hash_table_free(manifest->entries);
+    hash_table_free(manifest->hashes);
+    free(manifest->filename);
+    free(manifest);
+}
+
+manifest_t*
+manifest_open (const char *library_path)
+{
+    manifest_t *manifest = (manifest_t*)malloc(sizeof(manifest_t));
+
+    assert(manifest != 0);
+
+    manifest->filename = (char*)malloc(strlen(library_path) + 1 + strlen(MANIFEST_FILENAME) + 1);
+    assert(manifest->filename != 0);
+    sprintf(manifest->filename, "%s/%s", library_path, MANIFEST_FILENAME);
+
+    manifest->file = 0;
+    manifest->num_records = 0;
+    manifest->failed = 0;
+    manifest->entries = hash_table_new(hash_string, hash_string_equal);
+    manifest->hashes = hash_table_new(hash_content_hash, content_hashes_equal);
+
+    if (!read_manifest(manifest))
+    {
+	error_info_t info = error_make_string_info(manifest->filename);
+
+	free_manifest(manifest);
+
+	error_report(ERROR_MANIFEST_SYNTAX_ERROR, info);
+
+	return 0;
+    }
+
+    return manifest;
+}
+
+static void
+print_entry (manifest_entry_t *entry, FILE *out)
+{
+    char number[32];
+
+    lisp_print_open_paren(out);
+	lisp_print_symbol("source", out);
+	lisp_print_string(entry->path, out);
+	lisp_print_string(entry->filename, out);
+	sprintf(number, "%lld", entry->size);
+	lisp_print_string(number, out);
+	sprintf(number, "%lld", entry->mtime);
+	lisp_print_string(number, out);
+	sprintf(number, "%016llx", entry->hash);
+	lisp_print_string(number, out);
+    lisp_print_close_paren(out);
+    fputs("\n", out);
+}
+
+static void
+print_entry_func (const void *key, void *value, void *data)
+{
+    print_entry((manifest_entry_t*)value, (FILE*)data);
+}
+
+/* Writes only the current entries, via a temporary file. */
+static int
+compact_manifest (manifest_t *manifest)
+{
+    char temp_filename[strlen(manifest->filename) + 7 + 1];
+    FILE *file;
+    int result;
+
+    file = utils_create_temp_file(manifest->filename, temp_filename);
+    if (file == 0)
+	return 0;
+
+    hash_table_foreach(manifest->entries, print_entry_func, file);
+
+    result = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (fclose(file) != 0)
+	result = 0;
+
+    if (result)
+	result = rename(temp_filename, manifest->filename) == 0;
+
+    if (!result)
+	unlink(temp_filename);
+    else
+	manifest->num_records = manifest->entries->num_entries;
+
+    return result;
+}
+
+int
+manifest_sync (manifest_t *manifest)
+{
+    if (manifest->file != 0
+	&& (fflush(manifest->file) != 0 || fsync(fileno(manifest->file)) != 0))
+	manifest->failed = 1;
+
+    return !manifest->failed;
+}
+
+int
+manifest_close (manifest_t *manifest)
+{
+    int result = manifest_sync(manifest);
+
+    if (manifest->file != 0 && fclose(manifest->file) != 0)
+	result = 0;
+
+    if (result && manifest->num_records > 2 * manifest->entries->num_entries + 1024)
+	result = compact_manifest(manifest);
+
+    if (!result)
+	error_report(ERROR_MANIFEST_CANNOT_WRITE, error_make_string_info(manifest->filename));
+
+    free_manifest(manifest);
+
+    return result;
+}
+
+manifest_entry_t*
+manifest_lookup (manifest_t *manifest, const char *path)
+{
+    return (manifest_entry_t*)hash_table_lookup(manifest->entries, path);
+}
+
+manifest_entry_t*
+manifest_lookup_hash (manifest_t *manifest, unsigned long long hash)
+{
+    return (manifest_entry_t*)hash_table_lookup(manifest->hashes, &hash);
+}
+
+static FILE*
+get_file (manifest_t *manifest)
+{
+    if (manifest->file == 0 && !manifest->failed)
+    {
+	manifest->file = fopen(manifest->filename, "a");
+	if (manifest->file == 0)
+	    manifest->failed = 1;
+    }
+
+    return manifest->file;
+}
+
+void
+manifest_set (manifest_t *manifest, const char *path, const char *filename,
+	      long long size, long long mtime, unsigned long long hash)
+{
+    manifest_entry_t *entry = make_entry(path, filename, size, mtime, hash);
+    FILE *file = get_file(manifest);
+
+    if (file != 0)
+	print_entry(entry, file);
+
+    insert_entry(manifest, entry);
+    ++manifest->num_records;
+}
+
+void
+manifest_remove (manifest_t *manifest, const char *path)
+{
+    FILE *file = get_file(manifest);
+
+    if (file != 0)
+    {
+	lisp_print_open_paren(file);
+	    lisp_print_symbol("removed", file);
+	    lisp_print_string(path, file);
+	lisp_print_close_paren(file);
+	fputs("\n", file);
+    }
+
+    remove_entry(manifest, path);
+    ++manifest->num_records;
+}
+
+static void
+collect_entry_func (const void *key, void *value, void *data)
+{
+    manifest_entry_t ***entry = (manifest_entry_t***)data;
+
+    *(*entry)++ = (manifest_entry_t*)value;
+}
+
+manifest_entry_t**
+manifest_get_entries (manifest_t *manifest, unsigned int *num_entries)
+{
+    manifest_entry_t **entries = (manifest_entry_t**)malloc(sizeof(manifest_entry_t*)
+							    * (manifest->entries->num_entries + 1));
+    manifest_entry_t **p = entries;
+
+    assert(entries != 0);
+
+    hash_table_foreach(manifest->entries, collect_entry_func, &p);
+    *num_entries = p - entries;
+
+    return entries;
+}
+
+int
+manifest_hash_file (const char *path, unsigned long long *hash)
+{
+    unsigned char *buffer;
+    ssize_t length;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+	return 0;
+
+    buffer = (unsigned char*)malloc(HASH_BUFFER_SIZE);
+    assert(buffer != 0);
+
+    *hash = 0;
+    while ((length = read(fd, buffer, HASH_BUFFER_SIZE)) > 0)
+	*hash = hash_bytes_64(buffer, length, *hash);
+
+    free(buffer);
+    close(fd);
+
+    return length == 0;
+}
@@ -27,13 +27,6 @@
 
 #include "api.h"
 
-void
-metapixel_complete_subpixel (metapixel_t *pixel)
-{
-    color_convert_rgb_pixels(pixel->subpixels_hsv, pixel->subpixels_rgb, NUM_SUBPIXELS, COLOR_SPACE_HSV);
-    color_convert_rgb_pixels(pixel->subpixels_yiq, pixel->subpixels_rgb, NUM_SUBPIXELS, COLOR_SPACE_YIQ);
-}
-
 static void
 generate_coefficients (metapixel_t *pixel)
 {
@@ -58,7 +51,6 @@ generate_coefficients (metapixel_t *pixel)
     assert(scaled_bitmap->row_stride == NUM_SUBPIXEL_ROWS_COLS * NUM_CHANNELS);
 
     memcpy(pixel->subpixels_rgb, scaled_bitmap->data, NUM_SUBPIXELS * NUM_CHANNELS);
-    metapixel_complete_subpixel(pixel);
 
     bitmap_free(scaled_bitmap);
 }
@@ -81,6 +73,7 @@ metapixel_new (const char *name, unsigned int scaled_width, unsigned int scaled_
     metapixel->aspect_ratio = aspect_ratio;
     metapixel->enabled = 1;
     metapixel->anti_x = metapixel->anti_y = -1;
+    metapixel->atlas_offset = -1;
 
     metapixel->flip = 0;
 
@@ -104,14 +97,103 @@ metapixel_new_from_bitmap (bitmap_t *bitmap, const char *name,
     return metapixel;
 }
 
+void
+metapixel_add_levels (metapixel_t *metapixel, unsigned int min_size)
+{
+    bitmap_t *bitmap;
+
+    assert(metapixel->library == 0 && metapixel->bitmap != 0);
+    assert(metapixel->num_levels == 0);
+
+    bitmap = metapixel->bitmap;
+    while (bitmap->width / 2 >= min_size && bitmap->height / 2 >= min_size)
+    {
+	metapixel_level_t *level;
+
+	metapixel->levels = (metapixel_level_t*)realloc(metapixel->levels,
+							sizeof(metapixel_level_t) * (metapixel->num_levels + 1));
+	assert(metapixel->levels != 0);
+
+	level = &metapixel->levels[metapixel->num_levels++];
+
+	/* each level is scaled from the previous one, which keeps the
+	   filter footprint small */
+	level->width = bitmap->width / 2;
+	level->height = bitmap->height / 2;
+	level->filename = 0;
+	level->atlas_offset = -1;
+	level->bitmap = bitmap_scale(bitmap, level->width, level->height, FILTER_MITCHELL);
+	assert(level->bitmap != 0);
+
+	bitmap = level->bitmap;
+    }
+}
+
 void
 metapixel_free (metapixel_t *metapixel)
 {
+    unsigned int i;
+
     free(metapixel->name);
     if (metapixel->filename != 0)
 	free(metapixel->filename);
     if (metapixel->bitmap != 0)
 	bitmap_free(metapixel->bitmap);
+
+    for (i = 0; i < metapixel->num_levels; ++i)
+    {
+	if (metapixel->levels[i].filename != 0)
+	    free(metapixel->levels[i].filename);
+	if (metapixel->levels[i].bitmap != 0)
+	    bitmap_free(metapixel->levels[i].bitmap);
+    }
+    if (metapixel->levels != 0)
+	free(metapixel->levels);
+}
+
+static char*
+library_file_path (library_t *library, const char *name)
+{
+    char *filename = (char*)malloc(strlen(library->path) + 1 + strlen(name) + 1);
+
+    assert(filename != 0);
+
+    strcpy(filename, library->path);
+    strcat(filename, "/");
+    strcat(filename, name);
+
+    return filename;
+}
+
+static bitmap_t*
+read_library_bitmap (library_t *library, const char *name)
+{
+    char *filename = library_file_path(library, name);
+    bitmap_t *bitmap = bitmap_read(filename);
+
+    if (bitmap == 0)
+    {
+	error_info_t info = error_make_string_info(filename);
+
+	free(filename);
+
+	error_report(ERROR_CANNOT_READ_METAPIXEL_IMAGE, info);
+
+	return 0;
+    }
+
+    free(filename);
+
+    return bitmap;
+}
+
+char*
+metapixel_get_filename (metapixel_t *metapixel)
+{
+    if (metapixel->library == 0 || metapixel->filename == 0 || metapixel->atlas_offset >= 0)
+	return 0;
+
+    return library_file_path(metapixel->library, metapixel->filename);
 }
 
 bitmap_t*
@@ -119,67 +201,144 @@ metapixel_get_bitmap (metapixel_t *metapixel)
 {
     if (metapixel->bitmap != 0)
 	return bitmap_copy(metapixel->bitmap);
-    else
+    else if (metapixel->atlas_offset >= 0)
     {
-	char *filename;
-	bitmap_t *bitmap;
+	assert(metapixel->library != 0 && metapixel->library->atlas != 0);
 
+	return atlas_get_bitmap(metapixel->library->atlas, metapixel->atlas_offset,
+				metapixel->width, metapixel->height);
+    }
+    else
+    {
 	assert(metapixel->library != 0 && metapixel->filename != 0);
 
-	filename = (char*)malloc(strlen(metapixel->library->path) + 1 + strlen(metapixel->filename) + 1);
-	assert(filename != 0);
+	return read_library_bitmap(metapixel->library, metapixel->filename);
+    }
+}
 
-	strcpy(filename, metapixel->library->path);
-	strcat(filename, "/");
-	strcat(filename, metapixel->filename);
+bitmap_t*
+metapixel_get_level_bitmap (metapixel_t *metapixel, unsigned int level)
+{
+    assert(level < metapixel->num_levels);
 
-	bitmap = bitmap_read(filename);
+    if (metapixel->levels[level].bitmap != 0)
+	return bitmap_copy(metapixel->levels[level].bitmap);
+    else if (metapixel->levels[level].atlas_offset >= 0)
+    {
+	assert(metapixel->library != 0 && metapixel->library->atlas != 0);
 
-	if (bitmap == 0)
-	{
-	    error_info_t info = error_make_string_info(filename);
+	return atlas_get_bitmap(metapixel->library->atlas, metapixel->levels[level].atlas_offset,
+				metapixel->levels[level].width, metapixel->levels[level].height);
+    }
+    else
+    {
+	assert(metapixel->library != 0 && metapixel->levels[level].filename != 0);
 
-	    free(filename);
+	return read_library_bitmap(metapixel->library, metapixel->levels[level].filename);
+    }
+}
 
-	    error_report(ERROR_CANNOT_READ_METAPIXEL_IMAGE, info);
+/* Returns -1 for the full image. */
+static int
+level_for_size (metapixel_t *metapixel, unsigned int width, unsigned int height)
+{
+    int i;
 
-	    return 0;
-	}
+    /* reading the full image from memory beats reading a level from
+       disk */
+    if (metapixel->bitmap != 0)
+	return -1;
 
-	free(filename);
+    /* the levels get smaller, so the first one from the end which is
+       large enough is the best */
+    for (i = (int)metapixel->num_levels - 1; i >= 0; --i)
+	if (metapixel->levels[i].width >= width && metapixel->levels[i].height >= height)
+	    return i;
 
-	return bitmap;
-    }
+    return -1;
+}
+
+char*
+metapixel_get_filename_for_size (metapixel_t *metapixel, unsigned int width, unsigned int height)
+{
+    int level = level_for_size(metapixel, width, height);
+
+    if (level < 0)
+	return metapixel_get_filename(metapixel);
+
+    if (metapixel->library == 0 || metapixel->levels[level].filename == 0)
+	return 0;
+
+    return library_file_path(metapixel->library, metapixel->levels[level].filename);
+}
+
+bitmap_t*
+metapixel_get_bitmap_for_size (metapixel_t *metapixel, unsigned int width, unsigned int height)
+{
+    int level = level_for_size(metapixel, width, height);
+
+    if (level < 0)
+	return metapixel_get_bitmap(metapixel);
+
+    return metapixel_get_level_bitmap(metapixel, level);
 }
 
 int
 metapixel_paste (metapixel_t *pixel, bitmap_t *image, unsigned int x, unsigned int y,
-		 unsigned int small_width, unsigned int small_height, unsigned int orientation)
+		 unsigned int small_width, unsigned int small_height, unsigned int orientation,
+		 bitmap_t *cheat_image, unsigned int cheat, tile_cache_t *tile_cache)
 {
-    bitmap_t *bitmap, *flipped;
+    bitmap_t *bitmap, *tile;
+    int result;
 
-    bitmap = metapixel_get_bitmap(pixel);
-    if (bitmap == 0)
-	return 0;
+    if (cheat == 0)
+	cheat_image = 0;
 
-    if (bitmap->width != small_width || bitmap->height != small_height)
+    if (tile_cache != 0)
     {
-	bitmap_t *scaled_bitmap = bitmap_scale(bitmap, small_width, small_height, FILTER_MITCHELL);
+	tile = tile_cache_lookup(tile_cache, pixel, small_width, small_height, orientation);
 
-	assert(scaled_bitmap != 0);
+	if (tile != 0)
+	{
+	    result = bitmap_paste_scaled(image, tile, x, y, small_width, small_height, 0,
+					 FILTER_MITCHELL, cheat_image, cheat);
+	    bitmap_free(tile);
+
+	    return result;
+	}
+    }
 
+    bitmap = metapixel_get_bitmap_for_size(pixel, small_width, small_height);
+    if (bitmap == 0)
+	return 0;
+
+    if (tile_cache == 0)
+    {
+	/* scale and flip straight into the image */
+	result = bitmap_paste_scaled(image, bitmap, x, y, small_width, small_height, orientation,
+				     FILTER_MITCHELL, cheat_image, cheat);
 	bitmap_free(bitmap);
-	bitmap = scaled_bitmap;
+
+	return result;
     }
 
-    flipped = bitmap_flip(bitmap, orientation);
+    /* the cached tile must not have the cheat blended in, because
+       that is different at every position */
+    tile = bitmap_new_empty(bitmap->color, small_width, small_height);
+    result = bitmap_paste_scaled(tile, bitmap, 0, 0, small_width, small_height, orientation,
+				 FILTER_MITCHELL, 0, 0);
     bitmap_free(bitmap);
 
-    bitmap_paste(image, flipped, x, y);
+    if (result)
+    {
+	tile_cache_insert(tile_cache, pixel, small_width, small_height, orientation, tile);
+	result = bitmap_paste_scaled(image, tile, x, y, small_width, small_height, 0,
+				     FILTER_MITCHELL, cheat_image, cheat);
+    }
 
-    bitmap_free(flipped);
+    bitmap_free(tile);
 
-    return 1;
+    return result;
 }
 
 void
@@ -71,20 +71,18 @@ metric_generate_coeffs_for_subimage (coeffs_union_t *coeffs, bitmap_t *bitmap,
 	assert(0);
 }
 
+/* The copy in the feature store is preferred even for RGB, because
+   searches go through the store in order. */
 static unsigned char*
 subpixels_for_color_space (metapixel_t *pixel, int color_space)
 {
-    switch (color_space)
-    {
-	case COLOR_SPACE_RGB :
-	    return pixel->subpixels_rgb;
-	case COLOR_SPACE_HSV :
-	    return pixel->subpixels_hsv;
-	case COLOR_SPACE_YIQ :
-	    return pixel->subpixels_yiq;
-	default :
-	    assert(0);
-    }
+    unsigned char *subpixels = pixel->library != 0 ? pixel->library->features.subpixels[color_space] : 0;
+
+    if (subpixels != 0)
+	return subpixels + (size_t)pixel->feature_index * NUM_SUBPIXELS * NUM_CHANNELS;
+
+    assert(color_space == COLOR_SPACE_RGB);
+    return pixel->subpixels_rgb;
 }
 
 #define COMPARE_FUNC_NAME   subpixel_compare_no_flip
@@ -138,3 +136,12 @@ metric_compare_func_set_for_metric (metric_t *metric)
 	assert(0);
     return 0;
 }
+
+void
+metric_prepare_libraries (metric_t *metric, int num_libraries, library_t **libraries)
+{
+    int i;
+
+    for (i = 0; i < num_libraries; ++i)
+	library_need_features(libraries[i], metric->color_space);
+}
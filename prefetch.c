@@ -0,0 +1,201 @@
+/*
+ * prefetch.c
+ *
+ * metapixel
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#include <stdlib.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "api.h"
+
+prefetcher_t*
+prefetcher_new (unsigned int window)
+{
+    prefetcher_t *prefetcher = (prefetcher_t*)malloc(sizeof(prefetcher_t));
+
+    assert(prefetcher != 0);
+
+    pthread_mutex_init(&prefetcher->mutex, 0);
+    pthread_cond_init(&prefetcher->cond, 0);
+
+    prefetcher->window = window;
+
+    prefetcher->num_files = 0;
+    prefetcher->num_allocated = 0;
+    prefetcher->filenames = 0;
+    prefetcher->positions = 0;
+    prefetcher->seen = hash_table_new(hash_pointer, hash_pointer_equal);
+    prefetcher->num_added = 0;
+
+    prefetcher->next = 0;
+    prefetcher->position = 0;
+    prefetcher->stopping = 0;
+    prefetcher->num_threads = 0;
+
+    return prefetcher;
+}
+
+void
+prefetcher_add (prefetcher_t *prefetcher, metapixel_t *pixel, unsigned int width, unsigned int height)
+{
+    unsigned int position = prefetcher->num_added++;
+    char *filename;
+
+    /* metapixels which are in memory don't need to be fetched */
+    if (pixel->bitmap != 0 || pixel->filename == 0)
+	return;
+    if (hash_table_lookup(prefetcher->seen, pixel) != 0)
+	return;
+    hash_table_insert(prefetcher->seen, pixel, pixel);
+
+    filename = metapixel_get_filename_for_size(pixel, width, height);
+    if (filename == 0)
+	return;
+
+    /* the threads might be running already */
+    pthread_mutex_lock(&prefetcher->mutex);
+
+    if (prefetcher->num_files == prefetcher->num_allocated)
+    {
+	prefetcher->num_allocated = prefetcher->num_allocated > 0 ? prefetcher->num_allocated * 2 : 64;
+	prefetcher->filenames = (char**)realloc(prefetcher->filenames,
+						sizeof(char*) * prefetcher->num_allocated);
+	prefetcher->positions = (unsigned int*)realloc(prefetcher->positions,
+						       sizeof(unsigned int) * prefetcher->num_allocated);
+	assert(prefetcher->filenames != 0 && prefetcher->positions != 0);
+    }
+
+    prefetcher->filenames[prefetcher->num_files] = filename;
+    prefetcher->positions[prefetcher->num_files] = position;
+    ++prefetcher->num_files;
+
+    pthread_cond_signal(&prefetcher->cond);
+    pthread_mutex_unlock(&prefetcher->mutex);
+}
+
+/* rwimg can only read images from files, so the best we can do is
+   to have the kernel read them into the page cache.  Opening the file
+   is the part with the highest latency on network file systems, which
+   is why there are several of these threads. */
+static void
+prefetch_file (const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd >= 0)
+    {
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+	close(fd);
+    }
+}
+
+static void*
+prefetch_thread (void *data)
+{
+    prefetcher_t *prefetcher = (prefetcher_t*)data;
+
+    pthread_mutex_lock(&prefetcher->mutex);
+
+    for (;;)
+    {
+	char *filename;
+
+	if (prefetcher->stopping)
+	    break;
+
+	/* more files might still be added */
+	if (prefetcher->next >= prefetcher->num_files
+	    || prefetcher->positions[prefetcher->next] >= prefetcher->position + prefetcher->window)
+	{
+	    pthread_cond_wait(&prefetcher->cond, &prefetcher->mutex);
+	    continue;
+	}
+
+	/* the array can be reallocated while we fetch */
+	filename = prefetcher->filenames[prefetcher->next++];
+
+	pthread_mutex_unlock(&prefetcher->mutex);
+	prefetch_file(filename);
+	pthread_mutex_lock(&prefetcher->mutex);
+    }
+
+    pthread_mutex_unlock(&prefetcher->mutex);
+
+    return 0;
+}
+
+void
+prefetcher_start (prefetcher_t *prefetcher, int all_added)
+{
+    unsigned int num_threads = PREFETCH_NUM_THREADS;
+    unsigned int i;
+
+    assert(prefetcher->num_threads == 0);
+
+    if (all_added)
+	num_threads = MIN(num_threads, prefetcher->num_files);
+
+    for (i = 0; i < num_threads; ++i)
+    {
+	if (pthread_create(&prefetcher->threads[i], 0, prefetch_thread, prefetcher) != 0)
+	    break;
+	++prefetcher->num_threads;
+    }
+}
+
+void
+prefetcher_set_position (prefetcher_t *prefetcher, unsigned int position)
+{
+    pthread_mutex_lock(&prefetcher->mutex);
+    prefetcher->position = position;
+    pthread_cond_broadcast(&prefetcher->cond);
+    pthread_mutex_unlock(&prefetcher->mutex);
+}
+
+void
+prefetcher_free (prefetcher_t *prefetcher)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&prefetcher->mutex);
+    prefetcher->stopping = 1;
+    pthread_cond_broadcast(&prefetcher->cond);
+    pthread_mutex_unlock(&prefetcher->mutex);
+
+    for (i = 0; i < prefetcher->num_threads; ++i)
+	pthread_join(prefetcher->threads[i], 0);
+
+    hash_table_free(prefetcher->seen);
+    for (i = 0; i < prefetcher->num_files; ++i)
+	free(prefetcher->filenames[i]);
+    if (prefetcher->filenames != 0)
+	free(prefetcher->filenames);
+    if (prefetcher->positions != 0)
+	free(prefetcher->positions);
+
+    pthread_cond_destroy(&prefetcher->cond);
+    pthread_mutex_destroy(&prefetcher->mutex);
+
+    free(prefetcher);
+}
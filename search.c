@@ -37,6 +37,34 @@ metapixel_in_array (metapixel_t *pixel, metapixel_t **array, int size)
     return 0;
 }
 
+/* Slightly less than the least possible score of a metapixel whose
+   channel means are within the ranges.  The sum of the squared
+   differences of the subpixels of a channel is at least NUM_SUBPIXELS
+   times the squared difference of their means, regardless of
+   flipping. */
+static float
+means_score_bound (float *means, float *min, float *max, float *weights)
+{
+    float bound = 0.0;
+    int channel;
+
+    for (channel = 0; channel < NUM_CHANNELS; ++channel)
+    {
+	float dist = 0.0;
+
+	if (means[channel] < min[channel])
+	    dist = min[channel] - means[channel];
+	else if (means[channel] > max[channel])
+	    dist = means[channel] - max[channel];
+
+	bound += dist * dist * weights[channel];
+    }
+
+    /* leave room for rounding */
+    return bound * NUM_SUBPIXELS * 0.999;
+}
+
+/* Libraries must have been prepared for the metric. */
 metapixel_match_t
 search_metapixel_nearest_to (int num_libraries, library_t **libraries,
 			     coeffs_union_t *coeffs, metric_t *metric, int x, int y,
@@ -51,6 +79,8 @@ search_metapixel_nearest_to (int num_libraries, library_t **libraries,
     unsigned int best_orientation = 0;
     compare_func_set_t *compare_func_set = metric_compare_func_set_for_metric(metric);
     metapixel_match_t match;
+    float coeffs_means[NUM_CHANNELS];
+    unsigned int library_index, first_index;
     /* allowed < 0 means we don't know.  0 means not allowed, >0 means allowed.  */
     int allowed;
 
@@ -84,27 +114,95 @@ search_metapixel_nearest_to (int num_libraries, library_t **libraries,
 	    }
 	}
 
-    FOR_EACH_METAPIXEL(pixel, pixel_index)
+    /* The index of a metapixel is its position in the list of its
+       library, which is in reverse order of tables.mxt, after those
+       of all libraries before it. */
+    void check_feature (feature_store_t *store, float *means, unsigned int feature_index)
+	{
+	    float *pixel_means = means + (size_t)feature_index * NUM_CHANNELS;
+	    metapixel_t *pixel;
+	    unsigned int pixel_index;
+
+	    if (means_score_bound(coeffs_means, pixel_means, pixel_means, metric->weights) >= best_score)
+		return;
+
+	    pixel = store->pixels[feature_index];
+	    pixel_index = first_index + store->num_metapixels - 1 - feature_store_file_index(store, feature_index);
+
+	    allowed = -1;
+
+	    if (pixel->anti_x >= 0 && pixel->anti_y >= 0
+		&& (utils_manhattan_distance(x, y, pixel->anti_x, pixel->anti_y)
+		    < forbid_reconstruction_radius))
+		return;
+
+	    check_orientation(pixel, pixel_index, compare_func_set->compare_no_flip, 0);
+
+	    if (pixel->flip & FLIP_HOR & allowed_flips)
+	    {
+		check_orientation(pixel, pixel_index, compare_func_set->compare_hor_flip, FLIP_HOR);
+		if (pixel->flip & FLIP_VER & allowed_flips)
+		    check_orientation(pixel, pixel_index, compare_func_set->compare_hor_ver_flip, FLIP_HOR | FLIP_VER);
+	    }
+	    if (pixel->flip & FLIP_VER & allowed_flips)
+		check_orientation(pixel, pixel_index, compare_func_set->compare_ver_flip, FLIP_VER);
+	}
+
+    subpixel_means(coeffs->subpixel.subpixels, coeffs_means);
+
+    /* Starting with the most promising block and going outwards
+       finds good matches early, so that whole blocks can be
+       skipped. */
+    first_index = 0;
+    for (library_index = 0; library_index < num_libraries; ++library_index)
     {
-	allowed = -1;
+	feature_store_t *store = &libraries[library_index]->features;
+	float *means = store->means[metric->color_space];
+	feature_block_t *blocks = store->blocks[metric->color_space];
+	int num_blocks = (store->num_ordered + FEATURE_BLOCK_SIZE - 1) / FEATURE_BLOCK_SIZE;
+	int start = 0, block_index, k;
+	float start_bound = FLT_MAX;
+	unsigned int i;
 
-	if (pixel->anti_x >= 0 && pixel->anti_y >= 0
-	    && (utils_manhattan_distance(x, y, pixel->anti_x, pixel->anti_y)
-		< forbid_reconstruction_radius))
-	    continue;
+	assert(store->pixels != 0 && means != 0 && blocks != 0);
+	assert(store->num_metapixels == libraries[library_index]->num_metapixels);
 
-	check_orientation(pixel, pixel_index, compare_func_set->compare_no_flip, 0);
+	for (block_index = 0; block_index < num_blocks; ++block_index)
+	{
+	    float bound = means_score_bound(coeffs_means, blocks[block_index].min, blocks[block_index].max,
+					    metric->weights);
 
-	if (pixel->flip & FLIP_HOR & allowed_flips)
+	    if (bound < start_bound)
+	    {
+		start = block_index;
+		start_bound = bound;
+	    }
+	}
+
+	/* start, start + 1, start - 1, start + 2, ... */
+	for (k = 0; k < 2 * num_blocks; ++k)
 	{
-	    check_orientation(pixel, pixel_index, compare_func_set->compare_hor_flip, FLIP_HOR);
-	    if (pixel->flip & FLIP_VER & allowed_flips)
-		check_orientation(pixel, pixel_index, compare_func_set->compare_hor_ver_flip, FLIP_HOR | FLIP_VER);
+	    feature_block_t *block;
+
+	    block_index = (k & 1) ? start + (k + 1) / 2 : start - k / 2;
+	    if (block_index < 0 || block_index >= num_blocks)
+		continue;
+
+	    block = &blocks[block_index];
+	    if (means_score_bound(coeffs_means, block->min, block->max, metric->weights) >= best_score)
+		continue;
+
+	    for (i = block_index * FEATURE_BLOCK_SIZE;
+		 i < MIN((block_index + 1) * FEATURE_BLOCK_SIZE, store->num_ordered);
+		 ++i)
+		check_feature(store, means, i);
 	}
-	if (pixel->flip & FLIP_VER & allowed_flips)
-	    check_orientation(pixel, pixel_index, compare_func_set->compare_ver_flip, FLIP_VER);
+
+	for (i = store->num_ordered; i < store->num_metapixels; ++i)
+	    check_feature(store, means, i);
+
+	first_index += store->num_metapixels;
     }
-    END_FOR_EACH_METAPIXEL
 
     match.pixel = best_fit;
     match.pixel_index = best_index;
@@ -0,0 +1,632 @@
+/*
+ * server.c
+ *
+ * metapixel
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <ctype.h>
+#include <assert.h>
+
+#include "api.h"
+#include "server.h"
+
+typedef struct
+{
+    server_job_func_t func;
+    unsigned int max_jobs;
+    pthread_mutex_t mutex;
+    pthread_cond_t slot_cond;	/* signalled when a job finishes */
+    unsigned int num_running_jobs;
+} server_t;
+
+struct _server_connection_t
+{
+    server_t *server;
+    int fd;
+    pthread_mutex_t mutex;
+    FILE *out;			/* guarded by mutex */
+    unsigned int num_references; /* guarded by mutex */
+    char *directory;		/* not changed once a job has started */
+};
+
+typedef struct
+{
+    server_job_t job;
+    lisp_object_t *expr;
+} running_job_t;
+
+/* The socket is removed when the server is terminated. */
+static const char *listening_socket_path = 0;
+
+static int
+init_socket_address (struct sockaddr_un *addr, const char *socket_path)
+{
+    if (strlen(socket_path) >= sizeof(addr->sun_path))
+    {
+	fprintf(stderr, "Error: socket path `%s' is too long.\n", socket_path);
+	return 0;
+    }
+
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, socket_path);
+
+    return 1;
+}
+
+static int
+connect_to_socket (struct sockaddr_un *addr)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+	return -1;
+
+    if (connect(fd, (struct sockaddr*)addr, sizeof(struct sockaddr_un)) < 0)
+    {
+	close(fd);
+	return -1;
+    }
+
+    return fd;
+}
+
+static void
+release_connection (server_connection_t *connection)
+{
+    int last;
+
+    pthread_mutex_lock(&connection->mutex);
+    last = --connection->num_references == 0;
+    pthread_mutex_unlock(&connection->mutex);
+
+    if (!last)
+	return;
+
+    fclose(connection->out);
+    pthread_mutex_destroy(&connection->mutex);
+    if (connection->directory != 0)
+	free(connection->directory);
+    free(connection);
+}
+
+static void
+begin_response (server_connection_t *connection, const char *symbol)
+{
+    pthread_mutex_lock(&connection->mutex);
+    lisp_print_open_paren(connection->out);
+    lisp_print_symbol(symbol, connection->out);
+}
+
+static void
+end_response (server_connection_t *connection)
+{
+    lisp_print_close_paren(connection->out);
+    fputc('\n', connection->out);
+    fflush(connection->out);
+    pthread_mutex_unlock(&connection->mutex);
+}
+
+void
+server_job_report_progress (server_job_t *job, const char *stage, float progress)
+{
+    begin_response(job->connection, "progress");
+    fputc(' ', job->connection->out);
+    lisp_print_integer(job->number, job->connection->out);
+    fputc(' ', job->connection->out);
+    lisp_print_symbol(stage, job->connection->out);
+    fputc(' ', job->connection->out);
+    lisp_print_real(progress, job->connection->out);
+    end_response(job->connection);
+}
+
+void
+server_job_report_error (server_job_t *job, const char *message)
+{
+    begin_response(job->connection, "error");
+    fputc(' ', job->connection->out);
+    lisp_print_integer(job->number, job->connection->out);
+    fputc(' ', job->connection->out);
+    lisp_print_string(message, job->connection->out);
+    end_response(job->connection);
+}
+
+char*
+server_job_resolve_path (server_job_t *job, const char *path)
+{
+    const char *directory = job->connection->directory;
+    char *resolved;
+
+    if (path[0] == '/' || directory == 0)
+	resolved = strdup(path);
+    else
+    {
+	resolved = (char*)malloc(strlen(directory) + 1 + strlen(path) + 1);
+	assert(resolved != 0);
+
+	strcpy(resolved, directory);
+	strcat(resolved, "/");
+	strcat(resolved, path);
+    }
+
+    assert(resolved != 0);
+
+    return resolved;
+}
+
+static void*
+job_thread (void *data)
+{
+    running_job_t *running = (running_job_t*)data;
+    server_connection_t *connection = running->job.connection;
+    server_t *server = connection->server;
+    int result;
+
+    begin_response(connection, "started");
+    fputc(' ', connection->out);
+    lisp_print_integer(running->job.number, connection->out);
+    end_response(connection);
+
+    result = server->func(&running->job, running->expr);
+
+    begin_response(connection, "finished");
+    fputc(' ', connection->out);
+    lisp_print_integer(running->job.number, connection->out);
+    fputc(' ', connection->out);
+    lisp_print_boolean(result, connection->out);
+    end_response(connection);
+
+    lisp_free(running->expr);
+    free(running);
+
+    pthread_mutex_lock(&server->mutex);
+    --server->num_running_jobs;
+    pthread_cond_signal(&server->slot_cond);
+    pthread_mutex_unlock(&server->mutex);
+
+    release_connection(connection);
+
+    return 0;
+}
+
+static void
+start_job (server_connection_t *connection, unsigned int number, lisp_object_t *expr)
+{
+    server_t *server = connection->server;
+    running_job_t *running = (running_job_t*)malloc(sizeof(running_job_t));
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    assert(running != 0);
+
+    running->job.connection = connection;
+    running->job.number = number;
+    running->expr = expr;
+
+    /* waiting here also stops reading from the client */
+    pthread_mutex_lock(&server->mutex);
+    while (server->num_running_jobs >= server->max_jobs)
+	pthread_cond_wait(&server->slot_cond, &server->mutex);
+    ++server->num_running_jobs;
+    pthread_mutex_unlock(&server->mutex);
+
+    pthread_mutex_lock(&connection->mutex);
+    ++connection->num_references;
+    pthread_mutex_unlock(&connection->mutex);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, job_thread, running) != 0)
+	assert(0);
+    pthread_attr_destroy(&attr);
+}
+
+static void
+append_char (char **text, size_t *length, size_t *allocated, int c)
+{
+    if (*length + 1 >= *allocated)
+    {
+	*allocated = *allocated == 0 ? 256 : *allocated * 2;
+	*text = (char*)realloc(*text, *allocated);
+	assert(*text != 0);
+    }
+
+    (*text)[(*length)++] = c;
+    (*text)[*length] = '\0';
+}
+
+/* Reads the text of the next expression the client sends, which ends
+   with its closing parenthesis or quote, or after an atom.  The lispreader's tokenizer can't be used for this
+   because it must not be used by more than one thread at a time, and
+   the client can take as long as it likes.  Returns 0 at the end of
+   the input.  An expression cut off by the end of the input is
+   returned as it is, and doesn't parse.  The result must be freed. */
+static char*
+read_expression_text (FILE *in)
+{
+    char *text = 0;
+    size_t length = 0, allocated = 0;
+    int depth = 0;
+    int in_string = 0;
+    int c;
+
+    while ((c = getc(in)) != EOF)
+    {
+	if (in_string)
+	{
+	    append_char(&text, &length, &allocated, c);
+	    if (c == '\\')
+	    {
+		c = getc(in);
+		if (c == EOF)
+		    break;
+		append_char(&text, &length, &allocated, c);
+	    }
+	    else if (c == '"')
+	    {
+		in_string = 0;
+		if (depth == 0)
+		    break;
+	    }
+	}
+	else if (c == ';')
+	{
+	    while ((c = getc(in)) != EOF && c != '\n')
+		;
+	    if (length > 0)
+		append_char(&text, &length, &allocated, '\n');
+	    if (length > 0 && depth == 0)
+		break;
+	}
+	else if (isspace(c))
+	{
+	    if (length > 0 && depth == 0)
+		break;
+	    if (length > 0)
+		append_char(&text, &length, &allocated, c);
+	}
+	else if (depth == 0 && length > 0 && (c == '(' || c == '"'))
+	{
+	    /* it starts the next expression */
+	    ungetc(c, in);
+	    break;
+	}
+	else
+	{
+	    append_char(&text, &length, &allocated, c);
+	    if (c == '"')
+		in_string = 1;
+	    else if (c == '(')
+		++depth;
+	    else if (c == ')' && --depth <= 0)
+		break;
+	}
+    }
+
+    return text;
+}
+
+static void*
+connection_thread (void *data)
+{
+    server_connection_t *connection = (server_connection_t*)data;
+    FILE *in = fdopen(connection->fd, "r");
+    unsigned int num_jobs = 0;
+
+    assert(in != 0);
+
+    for (;;)
+    {
+	char *text = read_expression_text(in);
+	lisp_stream_t stream;
+	lisp_object_t *obj;
+	lisp_object_t *var;
+	int type;
+
+	if (text == 0)
+	    break;
+
+	utils_lock_lisp_reader();
+	lisp_stream_init_string(&stream, text);
+	obj = lisp_read(&stream);
+	utils_unlock_lisp_reader();
+	free(text);
+
+	type = lisp_type(obj);
+
+	/* the text is not empty, so if it ends here it is incomplete */
+	if (type == LISP_TYPE_EOF || type == LISP_TYPE_PARSE_ERROR)
+	{
+	    begin_response(connection, "rejected");
+	    fputc(' ', connection->out);
+	    lisp_print_string("parse error", connection->out);
+	    end_response(connection);
+
+	    lisp_free(obj);
+	    break;
+	}
+	else if (num_jobs == 0 && utils_lisp_match_string("(directory #?(string))", obj, &var))
+	{
+	    if (connection->directory != 0)
+		free(connection->directory);
+	    connection->directory = strdup(lisp_string(var));
+	    assert(connection->directory != 0);
+
+	    lisp_free(obj);
+	}
+	else
+	    start_job(connection, num_jobs++, obj);
+    }
+
+    /* the answers go through connection->out, which has its own
+       descriptor */
+    fclose(in);
+
+    release_connection(connection);
+
+    return 0;
+}
+
+static int
+bind_socket (int fd, struct sockaddr_un *addr, const char *socket_path)
+{
+    if (bind(fd, (struct sockaddr*)addr, sizeof(struct sockaddr_un)) == 0)
+	return 1;
+
+    if (errno == EADDRINUSE)
+    {
+	int other_fd = connect_to_socket(addr);
+
+	if (other_fd >= 0)
+	{
+	    close(other_fd);
+	    fprintf(stderr, "Error: there already is a server listening on `%s'.\n", socket_path);
+	    return 0;
+	}
+
+	/* left behind by a server that is gone */
+	if (unlink(socket_path) == 0
+	    && bind(fd, (struct sockaddr*)addr, sizeof(struct sockaddr_un)) == 0)
+	    return 1;
+    }
+
+    fprintf(stderr, "Error: cannot bind socket `%s': %s.\n", socket_path, strerror(errno));
+    return 0;
+}
+
+static void
+terminate_server (int signum)
+{
+    unlink(listening_socket_path);
+
+    signal(signum, SIG_DFL);
+    raise(signum);
+}
+
+int
+server_run (const char *socket_path, unsigned int max_jobs, server_job_func_t func)
+{
+    struct sockaddr_un addr;
+    server_t server;
+    int fd;
+
+    assert(max_jobs > 0);
+
+    if (!init_socket_address(&addr, socket_path))
+	return 0;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+	fprintf(stderr, "Error: cannot create socket: %s.\n", strerror(errno));
+	return 0;
+    }
+
+    if (!bind_socket(fd, &addr, socket_path))
+    {
+	close(fd);
+	return 0;
+    }
+
+    if (listen(fd, SOMAXCONN) < 0)
+    {
+	fprintf(stderr, "Error: cannot listen on socket `%s': %s.\n", socket_path, strerror(errno));
+	close(fd);
+	unlink(socket_path);
+	return 0;
+    }
+
+    /* clients that go away must not take the server with them */
+    signal(SIGPIPE, SIG_IGN);
+
+    listening_socket_path = socket_path;
+    signal(SIGINT, terminate_server);
+    signal(SIGTERM, terminate_server);
+    signal(SIGHUP, terminate_server);
+
+    server.func = func;
+    server.max_jobs = max_jobs;
+    pthread_mutex_init(&server.mutex, 0);
+    pthread_cond_init(&server.slot_cond, 0);
+    server.num_running_jobs = 0;
+
+    for (;;)
+    {
+	int connection_fd = accept(fd, 0, 0);
+	server_connection_t *connection;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int out_fd;
+
+	if (connection_fd < 0)
+	{
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+
+	    fprintf(stderr, "Error: cannot accept connection: %s.\n", strerror(errno));
+	    /* FIXME: this should never happen, but if it does we can't
+	       free the server while jobs are running */
+	    sleep(1);
+	    continue;
+	}
+
+	out_fd = dup(connection_fd);
+	if (out_fd < 0)
+	{
+	    close(connection_fd);
+	    continue;
+	}
+
+	connection = (server_connection_t*)malloc(sizeof(server_connection_t));
+	assert(connection != 0);
+
+	connection->server = &server;
+	connection->fd = connection_fd;
+	pthread_mutex_init(&connection->mutex, 0);
+	connection->out = fdopen(out_fd, "w");
+	assert(connection->out != 0);
+	connection->num_references = 1;
+	connection->directory = 0;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, connection_thread, connection) != 0)
+	    assert(0);
+	pthread_attr_destroy(&attr);
+    }
+
+    return 0;
+}
+
+typedef struct
+{
+    int fd;
+    FILE *in;
+} submission_t;
+
+static void*
+send_submission_thread (void *data)
+{
+    submission_t *submission = (submission_t*)data;
+    FILE *out = fdopen(dup(submission->fd), "w");
+    char directory[PATH_MAX];
+    char buffer[4096];
+    size_t length;
+
+    assert(out != 0);
+
+    if (getcwd(directory, sizeof(directory)) != 0)
+    {
+	lisp_print_open_paren(out);
+	lisp_print_symbol("directory", out);
+	fputc(' ', out);
+	lisp_print_string(directory, out);
+	lisp_print_close_paren(out);
+	fputc('\n', out);
+    }
+
+    while ((length = fread(buffer, 1, sizeof(buffer), submission->in)) > 0)
+	if (fwrite(buffer, 1, length, out) != length)
+	    break;
+
+    fclose(out);
+    shutdown(submission->fd, SHUT_WR);
+
+    return 0;
+}
+
+int
+server_submit (const char *socket_path, FILE *in)
+{
+    struct sockaddr_un addr;
+    submission_t submission;
+    pthread_t thread;
+    FILE *answers;
+    lisp_stream_t stream;
+    int fd;
+    int num_failed = 0;
+
+    if (!init_socket_address(&addr, socket_path))
+	return -1;
+
+    fd = connect_to_socket(&addr);
+    if (fd < 0)
+    {
+	fprintf(stderr, "Error: cannot connect to server at `%s': %s.\n", socket_path, strerror(errno));
+	return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* the server answers while we are still sending, so we must read
+       and write at the same time */
+    submission.fd = fd;
+    submission.in = in;
+    if (pthread_create(&thread, 0, send_submission_thread, &submission) != 0)
+	assert(0);
+
+    answers = fdopen(fd, "r");
+    assert(answers != 0);
+
+    lisp_stream_init_file(&stream, answers);
+
+    for (;;)
+    {
+	lisp_object_t *obj = lisp_read(&stream);
+	int type = lisp_type(obj);
+	lisp_object_t *vars[2];
+
+	if (type == LISP_TYPE_EOF || type == LISP_TYPE_PARSE_ERROR)
+	{
+	    lisp_free(obj);
+	    break;
+	}
+
+	lisp_dump(obj, stdout);
+	printf("\n");
+	fflush(stdout);
+
+	if (lisp_match_string("(finished #?(integer) #?(boolean))", obj, vars))
+	{
+	    if (!lisp_boolean(vars[1]))
+		++num_failed;
+	}
+	else if (lisp_match_string("(rejected . #?(list))", obj, vars))
+	    ++num_failed;
+
+	lisp_free(obj);
+    }
+
+    pthread_join(thread, 0);
+    fclose(answers);
+
+    return num_failed;
+}
@@ -0,0 +1,75 @@
+/* -*- c -*- */
+
+/*
+ * server.h
+ *
+ * metapixel
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __METAPIXEL_SERVER_H__
+#define __METAPIXEL_SERVER_H__
+
+#include "lispreader/lispreader.h"
+
+/* The server reads expressions from each client connection.  A
+   `(directory "DIR")' expression sets the directory relative
+   filenames are resolved against, every other expression is a job.
+   Each job runs in a thread of its own, and the server answers with
+
+     (started N)
+     (progress N STAGE FRACTION)
+     (error N "MESSAGE")
+     (finished N SUCCESS)
+
+   where N is the position of the job among the jobs the client sent,
+   starting at 0, and with `(rejected "MESSAGE")' if it cannot parse
+   the rest of what the client sent.  The connection is closed after
+   the client has shut down its side and all its jobs have finished.
+   The socket is removed when the server is terminated by a signal. */
+
+typedef struct _server_connection_t server_connection_t;
+
+typedef struct
+{
+    server_connection_t *connection;
+    unsigned int number;
+} server_job_t;
+
+/* Called in a thread of its own for each job.  Returns 0 if the job
+   failed.  The expression is freed after the function returns. */
+typedef int (*server_job_func_t) (server_job_t *job, lisp_object_t *expr);
+
+/* Listens on the Unix domain socket at socket_path, running at most
+   max_jobs jobs at the same time.  Only returns, with 0, if the
+   socket cannot be set up. */
+int server_run (const char *socket_path, unsigned int max_jobs, server_job_func_t func);
+
+void server_job_report_progress (server_job_t *job, const char *stage, float progress);
+void server_job_report_error (server_job_t *job, const char *message);
+/* Returns a newly allocated copy of the path, made absolute with the
+   directory the client gave. */
+char* server_job_resolve_path (server_job_t *job, const char *path);
+
+/* Sends the expressions read from in, preceded by the current
+   directory, to the server at socket_path and prints the answers to
+   stdout.  Returns the number of jobs that failed, or -1 if the server
+   cannot be reached. */
+int server_submit (const char *socket_path, FILE *in);
+
+#endif
@@ -0,0 +1,410 @@
+/*
+ * shmfeatures.c
+ *
+ * metapixel
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <assert.h>
+
+#include "api.h"
+
+/* The feature store of a library, complete in all color spaces, can
+   be published in a segment which other processes map read-only
+   instead of making their own.  The segment is named after the path
+   of the library, and is replaced when the tables file changes.  It
+   is either a POSIX shared memory object or a file in a directory,
+   which can be on hugetlbfs.  It consists of the header and the
+   arrays of the store, each aligned to SECTION_ALIGNMENT.  The magic
+   number is written last, so a segment which is still being filled
+   is never used.  Until then the header holds the process id of the
+   process filling it, so that other processes don't take it for an
+   abandoned one. */
+
+#define SHARED_FEATURES_MAGIC	0x5354584d	/* "MXTS" */
+#define SHARED_FEATURES_VERSION	1
+
+#define SECTION_ALIGNMENT	64
+/* so that segments can be on hugetlbfs */
+#define SEGMENT_ALIGNMENT	(2 * 1024 * 1024)
+
+/* how long a segment may go without a writer process id after it is
+   created, in seconds */
+#define SEGMENT_SETUP_TIMEOUT	60
+
+typedef struct
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int block_size;
+    unsigned int num_metapixels;
+    unsigned int num_ordered;
+    unsigned int writer_pid;	/* while the magic is not written */
+    /* of the tables file the features belong to */
+    long long tables_size;
+    long long tables_mtime;
+    long long tables_mtime_nsec;
+    long long tables_inode;
+    long long tables_device;
+} shared_header_t;
+
+/* offsets */
+typedef struct
+{
+    size_t order;
+    size_t blocks[NUM_COLOR_SPACES + 1];
+    size_t means[NUM_COLOR_SPACES + 1];
+    size_t subpixels[NUM_COLOR_SPACES + 1];
+    size_t size;
+} shared_layout_t;
+
+static int shared = 0;
+static char *shared_directory = 0;
+
+void
+library_set_shared_features (int share, const char *directory)
+{
+    shared = share;
+
+    if (shared_directory != 0)
+	free(shared_directory);
+    shared_directory = 0;
+
+    if (directory != 0)
+    {
+	shared_directory = strdup(directory);
+	assert(shared_directory != 0);
+    }
+}
+
+int
+shared_features_enabled (void)
+{
+    return shared;
+}
+
+static size_t
+align_offset (size_t offset, size_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+static void
+compute_layout (unsigned int num_metapixels, unsigned int num_ordered, shared_layout_t *layout)
+{
+    unsigned int num_blocks = (num_ordered + FEATURE_BLOCK_SIZE - 1) / FEATURE_BLOCK_SIZE;
+    size_t offset = align_offset(sizeof(shared_header_t), SECTION_ALIGNMENT);
+    int i;
+
+    layout->order = offset;
+    offset = align_offset(offset + sizeof(unsigned int) * num_ordered, SECTION_ALIGNMENT);
+
+    for (i = 1; i <= NUM_COLOR_SPACES; ++i)
+    {
+	layout->blocks[i] = offset;
+	offset = align_offset(offset + sizeof(feature_block_t) * num_blocks, SECTION_ALIGNMENT);
+	layout->means[i] = offset;
+	offset = align_offset(offset + sizeof(float) * NUM_CHANNELS * num_metapixels, SECTION_ALIGNMENT);
+	layout->subpixels[i] = offset;
+	offset = align_offset(offset + (size_t)SUBPIXELS_SIZE * num_metapixels, SECTION_ALIGNMENT);
+    }
+
+    layout->size = offset;
+}
+
+/* The result must be freed. */
+static char*
+segment_name (library_t *library)
+{
+    char path[PATH_MAX];
+    char *name;
+
+    if (realpath(library->path, path) == 0)
+    {
+	strncpy(path, library->path, PATH_MAX - 1);
+	path[PATH_MAX - 1] = 0;
+    }
+
+    name = (char*)malloc(strlen("metapixel-") + 16 + 1);
+    assert(name != 0);
+    sprintf(name, "metapixel-%016llx", hash_bytes_64(path, strlen(path), 0));
+
+    return name;
+}
+
+static int
+open_segment (const char *name, int flags, mode_t mode)
+{
+    char *filename;
+    char shm_name[strlen(name) + 2];
+    int fd;
+
+    if (shared_directory == 0)
+    {
+	strcpy(shm_name, "/");
+	strcat(shm_name, name);
+
+	return shm_open(shm_name, flags, mode);
+    }
+
+    filename = library_filename(shared_directory, name);
+    fd = open(filename, flags, mode);
+    free(filename);
+
+    return fd;
+}
+
+static void
+unlink_segment (const char *name)
+{
+    char *filename;
+    char shm_name[strlen(name) + 2];
+
+    if (shared_directory == 0)
+    {
+	strcpy(shm_name, "/");
+	strcat(shm_name, name);
+
+	shm_unlink(shm_name);
+	return;
+    }
+
+    filename = library_filename(shared_directory, name);
+    unlink(filename);
+    free(filename);
+}
+
+int
+shared_features_attach (library_t *library, shared_features_t *features)
+{
+    char *name = segment_name(library);
+    shared_header_t *header;
+    shared_layout_t layout;
+    struct stat buf, tables_stat;
+    unsigned int *order;
+    void *data;
+    unsigned int i;
+    int result;
+    int fd;
+
+    fd = open_segment(name, O_RDONLY, 0);
+    free(name);
+
+    if (fd == -1)
+	return 0;
+
+    if (fstat(fd, &buf) != 0 || buf.st_size < sizeof(shared_header_t))
+    {
+	close(fd);
+	return 0;
+    }
+
+    data = mmap(0, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+	return 0;
+
+    header = (shared_header_t*)data;
+    result = header->magic == SHARED_FEATURES_MAGIC
+	&& header->version == SHARED_FEATURES_VERSION
+	&& header->block_size == FEATURE_BLOCK_SIZE
+	&& header->num_metapixels == library->num_metapixels
+	&& header->num_ordered <= header->num_metapixels
+	&& library_stat_tables(library, &tables_stat)
+	&& header->tables_size == (long long)tables_stat.st_size
+	&& header->tables_mtime == (long long)tables_stat.st_mtime
+	&& header->tables_mtime_nsec == (long long)tables_stat.st_mtim.tv_nsec
+	&& header->tables_inode == (long long)tables_stat.st_ino
+	&& header->tables_device == (long long)tables_stat.st_dev;
+
+    if (result)
+    {
+	compute_layout(header->num_metapixels, header->num_ordered, &layout);
+	result = layout.size <= buf.st_size;
+    }
+
+    if (result)
+    {
+	order = (unsigned int*)((char*)data + layout.order);
+	for (i = 0; i < header->num_ordered && result; ++i)
+	    result = order[i] < header->num_ordered;
+    }
+
+    if (!result)
+    {
+	munmap(data, buf.st_size);
+	return 0;
+    }
+
+    features->data = data;
+    features->size = buf.st_size;
+    features->num_ordered = header->num_ordered;
+    features->order = order;
+    for (i = 1; i <= NUM_COLOR_SPACES; ++i)
+    {
+	features->blocks[i] = (feature_block_t*)((char*)data + layout.blocks[i]);
+	features->means[i] = (float*)((char*)data + layout.means[i]);
+	features->subpixels[i] = (unsigned char*)data + layout.subpixels[i];
+    }
+
+    return 1;
+}
+
+/* Whether the existing segment is one which cannot be attached to and
+   no process is filling anymore, so it can be replaced. */
+static int
+segment_is_stale (const char *name)
+{
+    shared_header_t header;
+    struct stat buf;
+    int fd = open_segment(name, O_RDONLY, 0);
+    void *data;
+
+    if (fd == -1)
+	return errno == ENOENT;
+
+    if (fstat(fd, &buf) != 0)
+    {
+	close(fd);
+	return 0;
+    }
+
+    if (buf.st_size < sizeof(shared_header_t))
+    {
+	close(fd);
+	/* it's not even set up yet, unless its process is gone */
+	return time(0) - buf.st_mtime > SEGMENT_SETUP_TIMEOUT;
+    }
+
+    data = mmap(0, sizeof(shared_header_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+	return 0;
+
+    memcpy(&header, data, sizeof(shared_header_t));
+    munmap(data, sizeof(shared_header_t));
+
+    /* complete, so it would have been attached to if it were current */
+    if (header.magic == SHARED_FEATURES_MAGIC)
+	return 1;
+
+    if (header.writer_pid == 0)
+	return time(0) - buf.st_mtime > SEGMENT_SETUP_TIMEOUT;
+
+    return kill((pid_t)header.writer_pid, 0) != 0 && errno == ESRCH;
+}
+
+int
+shared_features_publish (library_t *library)
+{
+    feature_store_t *store = &library->features;
+    unsigned int num_blocks = (store->num_ordered + FEATURE_BLOCK_SIZE - 1) / FEATURE_BLOCK_SIZE;
+    char *name = segment_name(library);
+    shared_header_t *header;
+    shared_layout_t layout;
+    struct stat tables_stat;
+    size_t size;
+    void *data;
+    int fd;
+    int i;
+
+    for (i = 1; i <= NUM_COLOR_SPACES; ++i)
+	assert(store->subpixels[i] != 0 && store->means[i] != 0 && store->blocks[i] != 0);
+
+    compute_layout(store->num_metapixels, store->num_ordered, &layout);
+    size = align_offset(layout.size, SEGMENT_ALIGNMENT);
+
+    if (!library_stat_tables(library, &tables_stat))
+    {
+	free(name);
+	return 0;
+    }
+
+    fd = open_segment(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1 && errno == EEXIST && segment_is_stale(name))
+    {
+	/* Processes using it keep their mapping.  If another process
+	   replaces it at the same time, one of the two new segments is
+	   wasted, but neither is used before it's complete. */
+	unlink_segment(name);
+	fd = open_segment(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    }
+
+    if (fd == -1)
+    {
+	free(name);
+	return 0;
+    }
+
+    if (ftruncate(fd, size) != 0
+	|| (data = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+	close(fd);
+	unlink_segment(name);
+	free(name);
+	return 0;
+    }
+
+    close(fd);
+    free(name);
+
+    header = (shared_header_t*)data;
+    memset(header, 0, sizeof(shared_header_t));
+    header->writer_pid = (unsigned int)getpid();
+    header->version = SHARED_FEATURES_VERSION;
+    header->block_size = FEATURE_BLOCK_SIZE;
+    header->num_metapixels = store->num_metapixels;
+    header->num_ordered = store->num_ordered;
+    header->tables_size = (long long)tables_stat.st_size;
+    header->tables_mtime = (long long)tables_stat.st_mtime;
+    header->tables_mtime_nsec = (long long)tables_stat.st_mtim.tv_nsec;
+    header->tables_inode = (long long)tables_stat.st_ino;
+    header->tables_device = (long long)tables_stat.st_dev;
+
+    memcpy((char*)data + layout.order, store->order, sizeof(unsigned int) * store->num_ordered);
+    for (i = 1; i <= NUM_COLOR_SPACES; ++i)
+    {
+	memcpy((char*)data + layout.blocks[i], store->blocks[i], sizeof(feature_block_t) * num_blocks);
+	memcpy((char*)data + layout.means[i], store->means[i],
+	       sizeof(float) * NUM_CHANNELS * store->num_metapixels);
+	memcpy((char*)data + layout.subpixels[i], store->subpixels[i],
+	       (size_t)SUBPIXELS_SIZE * store->num_metapixels);
+    }
+
+    __sync_synchronize();
+    header->magic = SHARED_FEATURES_MAGIC;
+
+    munmap(data, size);
+
+    return 1;
+}
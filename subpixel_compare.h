@@ -2,6 +2,7 @@ static float
 COMPARE_FUNC_NAME (coeffs_union_t *coeffs, metapixel_t *pixel, float best_score,
 		   int color_space, float weight_factors[NUM_CHANNELS])
 {
+    unsigned char *subpixels = subpixels_for_color_space(pixel, color_space);
     int channel;
     float score = 0.0;
 
@@ -15,7 +16,6 @@ COMPARE_FUNC_NAME (coeffs_union_t *coeffs, metapixel_t *pixel, float best_score,
 	    {
 		int coeffs_idx = y * NUM_SUBPIXEL_ROWS_COLS + x;
 		int pixel_idx = FLIP_Y(y) * NUM_SUBPIXEL_ROWS_COLS + FLIP_X(x);
-		unsigned char *subpixels = subpixels_for_color_space(pixel, color_space);
 
 		float dist = (int)coeffs->subpixel.subpixels[coeffs_idx * NUM_CHANNELS + channel]
 		    - (int)subpixels[pixel_idx * NUM_CHANNELS + channel];
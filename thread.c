@@ -0,0 +1,444 @@
+/*
+ * thread.c
+ *
+ * metapixel
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "thread.h"
+#include "error.h"
+
+#define MIN(a,b)           ((a)<(b)?(a):(b))
+
+/* Also a full memory barrier. */
+#define ATOMIC_READ(x)     __sync_fetch_and_add(&(x), 0)
+
+/* Each range of a parallel_for is at least this many times smaller
+   than the whole loop, for each thread. */
+#define RANGES_PER_THREAD      4
+
+static unsigned int default_concurrency = 0;
+static thread_pool_t *default_pool = 0;
+static pthread_once_t default_pool_once = PTHREAD_ONCE_INIT;
+
+/* The pool of the calling thread, if it belongs to one, and the index
+   of its queue there. */
+static __thread thread_pool_t *current_pool = 0;
+static __thread unsigned int current_queue = 0;
+
+/* The queue the calling thread pushes to and pops from in pool. */
+static task_queue_t*
+own_queue (thread_pool_t *pool)
+{
+    if (current_pool == pool)
+	return &pool->queues[current_queue];
+    return &pool->queues[pool->num_threads];
+}
+
+static void
+push_task (task_queue_t *queue, task_t *task)
+{
+    pthread_mutex_lock(&queue->mutex);
+
+    task->next = 0;
+    task->prev = queue->last;
+    if (queue->last != 0)
+	queue->last->next = task;
+    else
+	queue->first = task;
+    queue->last = task;
+
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+static void
+unlink_task (task_queue_t *queue, task_t *task)
+{
+    if (task->prev != 0)
+	task->prev->next = task->next;
+    else
+	queue->first = task->next;
+
+    if (task->next != 0)
+	task->next->prev = task->prev;
+    else
+	queue->last = task->prev;
+}
+
+/* Takes the newest task from queue if newest is set, otherwise the
+   oldest one.  If group is not 0, only its tasks are taken. */
+static task_t*
+take_task (thread_pool_t *pool, task_queue_t *queue, task_group_t *group, int newest)
+{
+    task_t *task;
+
+    pthread_mutex_lock(&queue->mutex);
+
+    task = newest ? queue->last : queue->first;
+    while (task != 0 && group != 0 && task->group != group)
+	task = newest ? task->prev : task->next;
+    if (task != 0)
+	unlink_task(queue, task);
+
+    pthread_mutex_unlock(&queue->mutex);
+
+    if (task != 0)
+    {
+	__sync_sub_and_fetch(&task->group->num_queued, 1);
+	__sync_sub_and_fetch(&pool->num_queued, 1);
+    }
+
+    return task;
+}
+
+/* Our own tasks first, then the ones from outside the pool, then
+   those of the other threads.  If group is not 0, only its tasks are
+   taken. */
+static task_t*
+find_task (thread_pool_t *pool, task_group_t *group)
+{
+    task_queue_t *queue = own_queue(pool);
+    unsigned int num_queues = pool->num_threads + 1;
+    unsigned int start = queue - pool->queues;
+    unsigned int i;
+    task_t *task;
+
+    task = take_task(pool, queue, group, 1);
+    if (task == 0 && queue != &pool->queues[pool->num_threads])
+	task = take_task(pool, &pool->queues[pool->num_threads], group, 0);
+
+    for (i = 1; task == 0 && i < num_queues; ++i)
+	task = take_task(pool, &pool->queues[(start + i) % num_queues], group, 0);
+
+    return task;
+}
+
+static void
+run_task (thread_pool_t *pool, task_t *task)
+{
+    task_group_t *group = task->group;
+    error_context_t *error_context = error_get_context();
+
+    error_set_context(task->error_context);
+    task->func(task->data);
+    error_set_context(error_context);
+    free(task);
+
+    /* the group might be gone as soon as it's empty */
+    if (__sync_sub_and_fetch(&group->num_pending, 1) == 0
+	&& ATOMIC_READ(pool->num_sleeping) > 0)
+    {
+	pthread_mutex_lock(&pool->mutex);
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+/* Sleeps until a task is queued or, if group is not 0, until a task
+   of the group is queued or the group becomes empty.  Returns 0 if
+   the pool is shutting down. */
+static int
+sleep_for_work (thread_pool_t *pool, task_group_t *group)
+{
+    int running;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    /* whoever queues a task or empties a group after this sees that
+       we're sleeping, and we see what they did before */
+    __sync_add_and_fetch(&pool->num_sleeping, 1);
+    if (group != 0)
+	++pool->num_waiting;
+
+    if (!pool->shutting_down
+	&& (group == 0
+	    ? ATOMIC_READ(pool->num_queued) == 0
+	    : ATOMIC_READ(group->num_queued) == 0 && ATOMIC_READ(group->num_pending) > 0))
+	pthread_cond_wait(&pool->cond, &pool->mutex);
+
+    if (group != 0)
+	--pool->num_waiting;
+    __sync_sub_and_fetch(&pool->num_sleeping, 1);
+    running = !pool->shutting_down;
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    return running;
+}
+
+typedef struct
+{
+    thread_pool_t *pool;
+    unsigned int index;
+} worker_data_t;
+
+static void*
+worker_thread (void *data)
+{
+    thread_pool_t *pool = ((worker_data_t*)data)->pool;
+
+    current_pool = pool;
+    current_queue = ((worker_data_t*)data)->index;
+    free(data);
+
+    for (;;)
+    {
+	task_t *task = find_task(pool, 0);
+
+	if (task != 0)
+	    run_task(pool, task);
+	else if (!sleep_for_work(pool, 0))
+	    break;
+    }
+
+    return 0;
+}
+
+thread_pool_t*
+thread_pool_new (unsigned int num_threads)
+{
+    thread_pool_t *pool = (thread_pool_t*)malloc(sizeof(thread_pool_t));
+    unsigned int i;
+
+    assert(pool != 0);
+
+    pthread_mutex_init(&pool->mutex, 0);
+    pthread_cond_init(&pool->cond, 0);
+
+    pool->num_sleeping = 0;
+    pool->num_waiting = 0;
+    pool->num_queued = 0;
+    pool->shutting_down = 0;
+
+    pool->queues = (task_queue_t*)malloc(sizeof(task_queue_t) * (num_threads + 1));
+    assert(pool->queues != 0);
+
+    for (i = 0; i <= num_threads; ++i)
+    {
+	pthread_mutex_init(&pool->queues[i].mutex, 0);
+	pool->queues[i].first = pool->queues[i].last = 0;
+    }
+
+    pool->num_threads = num_threads;
+    pool->threads = (pthread_t*)malloc(sizeof(pthread_t) * (num_threads > 0 ? num_threads : 1));
+    assert(pool->threads != 0);
+
+    for (i = 0; i < num_threads; ++i)
+    {
+	worker_data_t *data = (worker_data_t*)malloc(sizeof(worker_data_t));
+	int result;
+
+	assert(data != 0);
+
+	data->pool = pool;
+	data->index = i;
+
+	result = pthread_create(&pool->threads[i], 0, worker_thread, data);
+	assert(result == 0);
+    }
+
+    return pool;
+}
+
+void
+thread_pool_free (thread_pool_t *pool)
+{
+    unsigned int i;
+
+    assert(ATOMIC_READ(pool->num_queued) == 0);
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutting_down = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (i = 0; i < pool->num_threads; ++i)
+	pthread_join(pool->threads[i], 0);
+
+    for (i = 0; i <= pool->num_threads; ++i)
+	pthread_mutex_destroy(&pool->queues[i].mutex);
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+
+    free(pool->queues);
+    free(pool->threads);
+    free(pool);
+}
+
+void
+thread_pool_set_default_concurrency (unsigned int concurrency)
+{
+    assert(default_pool == 0);
+
+    default_concurrency = concurrency;
+}
+
+static void
+make_default_pool (void)
+{
+    long concurrency = default_concurrency;
+
+    if (concurrency == 0)
+	concurrency = sysconf(_SC_NPROCESSORS_ONLN);
+    if (concurrency < 1)
+	concurrency = 1;
+
+    /* the thread waiting for a group makes up the last one */
+    default_pool = thread_pool_new((unsigned int)concurrency - 1);
+}
+
+thread_pool_t*
+thread_pool_get_default (void)
+{
+    pthread_once(&default_pool_once, make_default_pool);
+
+    return default_pool;
+}
+
+unsigned int
+thread_pool_num_threads (thread_pool_t *pool)
+{
+    return pool->num_threads;
+}
+
+void
+task_group_init (task_group_t *group, thread_pool_t *pool)
+{
+    group->pool = pool;
+    group->num_pending = 0;
+    group->num_queued = 0;
+}
+
+void
+task_group_spawn (task_group_t *group, task_func_t func, void *data)
+{
+    thread_pool_t *pool = group->pool;
+    task_t *task = (task_t*)malloc(sizeof(task_t));
+
+    assert(task != 0);
+
+    task->func = func;
+    task->data = data;
+    task->group = group;
+    task->error_context = error_get_context();
+
+    __sync_add_and_fetch(&group->num_pending, 1);
+    /* counted before it's queued, so nobody goes to sleep while it's
+       there */
+    __sync_add_and_fetch(&group->num_queued, 1);
+    __sync_add_and_fetch(&pool->num_queued, 1);
+
+    push_task(own_queue(pool), task);
+
+    if (ATOMIC_READ(pool->num_sleeping) > 0)
+    {
+	pthread_mutex_lock(&pool->mutex);
+	/* a waiting thread only runs the tasks of its group, so if one
+	   is sleeping, this might not be for the one we'd wake */
+	if (pool->num_waiting > 0)
+	    pthread_cond_broadcast(&pool->cond);
+	else
+	    pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+void
+task_group_wait (task_group_t *group)
+{
+    thread_pool_t *pool = group->pool;
+
+    while (ATOMIC_READ(group->num_pending) > 0)
+    {
+	task_t *task = find_task(pool, group);
+
+	if (task != 0)
+	    run_task(pool, task);
+	else
+	    sleep_for_work(pool, group);
+    }
+}
+
+typedef struct
+{
+    parallel_for_func_t func;
+    void *data;
+    unsigned int start;
+    unsigned int end;
+} parallel_range_t;
+
+static void
+parallel_range_task (void *data)
+{
+    parallel_range_t *range = (parallel_range_t*)data;
+
+    range->func(range->start, range->end, range->data);
+}
+
+void
+parallel_for (thread_pool_t *pool, unsigned int start, unsigned int end, unsigned int grain_size,
+	      parallel_for_func_t func, void *data)
+{
+    unsigned int num_ranges, range_size, i;
+    parallel_range_t *ranges;
+    task_group_t group;
+
+    if (end <= start)
+	return;
+
+    if (grain_size < 1)
+	grain_size = 1;
+
+    num_ranges = MIN((end - start + grain_size - 1) / grain_size, (pool->num_threads + 1) * RANGES_PER_THREAD);
+    if (num_ranges <= 1 || pool->num_threads == 0)
+    {
+	func(start, end, data);
+	return;
+    }
+
+    range_size = (end - start + num_ranges - 1) / num_ranges;
+    num_ranges = (end - start + range_size - 1) / range_size;
+
+    ranges = (parallel_range_t*)malloc(sizeof(parallel_range_t) * num_ranges);
+    assert(ranges != 0);
+
+    task_group_init(&group, pool);
+
+    for (i = 0; i < num_ranges; ++i)
+    {
+	ranges[i].func = func;
+	ranges[i].data = data;
+	ranges[i].start = start + i * range_size;
+	ranges[i].end = MIN(ranges[i].start + range_size, end);
+
+	/* the first range is ours */
+	if (i > 0)
+	    task_group_spawn(&group, parallel_range_task, &ranges[i]);
+    }
+
+    parallel_range_task(&ranges[0]);
+    task_group_wait(&group);
+
+    free(ranges);
+}
@@ -0,0 +1,110 @@
+/* -*- c -*- */
+
+/*
+ * thread.h
+ *
+ * metapixel
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __METAPIXEL_THREAD_H__
+#define __METAPIXEL_THREAD_H__
+
+#include <pthread.h>
+
+typedef void (*task_func_t) (void *data);
+
+typedef struct _task_t
+{
+    task_func_t func;
+    void *data;
+    struct _task_group_t *group;
+    struct _error_context_t *error_context;	/* of the spawning thread */
+    struct _task_t *prev;
+    struct _task_t *next;
+} task_t;
+
+/* Each thread of a pool has its own queue of tasks.  It runs the
+   tasks it spawned last first, and when it has none left it steals
+   the oldest ones of the other threads. */
+typedef struct
+{
+    pthread_mutex_t mutex;
+    task_t *first;		/* stolen from here */
+    task_t *last;		/* the owner pushes and pops here */
+} task_queue_t;
+
+typedef struct _thread_pool_t
+{
+    pthread_mutex_t mutex;	/* only for sleeping */
+    pthread_cond_t cond;	/* signalled when a task is queued, or
+				   broadcast if threads are waiting for
+				   groups, and broadcast when a group
+				   becomes empty */
+    unsigned int num_sleeping;
+    unsigned int num_waiting;	/* of the sleeping, those in task_group_wait */
+    int num_queued;
+    int shutting_down;
+    unsigned int num_threads;
+    pthread_t *threads;
+    /* one per thread, and the last one for the tasks spawned by
+       threads outside the pool */
+    task_queue_t *queues;
+} thread_pool_t;
+
+typedef struct _task_group_t
+{
+    thread_pool_t *pool;
+    unsigned int num_pending;
+    int num_queued;		/* of the pending, those not taken yet */
+} task_group_t;
+
+typedef void (*parallel_for_func_t) (unsigned int start, unsigned int end, void *data);
+
+/* A pool with num_threads == 0 runs all tasks in task_group_wait. */
+thread_pool_t* thread_pool_new (unsigned int num_threads);
+/* All task groups must have been waited for. */
+void thread_pool_free (thread_pool_t *pool);
+
+/* The number of threads working on the tasks of the default pool,
+   counting the one waiting for them.  0, the default, means one per
+   online processor.  Must be called before the default pool is
+   used. */
+void thread_pool_set_default_concurrency (unsigned int concurrency);
+/* The pool shared by everything in the process.  It is created on
+   first use. */
+thread_pool_t* thread_pool_get_default (void);
+unsigned int thread_pool_num_threads (thread_pool_t *pool);
+
+void task_group_init (task_group_t *group, thread_pool_t *pool);
+/* The task reports its errors to the error context of the calling
+   thread. */
+void task_group_spawn (task_group_t *group, task_func_t func, void *data);
+/* Runs tasks of the group in the calling thread while there are any
+   pending, so it can be called from within a task, and nested
+   parallelism doesn't need more threads.  Only the group's own tasks
+   are run, so the caller is never held up by unrelated ones. */
+void task_group_wait (task_group_t *group);
+
+/* Calls func on ranges covering start to end, in parallel, and
+   returns when they are all done.  The ranges have at least
+   grain_size indexes, so small loops run in the calling thread. */
+void parallel_for (thread_pool_t *pool, unsigned int start, unsigned int end, unsigned int grain_size,
+		   parallel_for_func_t func, void *data);
+
+#endif
@@ -0,0 +1,209 @@
+/*
+ * tilecache.c
+ *
+ * metapixel
+ *
+ * Copyright (C) 2009 Mark Probst
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "api.h"
+
+static unsigned int
+hash_tile_key (const void *_key)
+{
+    const tile_cache_key_t *key = (const tile_cache_key_t*)_key;
+
+    return hash_pointer(key->pixel) ^ (key->width * 31 + key->height * 1021 + key->orientation * 65537);
+}
+
+static int
+tile_keys_equal (const void *_key1, const void *_key2)
+{
+    const tile_cache_key_t *key1 = (const tile_cache_key_t*)_key1;
+    const tile_cache_key_t *key2 = (const tile_cache_key_t*)_key2;
+
+    return key1->pixel == key2->pixel
+	&& key1->width == key2->width
+	&& key1->height == key2->height
+	&& key1->orientation == key2->orientation;
+}
+
+tile_cache_t*
+tile_cache_new (unsigned long max_bytes)
+{
+    tile_cache_t *cache = (tile_cache_t*)malloc(sizeof(tile_cache_t));
+
+    assert(cache != 0);
+
+    pthread_mutex_init(&cache->mutex, 0);
+
+    cache->max_bytes = max_bytes;
+    cache->num_bytes = 0;
+    cache->num_hits = 0;
+    cache->num_misses = 0;
+
+    cache->table = hash_table_new(hash_tile_key, tile_keys_equal);
+    cache->lru_first = cache->lru_last = 0;
+
+    return cache;
+}
+
+static void
+unlink_entry (tile_cache_t *cache, tile_cache_entry_t *entry)
+{
+    if (entry->lru_prev != 0)
+	entry->lru_prev->lru_next = entry->lru_next;
+    else
+	cache->lru_first = entry->lru_next;
+
+    if (entry->lru_next != 0)
+	entry->lru_next->lru_prev = entry->lru_prev;
+    else
+	cache->lru_last = entry->lru_prev;
+}
+
+static void
+link_entry_first (tile_cache_t *cache, tile_cache_entry_t *entry)
+{
+    entry->lru_prev = 0;
+    entry->lru_next = cache->lru_first;
+
+    if (cache->lru_first != 0)
+	cache->lru_first->lru_prev = entry;
+    else
+	cache->lru_last = entry;
+
+    cache->lru_first = entry;
+}
+
+static void
+evict_entry (tile_cache_t *cache, tile_cache_entry_t *entry)
+{
+    unlink_entry(cache, entry);
+    hash_table_remove(cache->table, &entry->key);
+
+    cache->num_bytes -= entry->num_bytes;
+
+    bitmap_free(entry->tile);
+    free(entry);
+}
+
+void
+tile_cache_free (tile_cache_t *cache)
+{
+    while (cache->lru_first != 0)
+	evict_entry(cache, cache->lru_first);
+
+    hash_table_free(cache->table);
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache);
+}
+
+void
+tile_cache_get_stats (tile_cache_t *cache, unsigned long *num_hits, unsigned long *num_misses)
+{
+    pthread_mutex_lock(&cache->mutex);
+    *num_hits = cache->num_hits;
+    *num_misses = cache->num_misses;
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+bitmap_t*
+tile_cache_lookup (tile_cache_t *cache, metapixel_t *pixel,
+		   unsigned int width, unsigned int height, unsigned int orientation)
+{
+    tile_cache_key_t key;
+    tile_cache_entry_t *entry;
+    bitmap_t *tile = 0;
+
+    key.pixel = pixel;
+    key.width = width;
+    key.height = height;
+    key.orientation = orientation;
+
+    pthread_mutex_lock(&cache->mutex);
+
+    entry = (tile_cache_entry_t*)hash_table_lookup(cache->table, &key);
+
+    if (entry == 0)
+	++cache->num_misses;
+    else
+    {
+	++cache->num_hits;
+
+	unlink_entry(cache, entry);
+	link_entry_first(cache, entry);
+
+	tile = bitmap_copy(entry->tile);
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+
+    return tile;
+}
+
+void
+tile_cache_insert (tile_cache_t *cache, metapixel_t *pixel,
+		   unsigned int width, unsigned int height, unsigned int orientation,
+		   bitmap_t *tile)
+{
+    unsigned long num_bytes = (unsigned long)tile->height * tile->row_stride + sizeof(tile_cache_entry_t);
+    tile_cache_entry_t *entry;
+
+    assert(tile->width == width && tile->height == height);
+
+    if (num_bytes > cache->max_bytes)
+	return;
+
+    entry = (tile_cache_entry_t*)malloc(sizeof(tile_cache_entry_t));
+    assert(entry != 0);
+
+    entry->key.pixel = pixel;
+    entry->key.width = width;
+    entry->key.height = height;
+    entry->key.orientation = orientation;
+
+    pthread_mutex_lock(&cache->mutex);
+
+    if (hash_table_lookup(cache->table, &entry->key) != 0)
+    {
+	/* another thread was faster */
+	pthread_mutex_unlock(&cache->mutex);
+	free(entry);
+	return;
+    }
+
+    while (cache->num_bytes + num_bytes > cache->max_bytes)
+    {
+	assert(cache->lru_last != 0);
+	evict_entry(cache, cache->lru_last);
+    }
+
+    entry->tile = bitmap_copy(tile);
+    entry->num_bytes = num_bytes;
+
+    hash_table_insert(cache->table, &entry->key, entry);
+    link_entry_first(cache, entry);
+
+    cache->num_bytes += num_bytes;
+
+    pthread_mutex_unlock(&cache->mutex);
+}
@@ -20,10 +20,23 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "lispreader/lispreader.h"
 
 #include "api.h"
 
+/* The tokenizer of the lispreader keeps its state in static variables,
+   so only one thread at a time may read expressions, which includes
+   lisp_match_string reading its pattern.  Matching compiled patterns
+   and walking read objects needs no lock. */
+static pthread_mutex_t lisp_reader_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 int
 utils_manhattan_distance (int x1, int y1, int x2, int y2)
 {
@@ -42,3 +55,73 @@ utils_flip_multiplier (unsigned int flips)
 
     return multiplier;
 }
+
+void
+utils_lock_lisp_reader (void)
+{
+    pthread_mutex_lock(&lisp_reader_mutex);
+}
+
+void
+utils_unlock_lisp_reader (void)
+{
+    pthread_mutex_unlock(&lisp_reader_mutex);
+}
+
+FILE*
+utils_create_temp_file (const char *filename, char *temp_filename)
+{
+    struct stat buf;
+    mode_t mode;
+    const char *slash;
+    FILE *file;
+    int fd;
+
+    sprintf(temp_filename, "%s.XXXXXX", filename);
+
+    fd = mkstemp(temp_filename);
+    if (fd < 0)
+	return 0;
+
+    /* mkstemp makes the file private, but it will take the place of
+       filename, so it gets its mode, or that of its directory */
+    if (stat(filename, &buf) == 0)
+	mode = buf.st_mode & 07777;
+    else
+    {
+	slash = strrchr(filename, '/');
+	if (slash == 0)
+	    mode = stat(".", &buf) == 0 ? buf.st_mode & 0666 : 0644;
+	else
+	{
+	    char directory[slash - filename + 2];
+
+	    memcpy(directory, filename, slash - filename + 1);
+	    directory[slash - filename + 1] = '\0';
+	    mode = stat(directory, &buf) == 0 ? buf.st_mode & 0666 : 0644;
+	}
+    }
+
+    if (fchmod(fd, mode) != 0
+	|| (file = fdopen(fd, "w")) == 0)
+    {
+	close(fd);
+	unlink(temp_filename);
+	return 0;
+    }
+
+    return file;
+}
+
+/* lisp_match_string, for where reading can happen concurrently. */
+int
+utils_lisp_match_string (const char *pattern_string, lisp_object_t *obj, lisp_object_t **vars)
+{
+    int result;
+
+    utils_lock_lisp_reader();
+    result = lisp_match_string(pattern_string, obj, vars);
+    utils_unlock_lisp_reader();
+
+    return result;
+}
@@ -27,6 +27,7 @@
 #include <assert.h>
 
 #include "zoom.h"
+#include "thread.h"
 
 #ifndef MIN
 #define MIN(a,b)           ((a)<(b)?(a):(b))
@@ -37,6 +38,10 @@
 
 #define MAX_FILTER          FILTER_MITCHELL
 
+/* Pixels per task when zooming in parallel.  Smaller images, like
+   most tiles, are zoomed in the calling thread. */
+#define ZOOM_GRAIN_PIXELS   32768
+
 typedef struct
 {
     int index;
@@ -204,23 +209,27 @@ free_sample_windows (sample_window_t **sample_windows, int size)
 }
 
 static void
-zoom_unidirectional (unsigned char *dest, unsigned char *src, int num_channels, sample_window_t **sample_windows,
-		     int num_pixels_in_entity, int num_entities,
-		     int dest_pixel_advance, int src_pixel_advance,
-		     int dest_entity_advance, int src_entity_advance)
+zoom_unidirectional_serial (unsigned char *dest, unsigned char *src, int num_channels, sample_window_t **sample_windows,
+			    int num_pixels_in_entity, int num_entities,
+			    int dest_pixel_advance, int src_pixel_advance,
+			    int dest_entity_advance, int src_entity_advance,
+			    unsigned char *blend, int blend_pixel_advance, int blend_entity_advance,
+			    unsigned int opacity)
 {
     int i;
-    unsigned char *dest_entity, *src_entity;
+    unsigned char *dest_entity, *src_entity, *blend_entity;
     int channels[num_channels];
 
     dest_entity = dest;
     src_entity = src;
+    blend_entity = blend;
     for (i = 0; i < num_entities; ++i)
     {
 	int j;
-	unsigned char *dest_pixel;
+	unsigned char *dest_pixel, *blend_pixel;
 
 	dest_pixel = dest_entity;
+	blend_pixel = blend_entity;
 	for (j = 0; j < num_pixels_in_entity; ++j)
 	{
 	    
@@ -247,19 +256,91 @@ zoom_unidirectional (unsigned char *dest, unsigned char *src, int num_channels,
 		dest_pixel[k] = MAX(0, MIN(255, value));
 	    }
 
+	    if (blend != 0)
+	    {
+		for (k = 0; k < num_channels; ++k)
+		    dest_pixel[k] = (((unsigned int)dest_pixel[k] * (0x10000 - opacity)) >> 16)
+			+ (((unsigned int)blend_pixel[k] * opacity) >> 16);
+
+		blend_pixel += blend_pixel_advance;
+	    }
+
 	    dest_pixel += dest_pixel_advance;
 	}
 
 	dest_entity += dest_entity_advance;
 	src_entity += src_entity_advance;
+	blend_entity += blend_entity_advance;
     }
 }
 
+typedef struct
+{
+    unsigned char *dest;
+    unsigned char *src;
+    int num_channels;
+    sample_window_t **sample_windows;
+    int num_pixels_in_entity;
+    int dest_pixel_advance, src_pixel_advance;
+    int dest_entity_advance, src_entity_advance;
+    unsigned char *blend;
+    int blend_pixel_advance, blend_entity_advance;
+    unsigned int opacity;
+} zoom_pass_t;
+
+static void
+zoom_entities (unsigned int start, unsigned int end, void *data)
+{
+    zoom_pass_t *pass = (zoom_pass_t*)data;
+
+    zoom_unidirectional_serial(pass->dest + (long)start * pass->dest_entity_advance,
+			       pass->src + (long)start * pass->src_entity_advance,
+			       pass->num_channels, pass->sample_windows,
+			       pass->num_pixels_in_entity, end - start,
+			       pass->dest_pixel_advance, pass->src_pixel_advance,
+			       pass->dest_entity_advance, pass->src_entity_advance,
+			       pass->blend != 0 ? pass->blend + (long)start * pass->blend_entity_advance : 0,
+			       pass->blend_pixel_advance, pass->blend_entity_advance,
+			       pass->opacity);
+}
+
+/* The entities (rows or columns) are independent, so large images
+   are split into bands of them on the default thread pool. */
+static void
+zoom_unidirectional (unsigned char *dest, unsigned char *src, int num_channels, sample_window_t **sample_windows,
+		     int num_pixels_in_entity, int num_entities,
+		     int dest_pixel_advance, int src_pixel_advance,
+		     int dest_entity_advance, int src_entity_advance,
+		     unsigned char *blend, int blend_pixel_advance, int blend_entity_advance,
+		     unsigned int opacity)
+{
+    zoom_pass_t pass;
+
+    pass.dest = dest;
+    pass.src = src;
+    pass.num_channels = num_channels;
+    pass.sample_windows = sample_windows;
+    pass.num_pixels_in_entity = num_pixels_in_entity;
+    pass.dest_pixel_advance = dest_pixel_advance;
+    pass.src_pixel_advance = src_pixel_advance;
+    pass.dest_entity_advance = dest_entity_advance;
+    pass.src_entity_advance = src_entity_advance;
+    pass.blend = blend;
+    pass.blend_pixel_advance = blend_pixel_advance;
+    pass.blend_entity_advance = blend_entity_advance;
+    pass.opacity = opacity;
+
+    parallel_for(thread_pool_get_default(), 0, num_entities,
+		 MAX(1, ZOOM_GRAIN_PIXELS / MAX(1, num_pixels_in_entity)),
+		 zoom_entities, &pass);
+}
+
 void
-zoom_image (unsigned char *dest, unsigned char *src,
-	    filter_t *filter, int num_channels,
-	    int dest_width, int dest_height, int dest_pixel_stride, int dest_row_stride,
-	    int src_width, int src_height, int src_pixel_stride, int src_row_stride)
+zoom_image_blended (unsigned char *dest, unsigned char *src,
+		    filter_t *filter, int num_channels,
+		    int dest_width, int dest_height, int dest_pixel_stride, int dest_row_stride,
+		    int src_width, int src_height, int src_pixel_stride, int src_row_stride,
+		    unsigned char *blend, int blend_pixel_stride, int blend_row_stride, unsigned int opacity)
 {
     float x_scale, y_scale;
     float filter_x_scale, filter_y_scale;
@@ -288,14 +369,19 @@ zoom_image (unsigned char *dest, unsigned char *src,
     temp_image = (unsigned char*)malloc(num_channels * dest_width * src_height);
     assert(temp_image != 0);
 
+    /* the temporary image is always packed, so the strides of the
+       destination (which might be negative for flipping) only
+       matter in the vertical pass */
     zoom_unidirectional(temp_image, src, num_channels, x_sample_windows,
 			dest_width, src_height,
 			num_channels, src_pixel_stride,
-			dest_row_stride, src_row_stride);
+			num_channels * dest_width, src_row_stride,
+			0, 0, 0, 0);
     zoom_unidirectional(dest, temp_image, num_channels, y_sample_windows,
 			dest_height, dest_width,
-			dest_row_stride, dest_row_stride,
-			dest_pixel_stride, num_channels);
+			dest_row_stride, num_channels * dest_width,
+			dest_pixel_stride, num_channels,
+			blend, blend_row_stride, blend_pixel_stride, opacity);
 
     free(temp_image);
 
@@ -303,6 +389,18 @@ zoom_image (unsigned char *dest, unsigned char *src,
     free_sample_windows(y_sample_windows, dest_height);
 }
 
+void
+zoom_image (unsigned char *dest, unsigned char *src,
+	    filter_t *filter, int num_channels,
+	    int dest_width, int dest_height, int dest_pixel_stride, int dest_row_stride,
+	    int src_width, int src_height, int src_pixel_stride, int src_row_stride)
+{
+    zoom_image_blended(dest, src, filter, num_channels,
+		       dest_width, dest_height, dest_pixel_stride, dest_row_stride,
+		       src_width, src_height, src_pixel_stride, src_row_stride,
+		       0, 0, 0, 0);
+}
+
 #ifdef TEST_ZOOM
 #include <stdio.h>
 
@@ -43,5 +43,14 @@ void zoom_image (unsigned char *dest, unsigned char *src,
 		 filter_t *filter, int num_channels,
 		 int dest_width, int dest_height, int dest_pixel_stride, int dest_row_stride,
 		 int src_width, int src_height, int src_pixel_stride, int src_row_stride);
+/* The destination strides can be negative, which flips the result.
+   If blend is not 0, each result pixel is composed with the
+   corresponding pixel of blend, with opacity ranging from 0 (only the
+   result) to 0x10000 (only blend). */
+void zoom_image_blended (unsigned char *dest, unsigned char *src,
+			 filter_t *filter, int num_channels,
+			 int dest_width, int dest_height, int dest_pixel_stride, int dest_row_stride,
+			 int src_width, int src_height, int src_pixel_stride, int src_row_stride,
+			 unsigned char *blend, int blend_pixel_stride, int blend_row_stride, unsigned int opacity);
 
 #endif